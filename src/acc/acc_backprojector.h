@@ -18,6 +18,7 @@ using deviceStream_t = float;
 #include "src/acc/acc_ptr.h"
 
 #ifdef ALTCPU
+#  include <vector>
 #  include <tbb/spin_mutex.h>
 #endif
 
@@ -33,6 +34,19 @@ public:
 
 #ifdef ALTCPU
 	tbb::spin_mutex *mutexes;
+
+	// How the CPU kernels add to the model shared by all threads:
+	// LOCKED  - a spin lock per (z,y) row of the model
+	// ATOMIC  - compare-and-swap adds on every voxel, without locks
+	// SHARDED - every thread adds to its own private copy of the model without
+	//           any synchronisation; the copies are summed into the model
+	//           before it is read back
+	enum Accumulation { LOCKED, ATOMIC, SHARDED };
+	Accumulation accumulation;
+
+	// Private copies of the model (real, imag and weight after each other)
+	// per TBB thread slot, allocated when a thread first back-projects
+	std::vector<XFLOAT *> shards;
 #endif
 
 	size_t allocaton_size;
@@ -53,7 +67,7 @@ public:
 				d_mdlReal(NULL), d_mdlImag(NULL), d_mdlWeight(NULL),
 				stream(0)
 #ifdef ALTCPU
-				, mutexes(0)
+				, mutexes(0), accumulation(LOCKED)
 #endif
 	{}
 
@@ -87,6 +101,17 @@ public:
 			bool data_is_3D,
 			deviceStream_t optStream);
 
+#ifdef ALTCPU
+	// Sets the accumulation mode; SHARDED needs nr_slots private copies of the model
+	void setAccumulation(Accumulation mode, int nr_slots = 0);
+
+	// The arrays the calling thread should add to, and how
+	Accumulation getAccumulationTarget(XFLOAT *&real, XFLOAT *&imag, XFLOAT *&weight);
+
+	// Sums the private copies of the SHARDED mode into the model and releases them
+	void reduceShards();
+#endif
+
 	void getMdlData(XFLOAT *real, XFLOAT *imag, XFLOAT * weights);
 	void getMdlDataPtrs(XFLOAT *& real, XFLOAT *& imag, XFLOAT *& weights);
 
@@ -9,6 +9,11 @@
 //#include "src/acc/settings.h"
 //#include "src/acc/acc_backprojector.h"
 #include "src/acc/acc_projector.h"
+#ifdef ALTCPU
+#  include <algorithm>
+#  include <tbb/parallel_for.h>
+#  include <tbb/task_arena.h>
+#endif
 
 size_t AccBackprojector::setMdlDim(
 #ifdef _SYCL_ENABLED
@@ -97,6 +102,12 @@ void AccBackprojector::initMdl()
 	stream->syclMemset(d_mdlWeight, 0, mdlXYZ * sizeof(XFLOAT));
 	stream->waitAll();
 #else
+	for (size_t s = 0; s < shards.size(); s++)
+	{
+		free(shards[s]);
+		shards[s] = NULL;
+	}
+
 	memset(d_mdlReal,     0, mdlXYZ * sizeof(XFLOAT));
 	memset(d_mdlImag,     0, mdlXYZ * sizeof(XFLOAT));
 	memset(d_mdlWeight,   0, mdlXYZ * sizeof(XFLOAT));
@@ -106,6 +117,82 @@ void AccBackprojector::initMdl()
 }
 
 
+#ifdef ALTCPU
+void AccBackprojector::setAccumulation(Accumulation mode, int nr_slots)
+{
+	reduceShards();
+
+	accumulation = mode;
+	if (accumulation == SHARDED)
+		shards.assign(nr_slots, NULL);
+}
+
+AccBackprojector::Accumulation AccBackprojector::getAccumulationTarget(XFLOAT *&r, XFLOAT *&i, XFLOAT *&w)
+{
+	r = d_mdlReal;
+	i = d_mdlImag;
+	w = d_mdlWeight;
+
+	if (accumulation != SHARDED)
+		return accumulation;
+
+	// A slot is only ever used by the one thread that occupies it, and a
+	// kernel does not spawn tasks, so the shard needs no locking
+	int slot = tbb::this_task_arena::current_thread_index();
+	if (slot < 0 || slot >= (int)shards.size())
+		return ATOMIC;
+
+	if (shards[slot] == NULL)
+	{
+		if (posix_memalign((void **)&shards[slot], MEM_ALIGN, 3 * mdlXYZ * sizeof(XFLOAT))) CRITICAL(RAMERR);
+		memset(shards[slot], 0, 3 * mdlXYZ * sizeof(XFLOAT));
+	}
+
+	r = shards[slot];
+	i = shards[slot] + mdlXYZ;
+	w = shards[slot] + 2 * mdlXYZ;
+	return SHARDED;
+}
+
+void AccBackprojector::reduceShards()
+{
+	std::vector<XFLOAT *> used;
+	for (size_t s = 0; s < shards.size(); s++)
+		if (shards[s] != NULL)
+			used.push_back(shards[s]);
+
+	if (used.size() > 0 && d_mdlReal != NULL)
+	{
+		// Sum in blocks of voxels, so that every block of the model is read
+		// and written by one thread while all shards are streamed through it
+		const size_t block = 16384;
+		tbb::parallel_for(size_t(0), (mdlXYZ + block - 1) / block, [&](size_t b)
+		{
+			size_t first = b * block;
+			size_t last = std::min(first + block, mdlXYZ);
+			for (size_t s = 0; s < used.size(); s++)
+			{
+				XFLOAT *sr = used[s];
+				XFLOAT *si = used[s] + mdlXYZ;
+				XFLOAT *sw = used[s] + 2 * mdlXYZ;
+				for (size_t n = first; n < last; n++)
+				{
+					d_mdlReal[n]   += sr[n];
+					d_mdlImag[n]   += si[n];
+					d_mdlWeight[n] += sw[n];
+				}
+			}
+		});
+	}
+
+	for (size_t s = 0; s < shards.size(); s++)
+	{
+		free(shards[s]);
+		shards[s] = NULL;
+	}
+}
+#endif
+
 void AccBackprojector::getMdlData(XFLOAT *r, XFLOAT *i, XFLOAT * w)
 {
 #ifdef _CUDA_ENABLED
@@ -131,6 +218,8 @@ void AccBackprojector::getMdlData(XFLOAT *r, XFLOAT *i, XFLOAT * w)
 	stream->syclMemcpy(w, d_mdlWeight, mdlXYZ * sizeof(XFLOAT));
 	stream->waitAll();
 #else
+	reduceShards();
+
 	memcpy(r, d_mdlReal,   mdlXYZ * sizeof(XFLOAT));
 	memcpy(i, d_mdlImag,   mdlXYZ * sizeof(XFLOAT));
 	memcpy(w, d_mdlWeight, mdlXYZ * sizeof(XFLOAT));
@@ -140,6 +229,8 @@ void AccBackprojector::getMdlData(XFLOAT *r, XFLOAT *i, XFLOAT * w)
 void AccBackprojector::getMdlDataPtrs(XFLOAT *& r, XFLOAT *& i, XFLOAT *& w)
 {
 #ifdef ALTCPU
+	reduceShards();
+
 	r = d_mdlReal;
 	i = d_mdlImag;
 	w = d_mdlWeight;
@@ -179,6 +270,12 @@ void AccBackprojector::clear()
 		free(d_mdlImag);
 		free(d_mdlWeight);
 		delete [] mutexes;
+
+		for (size_t s = 0; s < shards.size(); s++)
+		{
+			free(shards[s]);
+			shards[s] = NULL;
+		}
 #endif
 
 		d_mdlReal = d_mdlImag = d_mdlWeight = NULL;
@@ -502,6 +502,7 @@ void runWavgKernel(
 #endif
 }
 
+CPU_DISPATCH
 void runBackProjectKernel(
 		AccBackprojector &BP,
 		AccProjectorKernel &projector,
@@ -526,6 +527,11 @@ void runBackProjectKernel(
 		bool ctf_premultiplied,
 		deviceStream_t optStream)
 {
+#ifdef ALTCPU
+	// In the SHARDED mode, this thread adds to its own copy of the model
+	XFLOAT *mdl_real, *mdl_imag, *mdl_weight;
+	AccBackprojector::Accumulation accumulation = BP.getAccumulationTarget(mdl_real, mdl_imag, mdl_weight);
+#endif
 
 	if(BP.mdlZ==1)
 	{
@@ -682,10 +688,10 @@ void runBackProjectKernel(
                         trans_x, trans_y,
                         d_weights, d_Minvsigma2s, d_ctfs,
                         translation_num, significant_weight, weight_norm, d_eulers,
-                        BP.d_mdlReal, BP.d_mdlImag, BP.d_mdlWeight,
+                        mdl_real, mdl_imag, mdl_weight,
                         BP.maxR, BP.maxR2, (XFLOAT)BP.padding_factor,
                         (unsigned)imgX, (unsigned)imgY, (unsigned)imgX*imgY,
-                        (unsigned)BP.mdlX, BP.mdlInitY, BP.mutexes);
+                        (unsigned)BP.mdlX, BP.mdlInitY, BP.mutexes, accumulation);
 			else
 				CpuKernels::backproject2D_SGD<false>(
 						imageCount, BP_2D_BLOCK_SIZE,
@@ -694,10 +700,10 @@ void runBackProjectKernel(
 						trans_x, trans_y,
 						d_weights, d_Minvsigma2s, d_ctfs,
 						translation_num, significant_weight, weight_norm, d_eulers,
-						BP.d_mdlReal, BP.d_mdlImag, BP.d_mdlWeight,
+						mdl_real, mdl_imag, mdl_weight,
 						BP.maxR, BP.maxR2, (XFLOAT)BP.padding_factor,
 						(unsigned)imgX, (unsigned)imgY, (unsigned)imgX*imgY,
-						(unsigned)BP.mdlX, BP.mdlInitY, BP.mutexes);
+						(unsigned)BP.mdlX, BP.mdlInitY, BP.mutexes, accumulation);
 		else
 			if(ctf_premultiplied)
 				CpuKernels::backproject2D<true>(
@@ -706,10 +712,10 @@ void runBackProjectKernel(
 						trans_x, trans_y,
 						d_weights, d_Minvsigma2s, d_ctfs,
 						translation_num, significant_weight, weight_norm, d_eulers,
-						BP.d_mdlReal, BP.d_mdlImag, BP.d_mdlWeight,
+						mdl_real, mdl_imag, mdl_weight,
 						BP.maxR, BP.maxR2, (XFLOAT)BP.padding_factor,
 						(unsigned)imgX, (unsigned)imgY, (unsigned)imgX*imgY,
-						(unsigned)BP.mdlX, BP.mdlInitY, BP.mutexes);
+						(unsigned)BP.mdlX, BP.mdlInitY, BP.mutexes, accumulation);
 			else
 				CpuKernels::backproject2D<false>(
 						imageCount, BP_2D_BLOCK_SIZE,
@@ -717,10 +723,10 @@ void runBackProjectKernel(
 						trans_x, trans_y,
 						d_weights, d_Minvsigma2s, d_ctfs,
 						translation_num, significant_weight, weight_norm, d_eulers,
-						BP.d_mdlReal, BP.d_mdlImag, BP.d_mdlWeight,
+						mdl_real, mdl_imag, mdl_weight,
 						BP.maxR, BP.maxR2, (XFLOAT)BP.padding_factor,
 						(unsigned)imgX, (unsigned)imgY, (unsigned)imgX*imgY,
-						(unsigned)BP.mdlX, BP.mdlInitY, BP.mutexes);
+						(unsigned)BP.mdlX, BP.mdlInitY, BP.mutexes, accumulation);
 #endif
 	}
 	else
@@ -798,20 +804,20 @@ void runBackProjectKernel(
 						trans_x, trans_y, trans_z,
 						d_weights, d_Minvsigma2s, d_ctfs,
 						translation_num, significant_weight, weight_norm, d_eulers,
-						BP.d_mdlReal, BP.d_mdlImag, BP.d_mdlWeight,
+						mdl_real, mdl_imag, mdl_weight,
 						BP.maxR, BP.maxR2, BP.padding_factor,
 						imgX, imgY, imgZ, (size_t)imgX*(size_t)imgY*(size_t)imgZ,
-						BP.mdlX, BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes);
+						BP.mdlX, BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes, accumulation);
 				else
 					CpuKernels::backproject3D_SGD<true, false>(imageCount, BP_DATA3D_BLOCK_SIZE,
 						projector, d_img_real, d_img_imag,
 						trans_x, trans_y, trans_z,
 						d_weights, d_Minvsigma2s, d_ctfs,
 						translation_num, significant_weight, weight_norm, d_eulers,
-						BP.d_mdlReal, BP.d_mdlImag, BP.d_mdlWeight,
+						mdl_real, mdl_imag, mdl_weight,
 						BP.maxR, BP.maxR2, BP.padding_factor,
 						imgX, imgY, imgZ, (size_t)imgX*(size_t)imgY*(size_t)imgZ,
-						BP.mdlX, BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes);
+						BP.mdlX, BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes, accumulation);
 
 #endif
 			else
@@ -885,20 +891,20 @@ void runBackProjectKernel(
 						trans_x, trans_y, trans_z,
 						d_weights, d_Minvsigma2s, d_ctfs,
 						translation_num, significant_weight, weight_norm, d_eulers,
-						BP.d_mdlReal, BP.d_mdlImag, BP.d_mdlWeight,
+						mdl_real, mdl_imag, mdl_weight,
 						BP.maxR, BP.maxR2, (XFLOAT)BP.padding_factor,
 						(unsigned)imgX, (unsigned)imgY, (unsigned)imgZ, (size_t)imgX*(size_t)imgY*(size_t)imgZ,
-						(unsigned)BP.mdlX, (unsigned)BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes);
+						(unsigned)BP.mdlX, (unsigned)BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes, accumulation);
 				else
 					CpuKernels::backproject3D_SGD<false, false>(imageCount, BP_REF3D_BLOCK_SIZE,
 						projector, d_img_real, d_img_imag,
 						trans_x, trans_y, trans_z,
 						d_weights, d_Minvsigma2s, d_ctfs,
 						translation_num, significant_weight, weight_norm, d_eulers,
-						BP.d_mdlReal, BP.d_mdlImag, BP.d_mdlWeight,
+						mdl_real, mdl_imag, mdl_weight,
 						BP.maxR, BP.maxR2, (XFLOAT)BP.padding_factor,
 						(unsigned)imgX, (unsigned)imgY, (unsigned)imgZ, (size_t)imgX*(size_t)imgY*(size_t)imgZ,
-						(unsigned)BP.mdlX, (unsigned)BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes);
+						(unsigned)BP.mdlX, (unsigned)BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes, accumulation);
 #endif
 		}
 		else
@@ -976,20 +982,20 @@ void runBackProjectKernel(
 						trans_x, trans_y, trans_z,
 						d_weights, d_Minvsigma2s, d_ctfs,
 						translation_num, significant_weight, weight_norm, d_eulers,
-						BP.d_mdlReal, BP.d_mdlImag, BP.d_mdlWeight,
+						mdl_real, mdl_imag, mdl_weight,
 						BP.maxR, BP.maxR2, (XFLOAT)BP.padding_factor,
 						(unsigned)imgX, (unsigned)imgY, (unsigned)imgZ, (size_t)imgX*(size_t)imgY*(size_t)imgZ,
-						(unsigned)BP.mdlX, (unsigned)BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes);
+						(unsigned)BP.mdlX, (unsigned)BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes, accumulation);
 			    else
 					CpuKernels::backproject3D<true, false>(imageCount,BP_DATA3D_BLOCK_SIZE,
 						d_img_real, d_img_imag,
 						trans_x, trans_y, trans_z,
 						d_weights, d_Minvsigma2s, d_ctfs,
 						translation_num, significant_weight, weight_norm, d_eulers,
-						BP.d_mdlReal, BP.d_mdlImag, BP.d_mdlWeight,
+						mdl_real, mdl_imag, mdl_weight,
 						BP.maxR, BP.maxR2, (XFLOAT)BP.padding_factor,
 						(unsigned)imgX, (unsigned)imgY, (unsigned)imgZ, (size_t)imgX*(size_t)imgY*(size_t)imgZ,
-						(unsigned)BP.mdlX, (unsigned)BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes);
+						(unsigned)BP.mdlX, (unsigned)BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes, accumulation);
 
 #endif
 			else
@@ -1065,20 +1071,20 @@ void runBackProjectKernel(
 					trans_x, trans_y,
 					d_weights, d_Minvsigma2s, d_ctfs,
 					translation_num, significant_weight, weight_norm, d_eulers,
-					BP.d_mdlReal, BP.d_mdlImag, BP.d_mdlWeight,
+					mdl_real, mdl_imag, mdl_weight,
 					BP.maxR, BP.maxR2, (XFLOAT)BP.padding_factor,
 					(unsigned)imgX, (unsigned)imgY, (unsigned)imgZ, (size_t)imgX*(size_t)imgY*(size_t)imgZ,
-					(unsigned)BP.mdlX, (unsigned)BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes);
+					(unsigned)BP.mdlX, (unsigned)BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes, accumulation);
 			else
 				CpuKernels::backprojectRef3D<false>(imageCount,
 					d_img_real, d_img_imag,
 					trans_x, trans_y,
 					d_weights, d_Minvsigma2s, d_ctfs,
 					translation_num, significant_weight, weight_norm, d_eulers,
-					BP.d_mdlReal, BP.d_mdlImag, BP.d_mdlWeight,
+					mdl_real, mdl_imag, mdl_weight,
 					BP.maxR, BP.maxR2, (XFLOAT)BP.padding_factor,
 					(unsigned)imgX, (unsigned)imgY, (unsigned)imgZ, (size_t)imgX*(size_t)imgY*(size_t)imgZ,
-					(unsigned)BP.mdlX, (unsigned)BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes);
+					(unsigned)BP.mdlX, (unsigned)BP.mdlY, BP.mdlInitY, 	BP.mdlInitZ, BP.mutexes, accumulation);
 #endif
 		} // do_grad is false
 	#ifdef _CUDA_ENABLED
@@ -2004,6 +2010,7 @@ void runDiff2KernelFine(
 
 }
 
+CPU_DISPATCH
 void runCollect2jobs(	int grid_dim,
 						XFLOAT * oo_otrans_x,          // otrans-size -> make const
 						XFLOAT * oo_otrans_y,          // otrans-size -> make const
@@ -149,6 +149,7 @@ public:
 	std::vector<RFLOAT> highres_Xi2_img;
     RFLOAT min_diff2;
 	MultidimArray<bool> Mcoarse_significant;
+	MultidimArray<bool> Mcoarse_search; // optional coarse orientation mask (--prune_cache)
 	// And from storeWeightedSums
 	RFLOAT sum_weight, significant_weight, max_weight;
 	std::vector<RFLOAT> sum_weight_class;
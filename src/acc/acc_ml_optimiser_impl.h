@@ -1054,8 +1054,8 @@ void getAllSquaredDifferencesCoarse(
     long int group_id = baseMLO->mydata.getGroupId(op.part_id);
     RFLOAT my_pixel_size = baseMLO->mydata.getImagePixelSize(op.part_id);
 
-    //If particle specific sampling plan required
-	if (accMLO->generateProjectionPlanOnTheFly)
+    //If particle specific sampling plan required (also when the coarse search is pruned for this particle)
+	if (accMLO->generateProjectionPlanOnTheFly || op.Mcoarse_search.nzyxdim > 0)
 	{
 		CTIC(accMLO->timer,"generateProjectionSetupCoarse");
 #ifdef _HIP_ENABLED
@@ -1112,7 +1112,7 @@ void getAllSquaredDifferencesCoarse(
                             op.psi_prior,
                             op.pointer_dir_nonzeroprior,
                             op.pointer_psi_nonzeroprior,
-                            NULL, //Mcoarse_significant
+                            (op.Mcoarse_search.nzyxdim > 0) ? &op.Mcoarse_search : NULL,
                             baseMLO->mymodel.pdf_class,
                             baseMLO->mymodel.pdf_direction,
                             sp.nr_dir,
@@ -3778,6 +3778,11 @@ baseMLO->timer.toc(baseMLO->TIMING_ESP_DIFF2_A);
 			sp.ipsi_max = baseMLO->sampling.NrPsiSamplings(0, &op.pointer_psi_nonzeroprior ) - 1;
 		}
 
+		// Optionally restrict the coarse search to the neighbourhood of last iteration's best orientation
+		bool do_prune = baseMLO->getOrientationPruningMask(part_id, op.metadata_offset,
+				op.pointer_dir_nonzeroprior, op.pointer_psi_nonzeroprior, op.Mcoarse_search);
+		RFLOAT coarse_min_diff2 = 0., coarse_blank_diff2 = 0.;
+
 		// Initialise significant weight to minus one, so that all coarse sampling points will be handled in the first pass
 		op.significant_weight = -1.;
 
@@ -3853,6 +3858,15 @@ baseMLO->timer.toc(baseMLO->TIMING_ESP_DIFF2_B);
 
 				CTIC(timer,"getAllSquaredDifferencesCoarse");
 				getAllSquaredDifferencesCoarse<MlClass>(ipass, op, sp, baseMLO, myInstance, Mweight, ptrFactory, ibody);
+				if (baseMLO->do_prune_cache)
+					coarse_blank_diff2 = baseMLO->getBlankReferenceDiff2(op.Fimg, op.highres_Xi2_img, op.local_Minvsigma2);
+				if (do_prune && !baseMLO->checkOrientationPruning(op.metadata_offset, op.min_diff2, coarse_blank_diff2, op.Mcoarse_search))
+				{
+					// The pruned search did not reach last iteration's minimum: search all orientations
+					op.Mcoarse_search.clear();
+					getAllSquaredDifferencesCoarse<MlClass>(ipass, op, sp, baseMLO, myInstance, Mweight, ptrFactory, ibody);
+				}
+				coarse_min_diff2 = op.min_diff2;
 				CTOC(timer,"getAllSquaredDifferencesCoarse");
 
 				CTIC(timer,"convertAllSquaredDifferencesToWeightsCoarse");
@@ -3955,6 +3969,9 @@ baseMLO->timer.toc(baseMLO->TIMING_ESP_DIFF2_E);
 		storeWeightedSums<MlClass>(op, sp, baseMLO, myInstance, FinePassWeights, FineProjectionData, FinePassClassMasks, ptrFactory, ibody, bundleSWS);
 		CTOC(timer,"storeWeightedSums");
 
+		baseMLO->updateOrientationPruningCache(part_id, op.metadata_offset, coarse_min_diff2, coarse_blank_diff2, op.Mcoarse_significant,
+				op.pointer_dir_nonzeroprior, op.pointer_psi_nonzeroprior);
+
         FinePassWeights.dual_free_all();
     }
 
@@ -51,6 +51,8 @@ public:
 		orientation_num(other.orientation_num)
 	{};
 
+	// For a coarse plan, a non-NULL Mcoarse_significant is a mask over the
+	// (idir * nr_psi + ipsi) orientations to search; NULL searches them all
 	void setup(
 			HealpixSampling &sampling,
 			std::vector<RFLOAT> &directions_prior,
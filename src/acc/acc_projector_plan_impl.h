@@ -34,6 +34,8 @@ void getOrientations(HealpixSampling &sampling, long int idir, long int ipsi, in
 	my_tilt.clear();
 	my_psi.clear();
 	long int my_idir, my_ipsi;
+	const RFLOAT *over_rot, *over_tilt;
+	int nr_over;
 	if (pointer_dir_nonzeroprior.size() > idir && pointer_psi_nonzeroprior.size() > ipsi)
 	{
 		// nonzeroprior vectors have been initialised, so use priors!
@@ -58,6 +60,11 @@ void getOrientations(HealpixSampling &sampling, long int idir, long int ipsi, in
 		// for 2D sampling, only push back oversampled psi rotations
 		sampling.pushbackOversampledPsiAngles(my_ipsi, oversampling_order, 0., 0., my_rot, my_tilt, my_psi);
 	}
+	else if (sampling.getPrecalculatedOversampledDirections(my_idir, oversampling_order, over_rot, over_tilt, nr_over))
+	{
+		for (int iover = 0; iover < nr_over; iover++)
+			sampling.pushbackOversampledPsiAngles(my_ipsi, oversampling_order, over_rot[iover], over_tilt[iover], my_rot, my_tilt, my_psi);
+	}
 	else
 	{
 		// Set up oversampled grid for 3D sampling
@@ -204,7 +211,7 @@ void AccProjectorPlan::setup(
 			}
 			TIMING_TOC(TIMING_PRIOR);
 
-			// In the first pass, always proceed
+			// In the first pass, always proceed, unless a per-orientation search mask was given (--prune_cache)
 			// In the second pass, check whether one of the translations for this orientation of any of the particles had a significant weight in the first pass
 			// if so, proceed with projecting the reference in that direction
 
@@ -212,7 +219,7 @@ void AccProjectorPlan::setup(
 
 			TIMING_TIC(TIMING_PROC_CALC);
 			if (coarse && pdf_orientation > 0.)
-				do_proceed = true;
+				do_proceed = (Mcoarse_significant == NULL || DIRECT_A1D_ELEM(*Mcoarse_significant, iorient));
 			else if (pdf_orientation > 0.)
 			{
 				long int nr_trans = itrans_max - itrans_min + 1;
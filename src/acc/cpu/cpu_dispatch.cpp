@@ -0,0 +1,33 @@
+#ifdef ALTCPU
+
+#include "src/acc/cpu/cpu_dispatch.h"
+#include "src/acc/cpu/cpu_kernels/diff2_simd.h"
+
+namespace CpuKernels
+{
+
+std::string dispatchedInstructionSet()
+{
+#ifdef RELION_CPU_DISPATCH
+	// The same tests, in the same order, as the resolvers of target_clones
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("x86-64-v4"))
+		return "x86-64-v4 (AVX-512)";
+	if (__builtin_cpu_supports("x86-64-v3"))
+		return "x86-64-v3 (AVX2, FMA)";
+	return "generic x86-64";
+#else
+	return "build-flags (no run-time dispatch)";
+#endif
+}
+
+std::string cpuKernelReport()
+{
+	const Diff2SimdKernels *simd = diff2SimdKernels();
+	return "accelerated CPU kernels: " + dispatchedInstructionSet() + " version; diff2 inner loops: " +
+	       (simd == NULL ? std::string("auto-vectorised") : std::string(simd->isa));
+}
+
+} // namespace CpuKernels
+
+#endif // ALTCPU
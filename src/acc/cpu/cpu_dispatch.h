@@ -0,0 +1,27 @@
+#ifndef CPU_DISPATCH_H_
+#define CPU_DISPATCH_H_
+
+#include <string>
+
+// Run-time choice of instruction set for the accelerated CPU kernels.
+//
+// With RELION_CPU_DISPATCH (CMake option ALTCPU_DISPATCH, on by default), the
+// functions marked CPU_DISPATCH (src/acc/settings.h) that run the diff2, wavg,
+// collect2jobs and back-projection kernels are compiled for x86-64-v4
+// (AVX-512), x86-64-v3 (AVX2 and FMA) and generic x86-64, with the projector
+// code inlined into every copy. The loader picks the best copy for the CPU at
+// startup, so one binary serves clusters with mixed node types. The
+// hand-vectorised diff2 loops have their own choice (diff2_simd.h), which
+// RELION_CPU_SIMD can override.
+namespace CpuKernels
+{
+
+// The instruction set the CPU_DISPATCH functions run with on this CPU
+std::string dispatchedInstructionSet();
+
+// One line for the job log on the kernels this process runs
+std::string cpuKernelReport();
+
+} // namespace CpuKernels
+
+#endif /* CPU_DISPATCH_H_ */
@@ -8,6 +8,75 @@
 
 namespace CpuKernels
 {
+// Adds val to *address without a lock: the sum is retried until no other
+// thread has changed the value between reading and swapping it
+#ifndef __INTEL_COMPILER
+__attribute__((always_inline))
+#endif
+inline
+void atomicAddToModel(XFLOAT *address, XFLOAT val)
+{
+	XFLOAT expected, desired;
+	__atomic_load(address, &expected, __ATOMIC_RELAXED);
+	do
+		desired = expected + val;
+	while (!__atomic_compare_exchange(address, &expected, &desired, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Adds the trilinear contributions of one pixel to the voxels idx and idx+1,
+// which are neighbours (x0 and x1) in one row of the model
+#ifndef __INTEL_COMPILER
+__attribute__((always_inline))
+#endif
+inline
+void addToModelRowPair(
+		AccBackprojector::Accumulation accumulation,
+		tbb::spin_mutex &row_mutex,
+		XFLOAT *g_model_real,
+		XFLOAT *g_model_imag,
+		XFLOAT *g_model_weight,
+		size_t idx,
+		XFLOAT dd0,
+		XFLOAT dd1,
+		XFLOAT real,
+		XFLOAT imag,
+		XFLOAT weight)
+{
+	if (accumulation == AccBackprojector::ATOMIC)
+	{
+		atomicAddToModel(&g_model_real  [idx], dd0 * real);
+		atomicAddToModel(&g_model_imag  [idx], dd0 * imag);
+		atomicAddToModel(&g_model_weight[idx], dd0 * weight);
+
+		atomicAddToModel(&g_model_real  [idx + 1], dd1 * real);
+		atomicAddToModel(&g_model_imag  [idx + 1], dd1 * imag);
+		atomicAddToModel(&g_model_weight[idx + 1], dd1 * weight);
+	}
+	else if (accumulation == AccBackprojector::SHARDED)
+	{
+		// The model is private to this thread
+		g_model_real  [idx] += dd0 * real;
+		g_model_imag  [idx] += dd0 * imag;
+		g_model_weight[idx] += dd0 * weight;
+
+		g_model_real  [idx + 1] += dd1 * real;
+		g_model_imag  [idx + 1] += dd1 * imag;
+		g_model_weight[idx + 1] += dd1 * weight;
+	}
+	else
+	{
+		tbb::spin_mutex::scoped_lock lock(row_mutex);
+
+		g_model_real  [idx] += dd0 * real;
+		g_model_imag  [idx] += dd0 * imag;
+		g_model_weight[idx] += dd0 * weight;
+
+		g_model_real  [idx + 1] += dd1 * real;
+		g_model_imag  [idx + 1] += dd1 * imag;
+		g_model_weight[idx + 1] += dd1 * weight;
+	}
+}
+
 template < bool CTF_PREMULTIPLIED >
 #ifndef __INTEL_COMPILER
 __attribute__((always_inline))
@@ -38,7 +107,8 @@ void backproject2D(
 		unsigned img_xy,
 		unsigned mdl_x,
 		int mdl_inity,
-		tbb::spin_mutex *mutexes)
+		tbb::spin_mutex *mutexes,
+		AccBackprojector::Accumulation accumulation)
 {
 	int img_y_half = img_y / 2;
 
@@ -184,35 +254,16 @@ void backproject2D(
 
 				size_t idx_tmp;
 
-				// Locking necessary since all threads share the same back projector
-				{
-					idx_tmp = (size_t)y0 * (size_t)mdl_x + (size_t)x0;
-
-					tbb::spin_mutex::scoped_lock lock(mutexes[y0]);
-					g_model_real  [idx_tmp] += dd00 * real[x];
-					g_model_imag  [idx_tmp] += dd00 * imag[x];
-					g_model_weight[idx_tmp] += dd00 * Fweight[x];
+				// All threads share the same back projector, see addToModelRowPair
+				idx_tmp = (size_t)y0 * (size_t)mdl_x + (size_t)x0;
+				addToModelRowPair(accumulation, mutexes[y0],
+						g_model_real, g_model_imag, g_model_weight, idx_tmp,
+						dd00, dd01, real[x], imag[x], Fweight[x]);
 
-					idx_tmp = idx_tmp + 1;  // x1 = x0 + 1
-
-					g_model_real  [idx_tmp] += dd01 * real[x];
-					g_model_imag  [idx_tmp] += dd01 * imag[x];
-					g_model_weight[idx_tmp] += dd01 * Fweight[x];
-				}  // scoping for first lock
-
-				{
-					idx_tmp = (size_t)y1 * (size_t)mdl_x + (size_t)x0;
-
-					tbb::spin_mutex::scoped_lock lock(mutexes[y1]);
-					g_model_real  [idx_tmp] += dd10 * real[x];
-					g_model_imag  [idx_tmp] += dd10 * imag[x];
-					g_model_weight[idx_tmp] += dd10 * Fweight[x];
-
-					idx_tmp = idx_tmp + 1;  // x1 = x0 + 1
-					g_model_real  [idx_tmp] += dd11 * real[x];
-					g_model_imag  [idx_tmp] += dd11 * imag[x];
-					g_model_weight[idx_tmp] += dd11 * Fweight[x];
-				}  // scoping for second lock
+				idx_tmp = (size_t)y1 * (size_t)mdl_x + (size_t)x0;
+				addToModelRowPair(accumulation, mutexes[y1],
+						g_model_real, g_model_imag, g_model_weight, idx_tmp,
+						dd10, dd11, real[x], imag[x], Fweight[x]);
 			}  // for x
 			
 			pixel += (size_t)img_x;
@@ -254,7 +305,8 @@ void backproject3D(
 		unsigned mdl_y,
 		int mdl_inity,
 		int mdl_initz,
-		tbb::spin_mutex *mutexes)
+		tbb::spin_mutex *mutexes,
+		AccBackprojector::Accumulation accumulation)
 {
 	int img_y_half = img_y / 2;
 	int img_z_half = img_z / 2;
@@ -425,70 +477,38 @@ void backproject3D(
 					XFLOAT mfy = (XFLOAT)1.0 - fy;
 					XFLOAT mfz = (XFLOAT)1.0 - fz;
 
-					// Locking necessary since all threads share the same back projector
+					// All threads share the same back projector, see addToModelRowPair
 					XFLOAT dd000 = mfz * mfy * mfx;
 					XFLOAT dd001 = mfz * mfy *  fx;
 
 					size_t z0MdlxMdly = (size_t)z0 * (size_t)mdl_x * (size_t)mdl_y;
 
-					{
-						tbb::spin_mutex::scoped_lock lock(mutexes[z0 * mdl_y + y0]);
-
-						g_model_real  [z0MdlxMdly + y0 * mdl_x + x0]+=dd000 * real[tid];
-						g_model_imag  [z0MdlxMdly + y0 * mdl_x + x0]+=dd000 * imag[tid];
-						g_model_weight[z0MdlxMdly + y0 * mdl_x + x0]+=dd000 * Fweight[tid];
-
-						g_model_real  [z0MdlxMdly + y0 * mdl_x + x1]+=dd001 * real[tid];
-						g_model_imag  [z0MdlxMdly + y0 * mdl_x + x1]+=dd001 * imag[tid];
-						g_model_weight[z0MdlxMdly + y0 * mdl_x + x1]+=dd001 * Fweight[tid];
-					}
+					addToModelRowPair(accumulation, mutexes[z0 * mdl_y + y0],
+							g_model_real, g_model_imag, g_model_weight, z0MdlxMdly + y0 * mdl_x + x0,
+							dd000, dd001, real[tid], imag[tid], Fweight[tid]);
 
 					XFLOAT dd010 = mfz *  fy * mfx;
 					XFLOAT dd011 = mfz *  fy *  fx;
 
-					{
-						tbb::spin_mutex::scoped_lock lock(mutexes[z0 * mdl_y + y1]);
-
-						g_model_real  [z0MdlxMdly + y1 * mdl_x + x0]+=dd010 * real[tid];
-						g_model_imag  [z0MdlxMdly + y1 * mdl_x + x0]+=dd010 * imag[tid];
-						g_model_weight[z0MdlxMdly + y1 * mdl_x + x0]+=dd010 * Fweight[tid];
-
-						g_model_real  [z0MdlxMdly + y1 * mdl_x + x1]+=dd011 * real[tid];
-						g_model_imag  [z0MdlxMdly + y1 * mdl_x + x1]+=dd011 * imag[tid];
-						g_model_weight[z0MdlxMdly + y1 * mdl_x + x1]+=dd011 * Fweight[tid];
-					}
+					addToModelRowPair(accumulation, mutexes[z0 * mdl_y + y1],
+							g_model_real, g_model_imag, g_model_weight, z0MdlxMdly + y1 * mdl_x + x0,
+							dd010, dd011, real[tid], imag[tid], Fweight[tid]);
 
 					XFLOAT dd100 =  fz * mfy * mfx;
 					XFLOAT dd101 =  fz * mfy *  fx;
 
 					size_t z1MdlxMdly = (size_t)z1 * (size_t)mdl_x * (size_t)mdl_y;
 
-					{
-						tbb::spin_mutex::scoped_lock lock(mutexes[z1 * mdl_y + y0]);
-
-						g_model_real  [z1MdlxMdly + y0 * mdl_x + x0]+=dd100 * real[tid];
-						g_model_imag  [z1MdlxMdly + y0 * mdl_x + x0]+=dd100 * imag[tid];
-						g_model_weight[z1MdlxMdly + y0 * mdl_x + x0]+=dd100 * Fweight[tid];
-
-						g_model_real  [z1MdlxMdly + y0 * mdl_x + x1]+=dd101 * real[tid];
-						g_model_imag  [z1MdlxMdly + y0 * mdl_x + x1]+=dd101 * imag[tid];
-						g_model_weight[z1MdlxMdly + y0 * mdl_x + x1]+=dd101 * Fweight[tid];
-					}
+					addToModelRowPair(accumulation, mutexes[z1 * mdl_y + y0],
+							g_model_real, g_model_imag, g_model_weight, z1MdlxMdly + y0 * mdl_x + x0,
+							dd100, dd101, real[tid], imag[tid], Fweight[tid]);
 
 					XFLOAT dd110 =  fz *  fy * mfx;
 					XFLOAT dd111 =  fz *  fy *  fx;
 
-					{
-						tbb::spin_mutex::scoped_lock lock(mutexes[z1 * mdl_y + y1]);
-
-						g_model_real  [z1MdlxMdly + y1 * mdl_x + x0]+=dd110 * real[tid];
-						g_model_imag  [z1MdlxMdly + y1 * mdl_x + x0]+=dd110 * imag[tid];
-						g_model_weight[z1MdlxMdly + y1 * mdl_x + x0]+=dd110 * Fweight[tid];
-
-						g_model_real  [z1MdlxMdly + y1 * mdl_x + x1]+=dd111 * real[tid];
-						g_model_imag  [z1MdlxMdly + y1 * mdl_x + x1]+=dd111 * imag[tid];
-						g_model_weight[z1MdlxMdly + y1 * mdl_x + x1]+=dd111 * Fweight[tid];
-					}
+					addToModelRowPair(accumulation, mutexes[z1 * mdl_y + y1],
+							g_model_real, g_model_imag, g_model_weight, z1MdlxMdly + y1 * mdl_x + x0,
+							dd110, dd111, real[tid], imag[tid], Fweight[tid]);
 				}  // Fweight[tid] > (RFLOAT) 0.0
 			}  // for tid
 		} // for pass
@@ -533,7 +553,8 @@ void backprojectRef3D(
 		unsigned mdl_y,
 		int      mdl_inity,
 		int      mdl_initz,
-		tbb::spin_mutex *mutexes)
+		tbb::spin_mutex *mutexes,
+		AccBackprojector::Accumulation accumulation)
 {
 	int img_y_half = img_y / 2;
 	int img_y_half_2 = img_y_half * img_y_half;
@@ -686,71 +707,35 @@ void backprojectRef3D(
 				XFLOAT dd000 = mfz_mfy * mfx; // mfz *  mfy *  mfx
 				XFLOAT dd001 = mfz_mfy - dd000; // mfz *  mfy *  fx
 
-				{
-					tbb::spin_mutex::scoped_lock lock(mutexes[z0 * mdl_y + y0]);
-
-					idx_tmp = z0_mdl_x_mdl_y + y0_mdl_x + (size_t)x0; // z0 * mdl_x * mdl_y + y0 * mdl_x + x0;
-					g_model_real  [idx_tmp]+=dd000 * real[x];
-					g_model_imag  [idx_tmp]+=dd000 * imag[x];
-					g_model_weight[idx_tmp]+=dd000 * Fweight[x];
-
-					idx_tmp = idx_tmp + 1; // z0 * mdl_x * mdl_y + y0 * mdl_x + x1;
-					g_model_real  [idx_tmp]+=dd001 * real[x];
-					g_model_imag  [idx_tmp]+=dd001 * imag[x];
-					g_model_weight[idx_tmp]+=dd001 * Fweight[x];
-				}
+				idx_tmp = z0_mdl_x_mdl_y + y0_mdl_x + (size_t)x0; // z0 * mdl_x * mdl_y + y0 * mdl_x + x0;
+				addToModelRowPair(accumulation, mutexes[z0 * mdl_y + y0],
+						g_model_real, g_model_imag, g_model_weight, idx_tmp,
+						dd000, dd001, real[x], imag[x], Fweight[x]);
 
 				XFLOAT dd010 = (mfz - mfz_mfy) * mfx; // mfz *  fy *  mfx
 				XFLOAT dd011 = (mfz - mfz_mfy) - dd010; // mfz *  fy *  fx
 
-				{
-					tbb::spin_mutex::scoped_lock lock(mutexes[z0 * mdl_y + y0 + 1]);
-
-					idx_tmp = z0_mdl_x_mdl_y + y0_mdl_x + (size_t)mdl_x + (size_t)x0; // z0 * mdl_x * mdl_y + y1 * mdl_x + x0;
-					g_model_real  [idx_tmp]+=dd010 * real[x];
-					g_model_imag  [idx_tmp]+=dd010 * imag[x];
-					g_model_weight[idx_tmp]+=dd010 * Fweight[x];
-
-					idx_tmp = idx_tmp + 1; // z0 * mdl_x * mdl_y + y1 * mdl_x + x1;
-					g_model_real  [idx_tmp]+=dd011 * real[x];
-					g_model_imag  [idx_tmp]+=dd011 * imag[x];
-					g_model_weight[idx_tmp]+=dd011 * Fweight[x];
-				}
+				idx_tmp = z0_mdl_x_mdl_y + y0_mdl_x + (size_t)mdl_x + (size_t)x0; // z0 * mdl_x * mdl_y + y1 * mdl_x + x0;
+				addToModelRowPair(accumulation, mutexes[z0 * mdl_y + y0 + 1],
+						g_model_real, g_model_imag, g_model_weight, idx_tmp,
+						dd010, dd011, real[x], imag[x], Fweight[x]);
 
 				XFLOAT dd100 = (mfy - mfz_mfy) * mfx; // fz *  mfy *  mfx
 				XFLOAT dd101 = (mfy - mfz_mfy) - dd100; // fz *  mfy *  fx
 				int z1 = z0 + 1;
 
-				{
-					tbb::spin_mutex::scoped_lock lock(mutexes[z1 * mdl_y + y0]);
-
-					idx_tmp = z0_mdl_x_mdl_y + mdl_x_mdl_y + y0_mdl_x + (size_t)x0; // z1 * mdl_x * mdl_y + y0 * mdl_x + x0;
-					g_model_real  [idx_tmp]+=dd100 * real[x];
-					g_model_imag  [idx_tmp]+=dd100 * imag[x];
-					g_model_weight[idx_tmp]+=dd100 * Fweight[x];
-
-					idx_tmp = idx_tmp + 1; // z1 * mdl_x * mdl_y + y0 * mdl_x + x1;
-					g_model_real  [idx_tmp]+=dd101 * real[x];
-					g_model_imag  [idx_tmp]+=dd101 * imag[x];
-					g_model_weight[idx_tmp]+=dd101 * Fweight[x];
-
-				}
+				idx_tmp = z0_mdl_x_mdl_y + mdl_x_mdl_y + y0_mdl_x + (size_t)x0; // z1 * mdl_x * mdl_y + y0 * mdl_x + x0;
+				addToModelRowPair(accumulation, mutexes[z1 * mdl_y + y0],
+						g_model_real, g_model_imag, g_model_weight, idx_tmp,
+						dd100, dd101, real[x], imag[x], Fweight[x]);
 
 				XFLOAT dd110 = (1 - mfz - mfy + mfz_mfy) * mfx; // fz *  fy *  mfx
 				XFLOAT dd111 = (1 - mfz - mfy + mfz_mfy) - dd110; // fz *  fy *  fx
 
-				{
-					tbb::spin_mutex::scoped_lock lock(mutexes[z1 * mdl_y + y0 + 1]);
-					idx_tmp = z0_mdl_x_mdl_y + mdl_x_mdl_y + y0_mdl_x + (size_t)mdl_x + (size_t)x0; // z1 * mdl_x * mdl_y + y1 * mdl_x + x0;
-					g_model_real  [idx_tmp]+=dd110 * real[x];
-					g_model_imag  [idx_tmp]+=dd110 * imag[x];
-					g_model_weight[idx_tmp]+=dd110 * Fweight[x];
-
-					idx_tmp = idx_tmp + 1; // z1 * mdl_x * mdl_y + y1 * mdl_x + x1;
-					g_model_real  [idx_tmp]+=dd111 * real[x];
-					g_model_imag  [idx_tmp]+=dd111 * imag[x];
-					g_model_weight[idx_tmp]+=dd111 * Fweight[x];
-				}
+				idx_tmp = z0_mdl_x_mdl_y + mdl_x_mdl_y + y0_mdl_x + (size_t)mdl_x + (size_t)x0; // z1 * mdl_x * mdl_y + y1 * mdl_x + x0;
+				addToModelRowPair(accumulation, mutexes[z1 * mdl_y + y0 + 1],
+						g_model_real, g_model_imag, g_model_weight, idx_tmp,
+						dd110, dd111, real[x], imag[x], Fweight[x]);
 			}  // for x direction
 
 			pixel += (size_t)img_x;
@@ -793,7 +778,8 @@ void backproject3D_SGD(
 		unsigned mdl_y,
 		int mdl_inity,
 		int mdl_initz,
-		tbb::spin_mutex *mutexes)
+		tbb::spin_mutex *mutexes,
+		AccBackprojector::Accumulation accumulation)
 {
 	int img_y_half = img_y / 2;
 	int img_z_half = img_z / 2;
@@ -988,65 +974,32 @@ void backproject3D_SGD(
 
 					size_t z0MdlxMdly = (size_t)z0 * (size_t)mdl_x * (size_t)mdl_y;
 
-					{
-						tbb::spin_mutex::scoped_lock lock(mutexes[z0 * mdl_y + y0]);
-
-						g_model_real  [z0MdlxMdly + y0 * mdl_x + x0] += dd000 * real[tid];
-						g_model_imag  [z0MdlxMdly + y0 * mdl_x + x0] += dd000 * imag[tid];
-						g_model_weight[z0MdlxMdly + y0 * mdl_x + x0] += dd000 * Fweight[tid];
-
-						g_model_real  [z0MdlxMdly + y0 * mdl_x + x1] += dd001 * real[tid];
-						g_model_imag  [z0MdlxMdly + y0 * mdl_x + x1] += dd001 * imag[tid];
-						g_model_weight[z0MdlxMdly + y0 * mdl_x + x1] += dd001 * Fweight[tid];
-					}
+					addToModelRowPair(accumulation, mutexes[z0 * mdl_y + y0],
+							g_model_real, g_model_imag, g_model_weight, z0MdlxMdly + y0 * mdl_x + x0,
+							dd000, dd001, real[tid], imag[tid], Fweight[tid]);
 
 					XFLOAT dd010 = mfz *  fy * mfx;
 					XFLOAT dd011 = mfz *  fy *  fx;
 
-					{
-						tbb::spin_mutex::scoped_lock lock(mutexes[z0 * mdl_y + y1]);
-
-						g_model_real  [z0MdlxMdly + y1 * mdl_x + x0] += dd010 * real[tid];
-						g_model_imag  [z0MdlxMdly + y1 * mdl_x + x0] += dd010 * imag[tid];
-						g_model_weight[z0MdlxMdly + y1 * mdl_x + x0] += dd010 * Fweight[tid];
-
-						g_model_real  [z0MdlxMdly + y1 * mdl_x + x1] += dd011 * real[tid];
-						g_model_imag  [z0MdlxMdly + y1 * mdl_x + x1] += dd011 * imag[tid];
-						g_model_weight[z0MdlxMdly + y1 * mdl_x + x1] += dd011 * Fweight[tid];
-					}
+					addToModelRowPair(accumulation, mutexes[z0 * mdl_y + y1],
+							g_model_real, g_model_imag, g_model_weight, z0MdlxMdly + y1 * mdl_x + x0,
+							dd010, dd011, real[tid], imag[tid], Fweight[tid]);
 
 					XFLOAT dd100 =  fz * mfy * mfx;
 					XFLOAT dd101 =  fz * mfy *  fx;
 
 					size_t z1MdlxMdly = (size_t)z1 * (size_t)mdl_x * (size_t)mdl_y;
 
-					{
-						tbb::spin_mutex::scoped_lock lock(mutexes[z1 * mdl_y + y0]);
-
-						g_model_real  [z1MdlxMdly + y0 * mdl_x + x0] += dd100 * real[tid];
-						g_model_imag  [z1MdlxMdly + y0 * mdl_x + x0] += dd100 * imag[tid];
-						g_model_weight[z1MdlxMdly + y0 * mdl_x + x0] += dd100 * Fweight[tid];
-
-						g_model_real  [z1MdlxMdly + y0 * mdl_x + x1] += dd101 * real[tid];
-						g_model_imag  [z1MdlxMdly + y0 * mdl_x + x1] += dd101 * imag[tid];
-						g_model_weight[z1MdlxMdly + y0 * mdl_x + x1] += dd101 * Fweight[tid];
-
-					}
+					addToModelRowPair(accumulation, mutexes[z1 * mdl_y + y0],
+							g_model_real, g_model_imag, g_model_weight, z1MdlxMdly + y0 * mdl_x + x0,
+							dd100, dd101, real[tid], imag[tid], Fweight[tid]);
 
 					XFLOAT dd110 =  fz *  fy * mfx;
 					XFLOAT dd111 =  fz *  fy *  fx;
 
-					{
-						tbb::spin_mutex::scoped_lock lock(mutexes[z1 * mdl_y + y1]);
-
-						g_model_real  [z1MdlxMdly + y1 * mdl_x + x0] += dd110 * real[tid];
-						g_model_imag  [z1MdlxMdly + y1 * mdl_x + x0] += dd110 * imag[tid];
-						g_model_weight[z1MdlxMdly + y1 * mdl_x + x0] += dd110 * Fweight[tid];
-
-						g_model_real  [z1MdlxMdly + y1 * mdl_x + x1] += dd111 * real[tid];
-						g_model_imag  [z1MdlxMdly + y1 * mdl_x + x1] += dd111 * imag[tid];
-						g_model_weight[z1MdlxMdly + y1 * mdl_x + x1] += dd111 * Fweight[tid];
-					}
+					addToModelRowPair(accumulation, mutexes[z1 * mdl_y + y1],
+							g_model_real, g_model_imag, g_model_weight, z1MdlxMdly + y1 * mdl_x + x0,
+							dd110, dd111, real[tid], imag[tid], Fweight[tid]);
 
 				} // Fweight[tid] > (RFLOAT) 0.0
 			} // for tid
@@ -1085,7 +1038,8 @@ void backproject2D_SGD(
 		unsigned img_xy,
 		unsigned mdl_x,
 		int mdl_inity,
-		tbb::spin_mutex *mutexes)
+		tbb::spin_mutex *mutexes,
+		AccBackprojector::Accumulation accumulation)
 {
 	int img_y_half = img_y / 2;
 
@@ -1242,35 +1196,16 @@ void backproject2D_SGD(
 
 				size_t idx_tmp;
 
-				// Locking necessary since all threads share the same back projector
-				{
-					idx_tmp = (size_t)y0 * (size_t)mdl_x + (size_t)x0;
+				// All threads share the same back projector, see addToModelRowPair
+				idx_tmp = (size_t)y0 * (size_t)mdl_x + (size_t)x0;
+				addToModelRowPair(accumulation, mutexes[y0],
+						g_model_real, g_model_imag, g_model_weight, idx_tmp,
+						dd00, dd01, real[x], imag[x], Fweight[x]);
 
-					tbb::spin_mutex::scoped_lock lock(mutexes[y0]);
-					g_model_real  [idx_tmp] += dd00 * real[x];
-					g_model_imag  [idx_tmp] += dd00 * imag[x];
-					g_model_weight[idx_tmp] += dd00 * Fweight[x];
-
-					idx_tmp = idx_tmp + 1;  // x1 = x0 + 1
-
-					g_model_real  [idx_tmp] += dd01 * real[x];
-					g_model_imag  [idx_tmp] += dd01 * imag[x];
-					g_model_weight[idx_tmp] += dd01 * Fweight[x];
-				}  // scoping for first lock
-
-				{
-					idx_tmp = (size_t)y1 * (size_t)mdl_x + (size_t)x0;
-
-					tbb::spin_mutex::scoped_lock lock(mutexes[y1]);
-					g_model_real  [idx_tmp] += dd10 * real[x];
-					g_model_imag  [idx_tmp] += dd10 * imag[x];
-					g_model_weight[idx_tmp] += dd10 * Fweight[x];
-
-					idx_tmp = idx_tmp + 1;  // x1 = x0 + 1
-					g_model_real  [idx_tmp] += dd11 * real[x];
-					g_model_imag  [idx_tmp] += dd11 * imag[x];
-					g_model_weight[idx_tmp] += dd11 * Fweight[x];
-				}  // scoping for second lock
+				idx_tmp = (size_t)y1 * (size_t)mdl_x + (size_t)x0;
+				addToModelRowPair(accumulation, mutexes[y1],
+						g_model_real, g_model_imag, g_model_weight, idx_tmp,
+						dd10, dd11, real[x], imag[x], Fweight[x]);
 			}  // for x
 
 			pixel += (size_t)img_x;
@@ -10,6 +10,7 @@
 #include "src/acc/acc_projector.h"
 #include "src/acc/cpu/cpu_kernels/cpu_utils.h"
 #include "src/acc/cpu/cpu_kernels/helper.h"
+#include "src/acc/cpu/cpu_kernels/diff2_simd.h"
 
 namespace CpuKernels
 {
@@ -381,6 +382,9 @@ inline void diff2_coarse(
 	XFLOAT trans_cos_x[block_sz], trans_sin_x[block_sz];
 	XFLOAT trans_cos_y[block_sz], trans_sin_y[block_sz];
 	XFLOAT trans_cos_z[block_sz], trans_sin_z[block_sz];
+
+	// Hand-vectorised loops for this CPU, if any (see diff2_simd.h)
+	const Diff2SimdKernels *simd = diff2SimdKernels();
 #endif  // not Intel Compiler
 	
 	int x[pass_num][block_sz], y[pass_num][block_sz], z[pass_num][block_sz];
@@ -538,6 +542,16 @@ inline void diff2_coarse(
 						trans_sin_x[tid] = sin_x[i][xidx];
 					}					
 				}  // tid  						
+
+				if (simd != NULL)
+				{
+					simd->coarseTranslation(elements, eulers_per_block, block_sz,
+							trans_cos_x, trans_sin_x, trans_cos_y, trans_sin_y,
+							DATA3D ? trans_cos_z : NULL, DATA3D ? trans_sin_z : NULL,
+							s_real[pass], s_imag[pass], s_corr[pass],
+							&s_ref_real[0][0], &s_ref_imag[0][0], &diff2s[i][0]);
+					continue;
+				}
 #endif  // not Intel Compiler
 
 				for (int j = 0; j < eulers_per_block; j ++)
@@ -650,6 +664,10 @@ inline void diff2_fine_2D(
 	XFLOAT imgs_real[xSize], imgs_imag[xSize];
 	
 	XFLOAT s[translation_num];   
+	XFLOAT row_cos[translation_num], row_sin[translation_num];
+
+	// Hand-vectorised loops for this CPU, if any (see diff2_simd.h)
+	const Diff2SimdKernels *simd = diff2SimdKernels();
 	
 	// Now do calculations
 	for (unsigned long bid = 0; bid < grid_size; bid++) {
@@ -711,6 +729,17 @@ inline void diff2_fine_2D(
 				imgs_imag[x]  = g_imgs_imag[pixel + x] * half_corr;            
 			}
 
+			if (simd != NULL) {
+				for (unsigned long itrans=0; itrans<trans_num; itrans++) {
+					row_cos[itrans] = cos_y[itrans][abs(y)];
+					row_sin[itrans] = (y < 0) ? -sin_y[itrans][-y] : sin_y[itrans][y];
+				}
+				simd->fineRow(trans_num, xstart, xend, &cos_x[0][0], &sin_x[0][0], xSize,
+						row_cos, row_sin, ref_real, ref_imag, imgs_real, imgs_imag, s);
+
+				pixel += (unsigned long)xSize;
+				continue;
+			}
 
 			for (unsigned long itrans=0; itrans<trans_num; itrans++) {
 				XFLOAT trans_cos_y, trans_sin_y;
@@ -802,6 +831,10 @@ inline void diff2_fine_3D(
 	XFLOAT imgs_real[xSize], imgs_imag[xSize];
 	
 	XFLOAT s[translation_num];   
+	XFLOAT row_cos[translation_num], row_sin[translation_num];
+
+	// Hand-vectorised loops for this CPU, if any (see diff2_simd.h)
+	const Diff2SimdKernels *simd = diff2SimdKernels();
 		
 	// Now do calculations
 	for (unsigned long bid = 0; bid < grid_size; bid++) {
@@ -876,6 +909,20 @@ inline void diff2_fine_3D(
 					imgs_imag[x]  = g_imgs_imag[pixel + x] * half_corr;            
 				}
 
+				if (simd != NULL) {
+					// The y and z parts of the phase shift, combined once per row
+					for (unsigned long itrans=0; itrans<trans_num; itrans++) {
+						XFLOAT cy = cos_y[itrans][abs(y)], sy = (y < 0) ? -sin_y[itrans][-y] : sin_y[itrans][y];
+						XFLOAT cz = cos_z[itrans][abs(z)], sz = (z < 0) ? -sin_z[itrans][-z] : sin_z[itrans][z];
+						row_cos[itrans] = cy * cz - sy * sz;
+						row_sin[itrans] = sy * cz + cy * sz;
+					}
+					simd->fineRow(trans_num, xstart_y, xend_y, &cos_x[0][0], &sin_x[0][0], xSize,
+							row_cos, row_sin, ref_real, ref_imag, imgs_real, imgs_imag, s);
+
+					pixel += (unsigned long)xSize;
+					continue;
+				}
 
 				for (unsigned long itrans=0; itrans<trans_num; itrans++) {
 					XFLOAT trans_cos_z, trans_sin_z;
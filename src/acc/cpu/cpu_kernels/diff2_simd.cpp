@@ -0,0 +1,67 @@
+// The portable diff2 loops, and the choice between them and the loops for
+// wider instruction sets in diff2_simd_avx2.cpp and diff2_simd_avx512.cpp
+#define RELION_SIMD_NAMESPACE simd_portable
+#define RELION_SIMD_PORTABLE
+#include "src/acc/cpu/cpu_kernels/diff2_simd_impl.h"
+
+#include <stdlib.h>
+#include <string>
+#include <iostream>
+
+namespace CpuKernels
+{
+
+const Diff2SimdKernels *diff2SimdKernelsPortable()
+{
+	return &simd_portable::kernels;
+}
+
+static bool cpuSupports(const std::string &isa)
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	if (isa == "avx2")
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	if (isa == "avx512")
+		return __builtin_cpu_supports("avx512f");
+#endif
+	return false;
+}
+
+static const Diff2SimdKernels *chooseDiff2SimdKernels()
+{
+	const char *env = getenv("RELION_CPU_SIMD");
+	std::string choice = (env == NULL) ? "auto" : env;
+
+	if (choice == "off")
+		return NULL;
+	if (choice == "portable")
+		return diff2SimdKernelsPortable();
+	if (choice == "avx512" && diff2SimdKernelsAVX512() != NULL && cpuSupports("avx512"))
+		return diff2SimdKernelsAVX512();
+	if (choice == "avx2" && diff2SimdKernelsAVX2() != NULL && cpuSupports("avx2"))
+		return diff2SimdKernelsAVX2();
+	if (choice != "auto")
+		std::cerr << " + WARNING: RELION_CPU_SIMD=" << choice
+		          << " is not available in this build or on this CPU; choosing automatically." << std::endl;
+
+	if (diff2SimdKernelsAVX512() != NULL && cpuSupports("avx512"))
+		return diff2SimdKernelsAVX512();
+	if (diff2SimdKernelsAVX2() != NULL && cpuSupports("avx2"))
+		return diff2SimdKernelsAVX2();
+	return NULL;
+}
+
+static const Diff2SimdKernels *selected_diff2_kernels = chooseDiff2SimdKernels();
+
+const Diff2SimdKernels *diff2SimdKernels()
+{
+	return selected_diff2_kernels;
+}
+
+void setDiff2SimdKernels(const Diff2SimdKernels *kernels)
+{
+	selected_diff2_kernels = kernels;
+}
+
+} // namespace CpuKernels
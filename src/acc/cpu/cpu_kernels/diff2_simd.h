@@ -0,0 +1,70 @@
+#ifndef DIFF2_SIMD_H_
+#define DIFF2_SIMD_H_
+
+#include "src/acc/settings.h"
+
+namespace CpuKernels
+{
+
+// Hand-vectorised inner loops of the difference-based diff2 kernels.
+//
+// There is one set of these per instruction set (see simd.h), each compiled in
+// its own translation unit with the matching compiler flags. diff2_coarse and
+// diff2_fine_2D/3D in diff2.h use the set returned by diff2SimdKernels() in
+// place of their auto-vectorised loops.
+struct Diff2SimdKernels
+{
+	const char *isa;
+
+	// For each of the eulers orientations e, adds to diff2s[e] the sum over
+	// the first elements pixels of
+	//   corr * |ref_e - img * (cos_x + i sin_x)(cos_y + i sin_y)(cos_z + i sin_z)|^2
+	// ref_real and ref_imag hold one row of ref_stride values per orientation.
+	// cos_z and sin_z are NULL for 2D images.
+	void (*coarseTranslation)(
+			unsigned long elements,
+			int eulers,
+			unsigned long ref_stride,
+			const XFLOAT *cos_x, const XFLOAT *sin_x,
+			const XFLOAT *cos_y, const XFLOAT *sin_y,
+			const XFLOAT *cos_z, const XFLOAT *sin_z,
+			const XFLOAT *img_real, const XFLOAT *img_imag,
+			const XFLOAT *corr,
+			const XFLOAT *ref_real, const XFLOAT *ref_imag,
+			XFLOAT *diff2s);
+
+	// For each of the trans_num translations t, adds to s[t] the sum over
+	// x in [xstart, xend) of
+	//   |ref - img * (cos_x + i sin_x)[t * table_stride + x] * (cos_row + i sin_row)[t]|^2
+	// where the row phase holds the y (and z) part of the shift.
+	void (*fineRow)(
+			unsigned long trans_num,
+			int xstart,
+			int xend,
+			const XFLOAT *cos_x, const XFLOAT *sin_x,
+			unsigned long table_stride,
+			const XFLOAT *cos_row, const XFLOAT *sin_row,
+			const XFLOAT *ref_real, const XFLOAT *ref_imag,
+			const XFLOAT *img_real, const XFLOAT *img_imag,
+			XFLOAT *s);
+};
+
+// The kernels for each instruction set, or NULL when this build or this CPU
+// cannot run them
+const Diff2SimdKernels *diff2SimdKernelsPortable();
+const Diff2SimdKernels *diff2SimdKernelsAVX2();
+const Diff2SimdKernels *diff2SimdKernelsAVX512();
+
+// The kernels the diff2 kernels use: by default those for the widest
+// instruction set this CPU supports, or NULL (the auto-vectorised loops) if
+// that is neither AVX2 nor AVX-512. The environment variable RELION_CPU_SIMD
+// (auto, off, portable, avx2 or avx512) overrides the choice.
+const Diff2SimdKernels *diff2SimdKernels();
+
+// Overrides the choice above, e.g. to compare kernels; NULL selects the
+// auto-vectorised loops
+void setDiff2SimdKernels(const Diff2SimdKernels *kernels);
+
+} // namespace CpuKernels
+
+#endif /* DIFF2_SIMD_H_ */
@@ -0,0 +1,19 @@
+// The diff2 loops for AVX2 with FMA. This file is compiled with -mavx2 -mfma
+// (see src/apps/CMakeLists.txt) and only called on CPUs that support both.
+#define RELION_SIMD_NAMESPACE simd_avx2
+#include "src/acc/cpu/cpu_kernels/diff2_simd_impl.h"
+
+namespace CpuKernels
+{
+
+const Diff2SimdKernels *diff2SimdKernelsAVX2()
+{
+#if defined(__AVX2__) && defined(__FMA__) && !defined(__AVX512F__)
+	return &simd_avx2::kernels;
+#else
+	// Built without the flags, or the whole build already targets AVX-512
+	return NULL;
+#endif
+}
+
+} // namespace CpuKernels
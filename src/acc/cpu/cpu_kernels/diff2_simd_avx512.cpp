@@ -0,0 +1,18 @@
+// The diff2 loops for AVX-512. This file is compiled with -mavx512f -mfma
+// (see src/apps/CMakeLists.txt) and only called on CPUs that support it.
+#define RELION_SIMD_NAMESPACE simd_avx512
+#include "src/acc/cpu/cpu_kernels/diff2_simd_impl.h"
+
+namespace CpuKernels
+{
+
+const Diff2SimdKernels *diff2SimdKernelsAVX512()
+{
+#if defined(__AVX512F__)
+	return &simd_avx512::kernels;
+#else
+	return NULL;
+#endif
+}
+
+} // namespace CpuKernels
@@ -0,0 +1,144 @@
+// The hand-vectorised diff2 loops declared in diff2_simd.h, written once on
+// top of Simd<T> (simd.h). Every instruction set includes this in its own
+// translation unit after defining RELION_SIMD_NAMESPACE.
+#ifndef DIFF2_SIMD_IMPL_H_
+#define DIFF2_SIMD_IMPL_H_
+
+#include "src/acc/cpu/cpu_kernels/diff2_simd.h"
+#include "src/acc/cpu/cpu_kernels/simd.h"
+
+namespace CpuKernels
+{
+namespace RELION_SIMD_NAMESPACE
+{
+
+typedef Simd<XFLOAT> SimdX;
+
+static void coarseTranslation(
+		unsigned long elements,
+		int eulers,
+		unsigned long ref_stride,
+		const XFLOAT *cos_x, const XFLOAT *sin_x,
+		const XFLOAT *cos_y, const XFLOAT *sin_y,
+		const XFLOAT *cos_z, const XFLOAT *sin_z,
+		const XFLOAT *img_real, const XFLOAT *img_imag,
+		const XFLOAT *corr,
+		const XFLOAT *ref_real, const XFLOAT *ref_imag,
+		XFLOAT *diff2s)
+{
+	const long n = elements;
+	if (n <= 0)
+		return;
+	const long padded = (n + SimdX::width - 1) / SimdX::width * SimdX::width;
+
+	// Shift the image once; the padding is zero, as is corr there
+	XFLOAT shifted_real[padded], shifted_imag[padded];
+	for (long p = 0; p < n; p += SimdX::width)
+	{
+		const long left = n - p;
+		SimdX cx = SimdX::loadPartial(cos_x + p, left), sx = SimdX::loadPartial(sin_x + p, left);
+		SimdX cy = SimdX::loadPartial(cos_y + p, left), sy = SimdX::loadPartial(sin_y + p, left);
+
+		SimdX ss = fmadd(sx, cy, cx * sy);
+		SimdX cc = fnmadd(sx, sy, cx * cy);
+
+		if (cos_z != NULL)
+		{
+			SimdX cz = SimdX::loadPartial(cos_z + p, left), sz = SimdX::loadPartial(sin_z + p, left);
+			SimdX s = ss;
+			ss = fmadd(s, cz, cc * sz);
+			cc = fnmadd(s, sz, cc * cz);
+		}
+
+		SimdX re = SimdX::loadPartial(img_real + p, left), im = SimdX::loadPartial(img_imag + p, left);
+		fnmadd(ss, im, cc * re).store(shifted_real + p);
+		fmadd(ss, re, cc * im).store(shifted_imag + p);
+	}
+
+	// Four orientations at a time share the loads of the shifted image
+	int e = 0;
+	for (; e + 4 <= eulers; e += 4)
+	{
+		const XFLOAT *r0 = ref_real + (e    ) * ref_stride, *i0 = ref_imag + (e    ) * ref_stride;
+		const XFLOAT *r1 = ref_real + (e + 1) * ref_stride, *i1 = ref_imag + (e + 1) * ref_stride;
+		const XFLOAT *r2 = ref_real + (e + 2) * ref_stride, *i2 = ref_imag + (e + 2) * ref_stride;
+		const XFLOAT *r3 = ref_real + (e + 3) * ref_stride, *i3 = ref_imag + (e + 3) * ref_stride;
+
+		SimdX sum0 = SimdX::zero(), sum1 = SimdX::zero(), sum2 = SimdX::zero(), sum3 = SimdX::zero();
+		for (long p = 0; p < n; p += SimdX::width)
+		{
+			const long left = n - p;
+			SimdX re = SimdX::load(shifted_real + p), im = SimdX::load(shifted_imag + p);
+			SimdX c = SimdX::loadPartial(corr + p, left);
+			SimdX dr, di;
+
+			dr = SimdX::loadPartial(r0 + p, left) - re; di = SimdX::loadPartial(i0 + p, left) - im;
+			sum0 = fmadd(fmadd(dr, dr, di * di), c, sum0);
+			dr = SimdX::loadPartial(r1 + p, left) - re; di = SimdX::loadPartial(i1 + p, left) - im;
+			sum1 = fmadd(fmadd(dr, dr, di * di), c, sum1);
+			dr = SimdX::loadPartial(r2 + p, left) - re; di = SimdX::loadPartial(i2 + p, left) - im;
+			sum2 = fmadd(fmadd(dr, dr, di * di), c, sum2);
+			dr = SimdX::loadPartial(r3 + p, left) - re; di = SimdX::loadPartial(i3 + p, left) - im;
+			sum3 = fmadd(fmadd(dr, dr, di * di), c, sum3);
+		}
+		diff2s[e    ] += reduceAdd(sum0);
+		diff2s[e + 1] += reduceAdd(sum1);
+		diff2s[e + 2] += reduceAdd(sum2);
+		diff2s[e + 3] += reduceAdd(sum3);
+	}
+
+	for (; e < eulers; e++)
+	{
+		const XFLOAT *r = ref_real + e * ref_stride, *i = ref_imag + e * ref_stride;
+		SimdX sum = SimdX::zero();
+		for (long p = 0; p < n; p += SimdX::width)
+		{
+			const long left = n - p;
+			SimdX dr = SimdX::loadPartial(r + p, left) - SimdX::load(shifted_real + p);
+			SimdX di = SimdX::loadPartial(i + p, left) - SimdX::load(shifted_imag + p);
+			sum = fmadd(fmadd(dr, dr, di * di), SimdX::loadPartial(corr + p, left), sum);
+		}
+		diff2s[e] += reduceAdd(sum);
+	}
+}
+
+static void fineRow(
+		unsigned long trans_num,
+		int xstart,
+		int xend,
+		const XFLOAT *cos_x, const XFLOAT *sin_x,
+		unsigned long table_stride,
+		const XFLOAT *cos_row, const XFLOAT *sin_row,
+		const XFLOAT *ref_real, const XFLOAT *ref_imag,
+		const XFLOAT *img_real, const XFLOAT *img_imag,
+		XFLOAT *s)
+{
+	for (unsigned long t = 0; t < trans_num; t++)
+	{
+		const XFLOAT *cx_t = cos_x + t * table_stride, *sx_t = sin_x + t * table_stride;
+		SimdX cr = SimdX::broadcast(cos_row[t]), sr = SimdX::broadcast(sin_row[t]);
+
+		// Everything past xend loads as zero and adds nothing
+		SimdX sum = SimdX::zero();
+		for (int x = xstart; x < xend; x += SimdX::width)
+		{
+			const long left = xend - x;
+			SimdX cx = SimdX::loadPartial(cx_t + x, left), sx = SimdX::loadPartial(sx_t + x, left);
+			SimdX ss = fmadd(sx, cr, cx * sr);
+			SimdX cc = fnmadd(sx, sr, cx * cr);
+
+			SimdX re = SimdX::loadPartial(img_real + x, left), im = SimdX::loadPartial(img_imag + x, left);
+			SimdX dr = SimdX::loadPartial(ref_real + x, left) - fnmadd(ss, im, cc * re);
+			SimdX di = SimdX::loadPartial(ref_imag + x, left) - fmadd(ss, re, cc * im);
+			sum = fmadd(dr, dr, fmadd(di, di, sum));
+		}
+		s[t] += reduceAdd(sum);
+	}
+}
+
+static const Diff2SimdKernels kernels = { RELION_SIMD_ISA_NAME, coarseTranslation, fineRow };
+
+} // namespace RELION_SIMD_NAMESPACE
+} // namespace CpuKernels
+
+#endif /* DIFF2_SIMD_IMPL_H_ */
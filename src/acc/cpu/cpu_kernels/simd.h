@@ -0,0 +1,249 @@
+// Portable short-vector types for the hand-vectorised CPU kernels.
+//
+// Simd<T> holds as many float or double values as fit one register of the
+// instruction set the including translation unit is compiled for: AVX-512
+// (__AVX512F__), AVX2 with FMA (__AVX2__ and __FMA__) or, for everything else
+// and when RELION_SIMD_PORTABLE is defined, a 128-bit wide array that the
+// compiler vectorises as it can.
+//
+// The same kernel source is compiled once per instruction set, in separate
+// translation units with different compiler flags. To keep the copies apart,
+// the includer must define RELION_SIMD_NAMESPACE to a name that is unique to
+// the translation unit; everything here lives in that namespace.
+#ifndef RELION_SIMD_NAMESPACE
+#  error "Define RELION_SIMD_NAMESPACE before including simd.h"
+#endif
+
+#ifndef CPU_SIMD_H_
+#define CPU_SIMD_H_
+
+#include <stddef.h>
+
+#if !defined(RELION_SIMD_PORTABLE) && (defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__)))
+#  include <immintrin.h>
+#endif
+
+namespace CpuKernels
+{
+namespace RELION_SIMD_NAMESPACE
+{
+
+template <typename T> class Simd;
+
+#if !defined(RELION_SIMD_PORTABLE) && defined(__AVX512F__)
+
+#define RELION_SIMD_ISA_NAME "AVX-512"
+
+template <> class Simd<float>
+{
+public:
+	enum { width = 16 };
+	__m512 v;
+
+	Simd() {}
+	Simd(__m512 x) : v(x) {}
+
+	static Simd zero() { return _mm512_setzero_ps(); }
+	static Simd broadcast(float a) { return _mm512_set1_ps(a); }
+	static Simd load(const float *p) { return _mm512_loadu_ps(p); }
+	// The first n values (all if n >= width), the rest zero
+	static Simd loadPartial(const float *p, ptrdiff_t n)
+	{
+		return _mm512_maskz_loadu_ps(n >= width ? (__mmask16)0xFFFF : (__mmask16)((1u << n) - 1), p);
+	}
+	void store(float *p) const { _mm512_storeu_ps(p, v); }
+
+	friend Simd operator+(Simd a, Simd b) { return _mm512_add_ps(a.v, b.v); }
+	friend Simd operator-(Simd a, Simd b) { return _mm512_sub_ps(a.v, b.v); }
+	friend Simd operator*(Simd a, Simd b) { return _mm512_mul_ps(a.v, b.v); }
+	// a * b + c
+	friend Simd fmadd(Simd a, Simd b, Simd c) { return _mm512_fmadd_ps(a.v, b.v, c.v); }
+	// a * b - c
+	friend Simd fmsub(Simd a, Simd b, Simd c) { return _mm512_fmsub_ps(a.v, b.v, c.v); }
+	// c - a * b
+	friend Simd fnmadd(Simd a, Simd b, Simd c) { return _mm512_fnmadd_ps(a.v, b.v, c.v); }
+	friend float reduceAdd(Simd a) { return _mm512_reduce_add_ps(a.v); }
+};
+
+template <> class Simd<double>
+{
+public:
+	enum { width = 8 };
+	__m512d v;
+
+	Simd() {}
+	Simd(__m512d x) : v(x) {}
+
+	static Simd zero() { return _mm512_setzero_pd(); }
+	static Simd broadcast(double a) { return _mm512_set1_pd(a); }
+	static Simd load(const double *p) { return _mm512_loadu_pd(p); }
+	static Simd loadPartial(const double *p, ptrdiff_t n)
+	{
+		return _mm512_maskz_loadu_pd(n >= width ? (__mmask8)0xFF : (__mmask8)((1u << n) - 1), p);
+	}
+	void store(double *p) const { _mm512_storeu_pd(p, v); }
+
+	friend Simd operator+(Simd a, Simd b) { return _mm512_add_pd(a.v, b.v); }
+	friend Simd operator-(Simd a, Simd b) { return _mm512_sub_pd(a.v, b.v); }
+	friend Simd operator*(Simd a, Simd b) { return _mm512_mul_pd(a.v, b.v); }
+	friend Simd fmadd(Simd a, Simd b, Simd c) { return _mm512_fmadd_pd(a.v, b.v, c.v); }
+	friend Simd fmsub(Simd a, Simd b, Simd c) { return _mm512_fmsub_pd(a.v, b.v, c.v); }
+	friend Simd fnmadd(Simd a, Simd b, Simd c) { return _mm512_fnmadd_pd(a.v, b.v, c.v); }
+	friend double reduceAdd(Simd a) { return _mm512_reduce_add_pd(a.v); }
+};
+
+#elif !defined(RELION_SIMD_PORTABLE) && defined(__AVX2__) && defined(__FMA__)
+
+#define RELION_SIMD_ISA_NAME "AVX2"
+
+template <> class Simd<float>
+{
+public:
+	enum { width = 8 };
+	__m256 v;
+
+	Simd() {}
+	Simd(__m256 x) : v(x) {}
+
+	static Simd zero() { return _mm256_setzero_ps(); }
+	static Simd broadcast(float a) { return _mm256_set1_ps(a); }
+	static Simd load(const float *p) { return _mm256_loadu_ps(p); }
+	static Simd loadPartial(const float *p, ptrdiff_t n)
+	{
+		if (n >= width)
+			return load(p);
+		__m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)n), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+		return _mm256_maskload_ps(p, mask);
+	}
+	void store(float *p) const { _mm256_storeu_ps(p, v); }
+
+	friend Simd operator+(Simd a, Simd b) { return _mm256_add_ps(a.v, b.v); }
+	friend Simd operator-(Simd a, Simd b) { return _mm256_sub_ps(a.v, b.v); }
+	friend Simd operator*(Simd a, Simd b) { return _mm256_mul_ps(a.v, b.v); }
+	friend Simd fmadd(Simd a, Simd b, Simd c) { return _mm256_fmadd_ps(a.v, b.v, c.v); }
+	friend Simd fmsub(Simd a, Simd b, Simd c) { return _mm256_fmsub_ps(a.v, b.v, c.v); }
+	friend Simd fnmadd(Simd a, Simd b, Simd c) { return _mm256_fnmadd_ps(a.v, b.v, c.v); }
+	friend float reduceAdd(Simd a)
+	{
+		__m128 s = _mm_add_ps(_mm256_castps256_ps128(a.v), _mm256_extractf128_ps(a.v, 1));
+		s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+		s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+		return _mm_cvtss_f32(s);
+	}
+};
+
+template <> class Simd<double>
+{
+public:
+	enum { width = 4 };
+	__m256d v;
+
+	Simd() {}
+	Simd(__m256d x) : v(x) {}
+
+	static Simd zero() { return _mm256_setzero_pd(); }
+	static Simd broadcast(double a) { return _mm256_set1_pd(a); }
+	static Simd load(const double *p) { return _mm256_loadu_pd(p); }
+	static Simd loadPartial(const double *p, ptrdiff_t n)
+	{
+		if (n >= width)
+			return load(p);
+		__m256i mask = _mm256_cmpgt_epi64(_mm256_set1_epi64x(n), _mm256_setr_epi64x(0, 1, 2, 3));
+		return _mm256_maskload_pd(p, mask);
+	}
+	void store(double *p) const { _mm256_storeu_pd(p, v); }
+
+	friend Simd operator+(Simd a, Simd b) { return _mm256_add_pd(a.v, b.v); }
+	friend Simd operator-(Simd a, Simd b) { return _mm256_sub_pd(a.v, b.v); }
+	friend Simd operator*(Simd a, Simd b) { return _mm256_mul_pd(a.v, b.v); }
+	friend Simd fmadd(Simd a, Simd b, Simd c) { return _mm256_fmadd_pd(a.v, b.v, c.v); }
+	friend Simd fmsub(Simd a, Simd b, Simd c) { return _mm256_fmsub_pd(a.v, b.v, c.v); }
+	friend Simd fnmadd(Simd a, Simd b, Simd c) { return _mm256_fnmadd_pd(a.v, b.v, c.v); }
+	friend double reduceAdd(Simd a)
+	{
+		__m128d s = _mm_add_pd(_mm256_castpd256_pd128(a.v), _mm256_extractf128_pd(a.v, 1));
+		s = _mm_add_sd(s, _mm_unpackhi_pd(s, s));
+		return _mm_cvtsd_f64(s);
+	}
+};
+
+#else
+
+#define RELION_SIMD_ISA_NAME "portable"
+
+// 128 bits worth of values, in plain loops the compiler can map onto
+// whatever vector unit the build targets
+template <typename T> class Simd
+{
+public:
+	enum { width = 16 / sizeof(T) };
+	T v[width];
+
+	static Simd zero() { return broadcast((T)0); }
+	static Simd broadcast(T a)
+	{
+		Simd r;
+		for (int i = 0; i < width; i++) r.v[i] = a;
+		return r;
+	}
+	static Simd load(const T *p)
+	{
+		Simd r;
+		for (int i = 0; i < width; i++) r.v[i] = p[i];
+		return r;
+	}
+	static Simd loadPartial(const T *p, ptrdiff_t n)
+	{
+		Simd r;
+		for (int i = 0; i < width; i++) r.v[i] = (i < n) ? p[i] : (T)0;
+		return r;
+	}
+	void store(T *p) const
+	{
+		for (int i = 0; i < width; i++) p[i] = v[i];
+	}
+
+	friend Simd operator+(Simd a, Simd b)
+	{
+		for (int i = 0; i < width; i++) a.v[i] += b.v[i];
+		return a;
+	}
+	friend Simd operator-(Simd a, Simd b)
+	{
+		for (int i = 0; i < width; i++) a.v[i] -= b.v[i];
+		return a;
+	}
+	friend Simd operator*(Simd a, Simd b)
+	{
+		for (int i = 0; i < width; i++) a.v[i] *= b.v[i];
+		return a;
+	}
+	friend Simd fmadd(Simd a, Simd b, Simd c)
+	{
+		for (int i = 0; i < width; i++) a.v[i] = a.v[i] * b.v[i] + c.v[i];
+		return a;
+	}
+	friend Simd fmsub(Simd a, Simd b, Simd c)
+	{
+		for (int i = 0; i < width; i++) a.v[i] = a.v[i] * b.v[i] - c.v[i];
+		return a;
+	}
+	friend Simd fnmadd(Simd a, Simd b, Simd c)
+	{
+		for (int i = 0; i < width; i++) a.v[i] = c.v[i] - a.v[i] * b.v[i];
+		return a;
+	}
+	friend T reduceAdd(Simd a)
+	{
+		T s = 0;
+		for (int i = 0; i < width; i++) s += a.v[i];
+		return s;
+	}
+};
+
+#endif
+
+} // namespace RELION_SIMD_NAMESPACE
+} // namespace CpuKernels
+
+#endif /* CPU_SIMD_H_ */
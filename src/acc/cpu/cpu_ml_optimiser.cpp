@@ -55,6 +55,7 @@
 
 #include <tbb/parallel_for.h>
 #include <tbb/queuing_mutex.h>
+#include <tbb/task_arena.h>
 
 #include "src/acc/utilities.h"
 #include "src/acc/utilities_impl.h"
@@ -96,6 +97,10 @@ void MlDataBundle::setup(MlOptimiser *baseMLO)
 
 		projectors[imodel].initMdl(baseMLO->mdlClassComplex[imodel]);
 
+		// With --cpu_release_refs the kernels only keep their XFLOAT copy of the reference
+		// (multi-body refinement still reads the original ones)
+		if (baseMLO->do_cpu_release_refs && baseMLO->mymodel.nr_bodies == 1)
+			baseMLO->mymodel.PPref[imodel].data.clear();
 	}
 
 	for (int imodel = 0; imodel < nr_bproj; imodel++)
@@ -110,8 +115,47 @@ void MlDataBundle::setup(MlOptimiser *baseMLO)
 				baseMLO->wsum_model.BPref[imodel].padding_factor);
 
 		backprojectors[imodel].initMdl();
+
+		// ... and the weighted sums are only re-allocated, class by class, when the kernels hand them over
+		if (baseMLO->do_cpu_release_refs)
+		{
+			baseMLO->wsum_model.BPref[imodel].data.clear();
+			baseMLO->wsum_model.BPref[imodel].weight.clear();
+		}
+	}
+
+	// How the threads add to the shared back projectors
+	AccBackprojector::Accumulation accumulation;
+	if (baseMLO->cpu_bp_accumulation == "locked")
+		accumulation = AccBackprojector::LOCKED;
+	else if (baseMLO->cpu_bp_accumulation == "atomic")
+		accumulation = AccBackprojector::ATOMIC;
+	else if (baseMLO->cpu_bp_accumulation == "sharded")
+		accumulation = AccBackprojector::SHARDED;
+	else
+		REPORT_ERROR("ERROR: --cpu_bp_accumulation should be locked, atomic or sharded, not " + baseMLO->cpu_bp_accumulation);
+
+	// One shard per TBB worker that may run the expectation tasks
+	const int nr_shards = tbb::this_task_arena::max_concurrency();
+	if (accumulation == AccBackprojector::SHARDED)
+	{
+		// Every shard may end up with a private copy of every back projector
+		size_t shard_bytes = 0;
+		for (int imodel = 0; imodel < nr_bproj; imodel++)
+			shard_bytes += 3 * backprojectors[imodel].mdlXYZ * sizeof(XFLOAT);
+		if ((RFLOAT)shard_bytes * nr_shards > baseMLO->cpu_bp_shard_max_mem_Gb * 1024. * 1024. * 1024.)
+		{
+			if (baseMLO->verb > 0)
+				std::cerr << " + WARNING: private back projectors for " << nr_shards << " threads would need "
+				          << (RFLOAT)shard_bytes * nr_shards / (1024. * 1024. * 1024.)
+				          << " Gb, more than --cpu_bp_shard_max_mem; using atomic adds instead." << std::endl;
+			accumulation = AccBackprojector::ATOMIC;
+		}
 	}
 
+	for (int imodel = 0; imodel < nr_bproj; imodel++)
+		backprojectors[imodel].setAccumulation(accumulation, nr_shards);
+
 	/*======================================================
 						PROJECTION PLAN
 	======================================================*/
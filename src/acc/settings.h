@@ -17,6 +17,15 @@
 	#define ACCCOMPLEX float2
 #endif
 
+// Marks the functions that run the hot ALTCPU kernels. With RELION_CPU_DISPATCH
+// they are compiled for every instruction set below, and the loader picks the
+// best one for the CPU at startup (see src/acc/cpu/cpu_dispatch.h)
+#if defined(ALTCPU) && defined(RELION_CPU_DISPATCH)
+	#define CPU_DISPATCH __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#else
+	#define CPU_DISPATCH
+#endif
+
 #ifdef _CUDA_ENABLED
 	#define accGPUGetDeviceCount cudaGetDeviceCount
 	#define accGPUDeviceProp cudaDeviceProp
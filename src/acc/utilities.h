@@ -943,6 +943,7 @@ void frequencyPass(int grid_size, int block_size,
 }
 
 template<bool REFCTF, bool REF3D, bool DATA3D, int block_sz>
+CPU_DISPATCH
 void kernel_wavg(
 		XFLOAT *g_eulers,
 		AccProjectorKernel &projector,
@@ -1080,6 +1081,7 @@ void kernel_wavg(
 }
 
 template<bool REF3D, bool DATA3D, int block_sz, int eulers_per_block, int prefetch_fraction>
+CPU_DISPATCH
 void diff2_coarse(
 		unsigned long grid_size,
 		int block_size,
@@ -1159,6 +1161,7 @@ void diff2_coarse(
 }
 
 template<bool REF3D, bool DATA3D, int block_sz>
+CPU_DISPATCH
 void diff2_CC_coarse(
 		unsigned long grid_size,
 		int block_size,
@@ -1259,6 +1262,7 @@ void diff2_CC_coarse(
 }
 
 template<bool REF3D, bool DATA3D, int block_sz, int chunk_sz>
+CPU_DISPATCH
 void diff2_fine(
 		unsigned long grid_size,
 		int block_size,
@@ -1398,6 +1402,7 @@ void diff2_fine(
 }
 
 template<bool REF3D, bool DATA3D, int block_sz,int chunk_sz>
+CPU_DISPATCH
 void diff2_CC_fine(
 		unsigned long grid_size,
 		int block_size,
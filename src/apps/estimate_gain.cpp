@@ -170,6 +170,7 @@ class estimate_gain
 				}
 			
 				const int eer_grouping = (n_frames + n_threads - 1) / n_threads;
+				renderer.preReadFrames(n_threads);
 				#pragma omp parallel for num_threads(n_threads)
 				for (int frame = 1; frame < n_frames; frame += eer_grouping)
 				{
@@ -18,14 +18,168 @@
  ***************************************************************************/
 #include "src/mpi.h"
 #include "src/multidim_array.h"
+#include "src/args.h"
+#include <cmath>
+#include <limits>
 
 // This simple program tests MPI communication by sending
 // blocks of 1 MB to 600 MB.
+//
+// With --reduce, it instead times summing an array over all followers
+// (as in combineAllWeightedSums), e.g. on a single machine:
+//   mpirun -n 9 relion_mpi_tester --reduce --size 512 --algorithm ring
+// Followers are split into two halves as with --split_random_halves, unless --no_split is given.
+// The largest error of the sums, relative to the sum of the absolute values, is reported in units of
+// rounding of the type on the wire; it should stay below the number of followers that are summed over.
+
+void benchmarkReduction(MpiNode &node, int argc, char *argv[])
+{
+	IOParser parser;
+	parser.setCommandLine(argc, argv);
+	parser.addSection("Reduction benchmark options");
+	parser.checkOption("--reduce", "Time the summation of an array over all followers");
+	const std::ptrdiff_t count = textToFloat(parser.getOption("--size", "Size of the array (in MB)", "256")) * 1024 * 1024 / sizeof(RFLOAT);
+	const std::string algorithms = parser.getOption("--algorithm", "Reduction algorithm (serial, ring, tree or collective), or all", "all");
+	const std::ptrdiff_t chunk_size = textToFloat(parser.getOption("--chunk", "Size (in MB) of the messages for ring and tree reductions", "4")) * 1024 * 1024 / sizeof(RFLOAT);
+	const int nr_repeats = textToInteger(parser.getOption("--repeat", "Number of times to repeat each reduction", "3"));
+	const bool do_split = !parser.checkOption("--no_split", "Sum over all followers, instead of within two random halves");
+	const bool do_float = parser.checkOption("--float", "Send ring and tree reductions in single precision (as --mpi_pack float)");
+	if (parser.checkForErrors())
+		REPORT_ERROR("Errors encountered on the command line, exiting...");
+
+	const int nr_halfsets = (do_split) ? 2 : 1;
+	if ((node.size - 1) / nr_halfsets < 2)
+		REPORT_ERROR("The reduction benchmark needs at least two followers per half set");
+
+	std::vector<std::string> names;
+	if (algorithms == "all")
+	{
+		names = {"serial", "ring", "tree"};
+#ifdef USE_MPI_COLLECTIVE
+		names.push_back("collective");
+#endif
+	}
+	else
+		names.push_back(algorithms);
+
+	std::vector<int> ranks;
+	for (int follower = 1; follower < node.size; follower++)
+		if (!do_split || follower % 2 == node.rank % 2)
+			ranks.push_back(follower);
+
+	// Values of both signs and different sizes, which every rank can also work out for the others
+	auto value = [](int rank, std::ptrdiff_t i) { return (RFLOAT)(((i * 2654435761LL + rank * 40503LL) % 100003) - 50001) / (1. + i % 7); };
+
+	MultidimArray<RFLOAT> data(count), sum;
+	for (std::ptrdiff_t i = 0; i < count; i++)
+		DIRECT_MULTIDIM_ELEM(data, i) = value(node.rank, i);
+
+	// What the sum should be, for checking, and the sum of the absolute values, to which the rounding errors are proportional
+	MultidimArray<double> reference(count), magnitude(count);
+	if (!node.isLeader())
+	{
+		for (std::ptrdiff_t i = 0; i < count; i++)
+		{
+			long double total = 0., total_abs = 0.;
+			for (int j = 0; j < ranks.size(); j++)
+			{
+				total += value(ranks[j], i);
+				total_abs += fabsl(value(ranks[j], i));
+			}
+			DIRECT_MULTIDIM_ELEM(reference, i) = total;
+			DIRECT_MULTIDIM_ELEM(magnitude, i) = total_abs;
+		}
+	}
+
+	if (node.isLeader())
+		std::cout << " Summing " << count << " elements over " << (node.size - 1) / nr_halfsets << " followers" << ((do_split) ? " per half set" : "") << std::endl;
+
+	for (int iname = 0; iname < names.size(); iname++)
+	{
+		const ReduceAlgorithm algorithm = textToReduceAlgorithm(names[iname]);
+
+		for (int irepeat = 0; irepeat < nr_repeats; irepeat++)
+		{
+			if (!node.isLeader())
+				sum = data;
+
+			MPI_Barrier(MPI_COMM_WORLD);
+			const double start = MPI_Wtime();
+
+			if (node.isLeader())
+				;
+			else if (algorithm == REDUCE_RING || algorithm == REDUCE_TREE)
+				node.sumOverRanks(MULTIDIM_ARRAY(sum), count, ranks, algorithm, chunk_size, do_float);
+#ifdef USE_MPI_COLLECTIVE
+			else if (algorithm == REDUCE_COLLECTIVE)
+			{
+				MultidimArray<RFLOAT> total(count);
+				node.relion_MPI_Allreduce(MULTIDIM_ARRAY(sum), MULTIDIM_ARRAY(total), count, MY_MPI_DOUBLE, MPI_SUM, (do_split) ? node.splitC : node.followerC);
+				sum = total;
+			}
+#endif
+			else
+			{
+				// Pass the sum along the followers of each half set and back, as combineAllWeightedSums does
+				MPI_Status status;
+				MultidimArray<RFLOAT> received(count);
+				const int me = std::find(ranks.begin(), ranks.end(), node.rank) - ranks.begin();
+				if (me > 0)
+				{
+					node.relion_MPI_Recv(MULTIDIM_ARRAY(received), count, MY_MPI_DOUBLE, ranks[me - 1], MPITAG_PACK, MPI_COMM_WORLD, status);
+					sum += received;
+				}
+				if (me + 1 < ranks.size())
+				{
+					node.relion_MPI_Send(MULTIDIM_ARRAY(sum), count, MY_MPI_DOUBLE, ranks[me + 1], MPITAG_PACK, MPI_COMM_WORLD);
+					node.relion_MPI_Recv(MULTIDIM_ARRAY(sum), count, MY_MPI_DOUBLE, ranks[me + 1], MPITAG_PACK, MPI_COMM_WORLD, status);
+				}
+				if (me > 0)
+					node.relion_MPI_Send(MULTIDIM_ARRAY(sum), count, MY_MPI_DOUBLE, ranks[me - 1], MPITAG_PACK, MPI_COMM_WORLD);
+			}
+
+			MPI_Barrier(MPI_COMM_WORLD);
+			const double elapsed = MPI_Wtime() - start;
+
+			// Every partial sum that goes over the wire is rounded once, and so is the final sum.
+			// Along any path through the ring or the tree there are at most as many roundings as ranks,
+			// so the error is at most nr_ranks + 1 units of rounding of the sum of the absolute values.
+			const bool is_float = do_float && (algorithm == REDUCE_RING || algorithm == REDUCE_TREE);
+			const double unit_roundoff = (is_float) ? std::numeric_limits<float>::epsilon() / 2. : std::numeric_limits<RFLOAT>::epsilon() / 2.;
+			const double bound = (ranks.size() + 1) * unit_roundoff;
+			double my_error = 0., max_error = 0.;
+			if (!node.isLeader())
+				for (std::ptrdiff_t i = 0; i < count; i++)
+					if (DIRECT_MULTIDIM_ELEM(magnitude, i) > 0.)
+						my_error = XMIPP_MAX(my_error, fabs(DIRECT_MULTIDIM_ELEM(sum, i) - DIRECT_MULTIDIM_ELEM(reference, i)) / DIRECT_MULTIDIM_ELEM(magnitude, i));
+			MPI_Reduce(&my_error, &max_error, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
+			if (node.isLeader())
+				std::cout << " " << names[iname] << ": " << elapsed << " s (" << count * sizeof(RFLOAT) / (1024. * 1024.) / elapsed << " MB/s)"
+				          << ", relative error " << max_error / unit_roundoff << " units of rounding"
+				          << ((max_error > bound) ? "  ERROR ABOVE BOUND!" : "") << std::endl;
+		}
+	}
+}
 
 int main(int argc, char *argv[])
 {
 	MpiNode node(argc, argv);
 
+	if (checkParameter(argc, argv, "--reduce"))
+	{
+		try
+		{
+			benchmarkReduction(node, argc, argv);
+		}
+		catch (RelionError XE)
+		{
+			std::cerr << XE;
+			MPI_Abort(MPI_COMM_WORLD, RELION_EXIT_FAILURE);
+		}
+		return 0;
+	}
+
 	const int max_mb = 600;
 
 	MultidimArray<RFLOAT> buf(max_mb * 1024 * 1024);
@@ -25,6 +25,7 @@
  */
 
 #include "src/backprojector.h"
+#include <omp.h>
 
 #ifdef TIMING
 	#define RCTIC(timer,label) (timer.tic(label))
@@ -1384,7 +1385,9 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
                                 RFLOAT normalise,
                                 int minres_map,
                                 bool printTimes,
-                                Image<RFLOAT>* weight_out)
+                                Image<RFLOAT>* weight_out,
+                                int threads,
+                                bool float_gridding_weights)
 {
 #ifdef TIMING
 	Timer ReconTimer;
@@ -1393,9 +1396,7 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 	int ReconS_2_5 = ReconTimer.setNew(" RcS2.5_Regularize ");
 	int ReconS_3 = ReconTimer.setNew(" RcS3_skipGridding ");
 	int ReconS_4 = ReconTimer.setNew(" RcS4_doGridding_norm ");
-	int ReconS_5 = ReconTimer.setNew(" RcS5_doGridding_init ");
-	int ReconS_6 = ReconTimer.setNew(" RcS6_doGridding_iter ");
-	int ReconS_7 = ReconTimer.setNew(" RcS7_doGridding_apply ");
+	int ReconS_6 = ReconTimer.setNew(" RcS6_doGridding ");
 	int ReconS_8 = ReconTimer.setNew(" RcS8_blobConvolute ");
 	int ReconS_9 = ReconTimer.setNew(" RcS9_blobResize ");
 	int ReconS_10 = ReconTimer.setNew(" RcS10_blobSetReal ");
@@ -1456,7 +1457,7 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 	// Go from projector-centered to FFTW-uncentered
 	MultidimArray<RFLOAT> Fweight;
 	Fweight.reshape(Fconv);
-	Projector::decenter(weight, Fweight, max_r2);
+	decenter(weight, Fweight, max_r2, threads);
 
 	RCTOC(ReconTimer,ReconS_2);
 	RCTIC(ReconTimer,ReconS_2_5);
@@ -1464,40 +1465,52 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 	// This will regularise the actual reconstruction
 	if (do_map)
 	{
-		// Then, add the inverse of tau2-spectrum values to the weight
-		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Fconv)
- 		{
-			int r2 = kp * kp + ip * ip + jp * jp;
-			if (r2 < max_r2)
+		// Check the tau2-spectrum for the shells inside max_r2 first, as errors cannot leave the parallel loop below
+		const int max_ires = (max_r2 > 0) ? ROUND(sqrt((RFLOAT)(max_r2 - 1)) / padding_factor) : -1;
+		for (int ires = 0; ires <= max_ires; ires++)
+		{
+			if (!(DIRECT_A1D_ELEM(tau2, ires) > 0.) && !(DIRECT_A1D_ELEM(tau2, ires) < 1e-20))
 			{
-				int ires = ROUND(sqrt((RFLOAT)r2) / padding_factor);
-				RFLOAT invw = DIRECT_A3D_ELEM(Fweight, k, i, j);
+				std::cerr << " tau2= " << tau2 << std::endl;
+				REPORT_ERROR("ERROR BackProjector::reconstruct: Negative or zero values encountered for tau2 spectrum!");
+			}
+		}
 
-				RFLOAT invtau2;
-				if (DIRECT_A1D_ELEM(tau2, ires) > 0.)
-				{
-					// Calculate inverse of tau2
-					invtau2 = 1. / (oversampling_correction * tau2_fudge * DIRECT_A1D_ELEM(tau2, ires));
-				}
-				else if (DIRECT_A1D_ELEM(tau2, ires) < 1e-20)
-				{
-					// If tau2 is zero, use small value instead
-					if (invw > 1e-20) invtau2 = 1./ ( 0.001 * invw);
-					else invtau2 = 0.;
-				}
-				else
+		// Then, add the inverse of tau2-spectrum values to the weight
+		#pragma omp parallel for num_threads(threads)
+		for (long int k = 0; k < ZSIZE(Fconv); k++)
+		{
+			const long int kp = (k < XSIZE(Fconv)) ? k : k - ZSIZE(Fconv);
+			for (long int i = 0, ip = 0; i < YSIZE(Fconv); i++, ip = (i < XSIZE(Fconv)) ? i : i - YSIZE(Fconv))
+			for (long int j = 0, jp = 0; j < XSIZE(Fconv); j++, jp = j)
+			{
+				int r2 = kp * kp + ip * ip + jp * jp;
+				if (r2 < max_r2)
 				{
-					std::cerr << " tau2= " << tau2 << std::endl;
-					REPORT_ERROR("ERROR BackProjector::reconstruct: Negative or zero values encountered for tau2 spectrum!");
-				}
+					int ires = ROUND(sqrt((RFLOAT)r2) / padding_factor);
+					RFLOAT invw = DIRECT_A3D_ELEM(Fweight, k, i, j);
 
-				// Only for (ires >= minres_map) add Wiener-filter like term
-				if (ires >= minres_map)
-				{
-					// Now add the inverse-of-tau2_class term
-					invw += invtau2;
-					// Store the new weight again in Fweight
-					DIRECT_A3D_ELEM(Fweight, k, i, j) = invw;
+					RFLOAT invtau2;
+					if (DIRECT_A1D_ELEM(tau2, ires) > 0.)
+					{
+						// Calculate inverse of tau2
+						invtau2 = 1. / (oversampling_correction * tau2_fudge * DIRECT_A1D_ELEM(tau2, ires));
+					}
+					else
+					{
+						// If tau2 is zero, use small value instead
+						if (invw > 1e-20) invtau2 = 1./ ( 0.001 * invw);
+						else invtau2 = 0.;
+					}
+
+					// Only for (ires >= minres_map) add Wiener-filter like term
+					if (ires >= minres_map)
+					{
+						// Now add the inverse-of-tau2_class term
+						invw += invtau2;
+						// Store the new weight again in Fweight
+						DIRECT_A3D_ELEM(Fweight, k, i, j) = invw;
+					}
 				}
 			}
 		}
@@ -1508,31 +1521,52 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 	{
 		RCTIC(ReconTimer,ReconS_3);
 		Fconv.initZeros(); // to remove any stuff from the input volume
-		Projector::decenter(data, Fconv, max_r2);
+		decenter(data, Fconv, max_r2, threads);
 
 		// Prevent divisions by zero: set Fweight to at least 1/1000th of the radially averaged weight at that resolution
 		// beyond r_max, set Fweight to at least 1/1000th of the radially averaged weight at r_max;
 		MultidimArray<RFLOAT> radavg_weight(r_max), counter(r_max);
 		const int round_max_r2 = ROUND(r_max * padding_factor * r_max * padding_factor);
-		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Fweight)
+		// Each thread sums its sections in its own arrays, which are added up afterwards
+		std::vector<MultidimArray<RFLOAT> > thread_radavg_weight(threads, radavg_weight), thread_counter(threads, counter);
+		bool is_out_of_range = false;
+		#pragma omp parallel for num_threads(threads)
+		for (long int k = 0; k < ZSIZE(Fweight); k++)
 		{
-			const int r2 = kp * kp + ip * ip + jp * jp;
-			// Note that (r < ires) != (r2 < max_r2), because max_r2 = ROUND(r_max * padding_factor)^2.
-			// We have to use round_max_r2 = ROUND((r_max * padding_factor)^2).
-			// e.g. k = 0, i = 7, j = 28, max_r2 = 841, r_max = 16, padding_factor = 18.
-			if (r2 < round_max_r2)
+			const int thread_id = omp_get_thread_num();
+			const long int kp = (k < XSIZE(Fweight)) ? k : k - ZSIZE(Fweight);
+			for (long int i = 0, ip = 0; i < YSIZE(Fweight); i++, ip = (i < XSIZE(Fweight)) ? i : i - YSIZE(Fweight))
+			for (long int j = 0, jp = 0; j < XSIZE(Fweight); j++, jp = j)
 			{
-				const int ires = FLOOR(sqrt((RFLOAT)r2) / padding_factor);
-				if (ires >= XSIZE(radavg_weight))
+				const int r2 = kp * kp + ip * ip + jp * jp;
+				// Note that (r < ires) != (r2 < max_r2), because max_r2 = ROUND(r_max * padding_factor)^2.
+				// We have to use round_max_r2 = ROUND((r_max * padding_factor)^2).
+				// e.g. k = 0, i = 7, j = 28, max_r2 = 841, r_max = 16, padding_factor = 18.
+				if (r2 < round_max_r2)
 				{
-					std::cerr << " k= " << k << " i= " << i << " j= " << j << std::endl;
-					std::cerr << " ires= " << ires << " XSIZE(radavg_weight)= " << XSIZE(radavg_weight) << std::endl;
-					REPORT_ERROR("BUG: ires >=XSIZE(radavg_weight) ");
+					const int ires = FLOOR(sqrt((RFLOAT)r2) / padding_factor);
+					if (ires >= XSIZE(radavg_weight))
+					{
+						#pragma omp critical(BackProjector_reconstruct_report)
+						{
+							std::cerr << " k= " << k << " i= " << i << " j= " << j << std::endl;
+							std::cerr << " ires= " << ires << " XSIZE(radavg_weight)= " << XSIZE(radavg_weight) << std::endl;
+							is_out_of_range = true;
+						}
+						continue;
+					}
+					DIRECT_A1D_ELEM(thread_radavg_weight[thread_id], ires) += DIRECT_A3D_ELEM(Fweight, k, i, j);
+					DIRECT_A1D_ELEM(thread_counter[thread_id], ires) += 1.;
 				}
-				DIRECT_A1D_ELEM(radavg_weight, ires) += DIRECT_A3D_ELEM(Fweight, k, i, j);
-				DIRECT_A1D_ELEM(counter, ires) += 1.;
 			}
 		}
+		if (is_out_of_range)
+			REPORT_ERROR("BUG: ires >=XSIZE(radavg_weight) ");
+		for (int ithread = 0; ithread < threads; ithread++)
+		{
+			radavg_weight += thread_radavg_weight[ithread];
+			counter += thread_counter[ithread];
+		}
 
 		// Calculate 1/1000th of radial averaged weight
 		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(radavg_weight)
@@ -1551,25 +1585,35 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 
 		bool have_warned = false;
 		// perform XMIPP_MAX on all weight elements, and do division of data/weight
-		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Fweight)
+		#pragma omp parallel for num_threads(threads)
+		for (long int k = 0; k < ZSIZE(Fweight); k++)
 		{
-			const int r2 = kp * kp + ip * ip + jp * jp;
-			const int ires = FLOOR(sqrt((RFLOAT)r2) / padding_factor);
-			const RFLOAT weight =  XMIPP_MAX(DIRECT_A3D_ELEM(Fweight, k, i, j), DIRECT_A1D_ELEM(radavg_weight, (ires < r_max) ? ires : (r_max - 1)));
-			if (weight == 0.)
+			const long int kp = (k < XSIZE(Fweight)) ? k : k - ZSIZE(Fweight);
+			for (long int i = 0, ip = 0; i < YSIZE(Fweight); i++, ip = (i < XSIZE(Fweight)) ? i : i - YSIZE(Fweight))
+			for (long int j = 0, jp = 0; j < XSIZE(Fweight); j++, jp = j)
 			{
-				if (!have_warned && abs(DIRECT_A3D_ELEM(Fconv, k, i, j)) > 0.)
+				const int r2 = kp * kp + ip * ip + jp * jp;
+				const int ires = FLOOR(sqrt((RFLOAT)r2) / padding_factor);
+				const RFLOAT weight =  XMIPP_MAX(DIRECT_A3D_ELEM(Fweight, k, i, j), DIRECT_A1D_ELEM(radavg_weight, (ires < r_max) ? ires : (r_max - 1)));
+				if (weight == 0.)
 				{
-					std::cerr << " WARNING: ignoring divide by zero in skip_gridding: ires = " << ires << " kp = " << kp << " ip = " << ip << " jp = " << jp << std::endl;
-                    std::cerr << " Fconv= " << DIRECT_A3D_ELEM(Fconv, k, i, j) << " Fweight= " << DIRECT_A3D_ELEM(Fweight, k, i, j) << " radavg_weight=" <<DIRECT_A1D_ELEM(radavg_weight, (ires < r_max) ? ires : (r_max - 1)) << std::endl;
-					std::cerr << " max_r2 = " << max_r2 << " r_max = " << r_max << " padding_factor = " << padding_factor
-					           << " ROUND(sqrt(max_r2)) = " << ROUND(sqrt(max_r2)) << " ROUND(r_max * padding_factor) = " << ROUND(r_max * padding_factor) << std::endl;
-					have_warned = true;
+					if (abs(DIRECT_A3D_ELEM(Fconv, k, i, j)) > 0.)
+					{
+						#pragma omp critical(BackProjector_reconstruct_report)
+						if (!have_warned)
+						{
+							std::cerr << " WARNING: ignoring divide by zero in skip_gridding: ires = " << ires << " kp = " << kp << " ip = " << ip << " jp = " << jp << std::endl;
+							std::cerr << " Fconv= " << DIRECT_A3D_ELEM(Fconv, k, i, j) << " Fweight= " << DIRECT_A3D_ELEM(Fweight, k, i, j) << " radavg_weight=" <<DIRECT_A1D_ELEM(radavg_weight, (ires < r_max) ? ires : (r_max - 1)) << std::endl;
+							std::cerr << " max_r2 = " << max_r2 << " r_max = " << r_max << " padding_factor = " << padding_factor
+							           << " ROUND(sqrt(max_r2)) = " << ROUND(sqrt(max_r2)) << " ROUND(r_max * padding_factor) = " << ROUND(r_max * padding_factor) << std::endl;
+							have_warned = true;
+						}
+					}
+				}
+				else
+				{
+					DIRECT_A3D_ELEM(Fconv, k, i, j) /= weight;
 				}
-			}
-			else
-			{
-				DIRECT_A3D_ELEM(Fconv, k, i, j) /= weight;
 			}
 		}
 	}
@@ -1581,121 +1625,27 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 #ifdef DEBUG_RECONSTRUCT
 		std::cerr << " normalise= " << normalise << std::endl;
 #endif
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fweight)
+		#pragma omp parallel for num_threads(threads)
+		for (long int n = 0; n < NZYXSIZE(Fweight); n++)
 		{
 			DIRECT_MULTIDIM_ELEM(Fweight, n) /= normalise;
 		}
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(data)
+		#pragma omp parallel for num_threads(threads)
+		for (long int n = 0; n < NZYXSIZE(data); n++)
 		{
 			DIRECT_MULTIDIM_ELEM(data, n) /= normalise;
 		}
 
 		RCTOC(ReconTimer,ReconS_4);
-		RCTIC(ReconTimer,ReconS_5);
-
-		// Initialise Fnewweight with 1's and 0's. (also see comments below)
-		FOR_ALL_ELEMENTS_IN_ARRAY3D(weight)
-		{
-			if (k * k + i * i + j * j < max_r2)
-				A3D_ELEM(weight, k, i, j) = 1.;
-			else
-				A3D_ELEM(weight, k, i, j) = 0.;
-		}
-		// Fnewweight can become too large for a float: always keep this one in double-precision
-		MultidimArray<double> Fnewweight;
-		Fnewweight.reshape(Fconv);
-		decenter(weight, Fnewweight, max_r2);
-
-		RCTOC(ReconTimer,ReconS_5);
-		// Iterative algorithm as in  Eq. [14] in Pipe & Menon (1999)
-		// or Eq. (4) in Matej (2001)
-		for (int iter = 0; iter < max_iter_preweight; iter++)
-		{
-			//std::cout << "    iteration " << (iter+1) << "/" << max_iter_preweight << "\n";
-			RCTIC(ReconTimer,ReconS_6);
-			// Set Fnewweight * Fweight in the transformer
-			// In Matej et al (2001), weights w_P^i are convoluted with the kernel,
-			// and the initial w_P^0 are 1 at each sampling point
-			// Here the initial weights are also 1 (see initialisation Fnewweight above),
-			// but each "sampling point" counts "Fweight" times!
-			// That is why Fnewweight is multiplied by Fweight prior to the convolution
-
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fconv)
-			{
-				DIRECT_MULTIDIM_ELEM(Fconv, n) = DIRECT_MULTIDIM_ELEM(Fnewweight, n) * DIRECT_MULTIDIM_ELEM(Fweight, n);
-			}
-
-			// convolute through Fourier-transform (as both grids are rectangular)
-			// Note that convoluteRealSpace acts on the complex array inside the transformer
-			convoluteBlobRealSpace(transformer, false);
-
-			RFLOAT w, corr_min = LARGE_NUMBER, corr_max = -LARGE_NUMBER, corr_avg=0., corr_nn=0.;
-
-			FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Fconv)
-			{
-				if (kp * kp + ip * ip + jp * jp < max_r2)
-				{
-
-					// Make sure no division by zero can occur....
-					w = XMIPP_MAX(1e-6, abs(DIRECT_A3D_ELEM(Fconv, k, i, j)));
-					// Monitor min, max and avg conv_weight
-					corr_min = XMIPP_MIN(corr_min, w);
-					corr_max = XMIPP_MAX(corr_max, w);
-					corr_avg += w;
-					corr_nn += 1.;
-					// Apply division of Eq. [14] in Pipe & Menon (1999)
-					DIRECT_A3D_ELEM(Fnewweight, k, i, j) /= w;
-				}
-			}
-
-            RCTOC(ReconTimer,ReconS_6);
+		RCTIC(ReconTimer,ReconS_6);
 
-#ifdef DEBUG_RECONSTRUCT
-			std::cerr << " PREWEIGHTING ITERATION: "<< iter + 1 << " OF " << max_iter_preweight << std::endl;
-			// report of maximum and minimum values of current conv_weight
-			std::cerr << " corr_avg= " << corr_avg / corr_nn << std::endl;
-			std::cerr << " corr_min= " << corr_min << std::endl;
-			std::cerr << " corr_max= " << corr_max << std::endl;
-#endif
-		}
-
-		RCTIC(ReconTimer,ReconS_7);
-
-#ifdef DEBUG_RECONSTRUCT
-		Image<double> tttt;
-		tttt()=Fnewweight;
-		tttt.write("reconstruct_gridding_weight.spi");
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fconv)
-		{
-			DIRECT_MULTIDIM_ELEM(ttt(), n) = abs(DIRECT_MULTIDIM_ELEM(Fconv, n));
-		}
-		ttt.write("reconstruct_gridding_correction_term.spi");
-#endif
-
-
-		// Clear memory
-		Fweight.clear();
-
-		// Note that Fnewweight now holds the approximation of the inverse of the weights on a regular grid
-
-		// Now do the actual reconstruction with the data array
-		// Apply the iteratively determined weight
-		Fconv.initZeros(); // to remove any stuff from the input volume
-		Projector::decenter(data, Fconv, max_r2);
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fconv)
-		{
-#ifdef  RELION_SINGLE_PRECISION
-			// Prevent numerical instabilities in single-precision reconstruction with very unevenly sampled orientations
-			if (DIRECT_MULTIDIM_ELEM(Fnewweight, n) > 1e20)
-				DIRECT_MULTIDIM_ELEM(Fnewweight, n) = 1e20;
-#endif
-			DIRECT_MULTIDIM_ELEM(Fconv, n) *= DIRECT_MULTIDIM_ELEM(Fnewweight, n);
-		}
-
-		// Clear memory
-		Fnewweight.clear();
+		// Fnewweight can become too large for a float: keep it in double-precision, unless asked otherwise
+		if (float_gridding_weights)
+			applyGriddingCorrectionWeights<float>(transformer, Fweight, max_iter_preweight, max_r2, threads);
+		else
+			applyGriddingCorrectionWeights<double>(transformer, Fweight, max_iter_preweight, max_r2, threads);
 
-		RCTOC(ReconTimer,ReconS_7);
+		RCTOC(ReconTimer,ReconS_6);
 	} // end if !skip_gridding
 
 // Gridding theory says one now has to interpolate the fine grid onto the coarse one using a blob kernel
@@ -1783,7 +1733,7 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 	// Pass the transformer to prevent making and clearing a new one before clearing the one declared above....
 	// The latter may give memory problems as detected by electric fence....
 	RCTIC(ReconTimer,ReconS_17);
-	windowToOridimRealSpace(transformer, vol_out, printTimes);
+	windowToOridimRealSpace(transformer, vol_out, printTimes, threads);
 	RCTOC(ReconTimer,ReconS_17);
 
 #endif
@@ -1796,7 +1746,7 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 	// Correct for the linear/nearest-neighbour interpolation that led to the data array
 	RCTIC(ReconTimer,ReconS_18);
 
-	griddingCorrect(vol_out);
+	griddingCorrect(vol_out, threads);
 
 	RCTOC(ReconTimer,ReconS_18);
 	RCTIC(ReconTimer,ReconS_23);
@@ -1871,6 +1821,121 @@ void BackProjector::reconstruct(MultidimArray<RFLOAT> &vol_out,
 	}
 }
 
+template <typename T>
+void BackProjector::applyGriddingCorrectionWeights(FourierTransformer &transformer, MultidimArray<RFLOAT> &Fweight,
+                                                   int max_iter_preweight, int max_r2, int threads)
+{
+	MultidimArray<Complex>& Fconv = transformer.getFourierReference();
+
+	// With more than one thread, the FFTs of the convolutions are cut into slabs, with plans that are kept over the iterations
+	BatchFourierTransformer batch_transformer(threads);
+
+	// Initialise Fnewweight with 1's and 0's. (also see comments below)
+	#pragma omp parallel for num_threads(threads)
+	for (long int k = STARTINGZ(weight); k <= FINISHINGZ(weight); k++)
+		for (long int i = STARTINGY(weight); i <= FINISHINGY(weight); i++)
+			for (long int j = STARTINGX(weight); j <= FINISHINGX(weight); j++)
+			{
+				if (k * k + i * i + j * j < max_r2)
+					A3D_ELEM(weight, k, i, j) = 1.;
+				else
+					A3D_ELEM(weight, k, i, j) = 0.;
+			}
+	MultidimArray<T> Fnewweight;
+	Fnewweight.reshape(Fconv);
+	decenter(weight, Fnewweight, max_r2, threads);
+
+	// Single-precision weights are kept below this, so that they cannot overflow in the iterations below
+	const bool do_limit_weights = (sizeof(T) < sizeof(double));
+
+	// Iterative algorithm as in  Eq. [14] in Pipe & Menon (1999)
+	// or Eq. (4) in Matej (2001)
+	for (int iter = 0; iter < max_iter_preweight; iter++)
+	{
+		// Set Fnewweight * Fweight in the transformer
+		// In Matej et al (2001), weights w_P^i are convoluted with the kernel,
+		// and the initial w_P^0 are 1 at each sampling point
+		// Here the initial weights are also 1 (see initialisation Fnewweight above),
+		// but each "sampling point" counts "Fweight" times!
+		// That is why Fnewweight is multiplied by Fweight prior to the convolution
+		#pragma omp parallel for num_threads(threads)
+		for (long int n = 0; n < NZYXSIZE(Fconv); n++)
+		{
+			DIRECT_MULTIDIM_ELEM(Fconv, n) = DIRECT_MULTIDIM_ELEM(Fnewweight, n) * DIRECT_MULTIDIM_ELEM(Fweight, n);
+		}
+
+		// convolute through Fourier-transform (as both grids are rectangular)
+		// Note that convoluteRealSpace acts on the complex array inside the transformer
+		convoluteBlobRealSpace(transformer, false, threads, &batch_transformer);
+
+		RFLOAT corr_min = LARGE_NUMBER, corr_max = -LARGE_NUMBER, corr_avg=0., corr_nn=0.;
+
+		#pragma omp parallel for num_threads(threads) reduction(min:corr_min) reduction(max:corr_max) reduction(+:corr_avg,corr_nn)
+		for (long int k = 0; k < ZSIZE(Fconv); k++)
+		{
+			const long int kp = (k < XSIZE(Fconv)) ? k : k - ZSIZE(Fconv);
+			for (long int i = 0, ip = 0; i < YSIZE(Fconv); i++, ip = (i < XSIZE(Fconv)) ? i : i - YSIZE(Fconv))
+			for (long int j = 0, jp = 0; j < XSIZE(Fconv); j++, jp = j)
+			{
+				if (kp * kp + ip * ip + jp * jp < max_r2)
+				{
+					// Make sure no division by zero can occur....
+					RFLOAT w = XMIPP_MAX(1e-6, abs(DIRECT_A3D_ELEM(Fconv, k, i, j)));
+					// Monitor min, max and avg conv_weight
+					corr_min = XMIPP_MIN(corr_min, w);
+					corr_max = XMIPP_MAX(corr_max, w);
+					corr_avg += w;
+					corr_nn += 1.;
+					// Apply division of Eq. [14] in Pipe & Menon (1999)
+					DIRECT_A3D_ELEM(Fnewweight, k, i, j) /= w;
+					if (do_limit_weights && DIRECT_A3D_ELEM(Fnewweight, k, i, j) > 1e20)
+						DIRECT_A3D_ELEM(Fnewweight, k, i, j) = 1e20;
+				}
+			}
+		}
+
+#ifdef DEBUG_RECONSTRUCT
+		std::cerr << " PREWEIGHTING ITERATION: "<< iter + 1 << " OF " << max_iter_preweight << std::endl;
+		// report of maximum and minimum values of current conv_weight
+		std::cerr << " corr_avg= " << corr_avg / corr_nn << std::endl;
+		std::cerr << " corr_min= " << corr_min << std::endl;
+		std::cerr << " corr_max= " << corr_max << std::endl;
+#endif
+	}
+
+#ifdef DEBUG_RECONSTRUCT
+	Image<double> tttt(XSIZE(Fnewweight), YSIZE(Fnewweight), ZSIZE(Fnewweight));
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fnewweight)
+	{
+		DIRECT_MULTIDIM_ELEM(tttt(), n) = DIRECT_MULTIDIM_ELEM(Fnewweight, n);
+	}
+	tttt.write("reconstruct_gridding_weight.spi");
+#endif
+
+	// Clear memory
+	Fweight.clear();
+
+	// Note that Fnewweight now holds the approximation of the inverse of the weights on a regular grid
+
+	// Now do the actual reconstruction with the data array
+	// Apply the iteratively determined weight
+	Fconv.initZeros(); // to remove any stuff from the input volume
+	decenter(data, Fconv, max_r2, threads);
+	#pragma omp parallel for num_threads(threads)
+	for (long int n = 0; n < NZYXSIZE(Fconv); n++)
+	{
+#ifdef  RELION_SINGLE_PRECISION
+		// Prevent numerical instabilities in single-precision reconstruction with very unevenly sampled orientations
+		if (DIRECT_MULTIDIM_ELEM(Fnewweight, n) > 1e20)
+			DIRECT_MULTIDIM_ELEM(Fnewweight, n) = 1e20;
+#endif
+		DIRECT_MULTIDIM_ELEM(Fconv, n) *= DIRECT_MULTIDIM_ELEM(Fnewweight, n);
+	}
+
+	// Clear memory
+	Fnewweight.clear();
+}
+
 void BackProjector::reweightGrad() {
 
 	const int max_r2 = ROUND(r_max * padding_factor) * ROUND(r_max * padding_factor);
@@ -2480,7 +2545,8 @@ void BackProjector::applyPointGroupSymmetry(int threads)
 
 }
 
-void BackProjector::convoluteBlobRealSpace(FourierTransformer &transformer, bool do_mask)
+void BackProjector::convoluteBlobRealSpace(FourierTransformer &transformer, bool do_mask,
+                                           int threads, BatchFourierTransformer *batch_transformer)
 {
 
 	MultidimArray<RFLOAT> Mconv;
@@ -2494,8 +2560,18 @@ void BackProjector::convoluteBlobRealSpace(FourierTransformer &transformer, bool
 		Mconv.reshape(pad_size, pad_size, pad_size);
 
 	// inverse FFT
-	transformer.setReal(Mconv);
-	transformer.inverseFourierTransform();
+	MultidimArray<Complex>& Fconv = transformer.getFourierReference();
+	BatchFourierTransformer local_batch_transformer(threads);
+	if (batch_transformer == NULL)
+		batch_transformer = &local_batch_transformer;
+	const bool do_batch = (threads > 1 && ref_dim == 3);
+	if (do_batch)
+		batch_transformer->inverseFourierTransform(Fconv, Mconv);
+	else
+	{
+		transformer.setReal(Mconv);
+		transformer.inverseFourierTransform();
+	}
 
 	// Blob normalisation in Fourier space
 	RFLOAT normftblob = tab_ftblob(0.);
@@ -2507,7 +2583,10 @@ void BackProjector::convoluteBlobRealSpace(FourierTransformer &transformer, bool
 	//blob.alpha = 15;
 
     // Multiply with FT of the blob kernel
-	FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY3D(Mconv)
+	#pragma omp parallel for num_threads(threads)
+	for (long int k = 0; k < ZSIZE(Mconv); k++)
+	for (long int i = 0; i < YSIZE(Mconv); i++)
+	for (long int j = 0; j < XSIZE(Mconv); j++)
     {
 		int kp = (k < padhdim) ? k : k - pad_size;
 		int ip = (i < padhdim) ? i : i - pad_size;
@@ -2524,10 +2603,13 @@ void BackProjector::convoluteBlobRealSpace(FourierTransformer &transformer, bool
     }
 
     // forward FFT to go back to Fourier-space
-    transformer.FourierTransform();
+	if (do_batch)
+		batch_transformer->FourierTransform(Mconv, Fconv);
+	else
+		transformer.FourierTransform();
 }
 
-void BackProjector::windowToOridimRealSpace(FourierTransformer &transformer, MultidimArray<RFLOAT> &Mout, bool printTimes)
+void BackProjector::windowToOridimRealSpace(FourierTransformer &transformer, MultidimArray<RFLOAT> &Mout, bool printTimes, int threads)
 {
 
 #ifdef TIMING
@@ -2603,16 +2685,27 @@ void BackProjector::windowToOridimRealSpace(FourierTransformer &transformer, Mul
 	RCTOC(OriDimTimer,OriDim6);
 
 	// Do the inverse FFT
-	RCTIC(OriDimTimer,OriDim4);
-	transformer.setReal(Mout);
-	RCTOC(OriDimTimer,OriDim4);
-	RCTIC(OriDimTimer,OriDim5);
+	if (threads > 1 && ref_dim == 3)
+	{
+		// Cut into slabs, to be transformed by all threads
+		RCTIC(OriDimTimer,OriDim5);
+		BatchFourierTransformer batch_transformer(threads);
+		batch_transformer.inverseFourierTransform(Fin, Mout);
+		RCTOC(OriDimTimer,OriDim5);
+	}
+	else
+	{
+		RCTIC(OriDimTimer,OriDim4);
+		transformer.setReal(Mout);
+		RCTOC(OriDimTimer,OriDim4);
+		RCTIC(OriDimTimer,OriDim5);
 #ifdef TIMING
-	if(printTimes)
-		std::cout << std::endl << "FFTrealDims = (" << transformer.fReal->xdim << " , " << transformer.fReal->ydim << " , " << transformer.fReal->zdim << " ) " << std::endl;
+		if(printTimes)
+			std::cout << std::endl << "FFTrealDims = (" << transformer.fReal->xdim << " , " << transformer.fReal->ydim << " , " << transformer.fReal->zdim << " ) " << std::endl;
 #endif
-	transformer.inverseFourierTransform();
-	RCTOC(OriDimTimer,OriDim5);
+		transformer.inverseFourierTransform();
+		RCTOC(OriDimTimer,OriDim5);
+	}
 	//transformer.inverseFourierTransform(Fin, Mout);
 	Fin.clear();
 	transformer.fReal = NULL; // Make sure to re-calculate fftw plan
@@ -311,6 +311,9 @@ public:
 	/* Get the 3D reconstruction
 		 * If do_map is true, 1 will be added to all weights
 		 * alpha will contain the noise-reduction spectrum
+		 * The loops over the padded grid and the FFTs of the padded volume are done with threads threads.
+		 * With float_gridding_weights, the iterative gridding correction keeps its weights in single precision,
+		 * which halves their memory in double-precision builds (at the cost of some precision for very unevenly sampled orientations)
 	*/
 	void reconstruct(MultidimArray<RFLOAT> &vol_out,
 	                 int max_iter_preweight,
@@ -320,7 +323,9 @@ public:
 	                 RFLOAT normalise = 1.,
 	                 int minres_map = -1,
 	                 bool printTimes= false,
-	                 Image<RFLOAT>* weight_out = 0);
+	                 Image<RFLOAT>* weight_out = 0,
+	                 int threads = 1,
+	                 bool float_gridding_weights = false);
 
 	void reweightGrad();
 
@@ -378,13 +383,15 @@ public:
 
 	/* Convolute in Fourier-space with the blob by multiplication in real-space
 	 * Note the convolution is done on the complex array inside the transformer object!!
+	 * With more than one thread, the FFTs are done by batch_transformer instead, on the same arrays
 	 */
-	void convoluteBlobRealSpace(FourierTransformer &transformer, bool do_mask = false);
+	void convoluteBlobRealSpace(FourierTransformer &transformer, bool do_mask = false,
+	                            int threads = 1, BatchFourierTransformer *batch_transformer = NULL);
 
 	/* Calculate the inverse FFT of Fin and windows the result to ori_size
 	 * Also pass the transformer, to prevent making and clearing a new one before clearing the one in reconstruct()
 	 */
-	void windowToOridimRealSpace(FourierTransformer &transformer, MultidimArray<RFLOAT> &Mout, bool printTimes = false);
+	void windowToOridimRealSpace(FourierTransformer &transformer, MultidimArray<RFLOAT> &Mout, bool printTimes = false, int threads = 1);
 
 	/*
 	 * The same, but without the spherical cropping and thus invertible
@@ -450,21 +457,33 @@ public:
 		}
 	}
 
-#ifdef RELION_SINGLE_PRECISION
-	// Fnewweight needs decentering, but has to be in double-precision for correct calculations!
-	template <typename T>
-	void decenter(MultidimArray<T> &Min, MultidimArray<double> &Mout, int my_rmax2)
+	// As Projector::decenter, but over threads threads, and also into arrays of another precision
+	// (Fnewweight needs decentering, but has to be in double-precision for correct calculations!)
+	template <typename T1, typename T2>
+	void decenter(MultidimArray<T1> &Min, MultidimArray<T2> &Mout, int my_rmax2, int threads = 1)
 	{
 		// Mout should already have the right size
 		// Initialize to zero
 		Mout.initZeros();
-		FOR_ALL_ELEMENTS_IN_FFTW_TRANSFORM(Mout)
+		#pragma omp parallel for num_threads(threads)
+		for (long int k = 0; k < ZSIZE(Mout); k++)
 		{
-			if (kp*kp + ip*ip + jp*jp <= my_rmax2)
-				DIRECT_A3D_ELEM(Mout, k, i, j) = (double)A3D_ELEM(Min, kp, ip, jp);
+			const long int kp = (k < XSIZE(Mout)) ? k : k - ZSIZE(Mout);
+			for (long int i = 0, ip = 0; i < YSIZE(Mout); i++, ip = (i < XSIZE(Mout)) ? i : i - YSIZE(Mout))
+				for (long int j = 0, jp = 0; j < XSIZE(Mout); j++, jp = j)
+				{
+					if (kp*kp + ip*ip + jp*jp <= my_rmax2)
+						DIRECT_A3D_ELEM(Mout, k, i, j) = (T2)A3D_ELEM(Min, kp, ip, jp);
+				}
 		}
 	}
-#endif
+
+private:
+
+	// The iterative gridding correction of reconstruct() in weights of precision T: Fconv ends up as data times the weights
+	template <typename T>
+	void applyGriddingCorrectionWeights(FourierTransformer &transformer, MultidimArray<RFLOAT> &Fweight,
+	                                    int max_iter_preweight, int max_r2, int threads);
 };
 
 #endif /* BACKPROJECTOR_H_ */
@@ -0,0 +1,816 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/compressed_movie.h"
+#include "src/error.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace
+{
+	bool endsWith(const std::string &text, const std::string &end)
+	{
+		return text.size() >= end.size() && text.compare(text.size() - end.size(), end.size(), end) == 0;
+	}
+
+	uint32_t readLittleEndian32(const unsigned char *p)
+	{
+		return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+
+	// A read-only map of the whole compressed file
+	class MappedFile
+	{
+	public:
+
+		const unsigned char *data;
+		size_t size;
+
+		MappedFile(const std::string &filename)
+		:	data(NULL),
+			size(0)
+		{
+			const int fd = open(filename.c_str(), O_RDONLY);
+			if (fd < 0)
+				REPORT_ERROR("CompressedMovieDecoder: cannot open " + filename);
+
+			struct stat info;
+			if (fstat(fd, &info) == 0 && info.st_size > 0)
+			{
+				size = info.st_size;
+				void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (map == MAP_FAILED)
+				{
+					close(fd);
+					REPORT_ERROR("CompressedMovieDecoder: cannot map " + filename);
+				}
+				data = (const unsigned char *)map;
+			}
+			close(fd);
+		}
+
+		~MappedFile()
+		{
+			if (data != NULL)
+				munmap((void *)data, size);
+		}
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+	};
+
+	/* Decoders that can only run through the file once, from the start.
+	 * Skipping ahead means decoding the data in between.
+	 */
+	class StreamDecoder : public CompressedMovieDecoder
+	{
+	public:
+
+		StreamDecoder(const std::string &_filename, std::shared_ptr<const MappedFile> _file)
+		:	filename(_filename),
+			file(_file),
+			position(0)
+		{
+		}
+
+		bool isSeekable() const
+		{
+			return false;
+		}
+
+		bool readAt(char *dest, size_t offset, size_t size)
+		{
+			if (offset < position)
+				REPORT_ERROR("CompressedMovieDecoder: cannot go back in " + filename +
+				             ", which does not consist of independently compressed blocks");
+
+			if (offset > position)
+			{
+				std::vector<char> skipped(std::min(offset - position, (size_t)10000000)); // 10 MB
+				while (position < offset)
+				{
+					const size_t n = std::min(offset - position, skipped.size());
+					const size_t got = decode(&skipped[0], n);
+					position += got;
+					if (got < n)
+						return false;
+				}
+			}
+
+			const size_t got = decode(dest, size);
+			position += got;
+			return got == size;
+		}
+
+	protected:
+
+		std::string filename;
+		std::shared_ptr<const MappedFile> file;
+		size_t position; // in the uncompressed data
+
+		// Decode the next size bytes into dest; returns how many there were
+		virtual size_t decode(char *dest, size_t size) = 0;
+	};
+
+	// One independently compressed block of a file
+	struct Block
+	{
+		size_t compressed_offset, compressed_size, offset, size;
+	};
+
+	/* Decoders for files with an index of independently compressed blocks.
+	 * Only the blocks that hold the requested bytes are decoded.
+	 */
+	class BlockDecoder : public CompressedMovieDecoder
+	{
+	public:
+
+		BlockDecoder(const std::string &_filename, std::shared_ptr<const MappedFile> _file, const std::vector<Block> &_blocks)
+		:	filename(_filename),
+			file(_file),
+			blocks(_blocks)
+		{
+		}
+
+		bool isSeekable() const
+		{
+			return true;
+		}
+
+		bool readAt(char *dest, size_t offset, size_t size)
+		{
+			// The first block that ends after offset
+			std::vector<Block>::const_iterator block = std::upper_bound(blocks.begin(), blocks.end(), offset,
+					[](size_t o, const Block &b) { return o < b.offset + b.size; });
+
+			std::vector<char> buffer;
+			for (; block != blocks.end() && size > 0; block++)
+			{
+				const size_t first = offset - block->offset;
+				const size_t n = std::min(size, block->size - first);
+
+				if (n == block->size)
+					decodeBlock(*block, dest);
+				else
+				{
+					buffer.resize(block->size);
+					decodeBlock(*block, &buffer[0]);
+					memcpy(dest, &buffer[first], n);
+				}
+
+				dest += n;
+				offset += n;
+				size -= n;
+			}
+
+			return size == 0;
+		}
+
+	protected:
+
+		std::string filename;
+		std::shared_ptr<const MappedFile> file;
+		std::vector<Block> blocks; // without gaps, in order of their uncompressed offset
+
+		// Decode the whole of block b into dest. This must be thread-safe.
+		virtual void decodeBlock(const Block &b, char *dest) const = 0;
+	};
+
+#ifdef HAVE_BZIP2
+	std::string bzip2Error(int code)
+	{
+		std::stringstream ss;
+		ss << "libbz2 error " << code;
+		return ss.str();
+	}
+
+	class Bzip2StreamDecoder : public StreamDecoder
+	{
+	public:
+
+		Bzip2StreamDecoder(const std::string &filename, std::shared_ptr<const MappedFile> file)
+		:	StreamDecoder(filename, file),
+			is_finished(false)
+		{
+			startStream(0);
+		}
+
+		~Bzip2StreamDecoder()
+		{
+			if (!is_finished)
+				BZ2_bzDecompressEnd(&strm);
+		}
+
+	protected:
+
+		bz_stream strm;
+		size_t fed; // bytes of the file given to strm so far
+		bool is_finished;
+
+		void startStream(size_t start)
+		{
+			memset(&strm, 0, sizeof(strm));
+			const int ret = BZ2_bzDecompressInit(&strm, 0, 0);
+			if (ret != BZ_OK)
+				REPORT_ERROR("CompressedMovieDecoder: cannot decode " + filename + " (" + bzip2Error(ret) + ")");
+			fed = start;
+		}
+
+		size_t decode(char *dest, size_t size)
+		{
+			// avail_in and avail_out are 32-bit
+			const size_t max_chunk = 1 << 30;
+			size_t done = 0;
+
+			while (done < size && !is_finished)
+			{
+				if (strm.avail_in == 0 && fed < file->size)
+				{
+					strm.next_in = (char *)file->data + fed;
+					strm.avail_in = std::min(file->size - fed, max_chunk);
+					fed += strm.avail_in;
+				}
+
+				const size_t n = std::min(size - done, max_chunk);
+				strm.next_out = dest + done;
+				strm.avail_out = n;
+				const int ret = BZ2_bzDecompress(&strm);
+				done += n - strm.avail_out;
+
+				if (ret == BZ_STREAM_END)
+				{
+					// pbzip2 writes one stream after another
+					const size_t next = fed - strm.avail_in;
+					BZ2_bzDecompressEnd(&strm);
+					if (next + 4 <= file->size && memcmp(file->data + next, "BZh", 3) == 0)
+						startStream(next);
+					else
+						is_finished = true;
+				}
+				else if (ret != BZ_OK)
+					REPORT_ERROR("CompressedMovieDecoder: failed to decode " + filename + " (" + bzip2Error(ret) + ")");
+				else if (strm.avail_in == 0 && fed == file->size && strm.avail_out == n)
+				{
+					// Truncated file
+					BZ2_bzDecompressEnd(&strm);
+					is_finished = true;
+				}
+			}
+
+			return done;
+		}
+	};
+
+	// Decode one whole bzip2 stream; false unless it ends exactly at the end of the input
+	bool decodeBzip2Stream(const unsigned char *in, size_t in_size, std::vector<char> &out)
+	{
+		bz_stream strm;
+		memset(&strm, 0, sizeof(strm));
+		if (BZ2_bzDecompressInit(&strm, 0, 0) != BZ_OK)
+			return false;
+
+		// One pbzip2 stream is at most a few MB, so the sizes fit in 32 bits
+		out.resize(std::max((size_t)1024 * 1024, 8 * in_size));
+		strm.next_in = (char *)in;
+		strm.avail_in = in_size;
+		size_t done = 0;
+		int ret = BZ_OK;
+		while (ret == BZ_OK)
+		{
+			if (done == out.size())
+				out.resize(2 * out.size());
+			strm.next_out = &out[done];
+			strm.avail_out = out.size() - done;
+			const size_t before = strm.avail_out;
+			ret = BZ2_bzDecompress(&strm);
+			done += before - strm.avail_out;
+			if (ret == BZ_OK && strm.avail_in == 0 && strm.avail_out == before)
+				break; // no progress: the stream was cut short
+		}
+		BZ2_bzDecompressEnd(&strm);
+
+		out.resize(done);
+		return ret == BZ_STREAM_END && strm.avail_in == 0;
+	}
+
+	// Where the bzip2 streams in a file start: "BZh", the block size, and the magic number of a first block
+	std::vector<size_t> findBzip2Streams(const MappedFile &file)
+	{
+		static const unsigned char block_magic[6] = {0x31, 0x41, 0x59, 0x26, 0x53, 0x59};
+		std::vector<size_t> starts;
+
+		const unsigned char *p = file.data;
+		const unsigned char *end = file.data + file.size;
+		while (end - p >= 10)
+		{
+			p = (const unsigned char *)memchr(p, 'B', end - p - 9);
+			if (p == NULL)
+				break;
+			if (p[1] == 'Z' && p[2] == 'h' && p[3] >= '1' && p[3] <= '9' && memcmp(p + 4, block_magic, 6) == 0)
+				starts.push_back(p - file.data);
+			p++;
+		}
+
+		return starts;
+	}
+
+	/* The many streams of a file written by pbzip2.
+	 * Their uncompressed sizes are only known after decoding them, so they are decoded in order,
+	 * n_threads at a time, as far as needed for a request. Only the sizes are kept for all of them;
+	 * the decoded data are kept for the 2 * n_threads streams used last, and decoded again when needed later.
+	 */
+	class Bzip2MultiStreamDecoder : public CompressedMovieDecoder
+	{
+	public:
+
+		Bzip2MultiStreamDecoder(const std::string &_filename, std::shared_ptr<const MappedFile> _file,
+		                        const std::vector<size_t> &_starts, int _n_threads)
+		:	filename(_filename),
+			file(_file),
+			starts(_starts),
+			n_threads(std::max(1, _n_threads)),
+			decoded(_starts.size()),
+			last_used(_starts.size(), 0),
+			offsets(_starts.size() + 1, 0),
+			nr_decoded(0),
+			nr_uses(0),
+			max_cached(2 * std::max(1, _n_threads))
+		{
+			starts.push_back(file->size);
+		}
+
+		bool isSeekable() const
+		{
+			return true;
+		}
+
+		bool readAt(char *dest, size_t offset, size_t size)
+		{
+			// The streams are copied from outside the lock, so they must stay alive even if they are dropped from the cache
+			std::vector<std::shared_ptr<const std::vector<char> > > parts;
+			size_t istream;
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				while (offsets[nr_decoded] < offset + size && nr_decoded < decoded.size())
+					decodeNextStreams();
+
+				// The first stream that ends after offset, and those after it that are needed
+				istream = std::upper_bound(offsets.begin() + 1, offsets.begin() + nr_decoded + 1, offset) - offsets.begin() - 1;
+				std::vector<size_t> dropped;
+				size_t iend = istream;
+				for (; iend < nr_decoded && offsets[iend] < offset + size; iend++)
+					if (!decoded[iend])
+						dropped.push_back(iend);
+				decodeStreams(dropped);
+
+				for (size_t i = istream; i < iend; i++)
+				{
+					parts.push_back(decoded[i]);
+					last_used[i] = ++nr_uses;
+				}
+				dropLeastRecentlyUsed();
+			}
+
+			for (size_t i = 0; i < parts.size() && size > 0; i++, istream++)
+			{
+				const size_t first = offset - offsets[istream];
+				const size_t n = std::min(size, parts[i]->size() - first);
+				memcpy(dest, &(*parts[i])[first], n);
+				dest += n;
+				offset += n;
+				size -= n;
+			}
+
+			return size == 0;
+		}
+
+	protected:
+
+		std::string filename;
+		std::shared_ptr<const MappedFile> file;
+		std::vector<size_t> starts; // of the streams, and the end of the file
+		int n_threads;
+		std::vector<std::shared_ptr<const std::vector<char> > > decoded; // NULL if not in the cache
+		std::vector<size_t> last_used; // value of nr_uses when each stream was last read
+		std::vector<size_t> offsets; // of the decoded streams in the uncompressed data
+		size_t nr_decoded, nr_uses, max_cached;
+		std::mutex mutex;
+
+		// Decode the given streams, n_threads at a time, into the cache
+		void decodeStreams(const std::vector<size_t> &streams)
+		{
+			for (size_t ifirst = 0; ifirst < streams.size(); ifirst += n_threads)
+			{
+				const size_t ilast = std::min(streams.size(), ifirst + n_threads);
+				std::vector<std::vector<char> > out(ilast - ifirst);
+				std::vector<char> is_ok(ilast - ifirst, 0);
+
+				std::vector<std::thread> threads;
+				for (size_t i = ifirst; i < ilast; i++)
+					threads.push_back(std::thread([&, i]() {
+						const size_t istream = streams[i];
+						is_ok[i - ifirst] = decodeBzip2Stream(file->data + starts[istream],
+						                                      starts[istream + 1] - starts[istream], out[i - ifirst]);
+					}));
+				for (size_t i = 0; i < threads.size(); i++)
+					threads[i].join();
+
+				for (size_t i = ifirst; i < ilast; i++)
+				{
+					const size_t istream = streams[i];
+					if (!is_ok[i - ifirst] || (istream < nr_decoded && out[i - ifirst].size() != offsets[istream + 1] - offsets[istream]))
+						REPORT_ERROR("CompressedMovieDecoder: failed to decode stream " + std::to_string(istream + 1) +
+						             " of " + filename + ". Is the movie intact?");
+					decoded[istream] = std::make_shared<const std::vector<char> >(std::move(out[i - ifirst]));
+					last_used[istream] = ++nr_uses;
+				}
+			}
+		}
+
+		// Decode the next n_threads streams, to find out where they are in the uncompressed data
+		void decodeNextStreams()
+		{
+			const size_t first = nr_decoded;
+			const size_t last = std::min(decoded.size(), first + n_threads);
+			std::vector<size_t> streams;
+			for (size_t istream = first; istream < last; istream++)
+				streams.push_back(istream);
+			decodeStreams(streams);
+
+			for (size_t istream = first; istream < last; istream++)
+				offsets[istream + 1] = offsets[istream] + decoded[istream]->size();
+			nr_decoded = last;
+			dropLeastRecentlyUsed();
+		}
+
+		void dropLeastRecentlyUsed()
+		{
+			size_t nr_cached = 0;
+			for (size_t istream = 0; istream < nr_decoded; istream++)
+				if (decoded[istream])
+					nr_cached++;
+
+			for (; nr_cached > max_cached; nr_cached--)
+			{
+				size_t oldest = nr_decoded;
+				for (size_t istream = 0; istream < nr_decoded; istream++)
+					if (decoded[istream] && (oldest == nr_decoded || last_used[istream] < last_used[oldest]))
+						oldest = istream;
+				decoded[oldest].reset();
+			}
+		}
+	};
+#endif // HAVE_BZIP2
+
+#ifdef HAVE_LZMA
+	std::string lzmaError(lzma_ret code)
+	{
+		std::stringstream ss;
+		ss << "liblzma error " << (int)code;
+		return ss.str();
+	}
+
+	class XzStreamDecoder : public StreamDecoder
+	{
+	public:
+
+		XzStreamDecoder(const std::string &filename, std::shared_ptr<const MappedFile> file)
+		:	StreamDecoder(filename, file),
+			is_finished(false)
+		{
+			const lzma_stream init = LZMA_STREAM_INIT;
+			strm = init;
+			const lzma_ret ret = lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED);
+			if (ret != LZMA_OK)
+				REPORT_ERROR("CompressedMovieDecoder: cannot decode " + filename + " (" + lzmaError(ret) + ")");
+			strm.next_in = file->data;
+			strm.avail_in = file->size;
+		}
+
+		~XzStreamDecoder()
+		{
+			lzma_end(&strm);
+		}
+
+	protected:
+
+		lzma_stream strm;
+		bool is_finished;
+
+		size_t decode(char *dest, size_t size)
+		{
+			strm.next_out = (uint8_t *)dest;
+			strm.avail_out = size;
+			while (strm.avail_out > 0 && !is_finished)
+			{
+				const lzma_ret ret = lzma_code(&strm, LZMA_FINISH);
+				if (ret == LZMA_STREAM_END)
+					is_finished = true;
+				else if (ret == LZMA_BUF_ERROR)
+					is_finished = true; // truncated file
+				else if (ret != LZMA_OK)
+					REPORT_ERROR("CompressedMovieDecoder: failed to decode " + filename + " (" + lzmaError(ret) + ")");
+			}
+
+			return size - strm.avail_out;
+		}
+	};
+
+	class XzBlockDecoder : public BlockDecoder
+	{
+	public:
+
+		XzBlockDecoder(const std::string &filename, std::shared_ptr<const MappedFile> file,
+		               const std::vector<Block> &blocks, lzma_check _check)
+		:	BlockDecoder(filename, file, blocks),
+			check(_check)
+		{
+		}
+
+	protected:
+
+		lzma_check check;
+
+		void decodeBlock(const Block &b, char *dest) const
+		{
+			const uint8_t *in = file->data + b.compressed_offset;
+
+			lzma_filter filters[LZMA_FILTERS_MAX + 1];
+			lzma_block block;
+			memset(&block, 0, sizeof(block));
+			block.version = 1;
+			block.check = check;
+			block.filters = filters;
+			block.header_size = lzma_block_header_size_decode(in[0]);
+			if (block.header_size > b.compressed_size || lzma_block_header_decode(&block, NULL, in) != LZMA_OK)
+				REPORT_ERROR("CompressedMovieDecoder: invalid block header in " + filename);
+
+			size_t in_pos = block.header_size, out_pos = 0;
+			const lzma_ret ret = lzma_block_buffer_decode(&block, NULL, in, &in_pos, b.compressed_size,
+			                                              (uint8_t *)dest, &out_pos, b.size);
+			for (int i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++)
+				free(filters[i].options);
+
+			if (ret != LZMA_OK || out_pos != b.size)
+				REPORT_ERROR("CompressedMovieDecoder: failed to decode a block of " + filename + " (" + lzmaError(ret) + ")");
+		}
+	};
+
+	// The blocks of a file that is a single xz stream; false if it is not, or if it has only one block
+	bool indexXz(const MappedFile &file, std::vector<Block> &blocks, lzma_check &check)
+	{
+		// Stream padding: multiples of four zero bytes
+		size_t end = file.size;
+		while (end >= 4 && readLittleEndian32(file.data + end - 4) == 0)
+			end -= 4;
+		if (end < 2 * LZMA_STREAM_HEADER_SIZE)
+			return false;
+
+		lzma_stream_flags header_flags, footer_flags;
+		if (lzma_stream_header_decode(&header_flags, file.data) != LZMA_OK ||
+		    lzma_stream_footer_decode(&footer_flags, file.data + end - LZMA_STREAM_HEADER_SIZE) != LZMA_OK ||
+		    lzma_stream_flags_compare(&header_flags, &footer_flags) != LZMA_OK ||
+		    footer_flags.backward_size > end - 2 * LZMA_STREAM_HEADER_SIZE)
+			return false;
+
+		lzma_index *index = NULL;
+		uint64_t memlimit = UINT64_MAX;
+		size_t in_pos = 0;
+		if (lzma_index_buffer_decode(&index, &memlimit, NULL, file.data + end - LZMA_STREAM_HEADER_SIZE - footer_flags.backward_size,
+		                             &in_pos, footer_flags.backward_size) != LZMA_OK)
+			return false;
+
+		// Files of several concatenated streams are decoded from the start
+		if (lzma_index_stream_size(index) == end)
+		{
+			lzma_index_iter iter;
+			lzma_index_iter_init(&iter, index);
+			while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_NONEMPTY_BLOCK))
+			{
+				Block block;
+				block.compressed_offset = iter.block.compressed_file_offset;
+				block.compressed_size = iter.block.total_size;
+				block.offset = iter.block.uncompressed_file_offset;
+				block.size = iter.block.uncompressed_size;
+				blocks.push_back(block);
+			}
+		}
+		lzma_index_end(index, NULL);
+
+		check = header_flags.check;
+		return blocks.size() > 1;
+	}
+#endif // HAVE_LZMA
+
+#ifdef HAVE_ZSTD
+	class ZstdStreamDecoder : public StreamDecoder
+	{
+	public:
+
+		ZstdStreamDecoder(const std::string &filename, std::shared_ptr<const MappedFile> file)
+		:	StreamDecoder(filename, file)
+		{
+			dstream = ZSTD_createDStream();
+			if (dstream == NULL)
+				REPORT_ERROR("CompressedMovieDecoder: cannot decode " + filename);
+			ZSTD_initDStream(dstream);
+			in.src = file->data;
+			in.size = file->size;
+			in.pos = 0;
+		}
+
+		~ZstdStreamDecoder()
+		{
+			ZSTD_freeDStream(dstream);
+		}
+
+	protected:
+
+		ZSTD_DStream *dstream;
+		ZSTD_inBuffer in;
+
+		size_t decode(char *dest, size_t size)
+		{
+			ZSTD_outBuffer out = {dest, size, 0};
+			while (out.pos < out.size)
+			{
+				const size_t in_before = in.pos, out_before = out.pos;
+				const size_t ret = ZSTD_decompressStream(dstream, &out, &in);
+				if (ZSTD_isError(ret))
+					REPORT_ERROR("CompressedMovieDecoder: failed to decode " + filename + " (" + ZSTD_getErrorName(ret) + ")");
+				if (in.pos == in_before && out.pos == out_before)
+					break; // end of the file
+			}
+
+			return out.pos;
+		}
+	};
+
+	class ZstdBlockDecoder : public BlockDecoder
+	{
+	public:
+
+		ZstdBlockDecoder(const std::string &filename, std::shared_ptr<const MappedFile> file, const std::vector<Block> &blocks)
+		:	BlockDecoder(filename, file, blocks)
+		{
+		}
+
+	protected:
+
+		void decodeBlock(const Block &b, char *dest) const
+		{
+			ZSTD_DCtx *dctx = ZSTD_createDCtx();
+			const size_t ret = ZSTD_decompressDCtx(dctx, dest, b.size, file->data + b.compressed_offset, b.compressed_size);
+			ZSTD_freeDCtx(dctx);
+
+			if (ZSTD_isError(ret) || ret != b.size)
+				REPORT_ERROR("CompressedMovieDecoder: failed to decode a frame of " + filename +
+				             (ZSTD_isError(ret) ? (std::string)" (" + ZSTD_getErrorName(ret) + ")" : (std::string)""));
+		}
+	};
+
+	// The frames of a zstd file; false if their sizes are not known, or if there is only one
+	bool indexZstd(const MappedFile &file, std::vector<Block> &blocks)
+	{
+		const uint32_t seek_table_magic = 0x8F92EAB1;
+		const uint32_t seek_table_frame_magic = 0x184D2A5E;
+
+		// The seek table of the seekable format is a skippable frame at the end, which ends in a 9-byte footer
+		if (file.size >= 17 && readLittleEndian32(file.data + file.size - 4) == seek_table_magic)
+		{
+			const size_t nr_frames = readLittleEndian32(file.data + file.size - 9);
+			const size_t entry_size = (file.data[file.size - 5] & 0x80) ? 12 : 8; // with checksums or not
+			const size_t table_size = 8 + nr_frames * entry_size + 9;
+
+			if (table_size <= file.size && readLittleEndian32(file.data + file.size - table_size) == seek_table_frame_magic)
+			{
+				const unsigned char *entry = file.data + file.size - table_size + 8;
+				size_t compressed_offset = 0, offset = 0;
+				for (size_t iframe = 0; iframe < nr_frames; iframe++, entry += entry_size)
+				{
+					Block block;
+					block.compressed_offset = compressed_offset;
+					block.compressed_size = readLittleEndian32(entry);
+					block.offset = offset;
+					block.size = readLittleEndian32(entry + 4);
+					if (block.size > 0)
+						blocks.push_back(block);
+					compressed_offset += block.compressed_size;
+					offset += block.size;
+				}
+
+				if (compressed_offset == file.size - table_size)
+					return blocks.size() > 1;
+				blocks.clear();
+			}
+		}
+
+		// Otherwise, frames that record their own content size
+		size_t compressed_offset = 0, offset = 0;
+		while (compressed_offset < file.size)
+		{
+			const unsigned char *frame = file.data + compressed_offset;
+			const size_t compressed_size = ZSTD_findFrameCompressedSize(frame, file.size - compressed_offset);
+			if (ZSTD_isError(compressed_size))
+				return false;
+
+			if (file.size - compressed_offset < 4 || (readLittleEndian32(frame) & 0xFFFFFFF0) != ZSTD_MAGIC_SKIPPABLE_START)
+			{
+				const unsigned long long size = ZSTD_getFrameContentSize(frame, file.size - compressed_offset);
+				if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR)
+					return false;
+
+				if (size > 0)
+				{
+					Block block;
+					block.compressed_offset = compressed_offset;
+					block.compressed_size = compressed_size;
+					block.offset = offset;
+					block.size = size;
+					blocks.push_back(block);
+				}
+				offset += size;
+			}
+			compressed_offset += compressed_size;
+		}
+
+		return blocks.size() > 1;
+	}
+#endif // HAVE_ZSTD
+}
+
+CompressedMovieDecoder *CompressedMovieDecoder::open(const std::string &filename, int n_threads)
+{
+#ifdef HAVE_BZIP2
+	if (endsWith(filename, ".bz2"))
+	{
+		std::shared_ptr<const MappedFile> file = std::make_shared<const MappedFile>(filename);
+		const std::vector<size_t> starts = findBzip2Streams(*file);
+		if (starts.size() > 1 && starts[0] == 0)
+			return new Bzip2MultiStreamDecoder(filename, file, starts, n_threads);
+		else
+			return new Bzip2StreamDecoder(filename, file);
+	}
+#endif
+#ifdef HAVE_LZMA
+	if (endsWith(filename, ".xz"))
+	{
+		std::shared_ptr<const MappedFile> file = std::make_shared<const MappedFile>(filename);
+		std::vector<Block> blocks;
+		lzma_check check;
+		if (indexXz(*file, blocks, check))
+			return new XzBlockDecoder(filename, file, blocks, check);
+		else
+			return new XzStreamDecoder(filename, file);
+	}
+#endif
+#ifdef HAVE_ZSTD
+	if (endsWith(filename, ".zst"))
+	{
+		std::shared_ptr<const MappedFile> file = std::make_shared<const MappedFile>(filename);
+		std::vector<Block> blocks;
+		if (indexZstd(*file, blocks))
+			return new ZstdBlockDecoder(filename, file, blocks);
+		else
+			return new ZstdStreamDecoder(filename, file);
+	}
+#endif
+
+	return NULL;
+}
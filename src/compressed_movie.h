@@ -0,0 +1,56 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef COMPRESSED_MOVIE_H
+#define COMPRESSED_MOVIE_H
+
+#include <cstddef>
+#include <string>
+
+/* Decoders for compressed MRC movies (.mrc.bz2, .mrc.xz and .mrc.zst, and the same for .mrcs)
+ * that run inside this process, instead of pbzip2, xz or zstd behind a pipe.
+ * A format is only decoded here if RELION was built with its library (HAVE_BZIP2, HAVE_LZMA, HAVE_ZSTD).
+ *
+ * Most files can only be decoded from the start, in order. Files made of independently
+ * compressed blocks, of which the uncompressed sizes are known, can be read anywhere:
+ *  - xz files with more than one block, e.g. from "xz -T0" or "xz --block-size=<bytes per frame>";
+ *  - zstd files with more than one frame, either in zstd's seekable format (which has a seek table)
+ *    or with the content size in every frame header, e.g. parts compressed by "zstd" one by one and concatenated;
+ *  - bzip2 files written by pbzip2, which consist of many streams. These streams are decoded,
+ *    in parallel, as they are needed and kept in memory, since their sizes are only known afterwards.
+ * Blocks of exactly one frame (and one for the header) are fastest, as each frame is then decoded only once.
+ */
+class CompressedMovieDecoder
+{
+public:
+
+	// A decoder for this file, or NULL if RELION was built without the library for its format.
+	// n_threads is the number of threads for the streams of pbzip2 files.
+	static CompressedMovieDecoder *open(const std::string &filename, int n_threads);
+
+	virtual ~CompressedMovieDecoder() {}
+
+	// If true, readAt can be called with any offset, in any order, and from several threads at once.
+	// Otherwise, offsets must not go back and only one thread may read.
+	virtual bool isSeekable() const = 0;
+
+	// Decode bytes [offset, offset + size) of the uncompressed file into dest.
+	// Returns false if the file ends before that.
+	virtual bool readAt(char *dest, size_t offset, size_t size) = 0;
+};
+
+#endif
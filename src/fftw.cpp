@@ -48,6 +48,10 @@
 #include "src/args.h"
 #include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <map>
+#include <algorithm>
+#include <functional>
 
 //#define TIMING_FFTW
 #ifdef TIMING_FFTW
@@ -66,6 +70,332 @@
 
 //#define DEBUG_PLANS
 
+// Plan cache ---------------------------------------------------------------
+#ifdef RELION_SINGLE_PRECISION
+	typedef fftwf_plan FftwPlan;
+	typedef fftwf_complex FftwComplex;
+	#define FFTW_API(name) fftwf_##name
+#else
+	typedef fftw_plan FftwPlan;
+	typedef fftw_complex FftwComplex;
+	#define FFTW_API(name) fftw_##name
+#endif
+
+namespace
+{
+	enum FftwPlanKind
+	{
+		PLAN_R2C,
+		PLAN_C2R,
+		PLAN_C2C_FORWARD,
+		PLAN_C2C_BACKWARD
+	};
+
+	struct FftwPlanKey
+	{
+		// planner_threads: the number of threads FFTW was told to plan for (fftw_plan_with_nthreads)
+		int kind, ndim, N[3], in_alignment, out_alignment, planner_threads;
+
+		bool operator<(const FftwPlanKey &other) const
+		{
+			const int a[8] = {kind, ndim, N[0], N[1], N[2], in_alignment, out_alignment, planner_threads};
+			const int b[8] = {other.kind, other.ndim, other.N[0], other.N[1], other.N[2], other.in_alignment, other.out_alignment, other.planner_threads};
+			return std::lexicographical_compare(a, a + 8, b, b + 8);
+		}
+	};
+
+	struct CachedPlan
+	{
+		FftwPlan plan;
+		int users;
+		long int last_used;
+	};
+
+	struct PlanCacheState
+	{
+		std::map<FftwPlanKey, CachedPlan> plans;
+		std::map<FftwPlan, FftwPlanKey> keys;
+		long int use_counter;
+		int nr_unused;
+		int planner_threads; // as last set through FftwPlanCache::setPlannerThreads()
+		bool wisdom_is_loaded, wisdom_has_changed;
+	};
+
+	// Never destroyed, so that static FourierTransformers can still hand back their plans at exit.
+	// Only to be accessed inside critical(FourierTransformer_fftw_plan), as the FFTW planner itself.
+	PlanCacheState &planCache()
+	{
+		static PlanCacheState *state = []() {
+			PlanCacheState *state = new PlanCacheState{};
+			state->planner_threads = 1; // FFTW's default
+			return state;
+		}();
+		return *state;
+	}
+
+	unsigned getPlannerFlags()
+	{
+		static const unsigned flags = []() -> unsigned {
+			const char *env = getenv("RELION_FFTW_PLANNER");
+			const std::string planner = (env == NULL) ? "estimate" : env;
+			if (planner == "estimate") return FFTW_ESTIMATE;
+			else if (planner == "measure") return FFTW_MEASURE;
+			else if (planner == "patient") return FFTW_PATIENT;
+			else if (planner == "exhaustive") return FFTW_EXHAUSTIVE;
+			REPORT_ERROR("RELION_FFTW_PLANNER should be estimate, measure, patient or exhaustive, not: " + planner);
+		}();
+
+		return flags;
+	}
+
+	int getMaximumNumberOfUnusedPlans()
+	{
+		static const int max_unused = []() -> int {
+			const char *env = getenv("RELION_FFTW_PLAN_CACHE_MAX");
+			return (env == NULL) ? 256 : std::max(0, atoi(env));
+		}();
+
+		return max_unused;
+	}
+
+	const char *getWisdomFileName()
+	{
+		const char *env = getenv("RELION_FFTW_WISDOM");
+		return (env == NULL || env[0] == '\0') ? NULL : env;
+	}
+
+	// Write to a temporary file first, so that processes that finish at the same time do not garble the file
+	bool exportWisdom(const char *fn_wisdom)
+	{
+		const std::string fn_tmp = std::string(fn_wisdom) + ".tmp" + integerToString(getpid());
+		if (!FFTW_API(export_wisdom_to_filename)(fn_tmp.c_str()))
+			return false;
+
+		if (rename(fn_tmp.c_str(), fn_wisdom) != 0)
+		{
+			remove(fn_tmp.c_str());
+			return false;
+		}
+
+		return true;
+	}
+
+	void saveWisdomAtExit()
+	{
+		const char *fn_wisdom = getWisdomFileName();
+		bool is_saved = true;
+
+		#pragma omp critical(FourierTransformer_fftw_plan)
+		{
+			if (planCache().wisdom_has_changed)
+				is_saved = exportWisdom(fn_wisdom);
+		}
+
+		if (!is_saved)
+			std::cerr << " WARNING: could not write FFTW wisdom to " << fn_wisdom << std::endl;
+	}
+
+	// Read RELION_FFTW_WISDOM before the first plan is made
+	void loadWisdom()
+	{
+		PlanCacheState &cache = planCache();
+		const char *fn_wisdom = getWisdomFileName();
+
+		if (fn_wisdom != NULL && !cache.wisdom_is_loaded)
+		{
+			FFTW_API(import_wisdom_from_filename)(fn_wisdom); // it is fine if there is no such file yet
+			atexit(saveWisdomAtExit);
+			cache.wisdom_is_loaded = true;
+		}
+	}
+
+	// Destroy the least recently used plans that are not in use, until at most max_unused of them are left
+	void trimPlanCache(int max_unused)
+	{
+		PlanCacheState &cache = planCache();
+
+		while (cache.nr_unused > max_unused)
+		{
+			std::map<FftwPlanKey, CachedPlan>::iterator oldest = cache.plans.end();
+			for (std::map<FftwPlanKey, CachedPlan>::iterator it = cache.plans.begin(); it != cache.plans.end(); it++)
+				if (it->second.users == 0 && (oldest == cache.plans.end() || it->second.last_used < oldest->second.last_used))
+					oldest = it;
+
+			FFTW_API(destroy_plan)(oldest->second.plan);
+			cache.keys.erase(oldest->second.plan);
+			cache.plans.erase(oldest);
+			cache.nr_unused--;
+		}
+	}
+
+	// Plan a transform of size N, and keep that plan for the next transformer with the same size and array alignments.
+	// The plan does not keep a reference to in or out: it is always executed through the new-array interface.
+	FftwPlan getPlan(FftwPlanKind kind, int ndim, const int *N, void *in, void *out)
+	{
+		FftwPlanKey key;
+		key.kind = kind;
+		key.ndim = ndim;
+		for (int i = 0; i < 3; i++)
+			key.N[i] = (i < ndim) ? N[i] : 0;
+		key.in_alignment = FFTW_API(alignment_of)((RFLOAT *)in);
+		key.out_alignment = FFTW_API(alignment_of)((RFLOAT *)out);
+
+		const unsigned flags = getPlannerFlags(); // may throw, so not inside the critical section
+		FftwPlan plan = NULL;
+
+		#pragma omp critical(FourierTransformer_fftw_plan)
+		{
+			PlanCacheState &cache = planCache();
+			key.planner_threads = cache.planner_threads;
+
+			std::map<FftwPlanKey, CachedPlan>::iterator it = cache.plans.find(key);
+			if (it != cache.plans.end())
+			{
+				if (it->second.users == 0)
+					cache.nr_unused--;
+				it->second.users++;
+				it->second.last_used = cache.use_counter++;
+				plan = it->second.plan;
+			}
+			else
+			{
+				loadWisdom();
+
+				// Anything but FFTW_ESTIMATE overwrites the arrays while planning, so use scratch arrays with the same alignment instead
+				char *in_scratch = NULL, *out_scratch = NULL;
+				if (flags != FFTW_ESTIMATE)
+				{
+					size_t nr_real = 1, nr_half = 1;
+					for (int i = 0; i < ndim; i++)
+					{
+						nr_real *= N[i];
+						nr_half *= (i == ndim - 1) ? N[i] / 2 + 1 : N[i];
+					}
+					const size_t in_bytes = (kind == PLAN_R2C) ? nr_real * sizeof(RFLOAT) :
+					                        (kind == PLAN_C2R) ? nr_half * sizeof(FftwComplex) : nr_real * sizeof(FftwComplex);
+					const size_t out_bytes = (kind == PLAN_R2C) ? nr_half * sizeof(FftwComplex) :
+					                         (kind == PLAN_C2R) ? nr_real * sizeof(RFLOAT) : nr_real * sizeof(FftwComplex);
+
+					// fftw_malloc returns maximally aligned memory
+					in_scratch = (char *)FFTW_API(malloc)(in_bytes + 64);
+					out_scratch = (char *)FFTW_API(malloc)(out_bytes + 64);
+					in = in_scratch + key.in_alignment;
+					out = out_scratch + key.out_alignment;
+				}
+
+				switch (kind)
+				{
+				case PLAN_R2C:
+					plan = FFTW_API(plan_dft_r2c)(ndim, N, (RFLOAT *)in, (FftwComplex *)out, flags);
+					break;
+				case PLAN_C2R:
+					plan = FFTW_API(plan_dft_c2r)(ndim, N, (FftwComplex *)in, (RFLOAT *)out, flags);
+					break;
+				case PLAN_C2C_FORWARD:
+					plan = FFTW_API(plan_dft)(ndim, N, (FftwComplex *)in, (FftwComplex *)out, FFTW_FORWARD, flags);
+					break;
+				case PLAN_C2C_BACKWARD:
+					plan = FFTW_API(plan_dft)(ndim, N, (FftwComplex *)in, (FftwComplex *)out, FFTW_BACKWARD, flags);
+					break;
+				}
+
+				if (in_scratch != NULL)
+				{
+					FFTW_API(free)(in_scratch);
+					FFTW_API(free)(out_scratch);
+				}
+
+				if (plan != NULL)
+				{
+					CachedPlan cached;
+					cached.plan = plan;
+					cached.users = 1;
+					cached.last_used = cache.use_counter++;
+					cache.plans[key] = cached;
+					cache.keys[plan] = key;
+					if (flags != FFTW_ESTIMATE)
+						cache.wisdom_has_changed = true;
+				}
+			}
+		}
+
+		return plan;
+	}
+
+	// Another transformer uses this plan (e.g. a copy of the one that got it)
+	void retainPlan(FftwPlan plan)
+	{
+		#pragma omp critical(FourierTransformer_fftw_plan)
+		{
+			PlanCacheState &cache = planCache();
+			std::map<FftwPlan, FftwPlanKey>::iterator it = cache.keys.find(plan);
+			if (it != cache.keys.end())
+				cache.plans[it->second].users++;
+		}
+	}
+
+	void releasePlan(FftwPlan plan)
+	{
+		#pragma omp critical(FourierTransformer_fftw_plan)
+		{
+			PlanCacheState &cache = planCache();
+			std::map<FftwPlan, FftwPlanKey>::iterator it = cache.keys.find(plan);
+			if (it != cache.keys.end())
+			{
+				CachedPlan &cached = cache.plans[it->second];
+				cached.users--;
+				if (cached.users == 0)
+				{
+					cache.nr_unused++;
+					trimPlanCache(getMaximumNumberOfUnusedPlans());
+				}
+			}
+		}
+	}
+}
+
+void FftwPlanCache::clear()
+{
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	trimPlanCache(0);
+}
+
+size_t FftwPlanCache::size()
+{
+	size_t nr_plans;
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	nr_plans = planCache().plans.size();
+	return nr_plans;
+}
+
+void FftwPlanCache::setPlannerThreads(int nr_threads)
+{
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	{
+#ifdef MKLFFT
+		fftw_plan_with_nthreads(nr_threads);
+#endif
+		planCache().planner_threads = nr_threads;
+	}
+}
+
+bool FftwPlanCache::saveWisdom()
+{
+	const char *fn_wisdom = getWisdomFileName();
+	if (fn_wisdom == NULL)
+		return false;
+
+	bool is_saved;
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	{
+		is_saved = exportWisdom(fn_wisdom);
+		if (is_saved)
+			planCache().wisdom_has_changed = false;
+	}
+
+	return is_saved;
+}
+
 // Constructors and destructors --------------------------------------------
 FourierTransformer::FourierTransformer():
 		plans_are_set(false)
@@ -92,6 +422,12 @@ FourierTransformer::FourierTransformer(const FourierTransformer& op) :
 	clear();
 	// New object is an extact copy of op
 	*this = op;
+	// which shares its plans
+	if (plans_are_set)
+	{
+		retainPlan(fPlanForward);
+		retainPlan(fPlanBackward);
+	}
 }
 
 void FourierTransformer::init()
@@ -118,13 +454,18 @@ void FourierTransformer::cleanup()
 {
 	// First clear object and destroy plans
 	clear();
+	FftwPlanCache::clear();
 	// Then clean up all the junk fftw keeps lying around
 	// SOMEHOW THE FOLLOWING IS NOT ALLOWED WHEN USING MULTPLE TRANSFORMER OBJECTS....
+	// (so it is skipped while other transformers still hold plans from the cache)
+	if (FftwPlanCache::size() == 0)
+	{
 #ifdef RELION_SINGLE_PRECISION
-	fftwf_cleanup();
+		fftwf_cleanup();
 #else
-	fftw_cleanup();
+		fftw_cleanup();
 #endif
+	}
 
 #ifdef DEBUG_PLANS
 	std::cerr << "CLEANED-UP this= "<<this<< std::endl;
@@ -134,20 +475,12 @@ void FourierTransformer::cleanup()
 
 void FourierTransformer::destroyPlans()
 {
-	// Anything to do with plans has to be protected for threads!
-	#pragma omp critical(FourierTransformer_fftw_plan)
+	// The plans are shared with other transformers; the cache destroys them when they are no longer needed
+	if (plans_are_set)
 	{
-		if (plans_are_set)
-		{
-#ifdef RELION_SINGLE_PRECISION
-			fftwf_destroy_plan(fPlanForward);
-			fftwf_destroy_plan(fPlanBackward);
-#else
-			fftw_destroy_plan(fPlanForward);
-			fftw_destroy_plan(fPlanBackward);
-#endif
-			plans_are_set = false;
-		}
+		releasePlan(fPlanForward);
+		releasePlan(fPlanBackward);
+		plans_are_set = false;
 	}
 }
 
@@ -213,22 +546,8 @@ void FourierTransformer::setReal(MultidimArray<RFLOAT> &input, bool force_new_pl
 
 		RCTIC(TIMING_FFTW_PLAN);
 
-		#pragma omp critical(FourierTransformer_fftw_plan)
-		{
-#ifdef RELION_SINGLE_PRECISION
-			fPlanForward = fftwf_plan_dft_r2c(ndim, N, MULTIDIM_ARRAY(*fReal),
-							  (fftwf_complex*) MULTIDIM_ARRAY(fFourier), FFTW_ESTIMATE);
-			fPlanBackward = fftwf_plan_dft_c2r(ndim, N,
-							   (fftwf_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal),
-							   FFTW_ESTIMATE);
-#else
-			fPlanForward = fftw_plan_dft_r2c(ndim, N, MULTIDIM_ARRAY(*fReal),
-							 (fftw_complex*) MULTIDIM_ARRAY(fFourier), FFTW_ESTIMATE);
-			fPlanBackward = fftw_plan_dft_c2r(ndim, N,
-							  (fftw_complex*) MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal),
-							  FFTW_ESTIMATE);
-#endif
-		}	
+		fPlanForward = getPlan(PLAN_R2C, ndim, N, MULTIDIM_ARRAY(*fReal), MULTIDIM_ARRAY(fFourier));
+		fPlanBackward = getPlan(PLAN_C2R, ndim, N, MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fReal));
 		RCTOC(TIMING_FFTW_PLAN);
 
 		if (fPlanForward == NULL || fPlanBackward == NULL)
@@ -290,20 +609,8 @@ void FourierTransformer::setReal(MultidimArray<Complex > &input, bool force_new_
 		plans_are_set = true;
 
 		RCTIC(TIMING_FFTW_PLAN);
-		#pragma omp critical(FourierTransformer_fftw_plan)
-		{
-#ifdef RELION_SINGLE_PRECISION
-			fPlanForward = fftwf_plan_dft(ndim, N, (fftwf_complex*) MULTIDIM_ARRAY(*fComplex),
-						      (fftwf_complex*) MULTIDIM_ARRAY(fFourier), FFTW_FORWARD, FFTW_ESTIMATE);
-			fPlanBackward = fftwf_plan_dft(ndim, N, (fftwf_complex*) MULTIDIM_ARRAY(fFourier),
-						       (fftwf_complex*) MULTIDIM_ARRAY(*fComplex), FFTW_BACKWARD, FFTW_ESTIMATE);
-#else
-			fPlanForward = fftw_plan_dft(ndim, N, (fftw_complex*) MULTIDIM_ARRAY(*fComplex),
-						     (fftw_complex*) MULTIDIM_ARRAY(fFourier), FFTW_FORWARD, FFTW_ESTIMATE);
-			fPlanBackward = fftw_plan_dft(ndim, N, (fftw_complex*) MULTIDIM_ARRAY(fFourier),
-						      (fftw_complex*) MULTIDIM_ARRAY(*fComplex), FFTW_BACKWARD, FFTW_ESTIMATE);
-#endif
-		}		
+		fPlanForward = getPlan(PLAN_C2C_FORWARD, ndim, N, MULTIDIM_ARRAY(*fComplex), MULTIDIM_ARRAY(fFourier));
+		fPlanBackward = getPlan(PLAN_C2C_BACKWARD, ndim, N, MULTIDIM_ARRAY(fFourier), MULTIDIM_ARRAY(*fComplex));
 		RCTOC(TIMING_FFTW_PLAN);
 
 		if (fPlanForward == NULL || fPlanBackward == NULL)
@@ -432,6 +739,390 @@ void FourierTransformer::enforceHermitianSymmetry()
 	}
 }
 
+// Batched transforms -------------------------------------------------------
+BatchFourierTransformer::BatchFourierTransformer(int _nr_threads)
+:	nr_threads(std::max(1, _nr_threads)),
+	plan_xdim(0),
+	plan_ydim(0),
+	plan_zdim(0)
+{
+}
+
+BatchFourierTransformer::~BatchFourierTransformer()
+{
+	clear();
+}
+
+void BatchFourierTransformer::setThreads(int _nr_threads)
+{
+	// Plans are kept per number of images, so the ones for the old number of threads may still come in handy
+	nr_threads = std::max(1, _nr_threads);
+}
+
+void BatchFourierTransformer::clear()
+{
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	{
+		for (auto it = plans.begin(); it != plans.end(); it++)
+			FFTW_API(destroy_plan)(it->second);
+	}
+	plans.clear();
+	plan_xdim = plan_ydim = plan_zdim = 0;
+}
+
+void BatchFourierTransformer::FourierTransform(MultidimArray<RFLOAT> &stack, MultidimArray<Complex> &Fstack)
+{
+	Fstack.reshape(NSIZE(stack), ZSIZE(stack), YSIZE(stack), XSIZE(stack) / 2 + 1);
+	transform(FFTW_FORWARD, false, MULTIDIM_ARRAY(stack), MULTIDIM_ARRAY(Fstack),
+	          NSIZE(stack), XSIZE(stack), YSIZE(stack), ZSIZE(stack));
+}
+
+void BatchFourierTransformer::inverseFourierTransform(MultidimArray<Complex> &Fstack, MultidimArray<RFLOAT> &stack)
+{
+	if (NSIZE(Fstack) != NSIZE(stack) || ZSIZE(Fstack) != ZSIZE(stack) ||
+	    YSIZE(Fstack) != YSIZE(stack) || XSIZE(Fstack) != XSIZE(stack) / 2 + 1)
+		REPORT_ERROR("BatchFourierTransformer::inverseFourierTransform: the real stack does not have the size of the Fourier stack");
+
+	transform(FFTW_BACKWARD, false, MULTIDIM_ARRAY(stack), MULTIDIM_ARRAY(Fstack),
+	          NSIZE(stack), XSIZE(stack), YSIZE(stack), ZSIZE(stack));
+}
+
+void BatchFourierTransformer::FourierTransformInPlace(MultidimArray<Complex> &data, long int xdim)
+{
+	if (XSIZE(data) != xdim / 2 + 1)
+		REPORT_ERROR("BatchFourierTransformer::FourierTransformInPlace: the data are not in the in-place layout for images of size " + integerToString(xdim));
+
+	transform(FFTW_FORWARD, true, (RFLOAT *)MULTIDIM_ARRAY(data), MULTIDIM_ARRAY(data),
+	          NSIZE(data), xdim, YSIZE(data), ZSIZE(data));
+}
+
+void BatchFourierTransformer::inverseFourierTransformInPlace(MultidimArray<Complex> &data, long int xdim)
+{
+	if (XSIZE(data) != xdim / 2 + 1)
+		REPORT_ERROR("BatchFourierTransformer::inverseFourierTransformInPlace: the data are not Fourier transforms of images of size " + integerToString(xdim));
+
+	transform(FFTW_BACKWARD, true, (RFLOAT *)MULTIDIM_ARRAY(data), MULTIDIM_ARRAY(data),
+	          NSIZE(data), xdim, YSIZE(data), ZSIZE(data));
+}
+
+void BatchFourierTransformer::toInPlaceLayout(const MultidimArray<RFLOAT> &stack, MultidimArray<Complex> &data)
+{
+	const long int xdim = XSIZE(stack), padded_xdim = 2 * (xdim / 2 + 1);
+	const long int nr_rows = NSIZE(stack) * ZSIZE(stack) * YSIZE(stack);
+
+	data.reshape(NSIZE(stack), ZSIZE(stack), YSIZE(stack), xdim / 2 + 1);
+
+	RFLOAT *padded = (RFLOAT *)MULTIDIM_ARRAY(data);
+	for (long int row = 0; row < nr_rows; row++)
+	{
+		memcpy(padded + row * padded_xdim, MULTIDIM_ARRAY(stack) + row * xdim, xdim * sizeof(RFLOAT));
+		for (long int j = xdim; j < padded_xdim; j++)
+			padded[row * padded_xdim + j] = 0.;
+	}
+}
+
+void BatchFourierTransformer::fromInPlaceLayout(const MultidimArray<Complex> &data, long int xdim, MultidimArray<RFLOAT> &stack)
+{
+	const long int padded_xdim = 2 * XSIZE(data);
+	const long int nr_rows = NSIZE(data) * ZSIZE(data) * YSIZE(data);
+
+	if (XSIZE(data) != xdim / 2 + 1)
+		REPORT_ERROR("BatchFourierTransformer::fromInPlaceLayout: the data are not in the in-place layout for images of size " + integerToString(xdim));
+
+	stack.reshape(NSIZE(data), ZSIZE(data), YSIZE(data), xdim);
+
+	const RFLOAT *padded = (const RFLOAT *)MULTIDIM_ARRAY(data);
+	for (long int row = 0; row < nr_rows; row++)
+		memcpy(MULTIDIM_ARRAY(stack) + row * xdim, padded + row * padded_xdim, xdim * sizeof(RFLOAT));
+}
+
+namespace
+{
+	// Find the plan for key (extended with the alignments of in and out, and the number of planner threads) among plans,
+	// or make it with make(in, out).
+	// Only to be called inside critical(FourierTransformer_fftw_plan).
+	FftwPlan findBatchPlan(std::map<std::vector<int>, FftwPlan> &plans, std::vector<int> key,
+	                       void *in, void *out, size_t in_bytes, size_t out_bytes, unsigned flags,
+	                       const std::function<FftwPlan(void *, void *)> &make)
+	{
+		const int in_alignment = FFTW_API(alignment_of)((RFLOAT *)in);
+		const int out_alignment = FFTW_API(alignment_of)((RFLOAT *)out);
+		key.push_back(in_alignment);
+		key.push_back(out_alignment);
+		key.push_back(planCache().planner_threads);
+
+		auto it = plans.find(key);
+		if (it != plans.end())
+			return it->second;
+
+		loadWisdom();
+
+		// Anything but FFTW_ESTIMATE overwrites the arrays while planning, so use scratch arrays with the same alignment instead
+		char *in_scratch = NULL, *out_scratch = NULL;
+		if (flags != FFTW_ESTIMATE)
+		{
+			in_scratch = (char *)FFTW_API(malloc)(in_bytes + 64);
+			if (in == out)
+				in = out = in_scratch + in_alignment;
+			else
+			{
+				out_scratch = (char *)FFTW_API(malloc)(out_bytes + 64);
+				in = in_scratch + in_alignment;
+				out = out_scratch + out_alignment;
+			}
+		}
+
+		FftwPlan plan = make(in, out);
+
+		if (in_scratch != NULL) FFTW_API(free)(in_scratch);
+		if (out_scratch != NULL) FFTW_API(free)(out_scratch);
+
+		if (plan != NULL)
+		{
+			plans[key] = plan;
+			if (flags != FFTW_ESTIMATE)
+				planCache().wisdom_has_changed = true;
+		}
+
+		return plan;
+	}
+
+	// Kinds of batch plans
+	enum BatchPlanKind
+	{
+		BATCH_IMAGES,   // all dimensions of a chunk of images
+		BATCH_SECTIONS, // the two inner dimensions of a chunk of the sections of a volume
+		BATCH_COLUMNS   // the outer dimension of a chunk of the columns of a volume
+	};
+}
+
+void BatchFourierTransformer::transform(int sign, bool in_place, RFLOAT *real, Complex *fourier, long int nr_images,
+                                        long int xdim, long int ydim, long int zdim)
+{
+	if (nr_images == 0)
+		return;
+
+	if (xdim != plan_xdim || ydim != plan_ydim || zdim != plan_zdim)
+	{
+		clear();
+		plan_xdim = xdim;
+		plan_ydim = ydim;
+		plan_zdim = zdim;
+	}
+
+	// A single volume cannot be cut into images, so cut it into slabs instead
+	if (nr_images == 1 && zdim > 1 && nr_threads > 1)
+	{
+		transformVolume(sign, in_place, real, fourier, xdim, ydim, zdim);
+		return;
+	}
+
+	int ndim = 3;
+	if (zdim == 1)
+	{
+		ndim = 2;
+		if (ydim == 1)
+			ndim = 1;
+	}
+	const int all_N[3] = {(int)zdim, (int)ydim, (int)xdim};
+	const int *N = all_N + 3 - ndim;
+
+	// Rows of real images are padded for in-place transforms
+	const int half_xdim = xdim / 2 + 1;
+	const int real_xdim = in_place ? 2 * half_xdim : xdim;
+	int real_embed[3], fourier_embed[3];
+	for (int i = 0; i < ndim; i++)
+	{
+		real_embed[i] = (i == ndim - 1) ? real_xdim : N[i];
+		fourier_embed[i] = (i == ndim - 1) ? half_xdim : N[i];
+	}
+	const long int real_dist = zdim * ydim * real_xdim;
+	const long int fourier_dist = zdim * ydim * half_xdim;
+
+	// One chunk of images per thread
+	const int nr_chunks = std::min((long int)nr_threads, nr_images);
+	std::vector<long int> first_image(nr_chunks + 1);
+	for (int ichunk = 0; ichunk <= nr_chunks; ichunk++)
+		first_image[ichunk] = ichunk * nr_images / nr_chunks;
+
+	const unsigned flags = getPlannerFlags(); // may throw, so not inside the critical section
+	std::vector<FftwPlan> chunk_plans(nr_chunks, (FftwPlan)NULL);
+
+	RCTIC(TIMING_FFTW_PLAN);
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	{
+		for (int ichunk = 0; ichunk < nr_chunks; ichunk++)
+		{
+			const int howmany = first_image[ichunk + 1] - first_image[ichunk];
+			RFLOAT *chunk_real = real + first_image[ichunk] * real_dist;
+			Complex *chunk_fourier = fourier + first_image[ichunk] * fourier_dist;
+			const size_t real_bytes = howmany * real_dist * sizeof(RFLOAT);
+			const size_t fourier_bytes = howmany * fourier_dist * sizeof(Complex);
+
+			if (sign == FFTW_FORWARD)
+				chunk_plans[ichunk] = findBatchPlan(plans, {BATCH_IMAGES, sign, in_place, howmany},
+					chunk_real, chunk_fourier, real_bytes, fourier_bytes, flags, [&](void *in, void *out)
+				{
+					return FFTW_API(plan_many_dft_r2c)(ndim, N, howmany, (RFLOAT *)in, real_embed, 1, real_dist,
+					                                   (FftwComplex *)out, fourier_embed, 1, fourier_dist, flags);
+				});
+			else
+				chunk_plans[ichunk] = findBatchPlan(plans, {BATCH_IMAGES, sign, in_place, howmany},
+					chunk_fourier, chunk_real, fourier_bytes, real_bytes, flags, [&](void *in, void *out)
+				{
+					return FFTW_API(plan_many_dft_c2r)(ndim, N, howmany, (FftwComplex *)in, fourier_embed, 1, fourier_dist,
+					                                   (RFLOAT *)out, real_embed, 1, real_dist, flags);
+				});
+		}
+	}
+	RCTOC(TIMING_FFTW_PLAN);
+
+	for (int ichunk = 0; ichunk < nr_chunks; ichunk++)
+		if (chunk_plans[ichunk] == NULL)
+			REPORT_ERROR("FFTW plans cannot be created");
+
+	RCTIC(TIMING_FFTW_EXECUTE);
+	#pragma omp parallel for num_threads(nr_chunks)
+	for (int ichunk = 0; ichunk < nr_chunks; ichunk++)
+	{
+		RFLOAT *chunk_real = real + first_image[ichunk] * real_dist;
+		Complex *chunk_fourier = fourier + first_image[ichunk] * fourier_dist;
+
+		if (sign == FFTW_FORWARD)
+		{
+			FFTW_API(execute_dft_r2c)(chunk_plans[ichunk], chunk_real, (FftwComplex *)chunk_fourier);
+
+			// Normalisation of the transform, as in FourierTransformer
+			const size_t nr_coefficients = (first_image[ichunk + 1] - first_image[ichunk]) * fourier_dist;
+			const RFLOAT size = zdim * ydim * xdim;
+			for (size_t n = 0; n < nr_coefficients; n++)
+				chunk_fourier[n] /= size;
+		}
+		else
+			FFTW_API(execute_dft_c2r)(chunk_plans[ichunk], (FftwComplex *)chunk_fourier, chunk_real);
+	}
+	RCTOC(TIMING_FFTW_EXECUTE);
+}
+
+void BatchFourierTransformer::transformVolume(int sign, bool in_place, RFLOAT *real, Complex *fourier,
+                                              long int xdim, long int ydim, long int zdim)
+{
+	// The 3D transform is a 2D transform of each section, followed by 1D transforms along Z of all columns (or the reverse).
+	// Each thread does a chunk of the sections, and then a chunk of the columns.
+	const int half_xdim = xdim / 2 + 1;
+	const int real_xdim = in_place ? 2 * half_xdim : xdim;
+	const int N[2] = {(int)ydim, (int)xdim};
+	const int real_embed[2] = {(int)ydim, real_xdim};
+	const int fourier_embed[2] = {(int)ydim, half_xdim};
+	const long int real_dist = ydim * real_xdim;
+	const long int fourier_dist = ydim * half_xdim;
+	const int nz = zdim;
+	const long int nr_columns = fourier_dist;
+
+	const int nr_section_chunks = std::min((long int)nr_threads, zdim);
+	std::vector<long int> first_section(nr_section_chunks + 1);
+	for (int ichunk = 0; ichunk <= nr_section_chunks; ichunk++)
+		first_section[ichunk] = ichunk * zdim / nr_section_chunks;
+
+	const int nr_column_chunks = std::min((long int)nr_threads, nr_columns);
+	std::vector<long int> first_column(nr_column_chunks + 1);
+	for (int ichunk = 0; ichunk <= nr_column_chunks; ichunk++)
+		first_column[ichunk] = ichunk * nr_columns / nr_column_chunks;
+
+	const unsigned flags = getPlannerFlags(); // may throw, so not inside the critical section
+	std::vector<FftwPlan> section_plans(nr_section_chunks, (FftwPlan)NULL);
+	std::vector<FftwPlan> column_plans(nr_column_chunks, (FftwPlan)NULL);
+
+	RCTIC(TIMING_FFTW_PLAN);
+	#pragma omp critical(FourierTransformer_fftw_plan)
+	{
+		for (int ichunk = 0; ichunk < nr_section_chunks; ichunk++)
+		{
+			const int howmany = first_section[ichunk + 1] - first_section[ichunk];
+			RFLOAT *chunk_real = real + first_section[ichunk] * real_dist;
+			Complex *chunk_fourier = fourier + first_section[ichunk] * fourier_dist;
+			const size_t real_bytes = howmany * real_dist * sizeof(RFLOAT);
+			const size_t fourier_bytes = howmany * fourier_dist * sizeof(Complex);
+
+			if (sign == FFTW_FORWARD)
+				section_plans[ichunk] = findBatchPlan(plans, {BATCH_SECTIONS, sign, in_place, howmany},
+					chunk_real, chunk_fourier, real_bytes, fourier_bytes, flags, [&](void *in, void *out)
+				{
+					return FFTW_API(plan_many_dft_r2c)(2, N, howmany, (RFLOAT *)in, real_embed, 1, real_dist,
+					                                   (FftwComplex *)out, fourier_embed, 1, fourier_dist, flags);
+				});
+			else
+				section_plans[ichunk] = findBatchPlan(plans, {BATCH_SECTIONS, sign, in_place, howmany},
+					chunk_fourier, chunk_real, fourier_bytes, real_bytes, flags, [&](void *in, void *out)
+				{
+					return FFTW_API(plan_many_dft_c2r)(2, N, howmany, (FftwComplex *)in, fourier_embed, 1, fourier_dist,
+					                                   (RFLOAT *)out, real_embed, 1, real_dist, flags);
+				});
+		}
+
+		// The columns are transformed in place, with a stride of one section
+		for (int ichunk = 0; ichunk < nr_column_chunks; ichunk++)
+		{
+			const int howmany = first_column[ichunk + 1] - first_column[ichunk];
+			Complex *chunk_fourier = fourier + first_column[ichunk];
+			const size_t fourier_bytes = zdim * nr_columns * sizeof(Complex);
+
+			column_plans[ichunk] = findBatchPlan(plans, {BATCH_COLUMNS, sign, 0, howmany},
+				chunk_fourier, chunk_fourier, fourier_bytes, fourier_bytes, flags, [&](void *in, void *out)
+			{
+				return FFTW_API(plan_many_dft)(1, &nz, howmany, (FftwComplex *)in, NULL, nr_columns, 1,
+				                               (FftwComplex *)out, NULL, nr_columns, 1, sign, flags);
+			});
+		}
+	}
+	RCTOC(TIMING_FFTW_PLAN);
+
+	for (int ichunk = 0; ichunk < nr_section_chunks; ichunk++)
+		if (section_plans[ichunk] == NULL)
+			REPORT_ERROR("FFTW plans cannot be created");
+	for (int ichunk = 0; ichunk < nr_column_chunks; ichunk++)
+		if (column_plans[ichunk] == NULL)
+			REPORT_ERROR("FFTW plans cannot be created");
+
+	RCTIC(TIMING_FFTW_EXECUTE);
+	if (sign == FFTW_FORWARD)
+	{
+		#pragma omp parallel for num_threads(nr_section_chunks)
+		for (int ichunk = 0; ichunk < nr_section_chunks; ichunk++)
+			FFTW_API(execute_dft_r2c)(section_plans[ichunk], real + first_section[ichunk] * real_dist,
+			                          (FftwComplex *)(fourier + first_section[ichunk] * fourier_dist));
+
+		#pragma omp parallel for num_threads(nr_column_chunks)
+		for (int ichunk = 0; ichunk < nr_column_chunks; ichunk++)
+		{
+			FftwComplex *chunk_fourier = (FftwComplex *)(fourier + first_column[ichunk]);
+			FFTW_API(execute_dft)(column_plans[ichunk], chunk_fourier, chunk_fourier);
+		}
+
+		// Normalisation of the transform, as in FourierTransformer
+		const RFLOAT size = zdim * ydim * xdim;
+		#pragma omp parallel for num_threads(nr_section_chunks)
+		for (int ichunk = 0; ichunk < nr_section_chunks; ichunk++)
+			for (long int n = first_section[ichunk] * fourier_dist; n < first_section[ichunk + 1] * fourier_dist; n++)
+				fourier[n] /= size;
+	}
+	else
+	{
+		#pragma omp parallel for num_threads(nr_column_chunks)
+		for (int ichunk = 0; ichunk < nr_column_chunks; ichunk++)
+		{
+			FftwComplex *chunk_fourier = (FftwComplex *)(fourier + first_column[ichunk]);
+			FFTW_API(execute_dft)(column_plans[ichunk], chunk_fourier, chunk_fourier);
+		}
+
+		#pragma omp parallel for num_threads(nr_section_chunks)
+		for (int ichunk = 0; ichunk < nr_section_chunks; ichunk++)
+			FFTW_API(execute_dft_c2r)(section_plans[ichunk], (FftwComplex *)(fourier + first_section[ichunk] * fourier_dist),
+			                          real + first_section[ichunk] * real_dist);
+	}
+	RCTOC(TIMING_FFTW_EXECUTE);
+}
+
 
 void randomizePhasesBeyond(MultidimArray<RFLOAT> &v, int index)
 {
@@ -47,6 +47,8 @@
 #define __RELIONFFTW_H
 
 #include <fftw3.h>
+#include <map>
+#include <vector>
 #include "src/multidim_array.h"
 #include "src/funcs.h"
 #include "src/tabfuncs.h"
@@ -339,11 +341,11 @@ public:
 	/** Clear object */
 	void clear();
 
-	/** This calls fftw_cleanup.
+	/** This calls fftw_cleanup, once no plans are in use anymore.
 	*/
 	void cleanup();
 
-	/** Destroy both forward and backward fftw planes (mutex locked */
+	/** Hand both forward and backward fftw plans back to the FftwPlanCache */
 	void destroyPlans();
 
 	/** Computes the transform, specified in Init() function
@@ -380,6 +382,126 @@ public:
 	void setFourier(const MultidimArray<Complex> &imgFourier);
 };
 
+/** Process-wide cache of FFTW plans.
+ * @ingroup FourierW
+ *
+ * FourierTransformers take their plans from this cache instead of making their own,
+ * so that the many short-lived transformers of the same size share one plan.
+ * Plans are keyed by the dimensions, the kind of transform, the alignment of the arrays and the
+ * number of planner threads, and each transformer executes them on its own arrays (FFTW's new-array execute).
+ *
+ * The cache is configured through environment variables:
+ *  RELION_FFTW_PLANNER: estimate (default), measure, patient or exhaustive.
+ *      Plans other than estimate are made on scratch arrays, so they never overwrite the data.
+ *  RELION_FFTW_WISDOM: file with FFTW wisdom, read before the first plan is made and written back at exit.
+ *      Together with measure, this makes good plans affordable for programs that are run over and over.
+ *  RELION_FFTW_PLAN_CACHE_MAX: number of plans that are kept while no transformer uses them (default: 256).
+ *      Setting it to 0 destroys each plan as soon as its last transformer is done with it.
+ */
+class FftwPlanCache
+{
+public:
+	// Destroy all plans that are not in use by any transformer
+	static void clear();
+
+	// Number of plans in the cache, including the ones in use
+	static size_t size();
+
+	// Use this instead of fftw_plan_with_nthreads, so that plans made for another number of threads are not reused.
+	// FFTW itself is only told in MKLFFT builds, which link its threaded interface.
+	static void setPlannerThreads(int nr_threads);
+
+	// Write the wisdom to RELION_FFTW_WISDOM now rather than at exit; false if that failed or no file was set
+	static bool saveWisdom();
+};
+
+/** Fourier transforms of a whole stack of images in one call.
+ * @ingroup FourierW
+ *
+ * The images are the NSIZE() images of a MultidimArray (1D, 2D or 3D each), and they are all
+ * transformed by one FFTW plan (fftw_plan_many_dft_r2c/c2r, which the MKL FFTW interface offers as well).
+ * With more than one thread, the stack is cut into one chunk per thread and each thread transforms its chunk.
+ * A stack of a single volume is cut into slabs instead: the threads first transform chunks of its
+ * sections in 2D, and then chunks of its columns along Z (the other way around for the inverse transform),
+ * so that also one large volume (e.g. the padded reconstruction) is transformed by all threads.
+ * Plans are kept for as long as the image size does not change.
+ * As in FourierTransformer, the forward transform is normalised and the inverse transform is not.
+ *
+ * @code
+ * BatchFourierTransformer transformer(nr_threads);
+ * MultidimArray<RFLOAT> stack(nr_images, box, box);
+ * MultidimArray<Complex> Fstack;
+ * transformer.FourierTransform(stack, Fstack); // Fstack is nr_images x box x (box/2+1)
+ * transformer.inverseFourierTransform(Fstack, stack); // this overwrites Fstack
+ * @endcode
+ *
+ * In the in-place mode the real images live inside the complex stack, with each row padded
+ * to 2*(XSIZE/2+1) values as FFTW wants it, so that no separate real stack is needed:
+ *
+ * @code
+ * MultidimArray<Complex> data;
+ * BatchFourierTransformer::toInPlaceLayout(stack, data);
+ * transformer.FourierTransformInPlace(data, XSIZE(stack));
+ * ... (data now holds the transforms)
+ * transformer.inverseFourierTransformInPlace(data, XSIZE(stack));
+ * BatchFourierTransformer::fromInPlaceLayout(data, XSIZE(stack), stack);
+ * @endcode
+ */
+class BatchFourierTransformer
+{
+public:
+
+	BatchFourierTransformer(int nr_threads = 1);
+	~BatchFourierTransformer();
+
+	BatchFourierTransformer(const BatchFourierTransformer&) = delete;
+	BatchFourierTransformer& operator=(const BatchFourierTransformer&) = delete;
+
+	void setThreads(int nr_threads);
+
+	/** Transform all images of stack into Fstack, which is resized to NSIZE x ZSIZE x YSIZE x (XSIZE/2+1). */
+	void FourierTransform(MultidimArray<RFLOAT> &stack, MultidimArray<Complex> &Fstack);
+
+	/** Transform all images of Fstack back into stack, which should already have the right size.
+	    The contents of Fstack are destroyed. */
+	void inverseFourierTransform(MultidimArray<Complex> &Fstack, MultidimArray<RFLOAT> &stack);
+
+	/** Transform the real images of size xdim in data (see toInPlaceLayout) in place. */
+	void FourierTransformInPlace(MultidimArray<Complex> &data, long int xdim);
+
+	/** Transform the Fourier transforms in data back to real images of size xdim, in place. */
+	void inverseFourierTransformInPlace(MultidimArray<Complex> &data, long int xdim);
+
+	/** Copy a stack of real images into the padded layout of in-place transforms. */
+	static void toInPlaceLayout(const MultidimArray<RFLOAT> &stack, MultidimArray<Complex> &data);
+
+	/** Copy the real images of size xdim out of the padded layout into stack (which is resized). */
+	static void fromInPlaceLayout(const MultidimArray<Complex> &data, long int xdim, MultidimArray<RFLOAT> &stack);
+
+	/** Destroy all plans */
+	void clear();
+
+private:
+
+	int nr_threads;
+
+	// Size of the images the plans are for
+	long int plan_xdim, plan_ydim, plan_zdim;
+
+	// Plans by direction, in-place, number of images, alignment of the input and output arrays and number of planner threads
+#ifdef RELION_SINGLE_PRECISION
+	std::map<std::vector<int>, fftwf_plan> plans;
+#else
+	std::map<std::vector<int>, fftw_plan> plans;
+#endif
+
+	void transform(int sign, bool in_place, RFLOAT *real, Complex *fourier, long int nr_images,
+	               long int xdim, long int ydim, long int zdim);
+
+	void transformVolume(int sign, bool in_place, RFLOAT *real, Complex *fourier,
+	                     long int xdim, long int ydim, long int zdim);
+};
+
 // Randomize phases beyond the given F-space shell (index) of R-space input image
 void randomizePhasesBeyond(MultidimArray<RFLOAT> &I, int index);
 
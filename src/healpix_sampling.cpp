@@ -39,6 +39,7 @@ void HealpixSampling::clear()
 	translations_x.clear();
 	translations_y.clear();
 	translations_z.clear();
+	precalculateOrientationTables(0);
 	L_repository.clear();
 	R_repository.clear();
 	L_repository_relax.clear();
@@ -555,6 +556,8 @@ void HealpixSampling::setOrientations(int _order, RFLOAT _psi_step)
 	writeAllOrientationsToBild("orients_final.bild", "1 0 0 ", 0.020);
 #endif
 
+	precalculateOrientationTables(precalculated_oversampling_order);
+
 }
 
 /* Set only a single orientation */
@@ -585,7 +588,157 @@ void HealpixSampling::addOneOrientation(RFLOAT rot, RFLOAT tilt, RFLOAT psi, boo
 	// in-plane rotation
 	psi_angles.push_back(psi);
 
+	// The tables no longer match the directions (and are not worth recalculating for every single orientation)
+	directions_x.clear();
+	directions_y.clear();
+	directions_z.clear();
+	sorted_directions_z.clear();
+	sorted_directions_idir.clear();
+	oversampled_rot_angles.clear();
+	oversampled_tilt_angles.clear();
+
+}
+
+void HealpixSampling::precalculateOrientationTables(int max_oversampling_order)
+{
+	precalculated_oversampling_order = max_oversampling_order;
+	directions_x.clear();
+	directions_y.clear();
+	directions_z.clear();
+	sorted_directions_z.clear();
+	sorted_directions_idir.clear();
+	oversampled_rot_angles.clear();
+	oversampled_tilt_angles.clear();
+
+	if (!is_3D || rot_angles.size() == 0)
+		return;
+
+	// Unit vectors along all directions, and their index on z
+	long int nr_dir = rot_angles.size();
+	directions_x.resize(nr_dir);
+	directions_y.resize(nr_dir);
+	directions_z.resize(nr_dir);
+	std::vector<std::pair<RFLOAT, int> > z_idir(nr_dir);
+	Matrix1D<RFLOAT> my_direction;
+	for (long int idir = 0; idir < nr_dir; idir++)
+	{
+		Euler_angles2direction(rot_angles[idir], tilt_angles[idir], my_direction);
+		directions_x[idir] = XX(my_direction);
+		directions_y[idir] = YY(my_direction);
+		directions_z[idir] = ZZ(my_direction);
+		z_idir[idir] = std::make_pair(ZZ(my_direction), (int)idir);
+	}
+	std::sort(z_idir.begin(), z_idir.end());
+	sorted_directions_z.resize(nr_dir);
+	sorted_directions_idir.resize(nr_dir);
+	for (long int i = 0; i < nr_dir; i++)
+	{
+		sorted_directions_z[i] = z_idir[i].first;
+		sorted_directions_idir[i] = z_idir[i].second;
+	}
+
+	// Oversampled directions can only be calculated for directions that are HEALPix pixels
+	for (long int idir = 0; idir < nr_dir; idir++)
+		if (directions_ipix[idir] < 0)
+			return;
+
+	for (int order = 1; order <= max_oversampling_order; order++)
+	{
+		Healpix_Base HealPixOver(order + healpix_order, NEST);
+		int fact = HealPixOver.Nside()/healpix_base.Nside();
+		long int nr_over = fact * fact;
+		if (nr_dir * nr_over > HEALPIX_MAX_OVERSAMPLED_TABLE_SIZE)
+			break;
+
+		std::vector<RFLOAT> over_rot(nr_dir * nr_over), over_tilt(nr_dir * nr_over);
+		for (long int idir = 0; idir < nr_dir; idir++)
+		{
+			// Same loop as in getOrientations
+			int x, y, face;
+			healpix_base.nest2xyf(directions_ipix[idir], x, y, face);
+			long int iover = idir * nr_over;
+			for (int j = fact * y; j < fact * (y+1); ++j)
+			{
+				for (int i = fact * x; i < fact * (x+1); ++i, ++iover)
+				{
+					long int overpix = HealPixOver.xyf2nest(i, j, face);
+					// this one always has to be double (also for SINGLE_PRECISION CALCULATIONS) for call to external library
+					double zz, phi;
+					HealPixOver.pix2ang_z_phi(overpix, zz, phi);
+					RFLOAT rot = RAD2DEG(phi);
+					RFLOAT tilt = ACOSD(zz);
+					checkDirection(rot, tilt);
+					over_rot[iover] = rot;
+					over_tilt[iover] = tilt;
+				}
+			}
+		}
+		oversampled_rot_angles.push_back(over_rot);
+		oversampled_tilt_angles.push_back(over_tilt);
+	}
+
+}
+
+bool HealpixSampling::getPrecalculatedOversampledDirections(long int idir, int oversampling_order,
+		const RFLOAT *&over_rot, const RFLOAT *&over_tilt, int &nr_over) const
+{
+	if (oversampling_order < 1 || oversampling_order > oversampled_rot_angles.size())
+		return false;
+
+	const std::vector<RFLOAT> &table_rot = oversampled_rot_angles[oversampling_order - 1];
+	nr_over = table_rot.size() / rot_angles.size();
+	if (nr_over * rot_angles.size() != table_rot.size() || idir >= rot_angles.size())
+		return false;
+
+	over_rot = &table_rot[idir * nr_over];
+	over_tilt = &oversampled_tilt_angles[oversampling_order - 1][idir * nr_over];
+	return true;
+}
+
+bool HealpixSampling::getDirectionsNearPrior(RFLOAT prior_rot, RFLOAT prior_tilt, RFLOAT max_ang,
+		std::vector<int> &near_idirs)
+{
+	near_idirs.clear();
+	if (directions_z.size() == 0 || directions_z.size() != rot_angles.size() || max_ang >= 180.)
+		return false;
+
+	// A small margin, so that rounding errors never lose a direction at the edge
+	RFLOAT max_ang_rad = DEG2RAD(max_ang + 0.01);
+	RFLOAT min_dot = cos(max_ang_rad);
+
+	// The symmetry-related sampling point L * R^T * v is near the prior p if v is near R * L^T * p
+	Matrix1D<RFLOAT> prior_direction, centre;
+	Euler_angles2direction(prior_rot, prior_tilt, prior_direction);
+	std::vector<Matrix1D<RFLOAT> > centres;
+	for (int j = 0; j < R_repository.size(); j++)
+	{
+		centre = R_repository[j] * (L_repository[j].transpose() * prior_direction);
+		centres.push_back(centre);
+	}
+	if (centres.size() == 0)
+		centres.push_back(prior_direction);
+
+	for (int icentre = 0; icentre < centres.size(); icentre++)
+	{
+		RFLOAT cx = XX(centres[icentre]), cy = YY(centres[icentre]), cz = ZZ(centres[icentre]);
+
+		// Only directions with a tilt angle within max_ang of that of the centre can be near it
+		RFLOAT tilt_centre = acos(XMIPP_MAX(-1., XMIPP_MIN(1., cz)));
+		RFLOAT z_min = (tilt_centre + max_ang_rad >= PI) ? -2. : cos(tilt_centre + max_ang_rad);
+		RFLOAT z_max = (tilt_centre - max_ang_rad <= 0.) ? 2. : cos(tilt_centre - max_ang_rad);
+		std::vector<RFLOAT>::const_iterator first = std::lower_bound(sorted_directions_z.begin(), sorted_directions_z.end(), z_min);
+		std::vector<RFLOAT>::const_iterator last = std::upper_bound(sorted_directions_z.begin(), sorted_directions_z.end(), z_max);
+		for (long int i = first - sorted_directions_z.begin(); i < last - sorted_directions_z.begin(); i++)
+		{
+			int idir = sorted_directions_idir[i];
+			if (cx * directions_x[idir] + cy * directions_y[idir] + cz * directions_z[idir] >= min_dot)
+				near_idirs.push_back(idir);
+		}
+	}
 
+	std::sort(near_idirs.begin(), near_idirs.end());
+	near_idirs.erase(std::unique(near_idirs.begin(), near_idirs.end()), near_idirs.end());
+	return true;
 }
 
 
@@ -722,8 +875,19 @@ void HealpixSampling::selectOrientationsWithNonZeroPriorProbability(
 		RFLOAT best_ang = 9999.;
 		long int best_idir = -999;
 
-		for (long int idir = 0; idir < rot_angles.size(); idir++)
+		// With a prior on both rot and tilt, only check the directions near the prior.
+		// If there are none, check all of them, as the nearest direction is then needed.
+		// (If there are some, the nearest direction is one of them, but not with bimodal searches.)
+		std::vector<int> near_idirs;
+		bool do_near_only = (sigma_rot > 0. && sigma_tilt > 0. && !isRelax && !do_bimodal_search_psi &&
+				getDirectionsNearPrior(prior_rot, prior_tilt, sigma_cutoff * XMIPP_MAX(sigma_rot, sigma_tilt), near_idirs) &&
+				near_idirs.size() > 0);
+		long int nr_dir_check = (do_near_only) ? near_idirs.size() : rot_angles.size();
+
+		for (long int idir_check = 0; idir_check < nr_dir_check; idir_check++)
 		{
+			long int idir = (do_near_only) ? near_idirs[idir_check] : idir_check;
+
 			// Check if this direction was met before as symmetry mate
 			if (idir_flag[idir] == true)
 					continue;
@@ -1838,6 +2002,8 @@ void HealpixSampling::getOrientations(long int idir, long int ipsi, int oversamp
 	my_tilt.clear();
 	my_psi.clear();
 	long int my_idir, my_ipsi;
+	const RFLOAT *over_rot, *over_tilt;
+	int nr_over;
 	if (pointer_dir_nonzeroprior.size() > idir && pointer_psi_nonzeroprior.size() > ipsi)
 	{
 		// nonzeroprior vectors have been initialised, so use priors!
@@ -1875,6 +2041,11 @@ void HealpixSampling::getOrientations(long int idir, long int ipsi, int oversamp
 		// for 2D sampling, only push back oversampled psi rotations
 		pushbackOversampledPsiAngles(my_ipsi, oversampling_order, 0., 0., my_rot, my_tilt, my_psi);
 	}
+	else if (getPrecalculatedOversampledDirections(my_idir, oversampling_order, over_rot, over_tilt, nr_over))
+	{
+		for (int iover = 0; iover < nr_over; iover++)
+			pushbackOversampledPsiAngles(my_ipsi, oversampling_order, over_rot[iover], over_tilt[iover], my_rot, my_tilt, my_psi);
+	}
 	else
 	{
 		// Set up oversampled grid for 3D sampling
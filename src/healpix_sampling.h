@@ -34,6 +34,9 @@
 #define NOPRIOR 0
 #define PRIOR_ROTTILT_PSI 1
 
+// Largest number of oversampled directions precalculated for one oversampling order (see precalculateOrientationTables)
+#define HEALPIX_MAX_OVERSAMPLED_TABLE_SIZE 4194304
+
 class HealpixSampling
 {
 
@@ -97,6 +100,19 @@ public:
     /** vector with the X,Y(,Z)-translations (as of v3.1 in Angstroms!) */
     std::vector<RFLOAT> translations_x, translations_y, translations_z;
 
+    /** Unit vectors along all directions, stored per coordinate, and the directions sorted on their z-coordinate
+     * This is the spatial index for selecting the directions near an orientational prior */
+    std::vector<RFLOAT> directions_x, directions_y, directions_z;
+    std::vector<RFLOAT> sorted_directions_z;
+    std::vector<int> sorted_directions_idir;
+
+    /** Highest oversampling order for which the oversampled directions are precalculated */
+    int precalculated_oversampling_order;
+
+    /** The (rot, tilt) pairs of the oversampled HEALPix pixels inside every direction, for oversampling orders 1, 2, ...
+     * oversampled_rot_angles[order - 1][idir * nr_over + iover], with nr_over = 4^order */
+    std::vector<std::vector<RFLOAT> > oversampled_rot_angles, oversampled_tilt_angles;
+
 
 public:
 
@@ -114,7 +130,8 @@ public:
 		limit_tilt(0),
 		healpix_order(0),
 		pgOrder(0),
-		pgOrderRelaxSym(0)
+		pgOrderRelaxSym(0),
+		precalculated_oversampling_order(0)
     {}
 
     // Destructor
@@ -218,6 +235,26 @@ public:
     /* Add a single orientation */
     void addOneOrientation(RFLOAT rot, RFLOAT tilt, RFLOAT psi, bool do_clear = false);
 
+    /* Precalculate the read-only tables that speed up the orientational searches:
+     * unit vectors of all directions with an index on their z-coordinate (for selectOrientationsWithNonZeroPriorProbability),
+     * and the oversampled directions up to max_oversampling_order (for getOrientations)
+     * setOrientations recalculates them for the same max_oversampling_order; addOneOrientation removes them
+     */
+    void precalculateOrientationTables(int max_oversampling_order);
+
+    /* Get pointers to the nr_over precalculated (rot, tilt) pairs of the oversampled pixels inside direction idir
+     * (an index into rot_angles, not into a list of non-zero prior directions)
+     * Returns false if these were not precalculated
+     */
+    bool getPrecalculatedOversampledDirections(long int idir, int oversampling_order,
+    		const RFLOAT *&over_rot, const RFLOAT *&over_tilt, int &nr_over) const;
+
+    /* Get all directions within max_ang degrees of (prior_rot, prior_tilt), or of any of its symmetry mates, sorted on idir
+     * This may return a few directions just outside max_ang. Returns false if the spatial index is not available
+     */
+    bool getDirectionsNearPrior(RFLOAT prior_rot, RFLOAT prior_tilt, RFLOAT max_ang,
+    		std::vector<int> &near_idirs);
+
     /* Write all orientations as a sphere in a bild file
      * Mainly useful for debugging */
     void writeAllOrientationsToBild(FileName fn_bild, std::string rgb = "1 0 0", RFLOAT size = 0.025);
@@ -64,6 +64,9 @@
 #include "src/metadata_table.h"
 #include "src/fftw.h"
 #include "src/float16.h"
+#include "src/image_conversion.h"
+#include "src/mapped_stack_cache.h"
+#include "src/compressed_movie.h"
 
 /// @defgroup Images Images
 //@{
@@ -318,7 +321,7 @@ public:
 			if ((fimg  = fopen(fileName.c_str(), wmChar.c_str())) == NULL)
 				REPORT_ERROR((std::string)"Image::openFile cannot open: " + name);
 
-			if (ext_name=="mrcs" && wmChar=="r")
+			if (ext_name.contains("mrcs") && wmChar=="r")
 			{
 				if (bufferSize < SIZE_MAX)
 				{
@@ -411,6 +414,8 @@ private:
 	int mFd; // Handle the file in reading method and mmap
 	size_t mappedSize; // Size of the mapped file
 
+	friend class CompressedMRCReader; // decodes frames itself, with the byte order of its header
+
 public:
 	/** Empty constructor
 	 *
@@ -521,6 +526,9 @@ public:
 		if (name == "")
 			REPORT_ERROR("ERROR: trying to read image with empty file name!");
 		int err = 0;
+		if (readdata && !mapData && readFromMappedStack(name, select_img, is_2D, err))
+			return err;
+
 		fImageHandler hFile;
 		hFile.openFile(name);
 		err = _read(name, hFile, readdata, select_img, mapData, is_2D);
@@ -536,6 +544,9 @@ public:
 	int readFromOpenFile(const FileName &name, fImageHandler &hFile, long int select_img, bool is_2D = false)
 	{
 		int err = 0;
+		if (readFromMappedStack(name, select_img, is_2D, err))
+			return err;
+
 		err = _read(name, hFile, true, select_img, false, is_2D);
 		// Reposition file pointer for a next read
 		rewind(fimg);
@@ -559,6 +570,13 @@ public:
 	{
 
 		const FileName &fname = (name == "") ? filename : name;
+
+		// Readers should not see the file through an old map
+		long int dump;
+		FileName fn_file;
+		fname.decompose(dump, fn_file);
+		MappedStackCache::forget(fn_file.removeFileFormat());
+
 		fImageHandler hFile;
 		hFile.openFile(name, mode);
 		_write(fname, hFile, select_img, isStack, mode, datatype);
@@ -582,8 +600,7 @@ public:
 				else
 				{
 					unsigned char *ptr = (unsigned char *)page;
-					for (size_t i = 0; i < pageSize; i++)
-						ptrDest[i] = (T)ptr[i];
+					castPage(ptr, ptrDest, pageSize);
 				}
 				break;
 			}
@@ -596,8 +613,7 @@ public:
 				else
 				{
 					signed char *ptr = (signed char *)page;
-					for (size_t i = 0; i < pageSize; i++)
-						ptrDest[i] = (T)ptr[i];
+					castPage(ptr, ptrDest, pageSize);
 				}
 				break;
 			}
@@ -610,8 +626,7 @@ public:
 				else
 				{
 					unsigned short *ptr = (unsigned short *)page;
-					for(size_t i = 0; i < pageSize; i++)
-						ptrDest[i] = (T)ptr[i];
+					castPage(ptr, ptrDest, pageSize);
 				}
 				break;
 			}
@@ -624,8 +639,7 @@ public:
 				else
 				{
 					short *ptr = (short *)page;
-					for(size_t i = 0; i < pageSize; i++)
-						ptrDest[i] = (T)ptr[i];
+					castPage(ptr, ptrDest, pageSize);
 				}
 				break;
 			}
@@ -638,8 +652,7 @@ public:
 				else
 				{
 					unsigned int *ptr = (unsigned int *)page;
-					for(size_t i = 0; i < pageSize; i++)
-						ptrDest[i] = (T)ptr[i];
+					castPage(ptr, ptrDest, pageSize);
 				}
 				break;
 			}
@@ -652,8 +665,7 @@ public:
 				else
 				{
 					int *ptr = (int *)page;
-					for(size_t i = 0; i < pageSize; i++)
-						ptrDest[i] = (T)ptr[i];
+					castPage(ptr, ptrDest, pageSize);
 				}
 				break;
 			}
@@ -666,8 +678,7 @@ public:
 				else
 				{
 					long *ptr = (long *)page;
-					for(size_t i = 0; i < pageSize; i++)
-						ptrDest[i] = (T)ptr[i];
+					castPage(ptr, ptrDest, pageSize);
 				}
 				break;
 			}
@@ -680,8 +691,7 @@ public:
 				else
 				{
 					float *ptr = (float *)page;
-					for(size_t i = 0; i < pageSize; i++)
-						ptrDest[i] = (T)ptr[i];
+					castPage(ptr, ptrDest, pageSize);
 				}
 				break;
 			}
@@ -694,16 +704,14 @@ public:
 				else
 				{
 					RFLOAT *ptr = (RFLOAT *)page;
-					for(size_t i = 0; i < pageSize; i++)
-						ptrDest[i] = (T)ptr[i];
+					castPage(ptr, ptrDest, pageSize);
 				}
 				break;
 			}
 		case Float16:
 			{
 				float16 *ptr = (float16 *)page;
-				for(size_t i = 0; i < pageSize; i++)
-					ptrDest[i] = (T)half2float(ptr[i]);
+				castHalfPage(ptr, ptrDest, pageSize);
 				break;
 			}
 		case UHalf:
@@ -747,8 +755,7 @@ public:
 				else
 				{
 					float *ptr = (float *)page;
-					for (size_t i = 0; i < pageSize; i++)
-						ptr[i] = (float)srcPtr[i];
+					castPage(srcPtr, ptr, pageSize);
 				}
 				break;
 			}
@@ -761,16 +768,14 @@ public:
 				else
 				{
 					RFLOAT *ptr = (RFLOAT *)page;
-					for (size_t i = 0; i < pageSize; i++)
-						ptr[i] = (RFLOAT)srcPtr[i];
+					castPage(srcPtr, ptr, pageSize);
 				}
 				break;
 			}
 		case Float16:
 			{
 				float16 *ptr = (float16 *)page;
-				for (size_t i = 0; i < pageSize; i++)
-					ptr[i] = float2half((float)srcPtr[i]);
+				castPage2Half(srcPtr, ptr, pageSize);
 				break;
 			}
 		case SShort: 
@@ -782,8 +787,7 @@ public:
 				else
 				{
 					short *ptr = (short *)page;
-					for (size_t i = 0; i < pageSize; i++)
-						ptr[i] = (short)srcPtr[i];
+					castPage(srcPtr, ptr, pageSize);
 				}
 				break;
 			}
@@ -796,8 +800,7 @@ public:
 				else
 				{
 					unsigned short *ptr = (unsigned short *)page;
-					for (size_t i = 0; i < pageSize; i++)
-						ptr[i] = (unsigned short)srcPtr[i];
+					castPage(srcPtr, ptr, pageSize);
 				}
 				break;
 			}
@@ -810,8 +813,7 @@ public:
 				else
 				{
 					unsigned char *ptr = (unsigned char *)page;
-					for (size_t i = 0; i < pageSize; i++)
-						ptr[i] = (unsigned char)srcPtr[i];
+					castPage(srcPtr, ptr, pageSize);
 				}
 				break;
 			}
@@ -1106,6 +1108,55 @@ public:
 		return 0;
 	}
 
+	/** Read the raw data from a memory-mapped stack, as readData does from an open file
+	  * The data are converted straight from the map, without reading them into a page first.
+	  */
+	int readMappedData(const MappedStack &stack, long int select_img, DataType datatype)
+	{
+		if (dataflag < 1)
+			return 0;
+
+		size_t pagesize; // bytes
+		if (datatype == UHalf)
+		{
+			if (YXSIZE(data) % 2 != 0) REPORT_ERROR("For UHalf, YXSIZE(data) must be even.");
+			pagesize = ZYXSIZE(data) / 2;
+		}
+		else
+		{
+			pagesize = ZYXSIZE(data) * gettypesize(datatype);
+		}
+
+		if (select_img < 0)
+			select_img = 0;
+
+		const size_t myoffset = offset + select_img * pagesize;
+		const size_t readsize = NSIZE(data) * pagesize;
+
+		// As for a short read in readData
+		if (myoffset + readsize > stack.size)
+			return -2;
+
+		data.coreAllocateReuse();
+		stack.willNeed(myoffset, readsize);
+
+		if (swap)
+		{
+			// The map is read-only, so swap a copy
+			char *page = (char *) askMemory(readsize);
+			memcpy(page, stack.data + myoffset, readsize);
+			swapPage(page, readsize, datatype);
+			castPage2T(page, MULTIDIM_ARRAY(data), datatype, NZYXSIZE(data));
+			freeMemory(page, readsize);
+		}
+		else
+		{
+			castPage2T((char *)(stack.data + myoffset), MULTIDIM_ARRAY(data), datatype, NZYXSIZE(data));
+		}
+
+		return 0;
+	}
+
 	/** Data access
 	 *
 	 * This operator can be used to access the data multidimarray.
@@ -1384,6 +1435,49 @@ public:
 	}
 
 private:
+	/* Read an image (or a whole stack) from an MRC stack in the MappedStackCache, as _read would.
+	 * Returns false if the file should be read through an fImageHandler instead. */
+	bool readFromMappedStack(const FileName &name, long int select_img, bool is_2D, int &err)
+	{
+		if (!MappedStackCache::isEnabled())
+			return false;
+
+		FileName ext_name = name.getFileFormat();
+		if (!(ext_name.contains("mrcs") || (is_2D && ext_name.contains("mrc"))))
+			return false;
+
+		long int dump;
+		FileName fn_stack;
+		name.decompose(dump, fn_stack);
+		fn_stack = fn_stack.removeFileFormat();
+		if (fn_stack.contains("%"))
+			return false;
+
+		std::shared_ptr<const MappedStack> stack = MappedStackCache::get(fn_stack);
+		if (!stack || stack->size < MRCSIZE)
+			return false;
+
+		dataflag = 1;
+		mmapOn = false;
+		fimg = NULL;
+		fhed = NULL;
+
+		// Subtract 1 to have numbering 0...N-1 instead of 1...N
+		if (dump > 0)
+			dump--;
+		filename = name;
+
+		if (select_img == -1)
+			select_img = dump;
+
+		MDMainHeader.clear();
+		MDMainHeader.addObject();
+
+		err = readMRCMapped(*stack, select_img, name);
+
+		return true;
+	}
+
 	int _read(const FileName &name, fImageHandler &hFile, bool readdata=true, long int select_img = -1,
 			  bool mapData = false, bool is_2D = false)
 	{
@@ -1580,15 +1674,19 @@ class CompressedMRCReader
 /*
 	A class to read compressed MRC movies
 
-	We use pbzip2/xz/zstd, which must be in the PATH, to decompress.
-	pbzip2 can decompress in parallel when the file was compressed by
-	pbzip2, not the original bzip2.
+	When RELION was built with libbz2, liblzma or libzstd, the movie is decoded in this
+	process (see CompressedMovieDecoder). Otherwise we use pbzip2/xz/zstd, which must be
+	in the PATH, to decompress. pbzip2 can decompress in parallel when the file was
+	compressed by pbzip2, not the original bzip2.
 
-	Since these compressed streams do not allow random access, we can only read frames
+	Most compressed streams do not allow random access, so we can only read frames
 	in sequence. We can read all frames or some frames in order
 	(e.g. 3, 4, 7, 8) but cannot go back (e.g. 3, 4, 1, 2).
+	Files made of independently compressed blocks (multi-block xz, multi-frame zstd and
+	pbzip2 files) can be read in any order when decoded in this process; isRandomAccess()
+	then returns true, and readFrameInto() can be called from several threads at once.
 
-	This class is NOT thread safe.
+	Otherwise, this class is NOT thread safe.
 
 	Typical usage is:
 
@@ -1600,7 +1698,7 @@ class CompressedMRCReader
 	// You cannot copy Ihead() because its "data" buffer is not allocated.
 
 	// Read one frame
-	// frame_index is 0-indexed and must be in-order.
+	// frame_index is 0-indexed and must be in-order unless reader.isRandomAccess().
 	Image<T> image;
 	reader.readFrameInto(image, frame_index);
  */
@@ -1608,11 +1706,13 @@ class CompressedMRCReader
 	public:
 
 	FILE *pipe;
+	CompressedMovieDecoder *decoder;
 	std::string commandline;
 	// This is only to read the header. The type doesn't matter.
 	Image<float> Ihead;
 	int current_frame;
 	DataType datatype;
+	size_t data_offset; // of the first frame, when reading through the decoder
 
 	static bool isCompressedMRC(FileName filename)
 	{
@@ -1650,13 +1750,34 @@ class CompressedMRCReader
 	CompressedMRCReader()
 	{
 		pipe = NULL;
+		decoder = NULL;
+	}
+
+	// Whether frames can be read in any order and by several threads at once
+	bool isRandomAccess() const
+	{
+		return decoder != NULL && decoder->isSeekable();
 	}
 
 	void read(FileName filename, int n_threads)
 	{
-		if (pipe != NULL)
+		if (pipe != NULL || decoder != NULL)
 			REPORT_ERROR("CompressedMRCReader::read() called twice.");
 
+		Image<float>::MRChead *header = new Image<float>::MRChead();
+
+		decoder = CompressedMovieDecoder::open(filename, n_threads);
+		if (decoder != NULL)
+		{
+			if (!decoder->readAt((char *)header, 0, MRCSIZE))
+				REPORT_ERROR("CompressedMRCReader: error in reading header of image " + filename);
+			datatype = Ihead.parseMRCHeader(header, -1, true /* isStack */, filename);
+			data_offset = MRCSIZE + header->nsymbt;
+			current_frame = 0;
+			delete header;
+			return;
+		}
+
 		// -c: to stdout, -d: decompress. -k: keep the original, -p: number of threads
 		if (filename.endsWith("bz2"))
 			commandline = "pbzip2 -cdkp" + integerToString(n_threads);
@@ -1677,7 +1798,6 @@ class CompressedMRCReader
 				     ". Do you have pbzip2, xz, zstd in the PATH? Is the movie accessible and intact?\n" + \
 				     "Command line for the pipe: " + commandline);
 
-		Image<float>::MRChead *header = new Image<float>::MRChead();
 		if (fread(header, MRCSIZE, 1, pipe) < 1)
 			REPORT_ERROR("CompressedMRCReader: error in reading header of image " + filename + \
 			             "Command line for the pipe: " + commandline);
@@ -1690,6 +1810,12 @@ class CompressedMRCReader
 	template<typename T>
 	void readFrameInto(Image<T> &image, size_t frame)
 	{
+		if (decoder != NULL)
+		{
+			readDecodedFrameInto(image, frame);
+			return;
+		}
+
 		if (pipe == NULL)
 			REPORT_ERROR("CompressedMRCReader::readFrameInto() called before a file is opened.");
 //		std::cout << "CompressedMRCReader::readFrameInto(): frame = " << frame << " current_frame = " << current_frame << std::endl;
@@ -1715,9 +1841,50 @@ class CompressedMRCReader
 	{
 		if (pipe != NULL)
 			fclose(pipe);
+		if (decoder != NULL)
+			delete decoder;
 	}
 
 	CompressedMRCReader(const CompressedMRCReader&) = delete;
+
+	private:
+
+	template<typename T>
+	void readDecodedFrameInto(Image<T> &image, size_t frame)
+	{
+		size_t pagesize; // bytes
+		if (datatype == UHalf)
+		{
+			if (YXSIZE(Ihead.data) % 2 != 0) REPORT_ERROR("For UHalf, YXSIZE(data) must be even.");
+			pagesize = YXSIZE(Ihead.data) / 2;
+		}
+		else
+		{
+			pagesize = YXSIZE(Ihead.data) * gettypesize(datatype);
+		}
+
+		if (!decoder->isSeekable())
+		{
+			if (frame < current_frame)
+				REPORT_ERROR("CompressedMRCReader::readFrameInto() cannot go back in a file without independently compressed blocks.");
+			current_frame = frame + 1;
+		}
+
+		image.data.setXdim(Ihead.data.xdim);
+		image.data.setYdim(Ihead.data.ydim);
+		image.data.setZdim(1);
+		image.data.setNdim(1);
+		image.data.coreAllocateReuse();
+
+		char *page = (char *) askMemory(pagesize);
+		if (!decoder->readAt(page, data_offset + frame * pagesize, pagesize))
+			REPORT_ERROR("CompressedMRCReader::readFrameInto() failed to decode frame " + integerToString(frame + 1) +
+			             ". Is the movie intact?");
+		if (Ihead.swap)
+			Ihead.swapPage(page, pagesize, datatype);
+		image.castPage2T(page, MULTIDIM_ARRAY(image.data), datatype, NZYXSIZE(image.data));
+		freeMemory(page, pagesize);
+	}
 };
 
 // Some image-specific operations
@@ -0,0 +1,125 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/image_conversion.h"
+
+#include <cstring>
+
+// One clone of each kernel per instruction set; the dynamic loader picks the one that fits the CPU.
+// This needs ifunc support, so it is restricted to GCC and recent clang on x86_64 Linux.
+#if defined(__x86_64__) && defined(__linux__) && \
+    ((defined(__GNUC__) && !defined(__clang__) && !defined(__INTEL_COMPILER) && __GNUC__ >= 6) || \
+     (defined(__clang__) && __clang_major__ >= 14))
+#define CONVERSION_KERNEL __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define CONVERSION_KERNEL
+#endif
+
+#define CAST_PAGE_KERNEL(S, D) \
+CONVERSION_KERNEL void castPage(const S *__restrict__ src, D *__restrict__ dst, size_t n) \
+{ \
+	for (size_t i = 0; i < n; i++) \
+		dst[i] = (D)src[i]; \
+}
+
+CAST_PAGE_KERNEL(unsigned char, float)
+CAST_PAGE_KERNEL(signed char, float)
+CAST_PAGE_KERNEL(unsigned short, float)
+CAST_PAGE_KERNEL(short, float)
+CAST_PAGE_KERNEL(unsigned int, float)
+CAST_PAGE_KERNEL(int, float)
+CAST_PAGE_KERNEL(double, float)
+
+CAST_PAGE_KERNEL(unsigned char, double)
+CAST_PAGE_KERNEL(signed char, double)
+CAST_PAGE_KERNEL(unsigned short, double)
+CAST_PAGE_KERNEL(short, double)
+CAST_PAGE_KERNEL(unsigned int, double)
+CAST_PAGE_KERNEL(int, double)
+CAST_PAGE_KERNEL(float, double)
+
+CAST_PAGE_KERNEL(float, short)
+CAST_PAGE_KERNEL(float, unsigned short)
+CAST_PAGE_KERNEL(float, unsigned char)
+
+CAST_PAGE_KERNEL(double, short)
+CAST_PAGE_KERNEL(double, unsigned short)
+CAST_PAGE_KERNEL(double, unsigned char)
+
+// half2float and float2half from float16.h without branches, so that the loops vectorise
+
+static inline float halfBits2Float(unsigned int h)
+{
+	const unsigned int sign = (h & 0x8000u) << 16;
+	const unsigned int exponent = (h & 0x7c00u) >> 10;
+	const unsigned int fractional = (h & 0x03ffu) << 13;
+
+	unsigned int bits = sign | ((exponent + 112) << 23) | fractional;
+	bits = (exponent == 31) ? (sign | 0x7f800000u | fractional) : bits; // Inf, -Inf, NaN
+	bits = (exponent == 0) ? sign : bits; // subnormal numbers become signed zeros
+
+	float f;
+	memcpy(&f, &bits, sizeof(float));
+	return f;
+}
+
+static inline float16 float2HalfBits(float f)
+{
+	unsigned int bits;
+	memcpy(&bits, &f, sizeof(float));
+
+	const unsigned int sign = (bits & 0x80000000u) >> 16;
+	const unsigned int exponent = (bits & 0x7f800000u) >> 23;
+	const unsigned int fractional = bits & 0x007fffffu;
+
+	// Round, and carry up into the exponent
+	const unsigned int rounded = fractional + (1u << 12);
+	const unsigned int carry = rounded >> 23;
+	const unsigned int rounded_exponent = exponent + carry;
+
+	unsigned int ret = sign | (((rounded_exponent - 112) & 0x1fu) << 10) | ((rounded & 0x007fffffu) >> 13);
+	ret = (rounded_exponent < 127 - 14) ? sign : ret; // underflow
+	ret = (rounded_exponent > 127 + 15) ? (sign | 0x7bffu) : ret; // overflow: maximum instead of INF
+	ret = (exponent == 255) ? (sign | 0x7c00u | (fractional >> 13)) : ret; // Inf, -Inf, NaN
+	ret = (exponent == 0) ? sign : ret; // subnormal numbers become signed zeros
+
+	return (float16)ret;
+}
+
+CONVERSION_KERNEL void castHalfPage(const float16 *__restrict__ src, float *__restrict__ dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = halfBits2Float(src[i]);
+}
+
+CONVERSION_KERNEL void castHalfPage(const float16 *__restrict__ src, double *__restrict__ dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = (double)halfBits2Float(src[i]);
+}
+
+CONVERSION_KERNEL void castPage2Half(const float *__restrict__ src, float16 *__restrict__ dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = float2HalfBits(src[i]);
+}
+
+CONVERSION_KERNEL void castPage2Half(const double *__restrict__ src, float16 *__restrict__ dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = float2HalfBits((float)src[i]);
+}
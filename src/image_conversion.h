@@ -0,0 +1,91 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef IMAGE_CONVERSION_H
+#define IMAGE_CONVERSION_H
+
+#include <cstddef>
+#include <cstdio>
+#include "src/float16.h"
+
+/* Element-wise conversions between the data types of image files and the arrays of Image<T>,
+ * as used by Image::castPage2T and Image::castPage2Datatype.
+ *
+ * The templates below are the plain loops. For float and double arrays, which is what Image<RFLOAT>
+ * reads and writes, there are overloads in image_conversion.cpp that are compiled for AVX-512, AVX2 and
+ * the baseline instruction set; the best version for the CPU is picked when the program is loaded.
+ * They give exactly the same results as the loops, also for float16, where they follow half2float
+ * and float2half bit by bit (i.e. no INFs on overflow and signed zeros for subnormal numbers).
+ */
+
+// dst[i] = (D)src[i]
+template <typename S, typename D>
+inline void castPage(const S *src, D *dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = (D)src[i];
+}
+
+// dst[i] = (D)half2float(src[i])
+template <typename D>
+inline void castHalfPage(const float16 *src, D *dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = (D)half2float(src[i]);
+}
+
+// dst[i] = float2half((float)src[i])
+template <typename S>
+inline void castPage2Half(const S *src, float16 *dst, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		dst[i] = float2half((float)src[i]);
+}
+
+// From file to array
+void castPage(const unsigned char *src, float *dst, size_t n);
+void castPage(const signed char *src, float *dst, size_t n);
+void castPage(const unsigned short *src, float *dst, size_t n);
+void castPage(const short *src, float *dst, size_t n);
+void castPage(const unsigned int *src, float *dst, size_t n);
+void castPage(const int *src, float *dst, size_t n);
+void castPage(const double *src, float *dst, size_t n);
+
+void castPage(const unsigned char *src, double *dst, size_t n);
+void castPage(const signed char *src, double *dst, size_t n);
+void castPage(const unsigned short *src, double *dst, size_t n);
+void castPage(const short *src, double *dst, size_t n);
+void castPage(const unsigned int *src, double *dst, size_t n);
+void castPage(const int *src, double *dst, size_t n);
+void castPage(const float *src, double *dst, size_t n);
+
+void castHalfPage(const float16 *src, float *dst, size_t n);
+void castHalfPage(const float16 *src, double *dst, size_t n);
+
+// From array to file
+void castPage(const float *src, short *dst, size_t n);
+void castPage(const float *src, unsigned short *dst, size_t n);
+void castPage(const float *src, unsigned char *dst, size_t n);
+
+void castPage(const double *src, short *dst, size_t n);
+void castPage(const double *src, unsigned short *dst, size_t n);
+void castPage(const double *src, unsigned char *dst, size_t n);
+
+void castPage2Half(const float *src, float16 *dst, size_t n);
+void castPage2Half(const double *src, float16 *dst, size_t n);
+
+#endif
@@ -0,0 +1,242 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/image_prefetcher.h"
+
+ImagePrefetcher::ImagePrefetcher()
+:	max_batches(0),
+	max_bytes(0),
+	bytes_in_use(0),
+	fetching(NULL),
+	is_stopping(false)
+{
+}
+
+ImagePrefetcher::~ImagePrefetcher()
+{
+	clear();
+}
+
+void ImagePrefetcher::setup(int _max_batches, size_t _max_bytes)
+{
+	clear();
+	max_batches = _max_batches;
+	max_bytes = _max_bytes;
+}
+
+bool ImagePrefetcher::isActive() const
+{
+	return max_batches > 0;
+}
+
+bool ImagePrefetcher::isQueued(long int key)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	for (int i = 0; i < batches.size(); i++)
+		if (batches[i]->key == key) return true;
+
+	return false;
+}
+
+bool ImagePrefetcher::prefetch(long int key, const std::vector<FileName> &fn_imgs)
+{
+	if (!isActive() || fn_imgs.size() == 0) return false;
+
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (batches.size() >= max_batches || error) return false;
+	for (int i = 0; i < batches.size(); i++)
+		if (batches[i]->key == key) return false;
+
+	Batch *batch = new Batch;
+	batch->key = key;
+	batch->fn_imgs = fn_imgs;
+	batch->imgs.resize(fn_imgs.size());
+	batch->bytes = 0;
+	batch->done = false;
+	batches.push_back(batch);
+
+	// The reader thread is only started when it is needed
+	if (!reader.joinable())
+		reader = std::thread(&ImagePrefetcher::readBatches, this);
+
+	queue_changed.notify_all();
+
+	return true;
+}
+
+bool ImagePrefetcher::fetch(long int key, std::vector<MultidimArray<RFLOAT> > &imgs)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	rethrowReaderError(lock);
+
+	int ibatch = -1;
+	for (int i = 0; i < batches.size(); i++)
+	{
+		if (batches[i]->key == key)
+		{
+			ibatch = i;
+			break;
+		}
+	}
+	if (ibatch < 0) return false;
+
+	// Tell the reader not to wait for memory on our behalf
+	Batch *batch = batches[ibatch];
+	fetching = batch;
+	queue_changed.notify_all();
+	batch_done.wait(lock, [batch]{ return batch->done; });
+
+	imgs.swap(batch->imgs);
+
+	// Batches are read in order, so the ones before this one are done as well; they will not be fetched anymore
+	for (int i = 0; i <= ibatch; i++)
+	{
+		bytes_in_use -= batches.front()->bytes;
+		delete batches.front();
+		batches.pop_front();
+	}
+	fetching = NULL;
+
+	rethrowReaderError(lock);
+
+	queue_changed.notify_all();
+
+	return true;
+}
+
+void ImagePrefetcher::rethrowReaderError(std::unique_lock<std::mutex> &lock)
+{
+	if (!error) return;
+
+	std::exception_ptr reader_error = error;
+	error = nullptr;
+	lock.unlock();
+	clear();
+	std::rethrow_exception(reader_error);
+}
+
+void ImagePrefetcher::clear()
+{
+	stop();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	for (int i = 0; i < batches.size(); i++)
+		delete batches[i];
+	batches.clear();
+	bytes_in_use = 0;
+}
+
+void ImagePrefetcher::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		is_stopping = true;
+	}
+	queue_changed.notify_all();
+
+	if (reader.joinable())
+		reader.join();
+
+	std::lock_guard<std::mutex> lock(mutex);
+	is_stopping = false;
+}
+
+void ImagePrefetcher::readBatches()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	size_t image_bytes = 0;
+
+	while (!is_stopping)
+	{
+		Batch *batch = NULL;
+		for (int i = 0; i < batches.size(); i++)
+		{
+			if (!batches[i]->done)
+			{
+				batch = batches[i];
+				break;
+			}
+		}
+
+		if (batch == NULL)
+		{
+			queue_changed.wait(lock);
+			continue;
+		}
+
+		// Only open/close stacks once
+		fImageHandler hFile;
+		FileName fn_open_stack = "";
+		long int dump;
+
+		for (int i = 0; i < batch->fn_imgs.size(); i++)
+		{
+			// Wait for memory to be freed, unless the caller is already waiting for us
+			queue_changed.wait(lock, [&]{ return is_stopping || fetching != NULL || bytes_in_use + image_bytes <= max_bytes; });
+			if (is_stopping) return;
+			if (bytes_in_use + image_bytes > max_bytes) break;
+
+			FileName fn_img = batch->fn_imgs[i], fn_stack;
+			Image<RFLOAT> img;
+			bool is_read = false;
+
+			lock.unlock();
+			try
+			{
+				fn_img.decompose(dump, fn_stack);
+				if (fn_stack != fn_open_stack)
+				{
+					hFile.openFile(fn_stack, WRITE_READONLY);
+					fn_open_stack = fn_stack;
+				}
+				img.readFromOpenFile(fn_img, hFile, -1, false);
+				img().setXmippOrigin();
+				is_read = true;
+			}
+			catch (const RelionError &XE)
+			{
+				// Leave this image to the caller, who will report the error
+				fn_open_stack = "";
+			}
+			catch (...)
+			{
+				// Anything else is passed on to the caller by fetch; nothing more is read
+				lock.lock();
+				error = std::current_exception();
+				for (int j = 0; j < batches.size(); j++)
+					batches[j]->done = true;
+				batch_done.notify_all();
+				return;
+			}
+			lock.lock();
+
+			if (is_read)
+			{
+				image_bytes = MULTIDIM_SIZE(img()) * sizeof(RFLOAT);
+				batch->imgs[i] = img();
+				batch->bytes += image_bytes;
+				bytes_in_use += image_bytes;
+			}
+		}
+
+		batch->done = true;
+		batch_done.notify_all();
+	}
+}
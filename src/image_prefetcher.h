@@ -0,0 +1,111 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef IMAGE_PREFETCHER_H
+#define IMAGE_PREFETCHER_H
+
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "src/image.h"
+
+/*	class ImagePrefetcher:
+ *
+ *	Reads batches of 2D particle images (e.g. the next pool of particles in the expectation step)
+ *	in a background thread, while the current batch is being processed.
+ *
+ *	Batches are identified by a key (e.g. the first particle of the pool) and read in the order in
+ *	which they were queued. At most max_batches batches are kept in the queue, and the images that
+ *	have been read but not yet fetched take at most max_bytes of memory. When the cap is reached, the
+ *	reader waits until a batch is fetched; images of the batch that is being fetched are then left
+ *	unread, as are images that gave an error, and the caller reads those itself as before.
+ *	Any other exception in the reader (e.g. std::bad_alloc) stops it, and is thrown by the next fetch.
+ *
+ *	@code
+ *	prefetcher.setup(2, 2. * 1024 * 1024 * 1024);
+ *	prefetcher.prefetch(next_first_part_id, fn_next_imgs);
+ *	...
+ *	std::vector<MultidimArray<RFLOAT> > imgs;
+ *	if (prefetcher.fetch(first_part_id, imgs))
+ *		for (int i = 0; i < imgs.size(); i++)
+ *			if (imgs[i].nzyxdim == 0) // read fn_imgs[i] yourself
+ *	@endcode
+ */
+class ImagePrefetcher
+{
+public:
+
+	ImagePrefetcher();
+	~ImagePrefetcher();
+
+	ImagePrefetcher(const ImagePrefetcher&) = delete;
+	ImagePrefetcher& operator=(const ImagePrefetcher&) = delete;
+
+	// max_batches = 0 switches prefetching off
+	void setup(int max_batches, size_t max_bytes);
+
+	bool isActive() const;
+
+	// Is the batch with this key in the queue?
+	bool isQueued(long int key);
+
+	/* Queue the images of a batch for reading in the background.
+	 * Returns false if the queue is full or the batch is already in it. */
+	bool prefetch(long int key, const std::vector<FileName> &fn_imgs);
+
+	/* Take a batch out of the queue, after waiting for its images to be read.
+	 * Images that were not read are empty. Returns false if the batch was not queued.
+	 * Rethrows an exception from the reader thread, after clearing the queue. */
+	bool fetch(long int key, std::vector<MultidimArray<RFLOAT> > &imgs);
+
+	// Drop all queued batches (e.g. at the end of an iteration)
+	void clear();
+
+private:
+
+	struct Batch
+	{
+		long int key;
+		std::vector<FileName> fn_imgs;
+		std::vector<MultidimArray<RFLOAT> > imgs;
+		size_t bytes;
+		bool done;
+	};
+
+	int max_batches;
+	size_t max_bytes, bytes_in_use;
+
+	std::deque<Batch*> batches;
+	Batch *fetching;
+	bool is_stopping;
+	std::exception_ptr error;
+
+	std::thread reader;
+	std::mutex mutex;
+	std::condition_variable queue_changed, batch_done;
+
+	void readBatches();
+	void stop();
+
+	// Called with the mutex locked; unlocks it if there is an error to throw
+	void rethrowReaderError(std::unique_lock<std::mutex> &lock);
+};
+
+#endif
@@ -170,6 +170,7 @@ BufferedImage<T> MovieLoader::readEER(
 
 
 	BufferedImage<T> out(w0, h0, fc);
+	renderer.preReadFrames(num_threads);
 
 	#pragma omp parallel for num_threads(num_threads)
 	for (int f = 0; f < fc; f++)
@@ -0,0 +1,165 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/mapped_stack_cache.h"
+
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+MappedStack::MappedStack(const char *_data, size_t _size)
+:	data(_data),
+	size(_size)
+{
+}
+
+MappedStack::~MappedStack()
+{
+	munmap((void *)data, size);
+}
+
+void MappedStack::willNeed(size_t offset, size_t length) const
+{
+	// madvise needs a page-aligned start
+	const size_t page = sysconf(_SC_PAGESIZE);
+	const size_t start = offset - offset % page;
+
+	if (start < size)
+		madvise((void *)(data + start), std::min(size - start, length + offset - start), MADV_WILLNEED);
+}
+
+namespace
+{
+	struct CacheEntry
+	{
+		std::shared_ptr<const MappedStack> stack;
+		dev_t device;
+		ino_t inode;
+		off_t size;
+		struct timespec mtime;
+		long int last_used;
+	};
+
+	std::mutex cache_mutex;
+	std::unordered_map<std::string, CacheEntry> cache;
+	long int use_counter = 0;
+
+	size_t getMaximumNumberOfMaps()
+	{
+		static const size_t max_maps = []() -> size_t {
+			const char *env = getenv("RELION_MMAP_STACKS_MAX");
+			return (env == NULL) ? 1024 : std::max(1, atoi(env));
+		}();
+
+		return max_maps;
+	}
+
+	std::atomic<bool> &isEnabledFlag()
+	{
+		static std::atomic<bool> is_enabled([]() -> bool {
+			const char *env = getenv("RELION_MMAP_STACKS");
+			return env != NULL && atoi(env) != 0;
+		}());
+
+		return is_enabled;
+	}
+}
+
+bool MappedStackCache::isEnabled()
+{
+	return isEnabledFlag();
+}
+
+void MappedStackCache::setEnabled(bool is_enabled)
+{
+	isEnabledFlag() = is_enabled;
+
+	if (!is_enabled)
+		clear();
+}
+
+std::shared_ptr<const MappedStack> MappedStackCache::get(const std::string &fn)
+{
+	struct stat st;
+	if (stat(fn.c_str(), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+		return std::shared_ptr<const MappedStack>();
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	std::unordered_map<std::string, CacheEntry>::iterator it = cache.find(fn);
+	if (it != cache.end())
+	{
+		const CacheEntry &entry = it->second;
+		if (entry.device == st.st_dev && entry.inode == st.st_ino && entry.size == st.st_size &&
+		    entry.mtime.tv_sec == st.st_mtim.tv_sec && entry.mtime.tv_nsec == st.st_mtim.tv_nsec)
+		{
+			it->second.last_used = use_counter++;
+			return entry.stack;
+		}
+
+		// The file has changed since it was mapped
+		cache.erase(it);
+	}
+
+	const int fd = open(fn.c_str(), O_RDONLY);
+	if (fd < 0)
+		return std::shared_ptr<const MappedStack>();
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); // the map keeps the file open
+
+	if (map == MAP_FAILED)
+		return std::shared_ptr<const MappedStack>();
+
+	if (cache.size() >= getMaximumNumberOfMaps())
+	{
+		std::unordered_map<std::string, CacheEntry>::iterator oldest = cache.begin();
+		for (it = cache.begin(); it != cache.end(); it++)
+			if (it->second.last_used < oldest->second.last_used)
+				oldest = it;
+		cache.erase(oldest);
+	}
+
+	CacheEntry entry;
+	entry.stack = std::make_shared<const MappedStack>((const char *)map, (size_t)st.st_size);
+	entry.device = st.st_dev;
+	entry.inode = st.st_ino;
+	entry.size = st.st_size;
+	entry.mtime = st.st_mtim;
+	entry.last_used = use_counter++;
+	cache[fn] = entry;
+
+	return entry.stack;
+}
+
+void MappedStackCache::forget(const std::string &fn)
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	cache.erase(fn);
+}
+
+void MappedStackCache::clear()
+{
+	std::lock_guard<std::mutex> lock(cache_mutex);
+	cache.clear();
+}
@@ -0,0 +1,77 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef MAPPED_STACK_CACHE_H
+#define MAPPED_STACK_CACHE_H
+
+#include <memory>
+#include <string>
+
+/* A read-only memory map of a whole image stack.
+ * The map stays valid for as long as someone holds a pointer to it,
+ * also after it has been evicted from the MappedStackCache.
+ */
+class MappedStack
+{
+public:
+
+	const char *data;
+	size_t size;
+
+	MappedStack(const char *data, size_t size);
+	~MappedStack();
+
+	MappedStack(const MappedStack&) = delete;
+	MappedStack& operator=(const MappedStack&) = delete;
+
+	// Ask the kernel to read this part of the file in one go (e.g. one particle image)
+	void willNeed(size_t offset, size_t length) const;
+};
+
+/*	class MappedStackCache:
+ *
+ *	A process-wide cache of memory-mapped MRC stacks, keyed by file name.
+ *	Image::read serves single particles from these maps, so that reading a particle from a stack
+ *	with thousands of them no longer opens the file, reads the header and seeks each time.
+ *
+ *	The file is checked on every get(): a map is re-made when the size, modification time or inode
+ *	of the file changes, and dropped when the file is written through Image::write.
+ *	At most RELION_MMAP_STACKS_MAX (default: 1024) stacks are kept mapped; the least recently used one is dropped first.
+ *
+ *	The cache is off unless RELION_MMAP_STACKS=1 is set (or setEnabled(true) is called):
+ *	a stack that is truncated by another process while it is mapped (e.g. one that is still being
+ *	written by an Extract or Polish job) kills the reading process with SIGBUS instead of giving a read error.
+ */
+class MappedStackCache
+{
+public:
+
+	static bool isEnabled();
+
+	// Switch the cache on or off for this process, whatever RELION_MMAP_STACKS says
+	static void setEnabled(bool is_enabled);
+
+	// The map of file fn (without the @ prefix); NULL if the file cannot be mapped
+	static std::shared_ptr<const MappedStack> get(const std::string &fn);
+
+	// Drop the map of file fn, e.g. because it is about to be overwritten
+	static void forget(const std::string &fn);
+
+	static void clear();
+};
+
+#endif
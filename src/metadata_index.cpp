@@ -0,0 +1,277 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/metadata_index.h"
+
+MetaDataIndex::MetaDataIndex()
+:	label(EMDL_UNDEFINED),
+	is_string(false)
+{
+}
+
+MetaDataIndex::MetaDataIndex(const MetaDataTable &MDt, EMDLabel label)
+{
+	build(MDt, label);
+}
+
+void MetaDataIndex::build(const MetaDataTable &MDt, EMDLabel _label)
+{
+	label = _label;
+
+	if (!(EMDL::isString(label) || EMDL::isInt(label) || EMDL::isBool(label)))
+		REPORT_ERROR("MetaDataIndex::build: only string, integer and boolean labels can be indexed, not " + EMDL::label2Str(label));
+
+	if (!MDt.containsLabel(label))
+		REPORT_ERROR("MetaDataIndex::build: the table does not contain " + EMDL::label2Str(label));
+
+	is_string = EMDL::isString(label);
+
+	stringToGroup.clear();
+	intToGroup.clear();
+	stringKeys.clear();
+	intKeys.clear();
+
+	const long int nr_rows = MDt.numberOfObjects();
+	rowToGroup.resize(nr_rows);
+
+	if (is_string)
+	{
+		stringToGroup.reserve(nr_rows);
+		std::string key;
+
+		for (long int r = 0; r < nr_rows; r++)
+		{
+			MDt.getValue(label, key, r);
+
+			std::unordered_map<std::string, long int>::const_iterator it = stringToGroup.find(key);
+			if (it == stringToGroup.end())
+			{
+				const long int g = stringKeys.size();
+				stringToGroup.insert(std::make_pair(key, g));
+				stringKeys.push_back(key);
+				rowToGroup[r] = g;
+			}
+			else
+			{
+				rowToGroup[r] = it->second;
+			}
+		}
+	}
+	else
+	{
+		intToGroup.reserve(nr_rows);
+
+		for (long int r = 0; r < nr_rows; r++)
+		{
+			long key;
+			if (EMDL::isBool(label))
+				key = MDt.getBool(label, r) ? 1 : 0;
+			else
+				MDt.getValue(label, key, r);
+
+			std::unordered_map<long, long int>::const_iterator it = intToGroup.find(key);
+			if (it == intToGroup.end())
+			{
+				const long int g = intKeys.size();
+				intToGroup.insert(std::make_pair(key, g));
+				intKeys.push_back(key);
+				rowToGroup[r] = g;
+			}
+			else
+			{
+				rowToGroup[r] = it->second;
+			}
+		}
+	}
+
+	// Counting sort of the rows by group; this keeps the table order within each group
+	const long int nr_groups = numberOfGroups();
+	groupStart.assign(nr_groups + 1, 0);
+
+	for (long int r = 0; r < nr_rows; r++)
+		groupStart[rowToGroup[r] + 1]++;
+
+	for (long int g = 0; g < nr_groups; g++)
+		groupStart[g + 1] += groupStart[g];
+
+	std::vector<long int> next(groupStart.begin(), groupStart.end() - 1);
+	groupRows.resize(nr_rows);
+
+	for (long int r = 0; r < nr_rows; r++)
+		groupRows[next[rowToGroup[r]]++] = r;
+}
+
+EMDLabel MetaDataIndex::getLabel() const
+{
+	return label;
+}
+
+long int MetaDataIndex::numberOfRows() const
+{
+	return rowToGroup.size();
+}
+
+long int MetaDataIndex::numberOfGroups() const
+{
+	return is_string ? stringKeys.size() : intKeys.size();
+}
+
+long int MetaDataIndex::findGroup(const std::string &key) const
+{
+	if (!is_string)
+		REPORT_ERROR("MetaDataIndex::findGroup: " + EMDL::label2Str(label) + " is not a string label");
+
+	std::unordered_map<std::string, long int>::const_iterator it = stringToGroup.find(key);
+	return (it == stringToGroup.end()) ? -1 : it->second;
+}
+
+long int MetaDataIndex::findGroup(long key) const
+{
+	if (is_string)
+		REPORT_ERROR("MetaDataIndex::findGroup: " + EMDL::label2Str(label) + " is a string label");
+
+	std::unordered_map<long, long int>::const_iterator it = intToGroup.find(key);
+	return (it == intToGroup.end()) ? -1 : it->second;
+}
+
+long int MetaDataIndex::groupOfRow(long int row) const
+{
+	return rowToGroup[row];
+}
+
+long int MetaDataIndex::find(const std::string &key) const
+{
+	const long int g = findGroup(key);
+	return (g < 0) ? -1 : groupRows[groupStart[g]];
+}
+
+long int MetaDataIndex::find(long key) const
+{
+	const long int g = findGroup(key);
+	return (g < 0) ? -1 : groupRows[groupStart[g]];
+}
+
+bool MetaDataIndex::contains(const std::string &key) const
+{
+	return findGroup(key) >= 0;
+}
+
+bool MetaDataIndex::contains(long key) const
+{
+	return findGroup(key) >= 0;
+}
+
+long int MetaDataIndex::groupSize(long int g) const
+{
+	return groupStart[g + 1] - groupStart[g];
+}
+
+long int MetaDataIndex::groupRow(long int g, long int i) const
+{
+	return groupRows[groupStart[g] + i];
+}
+
+std::vector<long int> MetaDataIndex::getGroupRows(long int g) const
+{
+	return std::vector<long int>(groupRows.begin() + groupStart[g], groupRows.begin() + groupStart[g + 1]);
+}
+
+std::string MetaDataIndex::getGroupKey(long int g) const
+{
+	return is_string ? stringKeys[g] : integerToString(intKeys[g]);
+}
+
+long MetaDataIndex::getGroupIntKey(long int g) const
+{
+	if (is_string)
+		REPORT_ERROR("MetaDataIndex::getGroupIntKey: " + EMDL::label2Str(label) + " is a string label");
+
+	return intKeys[g];
+}
+
+long int MetaDataIndex::findGroupOfRow(const MetaDataTable &MDother, long int row) const
+{
+	if (is_string)
+	{
+		std::string key;
+		if (!MDother.getValue(label, key, row)) return -1;
+		return findGroup(key);
+	}
+	else if (EMDL::isBool(label))
+	{
+		bool key;
+		if (!MDother.getValue(label, key, row)) return -1;
+		return findGroup((long) (key ? 1 : 0));
+	}
+	else
+	{
+		long key;
+		if (!MDother.getValue(label, key, row)) return -1;
+		return findGroup(key);
+	}
+}
+
+MetaDataTable joinMetaDataTables(const MetaDataTable &MDleft, const MetaDataTable &MDright, EMDLabel label)
+{
+	if (!MDleft.containsLabel(label))
+		REPORT_ERROR("joinMetaDataTables: the left table does not contain " + EMDL::label2Str(label));
+
+	MetaDataIndex index(MDright, label);
+
+	MetaDataTable MDout;
+	MDout.setName(MDleft.getName());
+	MDout.addMissingLabels(&MDleft);
+	MDout.addMissingLabels(&MDright);
+	MDout.reserve(MDleft.numberOfObjects());
+
+	for (long int r = 0; r < MDleft.numberOfObjects(); r++)
+	{
+		const long int g = index.findGroupOfRow(MDleft, r);
+		if (g < 0) continue;
+
+		for (long int i = 0; i < index.groupSize(g); i++)
+		{
+			// Left values overwrite right values in shared columns
+			MDout.addObject();
+			MDout.setValuesOfDefinedLabels(MDright.getObject(index.groupRow(g, i)));
+			MDout.setValuesOfDefinedLabels(MDleft.getObject(r));
+		}
+	}
+
+	return MDout;
+}
+
+MetaDataTable semiJoinMetaDataTables(const MetaDataTable &MDleft, const MetaDataTable &MDright, EMDLabel label, bool anti)
+{
+	if (!MDleft.containsLabel(label))
+		REPORT_ERROR("semiJoinMetaDataTables: the left table does not contain " + EMDL::label2Str(label));
+
+	MetaDataIndex index(MDright, label);
+
+	MetaDataTable MDout;
+	MDout.setName(MDleft.getName());
+	MDout.addMissingLabels(&MDleft);
+
+	for (long int r = 0; r < MDleft.numberOfObjects(); r++)
+	{
+		const bool found = (index.findGroupOfRow(MDleft, r) >= 0);
+		if (found != anti)
+			MDout.addValuesOfDefinedLabels(MDleft.getObject(r));
+	}
+
+	return MDout;
+}
@@ -0,0 +1,112 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef METADATA_INDEX_H
+#define METADATA_INDEX_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "src/metadata_table.h"
+
+/*	class MetaDataIndex:
+ *
+ *	A hash index on one column of a MetaDataTable, e.g. rlnImageName or rlnMicrographName.
+ *	It is built once in O(N) and then answers "which rows have this value" in O(1).
+ *
+ *	Rows with the same value form a group. Groups are numbered in the order of their first row,
+ *	and the rows of a group are stored in table order, so iterating over the groups gives the
+ *	same result as the usual "loop over the table and collect rows per micrograph".
+ *
+ *	Only string, integer and boolean labels can be indexed (doubles cannot be compared exactly).
+ *	The index holds row numbers, so it becomes invalid when rows are added, removed or sorted.
+ *
+ *	@code
+ *	MetaDataIndex byMic(MDparticles, EMDL_MICROGRAPH_NAME);
+ *	for (long int g = 0; g < byMic.numberOfGroups(); g++)
+ *	{
+ *		const std::string mic = byMic.getGroupKey(g);
+ *		for (long int i = 0; i < byMic.groupSize(g); i++)
+ *		{
+ *			long int row = byMic.groupRow(g, i);
+ *			...
+ *		}
+ *	}
+ *	@endcode
+ */
+class MetaDataIndex
+{
+public:
+
+	MetaDataIndex();
+	MetaDataIndex(const MetaDataTable &MDt, EMDLabel label);
+
+	void build(const MetaDataTable &MDt, EMDLabel label);
+
+	EMDLabel getLabel() const;
+	long int numberOfRows() const;
+	long int numberOfGroups() const;
+
+	// Group of a key or of a row; -1 if the key is not present
+	long int findGroup(const std::string &key) const;
+	long int findGroup(long key) const;
+	long int groupOfRow(long int row) const;
+
+	// First row with this key; -1 if the key is not present
+	long int find(const std::string &key) const;
+	long int find(long key) const;
+
+	bool contains(const std::string &key) const;
+	bool contains(long key) const;
+
+	// Rows of group g, in table order
+	long int groupSize(long int g) const;
+	long int groupRow(long int g, long int i) const;
+	std::vector<long int> getGroupRows(long int g) const;
+
+	// The value shared by all rows of group g (as the string or the integer, depending on the label)
+	std::string getGroupKey(long int g) const;
+	long getGroupIntKey(long int g) const;
+
+	// Group of row 'row' of another table, looked up by the same label; -1 if not present
+	long int findGroupOfRow(const MetaDataTable &MDother, long int row) const;
+
+private:
+
+	EMDLabel label;
+	bool is_string;
+
+	std::unordered_map<std::string, long int> stringToGroup;
+	std::unordered_map<long, long int> intToGroup;
+
+	std::vector<std::string> stringKeys;
+	std::vector<long> intKeys;
+
+	// Rows grouped by key (compressed: the rows of group g are groupRows[groupStart[g] .. groupStart[g+1]-1])
+	std::vector<long int> groupStart, groupRows, rowToGroup;
+};
+
+/* Inner join: one output row for every pair of rows (one in MDleft, one in MDright) with equal values of 'label'.
+ * The output has all columns of both tables; where both tables have a column, the value from MDleft is kept.
+ * Rows appear in the order of MDleft. */
+MetaDataTable joinMetaDataTables(const MetaDataTable &MDleft, const MetaDataTable &MDright, EMDLabel label);
+
+/* Semi-join: the rows of MDleft whose value of 'label' occurs (or, with anti = true, does not occur) in MDright.
+ * Only the columns of MDleft are kept. */
+MetaDataTable semiJoinMetaDataTables(const MetaDataTable &MDleft, const MetaDataTable &MDright, EMDLabel label, bool anti = false);
+
+#endif
@@ -0,0 +1,594 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#include "src/metadata_star_reader.h"
+#include "src/metadata_table.h"
+
+// Characters that unescape() (and hence simplify()) removes from a line
+static inline bool isDroppedChar(char c)
+{
+	return c == '\n' || c == '\v' || c == '\b' || c == '\r' || c == '\f' || c == '\a';
+}
+
+// Lines containing these need the full simplify() + nextTokenInSTAR() treatment
+static inline bool needsSlowPath(char c)
+{
+	return c == '"' || c == '\'' || c == '\v' || c == '\b' || c == '\r' || c == '\f' || c == '\a';
+}
+
+// The stream parser reads numbers with operator>>, which yields 0 for anything
+// that does not start like a number (e.g. "nan", "None"). strtod/strtol are much faster,
+// but accept more, so reject such tokens up front to give identical values.
+static inline bool looksLikeNumber(const char *s)
+{
+	if (*s == '+' || *s == '-') s++;
+	return (*s >= '0' && *s <= '9') || *s == '.';
+}
+
+/* Length of the prefix of s that operator>> takes for a double: sign, digits with
+ * at most one '.', and an exponent. Unlike strtod, this stops at the 'x' of "0x1A". */
+static inline int doublePrefixLength(const char *s)
+{
+	const char *p = s;
+	if (*p == '+' || *p == '-') p++;
+	bool seen_dot = false;
+	for (; (*p >= '0' && *p <= '9') || (*p == '.' && !seen_dot); p++)
+		if (*p == '.') seen_dot = true;
+	if (*p == 'e' || *p == 'E')
+	{
+		p++;
+		if (*p == '+' || *p == '-') p++;
+		while (*p >= '0' && *p <= '9') p++;
+	}
+	return p - s;
+}
+
+// 0 unless strtod reads all of the prefix, as operator>> fails on e.g. "1e" or "."
+static inline double parseDoubleString(char *s)
+{
+	if (!looksLikeNumber(s)) return 0.;
+
+	const int len = doublePrefixLength(s);
+	s[len] = '\0';
+	char *end;
+	const double v = strtod(s, &end);
+	return (end == s + len) ? v : 0.;
+}
+
+static inline double parseDouble(const char *ptr, int len)
+{
+	char buf[64];
+	if (len < 64)
+	{
+		memcpy(buf, ptr, len);
+		buf[len] = '\0';
+		return parseDoubleString(buf);
+	}
+
+	std::string s(ptr, len);
+	return parseDoubleString(&s[0]);
+}
+
+static inline long parseLong(const char *ptr, int len)
+{
+	char buf[64];
+	if (len < 64)
+	{
+		memcpy(buf, ptr, len);
+		buf[len] = '\0';
+		return looksLikeNumber(buf) ? strtol(buf, NULL, 10) : 0;
+	}
+
+	std::string s(ptr, len);
+	return looksLikeNumber(s.c_str()) ? strtol(s.c_str(), NULL, 10) : 0;
+}
+
+StarLoopReader::StarLoopReader()
+:	data(NULL),
+	mappedSize(0),
+	version(30000),
+	nr_threads(1)
+{
+}
+
+StarLoopReader::~StarLoopReader()
+{
+	close();
+}
+
+int StarLoopReader::getNumberOfThreads()
+{
+	char *penv = getenv("RELION_STAR_THREADS");
+	if (penv != NULL)
+	{
+		int n = atoi(penv);
+		if (n > 0) return n;
+	}
+
+	return std::min(omp_get_max_threads(), 8);
+}
+
+bool StarLoopReader::isEnabled()
+{
+	char *penv = getenv("RELION_STAR_MMAP");
+	return (penv == NULL || strcmp(penv, "0") != 0);
+}
+
+bool StarLoopReader::open(const FileName &fn_star, const std::string &name)
+{
+	close();
+
+	int fd = ::open(fn_star.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+	{
+		::close(fd);
+		return false;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+
+	if (map == MAP_FAILED)
+		return false;
+
+	data = (const char*) map;
+	mappedSize = st.st_size;
+	nr_threads = getNumberOfThreads();
+
+	madvise(map, mappedSize, MADV_WILLNEED);
+
+	size_t dataStart;
+	if (!parseHeader(name, dataStart))
+	{
+		close();
+		return false;
+	}
+
+	indexRows(dataStart);
+
+	return true;
+}
+
+void StarLoopReader::close()
+{
+	if (data != NULL)
+		munmap((void*) data, mappedSize);
+
+	data = NULL;
+	mappedSize = 0;
+	version = 30000;
+	blockName = "";
+	labels.clear();
+	labelNames.clear();
+	rowBegin.clear();
+}
+
+bool StarLoopReader::isOpen() const
+{
+	return data != NULL;
+}
+
+long int StarLoopReader::numberOfRows() const
+{
+	return rowBegin.size() > 0 ? rowBegin.size() - 1 : 0;
+}
+
+int StarLoopReader::getVersion() const
+{
+	return version;
+}
+
+const std::string& StarLoopReader::getBlockName() const
+{
+	return blockName;
+}
+
+const std::vector<EMDLabel>& StarLoopReader::getLabels() const
+{
+	return labels;
+}
+
+const std::vector<std::string>& StarLoopReader::getLabelNames() const
+{
+	return labelNames;
+}
+
+// This follows MetaDataTable::readStar and the header part of MetaDataTable::readStarLoop line by line,
+// so that both parsers agree on which block is read and on its labels.
+bool StarLoopReader::parseHeader(const std::string &name, size_t &dataStart)
+{
+	size_t pos = 0;
+	std::string line;
+
+	// Returns false at the end of the file, like getline
+	auto nextLine = [&](size_t &lineStart) -> bool
+	{
+		if (pos >= mappedSize) return false;
+
+		lineStart = pos;
+		const char *eol = (const char*) memchr(data + pos, '\n', mappedSize - pos);
+		const size_t end = (eol == NULL) ? mappedSize : eol - data;
+
+		line.assign(data + pos, end - pos);
+		pos = end + 1;
+
+		return true;
+	};
+
+	size_t lineStart;
+	version = 30000;
+
+	while (nextLine(lineStart))
+	{
+		// Let the stream parser report CR+LF files
+		if (line.size() >= 2 && line[line.size() - 1] == '\r')
+			return false;
+
+		trim(line);
+		if (line.find("# version ") != std::string::npos)
+		{
+			std::istringstream sts(line.substr(line.find("# version ") + std::string("# version ").length()));
+			sts >> version;
+		}
+
+		if (line.find("data_") == std::string::npos)
+			continue;
+
+		const std::string token = line.substr(line.find("data_") + 5);
+		if (name != "" && name != token)
+			continue;
+
+		blockName = token;
+
+		bool is_loop = false;
+		while (nextLine(lineStart))
+		{
+			if (line.find("loop_") != std::string::npos)
+			{
+				is_loop = true;
+				break;
+			}
+			else if (line[0] == '_')
+			{
+				// A list: leave it to the stream parser
+				return false;
+			}
+		}
+
+		if (!is_loop)
+			return false;
+
+		dataStart = mappedSize;
+		while (nextLine(lineStart))
+		{
+			line = simplify(line);
+			if (line[0] == '#' || line[0] == '\0' || line[0] == ';')
+				continue;
+
+			if (line[0] != '_')
+			{
+				dataStart = lineStart;
+				break;
+			}
+
+			// Only take string from "_" until "#"
+			size_t pos0 = line.find("_");
+			size_t pos1 = line.find("#");
+			std::string labelName = line.substr(pos0 + 1, pos1 - pos0 - 2);
+
+			EMDLabel label = EMDL::str2Label(labelName);
+			if (label == EMDL_UNDEFINED)
+			{
+				std::cerr << " + WARNING: will ignore (but maintain) values for the unknown label: " << labelName << std::endl;
+				label = EMDL_UNKNOWN_LABEL;
+			}
+
+			labels.push_back(label);
+			labelNames.push_back(labelName);
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+void StarLoopReader::indexRows(size_t dataStart)
+{
+	rowBegin.clear();
+	rowBegin.push_back(dataStart);
+
+	if (dataStart >= mappedSize)
+		return;
+
+	// The loop usually ends long before the end of the file (e.g. data_optics followed by data_particles),
+	// so the file is scanned in growing windows that stop at the first empty line.
+	size_t window = 1 << 16;
+	const size_t max_window = (size_t) nr_threads << 24;
+
+	size_t p = dataStart;
+	size_t checked = 0; // rows [0, checked) are known to be non-empty
+
+	while (true)
+	{
+		const size_t hi = std::min(mappedSize, p + window);
+		const size_t size = hi - p;
+		const int nr_chunks = std::max(1, (int) std::min((size_t) nr_threads, size / (1 << 20)));
+
+		// 1. Find all line starts in [p, hi), one chunk of bytes per thread
+		std::vector<std::vector<size_t> > chunkStarts(nr_chunks);
+
+		#pragma omp parallel for num_threads(nr_chunks) schedule(static, 1)
+		for (int c = 0; c < nr_chunks; c++)
+		{
+			const size_t lo = p + (size * c) / nr_chunks;
+			const size_t up = p + (size * (c + 1)) / nr_chunks;
+			std::vector<size_t> &starts = chunkStarts[c];
+			starts.reserve((up - lo) / 64 + 16);
+
+			size_t q = lo;
+			while (q < up)
+			{
+				const char *nl = (const char*) memchr(data + q, '\n', up - q);
+				if (nl == NULL) break;
+
+				const size_t next = nl - data + 1;
+				if (next < mappedSize) starts.push_back(next);
+				q = next;
+			}
+		}
+
+		for (int c = 0; c < nr_chunks; c++)
+			rowBegin.insert(rowBegin.end(), chunkStarts[c].begin(), chunkStarts[c].end());
+
+		p = hi;
+
+		// 2. The loop ends at the first line that is empty after simplify().
+		//    The last line is only complete once the end of the file is reached.
+		const long int nr_complete = (p == mappedSize) ? rowBegin.size() : rowBegin.size() - 1;
+		long int first_blank = nr_complete;
+
+		#pragma omp parallel for num_threads(nr_threads) reduction(min:first_blank) schedule(static)
+		for (long int i = checked; i < nr_complete; i++)
+		{
+			if (i >= first_blank) continue;
+
+			const size_t end = (i + 1 < rowBegin.size()) ? rowBegin[i + 1] : mappedSize;
+			bool blank = true;
+			for (size_t q = rowBegin[i]; q < end; q++)
+			{
+				const char ch = data[q];
+				if (ch != ' ' && ch != '\t' && !isDroppedChar(ch))
+				{
+					blank = false;
+					break;
+				}
+			}
+
+			if (blank) first_blank = i;
+		}
+
+		if (first_blank < nr_complete)
+		{
+			// The start of the empty line is the end of the last row
+			rowBegin.resize(first_blank + 1);
+			return;
+		}
+
+		checked = nr_complete;
+
+		if (p == mappedSize)
+		{
+			rowBegin.push_back(mappedSize);
+			return;
+		}
+
+		window = std::min(2 * window, max_window);
+	}
+}
+
+void StarLoopReader::tokenizeRow(long int r, std::vector<Token> &tokens, std::vector<std::string> &scratch) const
+{
+	tokens.clear();
+
+	const char *p = data + rowBegin[r];
+	const char *end = data + rowBegin[r + 1];
+
+	// Exclude the line break
+	if (end > p && end[-1] == '\n') end--;
+
+	bool slow = false;
+	for (const char *q = p; q < end; q++)
+	{
+		if (needsSlowPath(*q))
+		{
+			slow = true;
+			break;
+		}
+	}
+
+	if (slow)
+	{
+		std::string line = simplify(std::string(p, end - p));
+
+		scratch.clear();
+		int pos = 0;
+		std::string value;
+		while (nextTokenInSTAR(line, pos, value))
+			scratch.push_back(value);
+
+		// Only take pointers once 'scratch' no longer reallocates
+		for (int i = 0; i < scratch.size(); i++)
+		{
+			Token t = {scratch[i].data(), (int) scratch[i].size()};
+			tokens.push_back(t);
+		}
+
+		return;
+	}
+
+	while (p < end)
+	{
+		while (p < end && (*p == ' ' || *p == '\t')) p++;
+		if (p == end || *p == '#') break;
+
+		const char *start = p;
+		while (p < end && *p != ' ' && *p != '\t') p++;
+
+		Token t = {start, (int) (p - start)};
+		tokens.push_back(t);
+	}
+}
+
+long int StarLoopReader::fill(MetaDataTable &MDt, bool do_only_count) const
+{
+	MDt.clear();
+	MDt.setName(blockName);
+	MDt.setVersion(version);
+	MDt.setIsList(false);
+
+	for (int i = 0; i < labels.size(); i++)
+		MDt.addLabel(labels[i], labelNames[i]);
+
+	const long int nr_rows = numberOfRows();
+	if (do_only_count)
+		return nr_rows;
+
+	// Column types and offsets into the MetaDataContainer arrays
+	enum ColumnType {DOUBLE_COL, INT_COL, BOOL_COL, STRING_COL, VECTOR_COL, UNKNOWN_COL};
+
+	const int num_labels = MDt.activeLabels.size();
+	std::vector<ColumnType> colType(num_labels);
+	std::vector<long> colOffset(num_labels);
+
+	for (int i = 0; i < num_labels; i++)
+	{
+		const EMDLabel l = MDt.activeLabels[i];
+
+		if (l == EMDL_UNKNOWN_LABEL)
+		{
+			colType[i] = UNKNOWN_COL;
+			colOffset[i] = MDt.unknownLabelPosition2Offset[i];
+		}
+		else
+		{
+			colOffset[i] = MDt.label2offset[l];
+
+			if (EMDL::isDouble(l)) colType[i] = DOUBLE_COL;
+			else if (EMDL::isInt(l)) colType[i] = INT_COL;
+			else if (EMDL::isBool(l)) colType[i] = BOOL_COL;
+			else if (EMDL::isString(l)) colType[i] = STRING_COL;
+			else colType[i] = VECTOR_COL;
+		}
+	}
+
+	MDt.objects.resize(nr_rows);
+
+	// Exceptions cannot leave an OpenMP region: remember the first bad line instead
+	long int bad_row = -1;
+	std::string error_message;
+
+	#pragma omp parallel num_threads(nr_threads)
+	{
+		std::vector<Token> tokens;
+		std::vector<std::string> scratch;
+
+		#pragma omp for schedule(dynamic, 4096)
+		for (long int r = 0; r < nr_rows; r++)
+		{
+			MetaDataContainer *obj = new MetaDataContainer(&MDt,
+				MDt.doubleLabels, MDt.intLabels, MDt.boolLabels, MDt.stringLabels,
+				MDt.intVectorLabels, MDt.doubleVectorLabels, MDt.unknownLabels);
+			MDt.objects[r] = obj;
+
+			tokenizeRow(r, tokens, scratch);
+
+			std::string problem;
+			if (tokens.size() > num_labels)
+				problem = "A line in the STAR file contains more columns than the number of labels.";
+			else if (tokens.size() < num_labels && num_labels > 2)
+				problem = "A line in the STAR file contains fewer columns than the number of labels. Expected = " +
+				          integerToString(num_labels) + " Found = " + integerToString(tokens.size());
+
+			if (problem != "")
+			{
+				#pragma omp critical(StarLoopReader_error)
+				{
+					if (bad_row < 0 || r < bad_row)
+					{
+						bad_row = r;
+						error_message = problem;
+					}
+				}
+				continue;
+			}
+
+			for (int i = 0; i < tokens.size(); i++)
+			{
+				const Token &t = tokens[i];
+				const long off = colOffset[i];
+
+				switch (colType[i])
+				{
+					case DOUBLE_COL:
+						obj->doubles[off] = parseDouble(t.ptr, t.len);
+						break;
+					case INT_COL:
+						obj->ints[off] = parseLong(t.ptr, t.len);
+						break;
+					case BOOL_COL:
+						obj->bools[off] = (parseLong(t.ptr, t.len) != 0);
+						break;
+					case STRING_COL:
+						obj->setValue(off, std::string(t.ptr, t.len));
+						break;
+					case UNKNOWN_COL:
+						obj->unknowns[off].assign(t.ptr, t.len);
+						break;
+					case VECTOR_COL:
+						MDt.setValueFromString(MDt.activeLabels[i], std::string(t.ptr, t.len), r);
+						break;
+				}
+			}
+		}
+	}
+
+	if (bad_row >= 0)
+	{
+		const char *p = data + rowBegin[bad_row];
+		const char *end = data + rowBegin[bad_row + 1];
+		if (end > p && end[-1] == '\n') end--;
+
+		std::cerr << "Error in line: " << std::string(p, end - p) << std::endl;
+		REPORT_ERROR(error_message);
+	}
+
+	return nr_rows;
+}
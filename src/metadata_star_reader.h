@@ -0,0 +1,114 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef METADATA_STAR_READER_H
+#define METADATA_STAR_READER_H
+
+#include <string>
+#include <vector>
+#include "src/filename.h"
+#include "src/metadata_label.h"
+
+class MetaDataTable;
+
+/*	class StarLoopReader:
+ *
+ *	- memory-maps a STAR file and locates a single data block
+ *	- indexes the rows of a loop_ block in parallel chunks (one newline scan per thread)
+ *	- fill() converts every column straight into the MetaDataContainers of a MetaDataTable,
+ *	  with the rows distributed over threads.
+ *
+ *	The table keeps its usual storage: one MetaDataContainer per row, with every field parsed
+ *	on reading. There is no column storage and no lazy parsing; this class only replaces the
+ *	single-threaded stream parser of MetaDataTable::readStarLoop for large loops.
+ *
+ *	Only plain loop_ blocks are handled. open() returns false for lists, for blocks that combine
+ *	a list and a loop and for files that cannot be mapped; MetaDataTable::read then falls back
+ *	to the stream-based parser, so the set of accepted files is unchanged.
+ *
+ *	The mapped path can be disabled by setting RELION_STAR_MMAP=0, the number of threads is
+ *	taken from RELION_STAR_THREADS (default: the OpenMP maximum, capped at 8).
+ */
+class StarLoopReader
+{
+public:
+
+	StarLoopReader();
+	~StarLoopReader();
+
+	/* Map fn_star and locate data_<name> (the first data block if name is empty).
+	 * Returns true only if the block is a loop_ that can be read by this class. */
+	bool open(const FileName &fn_star, const std::string &name = "");
+
+	// Unmap the file and forget all row information
+	void close();
+
+	bool isOpen() const;
+
+	long int numberOfRows() const;
+	int getVersion() const;
+	const std::string& getBlockName() const;
+
+	// Labels in file order; unknown labels are EMDL_UNKNOWN_LABEL and keep their name in getLabelNames()
+	const std::vector<EMDLabel>& getLabels() const;
+	const std::vector<std::string>& getLabelNames() const;
+
+	/* Replace the contents of MDt by this loop.
+	 * With do_only_count, only the labels are set.
+	 * Returns the number of rows (as MetaDataTable::readStarLoop). */
+	long int fill(MetaDataTable &MDt, bool do_only_count = false) const;
+
+	// Number of threads used for indexing and parsing
+	static int getNumberOfThreads();
+
+	// False if RELION_STAR_MMAP=0
+	static bool isEnabled();
+
+private:
+
+	const char *data;
+	size_t mappedSize;
+	int version;
+	int nr_threads;
+	std::string blockName;
+
+	std::vector<EMDLabel> labels;
+	std::vector<std::string> labelNames;
+
+	// Start of each data row in 'data'; rowBegin[numberOfRows()] is the end of the last row
+	std::vector<size_t> rowBegin;
+
+	// Non-copyable: owns the mapping
+	StarLoopReader(const StarLoopReader&);
+	StarLoopReader& operator=(const StarLoopReader&);
+
+	bool parseHeader(const std::string &name, size_t &dataStart);
+	void indexRows(size_t dataStart);
+
+	struct Token
+	{
+		const char *ptr;
+		int len;
+	};
+
+	/* Split row r into tokens.
+	 * Quoted values and lines with control characters go through nextTokenInSTAR();
+	 * their tokens then point into 'scratch'. */
+	void tokenizeRow(long int r, std::vector<Token> &tokens, std::vector<std::string> &scratch) const;
+};
+
+#endif
@@ -44,6 +44,9 @@
 
 #include "src/metadata_table.h"
 #include "src/metadata_label.h"
+#include "src/metadata_star_reader.h"
+#include "src/metadata_table_cache.h"
+#include "src/metadata_index.h"
 
 MetaDataTable::MetaDataTable()
 :	objects(0),
@@ -1345,16 +1348,45 @@ long int MetaDataTable::read(const FileName &filename, const std::string &name,
 	// Check for an :star extension
 	FileName fn_read = filename.removeFileFormat();
 
-	std::ifstream in(fn_read.data(), std::ios_base::in);
+	const bool use_cache = !do_only_count && StarBinaryCache::isEnabled();
 
-	if (in.fail())
+	// A valid binary sidecar spares parsing the text altogether
+	if (use_cache && StarBinaryCache::read(fn_read, name, *this))
 	{
-		REPORT_ERROR( (std::string) "MetaDataTable::read: File " + fn_read + " does not exist" );
+		firstObject();
+		return objects.size();
 	}
 
-	const long int ret = readStar(in, name, do_only_count);
+	long int ret;
+	bool parsed = false;
 
-	in.close();
+	// Large loops are mapped and parsed in parallel; anything else goes through the stream parser
+	if (StarLoopReader::isEnabled())
+	{
+		StarLoopReader reader;
+		if (reader.open(fn_read, name))
+		{
+			ret = reader.fill(*this, do_only_count);
+			parsed = true;
+		}
+	}
+
+	if (!parsed)
+	{
+		std::ifstream in(fn_read.data(), std::ios_base::in);
+
+		if (in.fail())
+		{
+			REPORT_ERROR( (std::string) "MetaDataTable::read: File " + fn_read + " does not exist" );
+		}
+
+		ret = readStar(in, name, do_only_count);
+
+		in.close();
+	}
+
+	if (use_cache && !isList && objects.size() >= StarBinaryCache::getMinimumRows())
+		StarBinaryCache::store(fn_read, *this);
 
 	// Go to the first object
 	firstObject();
@@ -1362,6 +1394,182 @@ long int MetaDataTable::read(const FileName &filename, const std::string &name,
 	return ret;
 }
 
+// Fast equivalents of the snprintf calls in getValueToString, used when writing large tables.
+// They produce exactly the same characters (including the truncation to 12 characters)
+// and fall back to snprintf whenever that cannot be guaranteed.
+static int formatDoubleForSTAR(double v, char *buffer)
+{
+	const double a = ABS(v);
+
+	if ((a > 0. && a < 0.001) || a > 100000.)
+	{
+		snprintf(buffer, 13, (v < 0.) ? "%12.5e" : "%12.6e", v);
+		return strlen(buffer);
+	}
+
+	// NaN and negative zero
+	if (!(a <= 100000.) || (v == 0. && std::signbit(v)))
+	{
+		snprintf(buffer, 13, (v < 0.) ? "%12.5f" : "%12.6f", v);
+		return strlen(buffer);
+	}
+
+	const bool negative = (v < 0.);
+	const int decimals = negative ? 5 : 6;
+	const long long scale = negative ? 100000LL : 1000000LL;
+
+	// a * scale <= 1e11, so its rounding error is far below 1e-3:
+	// unless the fraction is close to one half, rounding it gives the same digits as printf.
+	const double scaled = a * scale;
+	const double fl = floor(scaled);
+	const double frac = scaled - fl;
+
+	if (ABS(frac - 0.5) < 1e-3)
+	{
+		snprintf(buffer, 13, negative ? "%12.5f" : "%12.6f", v);
+		return strlen(buffer);
+	}
+
+	long long n = (long long) fl + ((frac > 0.5) ? 1 : 0);
+
+	// Digits in reverse order
+	char digits[32];
+	int len = 0;
+	for (int i = 0; i < decimals; i++)
+	{
+		digits[len++] = '0' + n % 10;
+		n /= 10;
+	}
+	digits[len++] = '.';
+	do
+	{
+		digits[len++] = '0' + n % 10;
+		n /= 10;
+	}
+	while (n > 0);
+	if (negative) digits[len++] = '-';
+
+	// Right-align in 12 characters; longer results are cut after 12, as by snprintf(buffer, 13, ...)
+	int pos = 0;
+	for (; pos < 12 - len; pos++) buffer[pos] = ' ';
+	for (int i = len - 1; i >= 0 && pos < 12; i--) buffer[pos++] = digits[i];
+	buffer[pos] = '\0';
+
+	return pos;
+}
+
+static int formatIntForSTAR(long v, char *buffer)
+{
+	char digits[32];
+	int len = 0;
+	unsigned long u = (v < 0) ? -(unsigned long) v : v;
+	do
+	{
+		digits[len++] = '0' + u % 10;
+		u /= 10;
+	}
+	while (u > 0);
+	if (v < 0) digits[len++] = '-';
+
+	int pos = 0;
+	for (; pos < 12 - len; pos++) buffer[pos] = ' ';
+	for (int i = len - 1; i >= 0 && pos < 12; i--) buffer[pos++] = digits[i];
+	buffer[pos] = '\0';
+
+	return pos;
+}
+
+// As "out << std::setw(10) << value << ' '"
+static inline void appendSTARValue(std::string &out, const char *value, int len)
+{
+	if (len < 10) out.append(10 - len, ' ');
+	out.append(value, len);
+	out += ' ';
+}
+
+static inline void appendSTARString(std::string &out, const std::string &value)
+{
+	// Only strings that escapeStringForSTAR would change need a copy
+	if (value.empty() || value[0] == '"' || value[0] == '\'' || value.find_first_of(" \t") != std::string::npos)
+	{
+		std::string escaped = value;
+		escapeStringForSTAR(escaped);
+		appendSTARValue(out, escaped.data(), escaped.size());
+	}
+	else
+	{
+		appendSTARValue(out, value.data(), value.size());
+	}
+}
+
+void MetaDataTable::writeStarLoopRows(long int begin, long int end, std::string &out) const
+{
+	char buffer[16];
+
+	out.clear();
+	out.reserve((end - begin) * activeLabels.size() * 14);
+
+	for (long int idx = begin; idx < end; idx++)
+	{
+		const MetaDataContainer *obj = objects[idx];
+		std::string entryComment = "";
+
+		for (long i = 0; i < activeLabels.size(); i++)
+		{
+			const EMDLabel l = activeLabels[i];
+
+			if (l == EMDL_UNKNOWN_LABEL)
+			{
+				appendSTARString(out, obj->unknowns[unknownLabelPosition2Offset[i]]);
+			}
+			else if (l == EMDL_COMMENT)
+			{
+				getValue(EMDL_COMMENT, entryComment, idx);
+			}
+			else if (l != EMDL_SORTED_IDX)
+			{
+				const long off = label2offset[l];
+
+				if (EMDL::isDouble(l))
+				{
+					appendSTARValue(out, buffer, formatDoubleForSTAR(obj->doubles[off], buffer));
+				}
+				else if (EMDL::isInt(l))
+				{
+					appendSTARValue(out, buffer, formatIntForSTAR(obj->ints[off], buffer));
+				}
+				else if (EMDL::isBool(l))
+				{
+					appendSTARValue(out, buffer, formatIntForSTAR(obj->bools[off] ? 1 : 0, buffer));
+				}
+				else if (EMDL::isString(l))
+				{
+					// An empty string is stored as "" (see MetaDataContainer::setValue), which is also how it is written
+					const std::string &val = obj->strings[off];
+					if (val == "\"\"")
+						appendSTARValue(out, val.data(), val.size());
+					else
+						appendSTARString(out, val);
+				}
+				else
+				{
+					std::string val;
+					getValueToString(l, val, idx, true); // escape=true
+					appendSTARValue(out, val.data(), val.size());
+				}
+			}
+		}
+
+		if (entryComment != std::string(""))
+		{
+			out += "# ";
+			out += entryComment;
+		}
+
+		out += '\n';
+	}
+}
+
 void MetaDataTable::write(std::ostream& out) const
 {
 	// Only write tables that have something in them
@@ -1405,61 +1613,51 @@ void MetaDataTable::write(std::ostream& out) const
 		}
 
 		// Write actual data block
-        //SHWS 31jul2024: writing of large STAR files on our ceph file system was very slow.
-        //SHWS 31jul2024: writing big data blocks (10,000 lines) in one go is much, much faster
-        std::ostringstream dataBlockStream;
-		for (long int idx = 0; idx < objects.size(); idx++)
-		{
-			std::string entryComment = "";
-
-            for (long i = 0; i < activeLabels.size(); i++)
+		//SHWS 31jul2024: writing of large STAR files on our ceph file system was very slow.
+		//SHWS 31jul2024: writing big data blocks (10,000 lines) in one go is much, much faster
+		// Blocks of rows are now formatted on several threads, while the previous blocks are being written.
+		const long int rows_per_block = 10000;
+		const long int nr_blocks = (objects.size() + rows_per_block - 1) / rows_per_block;
+		const int nr_threads = std::max(1L, std::min((long int) StarLoopReader::getNumberOfThreads(), nr_blocks));
+
+		// Two sets of buffers: one is being formatted while the other one is being written
+		std::vector<std::string> buffers[2];
+		buffers[0].resize(nr_threads);
+		buffers[1].resize(nr_threads);
+
+		#pragma omp parallel num_threads(nr_threads + 1)
+		#pragma omp single
+		{
+			for (long int first = 0, batch = 0; first < nr_blocks + nr_threads; first += nr_threads, batch++)
 			{
-				EMDLabel l = activeLabels[i];
+				std::vector<std::string> &current = buffers[batch % 2];
+				std::vector<std::string> &previous = buffers[(batch + 1) % 2];
 
-				if (l == EMDL_UNKNOWN_LABEL)
-				{
-					std::string token, val;
-					long offset = unknownLabelPosition2Offset[i];
-					val = objects[idx]->unknowns[offset];
-					escapeStringForSTAR(val);
-					dataBlockStream << std::setw(10) << val << " ";
-                    //out.width(10);
-                    //out << val << " ";
-				}
-				else if (l != EMDL_COMMENT && l != EMDL_SORTED_IDX)
+				if (batch > 0)
 				{
-					std::string val;
-					getValueToString(l, val, idx, true); // escape=true
-					dataBlockStream << std::setw(10) << val << " ";
-                    //out.width(10);
-                    //out << val << " ";
+					#pragma omp task shared(previous, out)
+					for (int j = 0; j < previous.size(); j++)
+					{
+						out << previous[j];
+						previous[j].clear();
+					}
 				}
-				if (l == EMDL_COMMENT)
+
+				for (int j = 0; j < nr_threads && first + j < nr_blocks; j++)
 				{
-					getValue(EMDL_COMMENT, entryComment, idx);
-				}
-			}
-			if (entryComment != std::string(""))
-			{
-				dataBlockStream << "# " << entryComment;
-                //out << "# " << entryComment;
-			}
-            dataBlockStream << "\n";
-			//out << "\n";
+					const long int begin = (first + j) * rows_per_block;
+					const long int end = std::min(begin + rows_per_block, (long int) objects.size());
 
-            if ((idx+1)%100000 == 0)
-            {
-                out << dataBlockStream.str();
-                dataBlockStream.str("");
-                dataBlockStream.clear();
-            }
+					#pragma omp task shared(current)
+					writeStarLoopRows(begin, end, current[j]);
+				}
 
+				#pragma omp taskwait
+			}
 		}
-		// Finish table with a white-line
-        dataBlockStream << " \n";
-        //out << " \n";
-        out << dataBlockStream.str();
 
+		// Finish table with a white-line
+		out << " \n";
 	}
 	else // isList
 	{
@@ -1527,6 +1725,8 @@ void MetaDataTable::write(const FileName &fn_out) const
 //	fh << "# RELION; version " << g_RELION_VERSION << std::endl;
 	write(fh);
 	fh.close();
+	// A binary sidecar of the old file would be rejected anyway, but there is no point in keeping it
+	StarBinaryCache::invalidate(fn_out);
 	// Rename to prevent errors with programs in pipeliner reading in incomplete STAR files
 	std::rename(fn_tmp.c_str(), fn_out.c_str());
 
@@ -1826,12 +2026,42 @@ void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
     MDonly1.setName(MD1.getName());
     MDonly2.setName(MD1.getName());
 
+	// Exact matches on strings or integers: look the rows of MD1 up in a hash index on MD2
+	// instead of scanning MD2 for each of them. The first matching row of MD2 is used, as below.
+	if (EMDL::isString(label1) || (EMDL::isInt(label1) && ROUND(eps) == 0))
+	{
+		MetaDataIndex index2(MD2, label1);
+		std::vector<bool> in_both2(MD2.numberOfObjects(), false);
+
+		for (long int current_object1 = 0; current_object1 < MD1.numberOfObjects(); current_object1++)
+		{
+			const long int group2 = index2.findGroupOfRow(MD1, current_object1);
+			if (group2 >= 0)
+			{
+				in_both2[index2.groupRow(group2, 0)] = true;
+				MDboth.addObject(MD1.getObject(current_object1));
+			}
+			else
+			{
+				MDonly1.addObject(MD1.getObject(current_object1));
+			}
+		}
+
+		for (long int current_object2 = 0; current_object2 < MD2.numberOfObjects(); current_object2++)
+		{
+			if (!in_both2[current_object2])
+				MDonly2.addObject(MD2.getObject(current_object2));
+		}
+
+		return;
+	}
+
 	std::string mystr1, mystr2;
 	long int myint1, myint2;
 	double myd1, myd2, mydy1 = 0., mydy2 = 0., mydz1 = 0., mydz2 = 0.;
 
 	// loop over MD1
-	std::vector<long int> to_remove_from_only2;
+	std::vector<bool> to_remove_from_only2(MD2.numberOfObjects(), false);
 	for (long int current_object1 = MD1.firstObject();
 				  current_object1 != MetaDataTable::NO_MORE_OBJECTS && current_object1 != MetaDataTable::NO_OBJECTS_STORED;
 				  current_object1 = MD1.nextObject())
@@ -1863,7 +2093,7 @@ void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
 				if (strcmp(mystr1.c_str(), mystr2.c_str()) == 0)
 				{
 					have_in_2 = true;
-					to_remove_from_only2.push_back(current_object2);
+					to_remove_from_only2[current_object2] = true;
 					MDboth.addObject(MD1.getObject());
 					break;
 				}
@@ -1874,7 +2104,7 @@ void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
 				if ( ABS(myint2 - myint1) <= ROUND(eps) )
 				{
 					have_in_2 = true;
-					to_remove_from_only2.push_back(current_object2);
+					to_remove_from_only2[current_object2] = true;
 					MDboth.addObject(MD1.getObject());
 					break;
 				}
@@ -1893,7 +2123,7 @@ void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
 				if ( ABS(dist) <= eps )
 				{
 					have_in_2 = true;
-					to_remove_from_only2.push_back(current_object2);
+					to_remove_from_only2[current_object2] = true;
 					//std::cerr << " current_object1= " << current_object1 << std::endl;
 					//std::cerr << " myd1= " << myd1 << " myd2= " << myd2 << " mydy1= " << mydy1 << " mydy2= " << mydy2 << " dist= "<<dist<<std::endl;
 					//std::cerr << " to be removed current_object2= " << current_object2 << std::endl;
@@ -1913,17 +2143,7 @@ void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
 				current_object2 != MetaDataTable::NO_MORE_OBJECTS && current_object2 != MetaDataTable::NO_OBJECTS_STORED;
 				current_object2 = MD2.nextObject())
 	{
-
-		bool to_be_removed = false;
-		for (long int i = 0; i < to_remove_from_only2.size(); i++)
-		{
-			if (to_remove_from_only2[i] == current_object2)
-			{
-				to_be_removed = true;
-				break;
-			}
-		}
-		if (!to_be_removed)
+		if (!to_remove_from_only2[current_object2])
 		{
 			//std::cerr << " doNOT remove current_object2= " << current_object2 << std::endl;
 			MDonly2.addObject(MD2.getObject(current_object2));
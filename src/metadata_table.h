@@ -99,6 +99,10 @@
  */
 class MetaDataTable
 {
+	// The memory-mapped STAR reader and the binary cache fill the containers directly
+	friend class StarLoopReader;
+	friend class StarBinaryCache;
+
 	// Effectively stores all metadata
 	std::vector<MetaDataContainer*> objects;
 
@@ -374,6 +378,9 @@ private:
 	 *  Same as setObject, but assumes that all labels are present. */
 	void setObjectUnsafe(MetaDataContainer* data, long objId);
 
+	// Format rows [begin, end) of a loop in STAR format into out
+	void writeStarLoopRows(long int begin, long int end, std::string &out) const;
+
 };
 
 void compareMetaDataTable(MetaDataTable &MD1, MetaDataTable &MD2,
@@ -0,0 +1,663 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <omp.h>
+
+#include "src/metadata_table_cache.h"
+#include "src/metadata_star_reader.h"
+#include "src/metadata_table.h"
+
+static const char CACHE_MAGIC[8] = {'R', 'L', 'N', 'M', 'D', 'T', 'B', '\0'};
+static const uint32_t CACHE_FORMAT_VERSION = 1;
+static const size_t CACHE_HASH_BYTES = 1 << 16;
+
+// Column types as stored in the sidecar
+static const char COL_DOUBLE = 'd';
+static const char COL_INT = 'i';
+static const char COL_BOOL = 'b';
+static const char COL_STRING = 's';
+static const char COL_INT_VECTOR = 'I';
+static const char COL_DOUBLE_VECTOR = 'D';
+static const char COL_UNKNOWN = 'u';
+
+static char columnType(EMDLabel label)
+{
+	if (label == EMDL_UNKNOWN_LABEL) return COL_UNKNOWN;
+	if (EMDL::isDouble(label)) return COL_DOUBLE;
+	if (EMDL::isInt(label)) return COL_INT;
+	if (EMDL::isBool(label)) return COL_BOOL;
+	if (EMDL::isString(label)) return COL_STRING;
+	if (EMDL::isIntVector(label)) return COL_INT_VECTOR;
+	return COL_DOUBLE_VECTOR;
+}
+
+// Little helpers for writing and reading the binary stream
+
+template <typename T>
+static void put(std::ostream &out, const T &value)
+{
+	out.write((const char*) &value, sizeof(T));
+}
+
+static void putString(std::ostream &out, const std::string &s)
+{
+	put(out, (uint32_t) s.size());
+	out.write(s.data(), s.size());
+}
+
+class CacheCursor
+{
+public:
+
+	CacheCursor(const char *ptr, const char *end) : ptr(ptr), end(end) {}
+
+	const char *ptr, *end;
+
+	bool has(size_t n) const
+	{
+		return ptr + n <= end;
+	}
+
+	template <typename T>
+	bool get(T &value)
+	{
+		if (!has(sizeof(T))) return false;
+		memcpy(&value, ptr, sizeof(T));
+		ptr += sizeof(T);
+		return true;
+	}
+
+	bool getString(std::string &s)
+	{
+		uint32_t len;
+		if (!get(len) || !has(len)) return false;
+		s.assign(ptr, len);
+		ptr += len;
+		return true;
+	}
+
+	bool skip(size_t n)
+	{
+		if (!has(n)) return false;
+		ptr += n;
+		return true;
+	}
+};
+
+bool StarBinaryCache::Stamp::operator == (const Stamp &s) const
+{
+	return size == s.size && mtime_sec == s.mtime_sec && mtime_nsec == s.mtime_nsec && hash == s.hash;
+}
+
+FileName StarBinaryCache::getCacheName(const FileName &fn_star)
+{
+	return fn_star + ".bin";
+}
+
+bool StarBinaryCache::isEnabled()
+{
+	char *penv = getenv("RELION_STAR_CACHE");
+	return (penv != NULL && strcmp(penv, "1") == 0);
+}
+
+long int StarBinaryCache::getMinimumRows()
+{
+	char *penv = getenv("RELION_STAR_CACHE_MIN_ROWS");
+	return (penv != NULL) ? atol(penv) : 10000;
+}
+
+bool StarBinaryCache::getStamp(const FileName &fn, Stamp &stamp)
+{
+	int fd = ::open(fn.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		::close(fd);
+		return false;
+	}
+
+	stamp.size = st.st_size;
+	stamp.mtime_sec = st.st_mtim.tv_sec;
+	stamp.mtime_nsec = st.st_mtim.tv_nsec;
+
+	// FNV-1a over the head and the tail of the file
+	std::vector<char> buffer(CACHE_HASH_BYTES);
+	unsigned long long hash = 14695981039346656037ULL;
+	const off_t offsets[2] = {0, (off_t) (stamp.size > CACHE_HASH_BYTES ? stamp.size - CACHE_HASH_BYTES : 0)};
+
+	for (int i = 0; i < 2; i++)
+	{
+		ssize_t n = pread(fd, &buffer[0], CACHE_HASH_BYTES, offsets[i]);
+		for (ssize_t j = 0; j < n; j++)
+		{
+			hash ^= (unsigned char) buffer[j];
+			hash *= 1099511628211ULL;
+		}
+	}
+
+	::close(fd);
+	stamp.hash = hash;
+
+	return true;
+}
+
+// Same rules as MetaDataTable::readStar
+bool StarBinaryCache::getFirstBlockName(const FileName &fn_star, std::string &name)
+{
+	std::ifstream in(fn_star.c_str(), std::ios_base::in);
+	std::string line;
+
+	while (getline(in, line, '\n'))
+	{
+		trim(line);
+		if (line.find("data_") != std::string::npos)
+		{
+			name = line.substr(line.find("data_") + 5);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void StarBinaryCache::serialise(const MetaDataTable &MDt, std::string &out)
+{
+	std::ostringstream sts(std::ios_base::out | std::ios_base::binary);
+
+	const uint64_t nr_rows = MDt.objects.size();
+	const uint32_t nr_cols = MDt.activeLabels.size();
+
+	put(sts, (int32_t) MDt.version);
+	putString(sts, MDt.comment);
+	put(sts, nr_rows);
+	put(sts, nr_cols);
+
+	for (uint32_t i = 0; i < nr_cols; i++)
+	{
+		const EMDLabel l = MDt.activeLabels[i];
+		putString(sts, (l == EMDL_UNKNOWN_LABEL) ? MDt.getUnknownLabelNameAt(i) : EMDL::label2Str(l));
+		put(sts, columnType(l));
+	}
+
+	for (uint32_t i = 0; i < nr_cols; i++)
+	{
+		const EMDLabel l = MDt.activeLabels[i];
+		const char type = columnType(l);
+		const long off = (l == EMDL_UNKNOWN_LABEL) ? MDt.unknownLabelPosition2Offset[i] : MDt.label2offset[l];
+
+		switch (type)
+		{
+			case COL_DOUBLE:
+			{
+				std::vector<double> column(nr_rows);
+				for (uint64_t r = 0; r < nr_rows; r++) column[r] = MDt.objects[r]->doubles[off];
+				sts.write((const char*) column.data(), nr_rows * sizeof(double));
+				break;
+			}
+			case COL_INT:
+			{
+				std::vector<int64_t> column(nr_rows);
+				for (uint64_t r = 0; r < nr_rows; r++) column[r] = MDt.objects[r]->ints[off];
+				sts.write((const char*) column.data(), nr_rows * sizeof(int64_t));
+				break;
+			}
+			case COL_BOOL:
+			{
+				std::vector<char> column(nr_rows);
+				for (uint64_t r = 0; r < nr_rows; r++) column[r] = MDt.objects[r]->bools[off];
+				sts.write(column.data(), nr_rows);
+				break;
+			}
+			case COL_STRING:
+			case COL_UNKNOWN:
+			{
+				// Offsets into one block of characters
+				std::vector<uint64_t> offsets(nr_rows + 1, 0);
+				for (uint64_t r = 0; r < nr_rows; r++)
+				{
+					const std::string &s = (type == COL_STRING) ? MDt.objects[r]->strings[off] : MDt.objects[r]->unknowns[off];
+					offsets[r + 1] = offsets[r] + s.size();
+				}
+				sts.write((const char*) offsets.data(), (nr_rows + 1) * sizeof(uint64_t));
+
+				for (uint64_t r = 0; r < nr_rows; r++)
+				{
+					const std::string &s = (type == COL_STRING) ? MDt.objects[r]->strings[off] : MDt.objects[r]->unknowns[off];
+					sts.write(s.data(), s.size());
+				}
+				break;
+			}
+			case COL_INT_VECTOR:
+			{
+				for (uint64_t r = 0; r < nr_rows; r++)
+				{
+					const std::vector<int> &v = MDt.objects[r]->intVectors[off];
+					put(sts, (uint32_t) v.size());
+					for (int j = 0; j < v.size(); j++) put(sts, (int32_t) v[j]);
+				}
+				break;
+			}
+			case COL_DOUBLE_VECTOR:
+			{
+				for (uint64_t r = 0; r < nr_rows; r++)
+				{
+					const std::vector<double> &v = MDt.objects[r]->doubleVectors[off];
+					put(sts, (uint32_t) v.size());
+					if (v.size() > 0) sts.write((const char*) v.data(), v.size() * sizeof(double));
+				}
+				break;
+			}
+		}
+	}
+
+	out = sts.str();
+}
+
+bool StarBinaryCache::deserialise(const char *ptr, const char *end, MetaDataTable &MDt)
+{
+	CacheCursor cur(ptr, end);
+
+	int32_t version;
+	std::string comment;
+	uint64_t nr_rows;
+	uint32_t nr_cols;
+
+	if (!cur.get(version) || !cur.getString(comment) || !cur.get(nr_rows) || !cur.get(nr_cols))
+		return false;
+
+	std::vector<char> types(nr_cols);
+
+	for (uint32_t i = 0; i < nr_cols; i++)
+	{
+		std::string labelName;
+		if (!cur.getString(labelName) || !cur.get(types[i]))
+			return false;
+
+		EMDLabel label = EMDL::str2Label(labelName);
+		if (label == EMDL_UNDEFINED) label = EMDL_UNKNOWN_LABEL;
+
+		// The meaning of a label has changed since the cache was written
+		if (columnType(label) != types[i])
+			return false;
+
+		if (label == EMDL_UNKNOWN_LABEL)
+			std::cerr << " + WARNING: will ignore (but maintain) values for the unknown label: " << labelName << std::endl;
+
+		MDt.addLabel(label, labelName);
+	}
+
+	// Duplicated labels would shift all columns
+	if (MDt.activeLabels.size() != nr_cols)
+		return false;
+
+	MDt.setVersion(version);
+	MDt.setComment(comment);
+	MDt.setIsList(false);
+
+	// Find the start of every column first, so that the columns can then be filled in parallel over rows
+	std::vector<const char*> colStart(nr_cols);
+	for (uint32_t i = 0; i < nr_cols; i++)
+	{
+		colStart[i] = cur.ptr;
+
+		switch (types[i])
+		{
+			case COL_DOUBLE:
+			case COL_INT:
+				if (!cur.skip(nr_rows * 8)) return false;
+				break;
+			case COL_BOOL:
+				if (!cur.skip(nr_rows)) return false;
+				break;
+			case COL_STRING:
+			case COL_UNKNOWN:
+			{
+				uint64_t total;
+				if (!cur.has((nr_rows + 1) * sizeof(uint64_t))) return false;
+				memcpy(&total, cur.ptr + nr_rows * sizeof(uint64_t), sizeof(uint64_t));
+				if (!cur.skip((nr_rows + 1) * sizeof(uint64_t) + total)) return false;
+				break;
+			}
+			case COL_INT_VECTOR:
+			case COL_DOUBLE_VECTOR:
+			{
+				const size_t item = (types[i] == COL_INT_VECTOR) ? sizeof(int32_t) : sizeof(double);
+				for (uint64_t r = 0; r < nr_rows; r++)
+				{
+					uint32_t n;
+					if (!cur.get(n) || !cur.skip(n * item)) return false;
+				}
+				break;
+			}
+			default:
+				return false;
+		}
+	}
+
+	MDt.objects.resize(nr_rows);
+
+	#pragma omp parallel for num_threads(StarLoopReader::getNumberOfThreads()) schedule(static)
+	for (long int r = 0; r < (long int) nr_rows; r++)
+	{
+		MDt.objects[r] = new MetaDataContainer(&MDt,
+			MDt.doubleLabels, MDt.intLabels, MDt.boolLabels, MDt.stringLabels,
+			MDt.intVectorLabels, MDt.doubleVectorLabels, MDt.unknownLabels);
+	}
+
+	for (uint32_t i = 0; i < nr_cols; i++)
+	{
+		const EMDLabel l = MDt.activeLabels[i];
+		const long off = (l == EMDL_UNKNOWN_LABEL) ? MDt.unknownLabelPosition2Offset[i] : MDt.label2offset[l];
+		const char *col = colStart[i];
+
+		if (types[i] == COL_INT_VECTOR || types[i] == COL_DOUBLE_VECTOR)
+		{
+			// Variable-length rows: sequential
+			CacheCursor vcur(col, end);
+			for (uint64_t r = 0; r < nr_rows; r++)
+			{
+				uint32_t n;
+				vcur.get(n);
+				if (types[i] == COL_INT_VECTOR)
+				{
+					std::vector<int> &v = MDt.objects[r]->intVectors[off];
+					v.resize(n);
+					for (uint32_t j = 0; j < n; j++)
+					{
+						int32_t x;
+						vcur.get(x);
+						v[j] = x;
+					}
+				}
+				else
+				{
+					std::vector<double> &v = MDt.objects[r]->doubleVectors[off];
+					v.resize(n);
+					if (n > 0) memcpy(v.data(), vcur.ptr, n * sizeof(double));
+					vcur.skip(n * sizeof(double));
+				}
+			}
+			continue;
+		}
+
+		#pragma omp parallel for num_threads(StarLoopReader::getNumberOfThreads()) schedule(static)
+		for (long int r = 0; r < (long int) nr_rows; r++)
+		{
+			MetaDataContainer *obj = MDt.objects[r];
+
+			switch (types[i])
+			{
+				case COL_DOUBLE:
+					memcpy(&obj->doubles[off], col + r * sizeof(double), sizeof(double));
+					break;
+				case COL_INT:
+				{
+					int64_t x;
+					memcpy(&x, col + r * sizeof(int64_t), sizeof(int64_t));
+					obj->ints[off] = x;
+					break;
+				}
+				case COL_BOOL:
+					obj->bools[off] = (col[r] != 0);
+					break;
+				case COL_STRING:
+				case COL_UNKNOWN:
+				{
+					uint64_t o[2];
+					memcpy(o, col + r * sizeof(uint64_t), 2 * sizeof(uint64_t));
+					const char *chars = col + (nr_rows + 1) * sizeof(uint64_t);
+					std::string &s = (types[i] == COL_STRING) ? obj->strings[off] : obj->unknowns[off];
+					s.assign(chars + o[0], o[1] - o[0]);
+					break;
+				}
+			}
+		}
+	}
+
+	return true;
+}
+
+bool StarBinaryCache::read(const FileName &fn_star, const std::string &name, MetaDataTable &MDt)
+{
+	const FileName fn_cache = getCacheName(fn_star);
+
+	Stamp starStamp;
+	if (!getStamp(fn_star, starStamp))
+		return false;
+
+	int fd = ::open(fn_cache.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0 ||
+	    st.st_mtim.tv_sec < starStamp.mtime_sec ||
+	    (st.st_mtim.tv_sec == starStamp.mtime_sec && st.st_mtim.tv_nsec < starStamp.mtime_nsec))
+	{
+		::close(fd);
+		return false;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+		return false;
+
+	const char *begin = (const char*) map;
+	CacheCursor cur(begin, begin + st.st_size);
+
+	bool success = false;
+	char magic[8];
+	uint32_t format, nr_blocks;
+	Stamp cacheStamp;
+	std::string firstBlock;
+
+	if (cur.get(magic) && memcmp(magic, CACHE_MAGIC, 8) == 0 &&
+	    cur.get(format) && format == CACHE_FORMAT_VERSION &&
+	    cur.get(cacheStamp.size) && cur.get(cacheStamp.mtime_sec) &&
+	    cur.get(cacheStamp.mtime_nsec) && cur.get(cacheStamp.hash) &&
+	    cacheStamp == starStamp &&
+	    cur.getString(firstBlock) && cur.get(nr_blocks))
+	{
+		const std::string target = (name == "") ? firstBlock : name;
+
+		for (uint32_t b = 0; b < nr_blocks; b++)
+		{
+			std::string blockName;
+			uint64_t length;
+			if (!cur.getString(blockName) || !cur.get(length) || !cur.has(length))
+				break;
+
+			if (blockName == target)
+			{
+				MDt.clear();
+				MDt.setName(blockName);
+				success = deserialise(cur.ptr, cur.ptr + length, MDt);
+				if (!success) MDt.clear();
+				break;
+			}
+
+			cur.skip(length);
+		}
+	}
+
+	munmap(map, st.st_size);
+
+	return success;
+}
+
+// Exclusive lock on <sidecar>.lock, held while a sidecar is read, extended and replaced.
+// fcntl locks only exclude other processes (e.g. MPI ranks reading different blocks of one STAR file),
+// so threads of this process are serialised by a mutex as well.
+class SidecarLock
+{
+public:
+
+	SidecarLock(const FileName &fn_cache)
+	:	guard(getMutex()),
+		fd(open((fn_cache + ".lock").c_str(), O_RDWR | O_CREAT, 0666)),
+		is_locked(false)
+	{
+		if (fd < 0)
+			return;
+
+		struct flock fl;
+		fl.l_type   = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start  = 0;
+		fl.l_len    = 0;
+		fl.l_pid    = getpid();
+		is_locked = (fcntl(fd, F_SETLKW, &fl) == 0);
+	}
+
+	~SidecarLock()
+	{
+		// Closing the file releases the lock
+		if (fd >= 0)
+			close(fd);
+	}
+
+	bool isLocked() const
+	{
+		return is_locked;
+	}
+
+private:
+
+	std::lock_guard<std::mutex> guard;
+	int fd;
+	bool is_locked;
+
+	static std::mutex &getMutex()
+	{
+		static std::mutex mutex;
+		return mutex;
+	}
+};
+
+void StarBinaryCache::store(const FileName &fn_star, const MetaDataTable &MDt)
+{
+	const FileName fn_cache = getCacheName(fn_star);
+
+	Stamp stamp;
+	std::string firstBlock;
+	if (!getStamp(fn_star, stamp) || !getFirstBlockName(fn_star, firstBlock))
+		return;
+
+	// Without the lock, two processes could each add their block to the same old sidecar, and one of the blocks would be lost
+	SidecarLock lock(fn_cache);
+	if (!lock.isLocked())
+		return;
+
+	// Keep the other blocks of a still valid sidecar
+	std::vector<std::string> oldNames, oldBlocks;
+	{
+		std::ifstream in(fn_cache.c_str(), std::ios_base::in | std::ios_base::binary);
+		if (in.good())
+		{
+			std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+			CacheCursor cur(contents.data(), contents.data() + contents.size());
+
+			char magic[8];
+			uint32_t format, nr_blocks;
+			Stamp cacheStamp;
+			std::string first;
+
+			if (cur.get(magic) && memcmp(magic, CACHE_MAGIC, 8) == 0 &&
+			    cur.get(format) && format == CACHE_FORMAT_VERSION &&
+			    cur.get(cacheStamp.size) && cur.get(cacheStamp.mtime_sec) &&
+			    cur.get(cacheStamp.mtime_nsec) && cur.get(cacheStamp.hash) &&
+			    cacheStamp == stamp &&
+			    cur.getString(first) && cur.get(nr_blocks))
+			{
+				for (uint32_t b = 0; b < nr_blocks; b++)
+				{
+					std::string blockName;
+					uint64_t length;
+					if (!cur.getString(blockName) || !cur.get(length) || !cur.has(length))
+						break;
+
+					if (blockName != MDt.getName())
+					{
+						oldNames.push_back(blockName);
+						oldBlocks.push_back(std::string(cur.ptr, length));
+					}
+
+					cur.skip(length);
+				}
+			}
+		}
+	}
+
+	std::string block;
+	serialise(MDt, block);
+
+	// Write to a temporary file and rename, so that concurrent readers never see half a sidecar
+	const FileName fn_tmp = fn_cache + ".tmp" + integerToString(getpid());
+	{
+		std::ofstream out(fn_tmp.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+		if (!out.good())
+			return;
+
+		out.write(CACHE_MAGIC, 8);
+		put(out, CACHE_FORMAT_VERSION);
+		put(out, stamp.size);
+		put(out, stamp.mtime_sec);
+		put(out, stamp.mtime_nsec);
+		put(out, stamp.hash);
+		putString(out, firstBlock);
+		put(out, (uint32_t) (oldBlocks.size() + 1));
+
+		for (int b = 0; b < oldBlocks.size(); b++)
+		{
+			putString(out, oldNames[b]);
+			put(out, (uint64_t) oldBlocks[b].size());
+			out.write(oldBlocks[b].data(), oldBlocks[b].size());
+		}
+
+		putString(out, MDt.getName());
+		put(out, (uint64_t) block.size());
+		out.write(block.data(), block.size());
+
+		if (!out.good())
+		{
+			out.close();
+			std::remove(fn_tmp.c_str());
+			return;
+		}
+	}
+
+	if (std::rename(fn_tmp.c_str(), fn_cache.c_str()) != 0)
+		std::remove(fn_tmp.c_str());
+}
+
+void StarBinaryCache::invalidate(const FileName &fn_star)
+{
+	const FileName fn_cache = getCacheName(fn_star);
+	if (exists(fn_cache))
+		std::remove(fn_cache.c_str());
+}
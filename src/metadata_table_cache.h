@@ -0,0 +1,88 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef METADATA_TABLE_CACHE_H
+#define METADATA_TABLE_CACHE_H
+
+#include <string>
+#include <vector>
+#include "src/filename.h"
+#include "src/metadata_label.h"
+
+class MetaDataTable;
+
+/*	class StarBinaryCache:
+ *
+ *	A binary column store written next to a STAR file (run_data.star -> run_data.star.bin),
+ *	so that the text does not have to be parsed again by every job in a pipeline.
+ *
+ *	The sidecar holds any number of data blocks of the STAR file. Each block stores its name,
+ *	version, the label names (not the EMDLabel values, so that the cache survives changes to
+ *	the label enum) with their types, and one contiguous array per column.
+ *
+ *	A sidecar is only used if it is newer than the STAR file and its stamp matches the STAR file:
+ *	size, modification time and a hash over the first and last 64 kB. Anything else, including
+ *	a label whose type has changed, counts as a miss and the text is parsed as before.
+ *
+ *	Caching is off by default and enabled by setting RELION_STAR_CACHE=1. Only blocks with at
+ *	least RELION_STAR_CACHE_MIN_ROWS rows (default: 10000) are stored, and only loops (lists are small).
+ *	Failures to write the sidecar (e.g. in a read-only directory) are silently ignored.
+ *	Processes that add blocks to the same sidecar take turns through an fcntl lock on an empty
+ *	<sidecar>.lock file (run_data.star.bin.lock), which is left in place.
+ */
+class StarBinaryCache
+{
+public:
+
+	// run_data.star -> run_data.star.bin
+	static FileName getCacheName(const FileName &fn_star);
+
+	static bool isEnabled();
+	static long int getMinimumRows();
+
+	/* Fill MDt with block 'name' of fn_star (the first block if name is empty) from the sidecar.
+	 * Returns false on a cache miss; MDt is then left empty. */
+	static bool read(const FileName &fn_star, const std::string &name, MetaDataTable &MDt);
+
+	/* Add MDt to the sidecar of fn_star, keeping the other still valid blocks in it.
+	 * MDt must have been read from fn_star. */
+	static void store(const FileName &fn_star, const MetaDataTable &MDt);
+
+	// Remove the sidecar, e.g. because fn_star is about to be overwritten
+	static void invalidate(const FileName &fn_star);
+
+private:
+
+	struct Stamp
+	{
+		unsigned long long size;
+		long long mtime_sec, mtime_nsec;
+		unsigned long long hash;
+
+		bool operator == (const Stamp &s) const;
+	};
+
+	static bool getStamp(const FileName &fn, Stamp &stamp);
+
+	// The name of the first data block, i.e. the one read when no name is given
+	static bool getFirstBlockName(const FileName &fn_star, std::string &name);
+
+	static void serialise(const MetaDataTable &MDt, std::string &out);
+	static bool deserialise(const char *ptr, const char *end, MetaDataTable &MDt);
+};
+
+#endif
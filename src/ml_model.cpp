@@ -1839,7 +1839,7 @@ void MlWsumModel::initZeros()
 
 }
 
-unsigned long long MlWsumModel::getPackSize()
+unsigned long long MlWsumModel::getPackSize(bool only_populated)
 {
 	unsigned long long packed_size = 0;
 	int spectral_size = (ori_size / 2) + 1;
@@ -1855,9 +1855,23 @@ unsigned long long MlWsumModel::getPackSize()
 	packed_size += 2 * nr_groups;
 
 	// for all class-related stuff
+	unsigned long long bp_size = BPref[0].getSize();
+	if (only_populated)
+	{
+		// Count from the shape of the box, as the data may already have been packed (and cleared)
+		const int max_r2 = getPopulatedRadius2();
+		const int half = BPref[0].pad_size / 2;
+		const int zhalf = (BPref[0].ref_dim == 3) ? half : 0;
+		bp_size = 0;
+		for (int k = -zhalf; k <= zhalf; k++)
+			for (int i = -half; i <= half; i++)
+				for (int j = 0; j <= half; j++)
+					if (k*k + i*i + j*j <= max_r2)
+						bp_size++;
+	}
 	// data is complex: multiply by two!
-	packed_size += nr_classes * nr_bodies * 2 * (unsigned long long) BPref[0].getSize(); // BPref.data
-	packed_size += nr_classes * nr_bodies * (unsigned long long) BPref[0].getSize(); // BPref.weight
+	packed_size += nr_classes * nr_bodies * 2 * bp_size; // BPref.data
+	packed_size += nr_classes * nr_bodies * bp_size; // BPref.weight
 	packed_size += nr_classes * nr_bodies * (unsigned long long) nr_directions; // pdf_directions
 
 	// for pdf_class
@@ -1870,6 +1884,13 @@ unsigned long long MlWsumModel::getPackSize()
 	return packed_size;
 }
 
+int MlWsumModel::getPopulatedRadius2()
+{
+	// Trilinear interpolation puts weight on neighbours up to sqrt(3) voxels beyond r_max
+	const int max_r = ROUND(BPref[0].r_max * BPref[0].padding_factor) + 2;
+	return max_r * max_r;
+}
+
 //#define DEBUG_PACK
 #ifdef DEBUG_PACK
 #define MAX_PACK_SIZE	  100000
@@ -1878,9 +1899,10 @@ unsigned long long MlWsumModel::getPackSize()
 #define MAX_PACK_SIZE 67101000
 #endif
 
-void MlWsumModel::pack(MultidimArray<RFLOAT> &packed)
+void MlWsumModel::pack(MultidimArray<RFLOAT> &packed, bool only_populated)
 {
-	unsigned long long packed_size = getPackSize();
+	unsigned long long packed_size = getPackSize(only_populated);
+	const int max_r2 = (only_populated) ? getPopulatedRadius2() : 0;
 
 	// Get memory for the packed array
 	packed.clear();
@@ -1925,19 +1947,40 @@ void MlWsumModel::pack(MultidimArray<RFLOAT> &packed)
 
 	for (int iclass = 0; iclass < nr_classes * nr_bodies; iclass++)
 	{
-
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].data)
+		if (only_populated)
 		{
-			DIRECT_MULTIDIM_ELEM(packed, idx++) = (DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n)).real;
-			DIRECT_MULTIDIM_ELEM(packed, idx++) = (DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n)).imag;
-		}
-		BPref[iclass].data.clear();
+			FOR_ALL_ELEMENTS_IN_ARRAY3D(BPref[iclass].data)
+			{
+				if (k*k + i*i + j*j <= max_r2)
+				{
+					DIRECT_MULTIDIM_ELEM(packed, idx++) = (A3D_ELEM(BPref[iclass].data, k, i, j)).real;
+					DIRECT_MULTIDIM_ELEM(packed, idx++) = (A3D_ELEM(BPref[iclass].data, k, i, j)).imag;
+				}
+			}
+			BPref[iclass].data.clear();
 
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].weight)
+			FOR_ALL_ELEMENTS_IN_ARRAY3D(BPref[iclass].weight)
+			{
+				if (k*k + i*i + j*j <= max_r2)
+					DIRECT_MULTIDIM_ELEM(packed, idx++) = A3D_ELEM(BPref[iclass].weight, k, i, j);
+			}
+			BPref[iclass].weight.clear();
+		}
+		else
 		{
-			DIRECT_MULTIDIM_ELEM(packed, idx++) = DIRECT_MULTIDIM_ELEM(BPref[iclass].weight, n);
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].data)
+			{
+				DIRECT_MULTIDIM_ELEM(packed, idx++) = (DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n)).real;
+				DIRECT_MULTIDIM_ELEM(packed, idx++) = (DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n)).imag;
+			}
+			BPref[iclass].data.clear();
+
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].weight)
+			{
+				DIRECT_MULTIDIM_ELEM(packed, idx++) = DIRECT_MULTIDIM_ELEM(BPref[iclass].weight, n);
+			}
+			BPref[iclass].weight.clear();
 		}
-		BPref[iclass].weight.clear();
 		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(pdf_direction[iclass])
 		{
 			DIRECT_MULTIDIM_ELEM(packed, idx++) = DIRECT_MULTIDIM_ELEM(pdf_direction[iclass], n);
@@ -1966,7 +2009,7 @@ void MlWsumModel::pack(MultidimArray<RFLOAT> &packed)
 	}
 
 }
-void MlWsumModel::unpack(MultidimArray<RFLOAT> &packed)
+void MlWsumModel::unpack(MultidimArray<RFLOAT> &packed, bool only_populated)
 {
 
 	unsigned long long idx = 0;
@@ -2008,15 +2051,37 @@ void MlWsumModel::unpack(MultidimArray<RFLOAT> &packed)
 
 	for (int iclass = 0; iclass < nr_classes * nr_bodies; iclass++)
 	{
-		BPref[iclass].initialiseDataAndWeight(current_size);
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].data)
+		if (only_populated)
 		{
-			(DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n)).real = DIRECT_MULTIDIM_ELEM(packed, idx++);
-			(DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n)).imag = DIRECT_MULTIDIM_ELEM(packed, idx++);
+			// Everything outside the sphere is zero
+			BPref[iclass].initZeros(current_size);
+			const int max_r2 = getPopulatedRadius2();
+			FOR_ALL_ELEMENTS_IN_ARRAY3D(BPref[iclass].data)
+			{
+				if (k*k + i*i + j*j <= max_r2)
+				{
+					(A3D_ELEM(BPref[iclass].data, k, i, j)).real = DIRECT_MULTIDIM_ELEM(packed, idx++);
+					(A3D_ELEM(BPref[iclass].data, k, i, j)).imag = DIRECT_MULTIDIM_ELEM(packed, idx++);
+				}
+			}
+			FOR_ALL_ELEMENTS_IN_ARRAY3D(BPref[iclass].weight)
+			{
+				if (k*k + i*i + j*j <= max_r2)
+					A3D_ELEM(BPref[iclass].weight, k, i, j) = DIRECT_MULTIDIM_ELEM(packed, idx++);
+			}
 		}
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].weight)
+		else
 		{
-			DIRECT_MULTIDIM_ELEM(BPref[iclass].weight, n) = DIRECT_MULTIDIM_ELEM(packed, idx++);
+			BPref[iclass].initialiseDataAndWeight(current_size);
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].data)
+			{
+				(DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n)).real = DIRECT_MULTIDIM_ELEM(packed, idx++);
+				(DIRECT_MULTIDIM_ELEM(BPref[iclass].data, n)).imag = DIRECT_MULTIDIM_ELEM(packed, idx++);
+			}
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(BPref[iclass].weight)
+			{
+				DIRECT_MULTIDIM_ELEM(BPref[iclass].weight, n) = DIRECT_MULTIDIM_ELEM(packed, idx++);
+			}
 		}
 		pdf_direction[iclass].resize(nr_directions);
 		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(pdf_direction[iclass])
@@ -526,14 +526,20 @@ public:
 	void initZeros();
 
 	// Return the current pack size
-	unsigned long long getPackSize();
+	unsigned long long getPackSize(bool only_populated = false);
 
 	// Pack entire structure into one large MultidimArray<RFLOAT> for reading/writing to disc
 	// To save memory, the model itself will be cleared after packing.
-	void pack(MultidimArray<RFLOAT> &packed);
+	// With only_populated, the BPref arrays are packed only within the sphere that backprojection can fill (see getPopulatedRadius2),
+	// which is only about half of their (cubic) box in 3D. This is what goes over the network in MPI runs.
+	void pack(MultidimArray<RFLOAT> &packed, bool only_populated = false);
 
-	// Fill the model again using unpack (this is the inverse operation from pack)
-	void unpack(MultidimArray<RFLOAT> &packed);
+	// Fill the model again using unpack (this is the inverse operation from pack, with the same only_populated)
+	void unpack(MultidimArray<RFLOAT> &packed, bool only_populated = false);
+
+	// Squared radius (in the padded Fourier box) beyond which the BPref arrays are always zero:
+	// backprojection stops at r_max, plus the neighbours used in interpolation
+	int getPopulatedRadius2();
 
 	// Pack entire structure into one large MultidimArray<RFLOAT> for shipping over with MPI
 	// To save memory, the model itself will be cleared after packing.
@@ -63,6 +63,7 @@
     #define TBB_PREVIEW_GLOBAL_CONTROL 1
     #include <tbb/global_control.h>
     #include "src/acc/cpu/cpu_ml_optimiser.h"
+    #include "src/acc/cpu/cpu_dispatch.h"
 #endif
 
 #define NR_CLASS_MUTEXES 5
@@ -80,11 +81,8 @@ void globalThreadExpectationSomeParticles(void *self, int thread_id)
     try
     {
 #if defined _CUDA_ENABLED || defined _HIP_ENABLED || defined _SYCL_ENABLED
-        if (MLO->do_gpu || MLO->do_sycl)
-            ((MlOptimiserAccGPU*) MLO->gpuOptimisers[thread_id])->doThreadExpectationSomeParticles(thread_id);
-        else
+        ((MlOptimiserAccGPU*) MLO->gpuOptimisers[thread_id])->doThreadExpectationSomeParticles(thread_id);
 #endif
-            MLO->doThreadExpectationSomeParticles(thread_id);
     }
     catch (RelionError XE)
     {
@@ -429,6 +427,10 @@ void MlOptimiser::parseContinue(int argc, char **argv)
     else
         do_center_classes = false;
 
+    do_prune_cache = parser.checkOption("--prune_cache", "Restrict the coarse search of each particle to the neighbourhood of its significant orientations in the previous iteration");
+    prune_cache_margin = textToFloat(parser.getOption("--prune_cache_margin", "Margin around the previously significant orientations for --prune_cache (in coarse angular sampling steps)", "2"));
+    prune_cache_tolerance = textToFloat(parser.getOption("--prune_cache_tolerance", "Relative increase of the best coarse squared difference (relative to that with an empty reference) above which --prune_cache searches all orientations after all", "0.005"));
+
     do_skip_maximization = parser.checkOption("--skip_maximize", "Skip maximization step (only write out data.star file)?");
 
     int corrections_section = parser.addSection("Corrections");
@@ -463,6 +465,8 @@ void MlOptimiser::parseContinue(int argc, char **argv)
     combine_weights_thru_disc = !parser.checkOption("--dont_combine_weights_via_disc", "Send the large arrays of summed weights through the MPI network, instead of writing large files to disc");
     do_shifts_onthefly = parser.checkOption("--onthefly_shifts", "Calculate shifted images on-the-fly, do not store precalculated ones in memory");
     do_preread_images  = parser.checkOption("--preread_images", "Use this to let the leader process read all particles into memory. Be careful you have enough RAM for large data sets!");
+    nr_prefetch_pools = textToInteger(parser.getOption("--prefetch_pools", "Number of pools of particle images to read ahead in a background thread (0 = off)", "0"));
+    prefetch_max_mem_Gb = textToFloat(parser.getOption("--prefetch_max_mem", "Maximum amount of memory for particle images that have been read ahead (in Gb)", "2"));
     fn_scratch = parser.getOption("--scratch_dir", "If provided, particle stacks will be copied to this local scratch disk prior to refinement.", "");
     keep_free_scratch_Gb = textToFloat(parser.getOption("--keep_free_scratch", "Space available for copying particle stacks (in Gb)", "10"));
     do_reuse_scratch = parser.checkOption("--reuse_scratch", "Re-use data on scratchdir, instead of wiping it and re-copying all data. This works only when ALL particles have already been cached.");
@@ -470,8 +474,14 @@ void MlOptimiser::parseContinue(int argc, char **argv)
 
 #ifdef ALTCPU
 	do_cpu = parser.checkOption("--cpu", "Use intel vectorisation implementation for CPU");
+	cpu_bp_accumulation = parser.getOption("--cpu_bp_accumulation", "How CPU threads add to the shared back projectors: locked (a lock per row), atomic (lock-free adds) or sharded (a private copy per thread, summed at the end)", "locked");
+	cpu_bp_shard_max_mem_Gb = textToFloat(parser.getOption("--cpu_bp_shard_max_mem", "Maximum amount of memory for the private back projectors of all threads with --cpu_bp_accumulation sharded (in Gb); atomic adds are used above it", "8"));
+	do_cpu_release_refs = parser.checkOption("--cpu_release_refs", "Free the double-precision class references and weighted sums while the CPU kernels hold their own copies during expectation (cuts that memory per MPI process to about a third; it still grows with the number of classes). With MPI, this also switches on --node_shared_memory, so that the followers on one host share a single copy of the CPU references");
 #else
 	do_cpu = false;
+	cpu_bp_accumulation = "locked";
+	cpu_bp_shard_max_mem_Gb = 0.;
+	do_cpu_release_refs = false;
 #endif
 
     failsafe_threshold = textToInteger(parser.getOption("--failsafe_threshold", "Maximum number of particles permitted to be drop, due to zero sum of weights, before exiting with an error (GPU only).", "40"));
@@ -763,6 +773,9 @@ void MlOptimiser::parseInitial(int argc, char **argv)
     do_skip_align = parser.checkOption("--skip_align", "Skip orientational assignment (only classify)?");
     do_skip_rotate = parser.checkOption("--skip_rotate", "Skip rotational assignment (only translate and classify)?");
     do_bimodal_psi = parser.checkOption("--bimodal_psi", "Do bimodal searches of psi angle?"); // Oct07,2015 - Shaoda, bimodal psi
+    do_prune_cache = parser.checkOption("--prune_cache", "Restrict the coarse search of each particle to the neighbourhood of its significant orientations in the previous iteration");
+    prune_cache_margin = textToFloat(parser.getOption("--prune_cache_margin", "Margin around the previously significant orientations for --prune_cache (in coarse angular sampling steps)", "2"));
+    prune_cache_tolerance = textToFloat(parser.getOption("--prune_cache_tolerance", "Relative increase of the best coarse squared difference (relative to that with an empty reference) above which --prune_cache searches all orientations after all", "0.005"));
     do_skip_maximization = false;
 
     // Helical reconstruction
@@ -898,6 +911,8 @@ void MlOptimiser::parseInitial(int argc, char **argv)
     do_shifts_onthefly = parser.checkOption("--onthefly_shifts", "Calculate shifted images on-the-fly, do not store precalculated ones in memory");
     do_parallel_disc_io = !parser.checkOption("--no_parallel_disc_io", "Do NOT let parallel (MPI) processes access the disc simultaneously (use this option with NFS)");
     do_preread_images  = parser.checkOption("--preread_images", "Use this to let the leader process read all particles into memory. Be careful you have enough RAM for large data sets!");
+    nr_prefetch_pools = textToInteger(parser.getOption("--prefetch_pools", "Number of pools of particle images to read ahead in a background thread (0 = off)", "0"));
+    prefetch_max_mem_Gb = textToFloat(parser.getOption("--prefetch_max_mem", "Maximum amount of memory for particle images that have been read ahead (in Gb)", "2"));
     fn_scratch = parser.getOption("--scratch_dir", "If provided, particle stacks will be copied to this local scratch disk prior to refinement.", "");
     keep_free_scratch_Gb = textToFloat(parser.getOption("--keep_free_scratch", "Space available for copying particle stacks (in Gb)", "10"));
     do_reuse_scratch = parser.checkOption("--reuse_scratch", "Re-use data on scratchdir, instead of wiping it and re-copying all data.");
@@ -905,8 +920,14 @@ void MlOptimiser::parseInitial(int argc, char **argv)
     do_fast_subsets = parser.checkOption("--fast_subsets", "Use faster optimisation by using subsets of the data in the first 15 iterations");
 #ifdef ALTCPU
     do_cpu = parser.checkOption("--cpu", "Use intel vectorisation implementation for CPU");
+    cpu_bp_accumulation = parser.getOption("--cpu_bp_accumulation", "How CPU threads add to the shared back projectors: locked (a lock per row), atomic (lock-free adds) or sharded (a private copy per thread, summed at the end)", "locked");
+    cpu_bp_shard_max_mem_Gb = textToFloat(parser.getOption("--cpu_bp_shard_max_mem", "Maximum amount of memory for the private back projectors of all threads with --cpu_bp_accumulation sharded (in Gb); atomic adds are used above it", "8"));
+    do_cpu_release_refs = parser.checkOption("--cpu_release_refs", "Free the double-precision class references and weighted sums while the CPU kernels hold their own copies during expectation (cuts that memory per MPI process to about a third; it still grows with the number of classes). With MPI, this also switches on --node_shared_memory, so that the followers on one host share a single copy of the CPU references");
 #else
     do_cpu = false;
+    cpu_bp_accumulation = "locked";
+    cpu_bp_shard_max_mem_Gb = 0.;
+    do_cpu_release_refs = false;
 #endif
 
 #ifdef _SYCL_ENABLED
@@ -1298,7 +1319,7 @@ void MlOptimiser::read(FileName fn_in, int rank, bool do_prevent_preread)
     std::cerr<<"MlOptimiser::readStar before data."<<std::endl;
 #endif
     bool do_preread = (do_preread_images) ? (do_parallel_disc_io || rank == 0) : false;
-    if (do_prevent_preread) do_preread = false;
+    if (do_prevent_preread || prevent_preread_images) do_preread = false;
     bool is_helical_segment = (do_helical_refine) || ((mymodel.ref_dim == 2) && (helical_tube_outer_diameter > 0.));
 
     remove_offset_priors_again = mydata.read(fn_data, fn_tomo, fn_motion, false, false,
@@ -1779,11 +1800,16 @@ void MlOptimiser::initialise()
 
     // And allow plans before expectation to run using allowed
     // number of threads
-    fftw_plan_with_nthreads(nr_threads);
+    FftwPlanCache::setPlannerThreads(nr_threads);
 #endif
 
     initialiseGeneral();
 
+#ifdef ALTCPU
+    if (do_cpu && verb > 0)
+        std::cout << " Using " << CpuKernels::cpuKernelReport() << std::endl;
+#endif
+
     initialiseWorkLoad();
 
     initialiseSigma2Noise();
@@ -2066,7 +2092,7 @@ void MlOptimiser::initialiseGeneral(int rank)
     {
         // Read in the experimental image metadata
         // If do_preread_images: only the leader reads all images into RAM
-        bool do_preread = (do_preread_images) ? (do_parallel_disc_io || rank == 0) : false;
+        bool do_preread = (do_preread_images && !prevent_preread_images) ? (do_parallel_disc_io || rank == 0) : false;
         bool is_helical_segment = (do_helical_refine) || ((mymodel.ref_dim == 2) && (helical_tube_outer_diameter > 0.));
         int myverb = (rank==0) ? 1 : 0;
         remove_offset_priors_again = mydata.read(fn_data, fn_tomo, fn_motion, true, false,
@@ -2351,6 +2377,9 @@ void MlOptimiser::initialiseGeneral(int rank)
             do_local_searches_helical, (do_helical_refine) && (!ignore_helical_symmetry),
             helical_rise_initial, helical_twist_initial);
 
+    // Precalculate the oversampled directions once, rather than for every particle, pass and thread
+    sampling.precalculateOrientationTables(adaptive_oversampling);
+
     // Now that sampling is initialised, also modify sigma2_rot for the helical refinement
     if ((do_auto_refine || do_auto_sampling) && do_helical_refine && !ignore_helical_symmetry && iter == 0 && sampling.healpix_order >= autosampling_hporder_local_searches)
     {
@@ -3514,7 +3543,7 @@ void MlOptimiser::expectation()
 
 #ifdef MKLFFT
     // Allow parallel FFTW execution
-    fftw_plan_with_nthreads(nr_threads);
+    FftwPlanCache::setPlannerThreads(nr_threads);
 #endif
 
     // Initialise some stuff
@@ -3700,7 +3729,7 @@ void MlOptimiser::expectation()
 
 #ifdef MKLFFT
     // Single-threaded FFTW execution for code inside parallel processing loop
-    fftw_plan_with_nthreads(1);
+    FftwPlanCache::setPlannerThreads(1);
 #endif
 
     // Now perform real expectation over all particles
@@ -3735,6 +3764,8 @@ void MlOptimiser::expectation()
         init_progress_bar(my_nr_particles);
     }
 
+    setupImagePrefetcher();
+
     // SHWS10052021: reduce frequency of abort check 10-fold
     long int icheck= 0;
     while (nr_particles_done < my_nr_particles)
@@ -3750,6 +3781,14 @@ void MlOptimiser::expectation()
         // Get the metadata for these particles
         getMetaAndImageDataSubset(my_pool_first_part_id, my_pool_last_part_id, !do_parallel_disc_io);
 
+        // Meanwhile, read the images of the next pools in the background
+        for (int ipool = 1; ipool <= nr_prefetch_pools && image_prefetcher.isActive(); ipool++)
+        {
+            long int my_next_first_part_id = my_pool_first_part_id + ipool * nr_pool;
+            if (my_next_first_part_id > my_last_part_id) break;
+            prefetchImageDataSubset(my_next_first_part_id, XMIPP_MIN(my_last_part_id, my_next_first_part_id + nr_pool - 1));
+        }
+
 #ifdef TIMING
         timer.toc(TIMING_EXP_METADATA);
 #endif
@@ -3795,6 +3834,8 @@ void MlOptimiser::expectation()
     if (verb > 0)
         progress_bar(my_nr_particles);
 
+    image_prefetcher.clear();
+
 #if defined _CUDA_ENABLED || defined _HIP_ENABLED
     if (do_gpu)
     {
@@ -3920,6 +3961,10 @@ void MlOptimiser::expectation()
 
         for (int j = 0; j < b->backprojectors.size(); j++)
         {
+            // With --cpu_release_refs, MlDataBundle::setup released the weighted sums
+            if (do_cpu_release_refs)
+                wsum_model.BPref[j].initZeros(wsum_model.current_size);
+
             unsigned long s = wsum_model.BPref[j].data.nzyxdim;
             XFLOAT *reals = NULL;
             XFLOAT *imags = NULL;
@@ -3960,9 +4005,12 @@ void MlOptimiser::expectation()
 #ifdef  MKLFFT
     // Allow parallel FFTW execution to continue now that we are outside the parallel
     // portion of expectation
-    fftw_plan_with_nthreads(nr_threads);
+    FftwPlanCache::setPlannerThreads(nr_threads);
 #endif
 
+    // How much did --prune_cache reduce the coarse searches?
+    reportOrientationPruning();
+
     // Clean up some memory
     for (int iclass = 0; iclass < mymodel.nr_classes; iclass++)
         mymodel.PPref[iclass].data.clear();
@@ -4160,6 +4208,11 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
     long int dump;
     FileName fn_img, fn_stack, fn_open_stack="";
 
+    // Images of these particles that have been read ahead in the background
+    std::vector<MultidimArray<RFLOAT> > prefetched_imgs;
+    if (image_prefetcher.isActive())
+        image_prefetcher.fetch(my_first_part_id, prefetched_imgs);
+
     // Store total number of particle images in this bunch of SomeParticles, and set translations and orientations for skip_align/rotate
     exp_imgs.clear();
     int metadata_offset = 0;
@@ -4228,7 +4281,13 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
 
         // Sjors 7 March 2016 to prevent too high disk access... Read in all pooled images simultaneously
         // Don't do this for sub-tomograms to save RAM!
-        if (do_parallel_disc_io && !do_preread_images && mymodel.data_dim != 3)
+        if (do_parallel_disc_io && !do_preread_images && mymodel.data_dim != 3 &&
+            metadata_offset < prefetched_imgs.size() && MULTIDIM_SIZE(prefetched_imgs[metadata_offset]) > 0)
+        {
+            exp_imgs.push_back(prefetched_imgs[metadata_offset]);
+            prefetched_imgs[metadata_offset].clear();
+        }
+        else if (do_parallel_disc_io && !do_preread_images && mymodel.data_dim != 3)
         {
             // Read in the actual image from disc, only open/close common stacks once
 
@@ -4265,16 +4324,57 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
 #ifdef DEBUG_EXPSOME
     std::cerr << " exp_my_first_part_id= " << exp_my_first_part_id << " exp_my_last_part_id= " << exp_my_last_part_id << std::endl;
 #endif
-    if (!do_cpu)
+    if (!do_cpu && (do_gpu || do_sycl))
     {
-        // GPU and traditional CPU case - use RELION's built-in task manager to
-        // process multiple particles at once
+        // GPU case - use RELION's built-in task manager to process multiple
+        // particles at once, with one thread per device queue
         exp_ipart_ThreadTaskDistributor->resize(my_last_part_id - my_first_part_id + 1, 1);
         exp_ipart_ThreadTaskDistributor->reset();
         #pragma omp parallel for num_threads(nr_threads)
         for (int thread_id = 0; thread_id < nr_threads; thread_id++)
             globalThreadExpectationSomeParticles(this, thread_id);
     }
+    else if (!do_cpu)
+    {
+        // Traditional CPU case - each particle is a task for the work-stealing scheduler.
+        // Particles with many significant samples in the previous iteration take longest,
+        // so start with those: then the last tasks of the pool are short ones.
+        std::vector<std::pair<int, long int> > cost_and_ipart(my_last_part_id - my_first_part_id + 1);
+        for (long int ipart = 0; ipart < cost_and_ipart.size(); ipart++)
+        {
+            int nr_significant = 0;
+            mydata.MDimg.getValue(EMDL_PARTICLE_NR_SIGNIFICANT_SAMPLES, nr_significant, mydata.sorted_idx[my_first_part_id + ipart]);
+            cost_and_ipart[ipart] = std::make_pair(-nr_significant, ipart);
+        }
+        std::stable_sort(cost_and_ipart.begin(), cost_and_ipart.end());
+
+#ifdef TIMING
+        timer.tic(TIMING_ESP_THR);
+#endif
+        exp_scheduler.setThreads(nr_threads);
+        exp_scheduler.parallelFor(0, cost_and_ipart.size(), [&](long int i, int thread_id)
+        {
+#ifdef TIMING
+            // Only time one thread
+            if (thread_id == 0)
+                timer.tic(TIMING_ESP_ONEPART);
+            else if (thread_id == nr_threads -1)
+                timer.tic(TIMING_ESP_ONEPARTN);
+#endif
+            expectationOneParticle(my_first_part_id + cost_and_ipart[i].second, thread_id);
+
+#ifdef TIMING
+            // Only time one thread
+            if (thread_id == 0)
+                timer.toc(TIMING_ESP_ONEPART);
+            else if (thread_id == nr_threads -1)
+                timer.toc(TIMING_ESP_ONEPARTN);
+#endif
+        });
+#ifdef TIMING
+        timer.toc(TIMING_ESP_THR);
+#endif
+    }
 #ifdef ALTCPU
     else
     {
@@ -4316,57 +4416,6 @@ void MlOptimiser::expectationSomeParticles(long int my_first_part_id, long int m
 }
 
 
-void MlOptimiser::doThreadExpectationSomeParticles(int thread_id)
-{
-
-#ifdef TIMING
-    // Only time one thread
-    if (thread_id == 0)
-        timer.tic(TIMING_ESP_THR);
-#endif
-
-    size_t first_ipart = 0, last_ipart = 0;
-    while (exp_ipart_ThreadTaskDistributor->getTasks(first_ipart, last_ipart))
-    {
-//#define DEBUG_EXPSOMETHR
-#ifdef DEBUG_EXPSOMETHR
-        omp_set_lock(&global_mutex);
-        std::cerr << " thread_id= " << thread_id << " first_ipart= " << first_ipart << " last_ipart= " << last_ipart << std::endl;
-        std::cerr << " exp_my_first_part_id= " << exp_my_first_part_id << " exp_my_last_part_id= " << exp_my_last_part_id << std::endl;
-        omp_unset_lock(&global_mutex);
-#endif
-
-        for (long int ipart = first_ipart; ipart <= last_ipart; ipart++)
-        {
-#ifdef TIMING
-            // Only time one thread
-            if (thread_id == 0)
-                timer.tic(TIMING_ESP_ONEPART);
-            else if (thread_id == nr_threads -1)
-                timer.tic(TIMING_ESP_ONEPARTN);
-#endif
-            expectationOneParticle(exp_my_first_part_id + ipart, thread_id);
-
-#ifdef TIMING
-            // Only time one thread
-            if (thread_id == 0)
-                timer.toc(TIMING_ESP_ONEPART);
-            else if (thread_id == nr_threads -1)
-                timer.toc(TIMING_ESP_ONEPARTN);
-#endif
-
-        }
-    }
-
-#ifdef TIMING
-    // Only time one thread
-    if (thread_id == 0)
-        timer.toc(TIMING_ESP_THR);
-#endif
-
-}
-
-
 void MlOptimiser::expectationOneParticle(long int part_id_sorted, int thread_id)
 {
 #ifdef TIMING
@@ -4442,9 +4491,10 @@ void MlOptimiser::expectationOneParticle(long int part_id_sorted, int thread_id)
         int exp_current_image_size, exp_current_oversampling;
         std::vector<RFLOAT> exp_highres_Xi2_img;
         MultidimArray<RFLOAT> exp_Mweight, exp_STMulti, exp_local_Minvsigma2;
-        MultidimArray<bool> exp_Mcoarse_significant;
+        MultidimArray<bool> exp_Mcoarse_significant, exp_Mcoarse_search;
         // And from storeWeightedSums
-        RFLOAT exp_min_diff2, exp_sum_weight, exp_significant_weight, exp_max_weight;
+        RFLOAT exp_min_diff2, exp_coarse_min_diff2, exp_sum_weight, exp_significant_weight, exp_max_weight;
+        RFLOAT exp_coarse_blank_diff2 = 0.;
         Matrix1D<RFLOAT> exp_old_offset, exp_prior;
         std::vector<RFLOAT> exp_wsum_norm_correction;
         std::vector<MultidimArray<RFLOAT> > exp_power_imgs;
@@ -4527,6 +4577,10 @@ void MlOptimiser::expectationOneParticle(long int part_id_sorted, int thread_id)
         // Initialise significant weight to minus one, so that all coarse sampling points will be handled in the first pass
         exp_significant_weight = -1.;
 
+        // With --prune_cache, only search the coarse orientations near the ones that were significant in the previous iteration
+        bool do_prune = getOrientationPruningMask(part_id, metadata_offset,
+                exp_pointer_dir_nonzeroprior, exp_pointer_psi_nonzeroprior, exp_Mcoarse_search);
+
         // Only perform a second pass when using adaptive oversampling
         int nr_sampling_passes = (adaptive_oversampling > 0) ? 2 : 1;
 
@@ -4555,10 +4609,29 @@ void MlOptimiser::expectationOneParticle(long int part_id_sorted, int thread_id)
             getAllSquaredDifferences(part_id, ibody, exp_ipass, exp_current_oversampling,
                     metadata_offset, exp_idir_min, exp_idir_max, exp_ipsi_min, exp_ipsi_max,
                     exp_itrans_min, exp_itrans_max, exp_iclass_min, exp_iclass_max, exp_min_diff2, exp_highres_Xi2_img,
-                    exp_Fimg, exp_Fctf, exp_old_offset, exp_Mweight, exp_Mcoarse_significant,
+                    exp_Fimg, exp_Fctf, exp_old_offset, exp_Mweight, exp_Mcoarse_significant, exp_Mcoarse_search,
                     exp_pointer_dir_nonzeroprior, exp_pointer_psi_nonzeroprior, exp_directions_prior, exp_psi_prior,
                     exp_local_Fimgs_shifted, exp_local_Minvsigma2, exp_local_Fctf, exp_local_sqrtXi2, exp_STMulti);
 
+            // The scale of the coarse squared differences under the current noise model
+            if (exp_ipass == 0 && do_prune_cache)
+                exp_coarse_blank_diff2 = getBlankReferenceDiff2(exp_Fimg, exp_highres_Xi2_img, exp_local_Minvsigma2);
+
+            // If the pruned coarse search fits the particle worse than the previous iteration did, search all orientations after all
+            if (exp_ipass == 0 && do_prune && !checkOrientationPruning(metadata_offset, exp_min_diff2, exp_coarse_blank_diff2, exp_Mcoarse_search))
+            {
+                exp_Mcoarse_search.clear();
+                getAllSquaredDifferences(part_id, ibody, exp_ipass, exp_current_oversampling,
+                        metadata_offset, exp_idir_min, exp_idir_max, exp_ipsi_min, exp_ipsi_max,
+                        exp_itrans_min, exp_itrans_max, exp_iclass_min, exp_iclass_max, exp_min_diff2, exp_highres_Xi2_img,
+                        exp_Fimg, exp_Fctf, exp_old_offset, exp_Mweight, exp_Mcoarse_significant, exp_Mcoarse_search,
+                        exp_pointer_dir_nonzeroprior, exp_pointer_psi_nonzeroprior, exp_directions_prior, exp_psi_prior,
+                        exp_local_Fimgs_shifted, exp_local_Minvsigma2, exp_local_Fctf, exp_local_sqrtXi2, exp_STMulti);
+            }
+
+            if (exp_ipass == 0)
+                exp_coarse_min_diff2 = exp_min_diff2;
+
 
 #ifdef DEBUG_ESP_MEM
             if (thread_id==0)
@@ -4670,6 +4743,9 @@ void MlOptimiser::expectationOneParticle(long int part_id_sorted, int thread_id)
                 exp_local_Fimgs_shifted, exp_local_Fimgs_shifted_nomask, exp_local_Minvsigma2, exp_local_Fctf,
                 exp_local_sqrtXi2, exp_STMulti);
 
+        updateOrientationPruningCache(part_id, metadata_offset, exp_coarse_min_diff2, exp_coarse_blank_diff2, exp_Mcoarse_significant,
+                exp_pointer_dir_nonzeroprior, exp_pointer_psi_nonzeroprior);
+
 #ifdef RELION_TESTING
 //		std::string mode;
         if (do_gpu)
@@ -5006,7 +5082,9 @@ void MlOptimiser::maximization()
                                 mymodel.tau2_fudge_factor,
                                 wsum_model.pdf_class[iclass],
                                 minres_map,
-                                (iclass==0));
+                                (iclass==0),
+                                NULL,
+                                nr_threads);
                 }
             }
         }
@@ -7088,6 +7166,196 @@ bool MlOptimiser::isSignificantAnyImageAnyTranslation(long int iorient, int exp_
 }
 
 
+// Unit vector along the projection direction (rot, tilt), in degrees
+static inline void pruningDirection(RFLOAT rot, RFLOAT tilt, RFLOAT *v)
+{
+    RFLOAT sin_tilt = sin(DEG2RAD(tilt));
+    v[0] = cos(DEG2RAD(rot)) * sin_tilt;
+    v[1] = sin(DEG2RAD(rot)) * sin_tilt;
+    v[2] = cos(DEG2RAD(tilt));
+}
+
+bool MlOptimiser::getOrientationPruningMask(long int part_id, int metadata_offset,
+        std::vector<int> &exp_pointer_dir_nonzeroprior, std::vector<int> &exp_pointer_psi_nonzeroprior,
+        MultidimArray<bool> &exp_Mcoarse_search)
+{
+    exp_Mcoarse_search.clear();
+    if (!do_prune_cache)
+        return false;
+
+    long int exp_nr_dir = sampling.NrDirections(0, &exp_pointer_dir_nonzeroprior);
+    long int exp_nr_psi = sampling.NrPsiSamplings(0, &exp_pointer_psi_nonzeroprior);
+    long int nr_searched = exp_nr_dir * exp_nr_psi;
+
+    // The cache is only valid if it was made in the previous iteration, with the same coarse image size (and thus diff2 scale)
+    bool do_CC = (iter == 1 && do_firstiter_cc) || do_always_cc;
+    int cache_iter = ROUND(DIRECT_A2D_ELEM(exp_metadata, metadata_offset, metadataPruneColumn(METADATA_PRUNE_ITER)));
+    int cache_size = ROUND(DIRECT_A2D_ELEM(exp_metadata, metadata_offset, metadataPruneColumn(METADATA_PRUNE_SIZE)));
+    if (!(do_CC || mymodel.nr_bodies > 1 || do_skip_align || do_skip_rotate || do_only_sample_tilt) &&
+        cache_iter > 0 && cache_iter == iter - 1 && cache_size == image_coarse_size[mydata.getOpticsGroup(part_id)])
+    {
+        RFLOAT dir_radius = DIRECT_A2D_ELEM(exp_metadata, metadata_offset, metadataPruneColumn(METADATA_PRUNE_DIR_RADIUS)) + prune_cache_margin * sampling.getAngularSampling();
+        RFLOAT psi_radius = DIRECT_A2D_ELEM(exp_metadata, metadata_offset, metadataPruneColumn(METADATA_PRUNE_PSI_RADIUS)) + prune_cache_margin * sampling.psi_step;
+        RFLOAT rot = DIRECT_A2D_ELEM(exp_metadata, metadata_offset, METADATA_ROT);
+        RFLOAT tilt = DIRECT_A2D_ELEM(exp_metadata, metadata_offset, METADATA_TILT);
+        RFLOAT psi = DIRECT_A2D_ELEM(exp_metadata, metadata_offset, METADATA_PSI);
+
+        // The neighbourhood is the product of the nearby directions and the nearby in-plane angles
+        std::vector<bool> is_near_dir(exp_nr_dir, true), is_near_psi(exp_nr_psi, true);
+        long int nr_near_dir = exp_nr_dir, nr_near_psi = 0;
+        if (sampling.is_3D && dir_radius < 180.)
+        {
+            RFLOAT v0[3], v[3];
+            pruningDirection(rot, tilt, v0);
+            RFLOAT min_dot = cos(DEG2RAD(dir_radius));
+            nr_near_dir = 0;
+            for (long int idir = 0; idir < exp_nr_dir; idir++)
+            {
+                long int mydir = (exp_pointer_dir_nonzeroprior.size() > 0) ? exp_pointer_dir_nonzeroprior[idir] : idir;
+                pruningDirection(sampling.rot_angles[mydir], sampling.tilt_angles[mydir], v);
+                is_near_dir[idir] = (v0[0] * v[0] + v0[1] * v[1] + v0[2] * v[2] >= min_dot);
+                if (is_near_dir[idir])
+                    nr_near_dir++;
+            }
+        }
+        for (long int ipsi = 0; ipsi < exp_nr_psi; ipsi++)
+        {
+            long int mypsi = (exp_pointer_psi_nonzeroprior.size() > 0) ? exp_pointer_psi_nonzeroprior[ipsi] : ipsi;
+            RFLOAT dpsi = sampling.psi_angles[mypsi] - psi;
+            is_near_psi[ipsi] = (ABS(realWRAP(dpsi, -180., 180.)) <= psi_radius);
+            if (is_near_psi[ipsi])
+                nr_near_psi++;
+        }
+
+        // Searching nothing (e.g. when the local-search priors moved away) or everything is a full search
+        if (nr_near_dir * nr_near_psi > 0 && nr_near_dir * nr_near_psi < exp_nr_dir * exp_nr_psi)
+        {
+            exp_Mcoarse_search.resize(exp_nr_dir * exp_nr_psi);
+            for (long int idir = 0, iorient = 0; idir < exp_nr_dir; idir++)
+                for (long int ipsi = 0; ipsi < exp_nr_psi; ipsi++, iorient++)
+                    DIRECT_A1D_ELEM(exp_Mcoarse_search, iorient) = is_near_dir[idir] && is_near_psi[ipsi];
+            return true;
+        }
+    }
+
+    omp_set_lock(&global_mutex);
+    prune_nr_part_full++;
+    prune_nr_orient_searched += nr_searched;
+    prune_nr_orient_all += nr_searched;
+    omp_unset_lock(&global_mutex);
+
+    return false;
+}
+
+RFLOAT MlOptimiser::getBlankReferenceDiff2(std::vector<MultidimArray<Complex> > &exp_Fimg, std::vector<RFLOAT> &exp_highres_Xi2_img,
+        MultidimArray<RFLOAT> &exp_local_Minvsigma2)
+{
+    // As in getAllSquaredDifferences, with Frefctf = 0
+    RFLOAT diff2 = 0.;
+    MultidimArray<Complex> Fimg;
+    for (int img_id = 0; img_id < exp_Fimg.size(); img_id++)
+    {
+        windowFourierTransform(exp_Fimg[img_id], Fimg, YSIZE(exp_local_Minvsigma2));
+        diff2 += exp_highres_Xi2_img[img_id] / 2.;
+        FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(exp_local_Minvsigma2)
+            diff2 += norm(DIRECT_MULTIDIM_ELEM(Fimg, n)) * 0.5 * DIRECT_MULTIDIM_ELEM(exp_local_Minvsigma2, n);
+    }
+
+    return diff2;
+}
+
+// The best coarse squared difference relative to that with an empty reference, which scales in the same way with sigma2
+static inline RFLOAT pruningScore(RFLOAT min_diff2, RFLOAT blank_diff2)
+{
+    return (blank_diff2 > 0.) ? min_diff2 / blank_diff2 : min_diff2;
+}
+
+bool MlOptimiser::checkOrientationPruning(int metadata_offset, RFLOAT exp_coarse_min_diff2, RFLOAT exp_blank_diff2,
+        MultidimArray<bool> &exp_Mcoarse_search)
+{
+    // A higher squared difference means a lower likelihood
+    RFLOAT cache_score = DIRECT_A2D_ELEM(exp_metadata, metadata_offset, metadataPruneColumn(METADATA_PRUNE_DIFF2));
+    bool is_good = (pruningScore(exp_coarse_min_diff2, exp_blank_diff2) <= cache_score + prune_cache_tolerance * ABS(cache_score));
+
+    long int nr_searched = 0;
+    FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(exp_Mcoarse_search)
+    {
+        if (DIRECT_MULTIDIM_ELEM(exp_Mcoarse_search, n))
+            nr_searched++;
+    }
+
+    omp_set_lock(&global_mutex);
+    prune_nr_part_pruned++;
+    prune_nr_orient_all += XSIZE(exp_Mcoarse_search);
+    prune_nr_orient_searched += nr_searched;
+    if (!is_good)
+    {
+        prune_nr_fallback++;
+        prune_nr_orient_searched += XSIZE(exp_Mcoarse_search);
+    }
+    omp_unset_lock(&global_mutex);
+
+    return is_good;
+}
+
+void MlOptimiser::updateOrientationPruningCache(long int part_id, int metadata_offset, RFLOAT exp_coarse_min_diff2, RFLOAT exp_blank_diff2,
+        MultidimArray<bool> &exp_Mcoarse_significant,
+        std::vector<int> &exp_pointer_dir_nonzeroprior, std::vector<int> &exp_pointer_psi_nonzeroprior)
+{
+    bool do_CC = (iter == 1 && do_firstiter_cc) || do_always_cc;
+    if (!do_prune_cache || do_CC || mymodel.nr_bodies > 1 || do_skip_align || do_skip_rotate || do_only_sample_tilt)
+        return;
+
+    long int exp_nr_dir = sampling.NrDirections(0, &exp_pointer_dir_nonzeroprior);
+    long int exp_nr_psi = sampling.NrPsiSamplings(0, &exp_pointer_psi_nonzeroprior);
+    long int exp_nr_trans = sampling.NrTranslationalSamplings();
+
+    // Distances from the new optimal orientation to the farthest significant coarse direction and in-plane angle
+    RFLOAT v0[3], v[3];
+    pruningDirection(DIRECT_A2D_ELEM(exp_metadata, metadata_offset, METADATA_ROT),
+                     DIRECT_A2D_ELEM(exp_metadata, metadata_offset, METADATA_TILT), v0);
+    RFLOAT psi = DIRECT_A2D_ELEM(exp_metadata, metadata_offset, METADATA_PSI);
+    RFLOAT min_dot = 1., psi_radius = 0.;
+    for (long int ihidden = 0; ihidden < XSIZE(exp_Mcoarse_significant); ihidden++)
+    {
+        if (!DIRECT_A1D_ELEM(exp_Mcoarse_significant, ihidden))
+            continue;
+
+        long int iorient = (ihidden / exp_nr_trans) % (exp_nr_dir * exp_nr_psi);
+        long int idir = iorient / exp_nr_psi;
+        long int ipsi = iorient % exp_nr_psi;
+        long int mydir = (exp_pointer_dir_nonzeroprior.size() > 0) ? exp_pointer_dir_nonzeroprior[idir] : idir;
+        long int mypsi = (exp_pointer_psi_nonzeroprior.size() > 0) ? exp_pointer_psi_nonzeroprior[ipsi] : ipsi;
+        if (sampling.is_3D)
+        {
+            pruningDirection(sampling.rot_angles[mydir], sampling.tilt_angles[mydir], v);
+            min_dot = XMIPP_MIN(min_dot, v0[0] * v[0] + v0[1] * v[1] + v0[2] * v[2]);
+        }
+        RFLOAT dpsi = sampling.psi_angles[mypsi] - psi;
+        psi_radius = XMIPP_MAX(psi_radius, ABS(realWRAP(dpsi, -180., 180.)));
+    }
+
+    DIRECT_A2D_ELEM(exp_metadata, metadata_offset, metadataPruneColumn(METADATA_PRUNE_ITER)) = iter;
+    DIRECT_A2D_ELEM(exp_metadata, metadata_offset, metadataPruneColumn(METADATA_PRUNE_SIZE)) = image_coarse_size[mydata.getOpticsGroup(part_id)];
+    DIRECT_A2D_ELEM(exp_metadata, metadata_offset, metadataPruneColumn(METADATA_PRUNE_DIFF2)) = pruningScore(exp_coarse_min_diff2, exp_blank_diff2);
+    DIRECT_A2D_ELEM(exp_metadata, metadata_offset, metadataPruneColumn(METADATA_PRUNE_DIR_RADIUS)) = RAD2DEG(acos(XMIPP_MAX(-1., min_dot)));
+    DIRECT_A2D_ELEM(exp_metadata, metadata_offset, metadataPruneColumn(METADATA_PRUNE_PSI_RADIUS)) = psi_radius;
+}
+
+void MlOptimiser::reportOrientationPruning()
+{
+    if (do_prune_cache && verb > 0 && prune_nr_orient_searched > 0.)
+    {
+        std::cout << " Pruned coarse searches: " << prune_nr_part_pruned << " of " << prune_nr_part_pruned + prune_nr_part_full
+                  << " particles, of which " << prune_nr_fallback << " fell back to the full search;"
+                  << " searched " << 100. * prune_nr_orient_searched / prune_nr_orient_all << "% of the coarse orientations ("
+                  << prune_nr_orient_all / prune_nr_orient_searched << "x fewer)" << std::endl;
+    }
+
+    prune_nr_part_pruned = prune_nr_part_full = prune_nr_fallback = 0;
+    prune_nr_orient_searched = prune_nr_orient_all = 0.;
+}
+
 void MlOptimiser::getAllSquaredDifferences(long int part_id, int ibody,
         int exp_ipass, int exp_current_oversampling, int metadata_offset,
         int exp_idir_min, int exp_idir_max, int exp_ipsi_min, int exp_ipsi_max,
@@ -7099,6 +7367,7 @@ void MlOptimiser::getAllSquaredDifferences(long int part_id, int ibody,
         Matrix1D<RFLOAT> &exp_old_offset,
         MultidimArray<RFLOAT> &exp_Mweight,
         MultidimArray<bool> &exp_Mcoarse_significant,
+        MultidimArray<bool> &exp_Mcoarse_search,
         std::vector<int> &exp_pointer_dir_nonzeroprior, std::vector<int> &exp_pointer_psi_nonzeroprior,
         std::vector<RFLOAT> &exp_directions_prior, std::vector<RFLOAT> &exp_psi_prior,
         std::vector<std::vector<MultidimArray<Complex > > > &exp_local_Fimgs_shifted,
@@ -7212,10 +7481,10 @@ void MlOptimiser::getAllSquaredDifferences(long int part_id, int ibody,
                     {
                         pdf_orientation = exp_directions_prior[idir] * exp_psi_prior[ipsi];
                     }
-                    // In the first pass, always proceed
+                    // In the first pass, always proceed (unless the orientation lies outside the pruned search)
                     // In the second pass, check whether one of the translations for this orientation had a significant weight in the first pass
                     // if so, proceed with projecting the reference in that direction
-                    bool do_proceed = (exp_ipass==0) ? true :
+                    bool do_proceed = (exp_ipass==0) ? (XSIZE(exp_Mcoarse_search) == 0 || DIRECT_A1D_ELEM(exp_Mcoarse_search, iorient)) :
                         isSignificantAnyImageAnyTranslation(iorientclass, exp_itrans_min, exp_itrans_max, exp_Mcoarse_significant);
 
                     if (do_proceed && pdf_orientation > 0.)
@@ -10244,6 +10513,14 @@ void MlOptimiser::setMetaDataSubset(long int first_part_id, long int last_part_i
             }
         }
 
+        if (do_prune_cache)
+        {
+            if (YSIZE(prune_cache) != mydata.numberOfParticles())
+                prune_cache.initZeros(mydata.numberOfParticles(), METADATA_NR_PRUNE_PARAMS);
+            for (int i = 0; i < METADATA_NR_PRUNE_PARAMS; i++)
+                DIRECT_A2D_ELEM(prune_cache, part_id, i) = DIRECT_A2D_ELEM(exp_metadata, metadata_offset, metadataPruneColumn(i));
+        }
+
         // For multi-body refinement
         if (mymodel.nr_bodies > 1)
         {
@@ -10275,6 +10552,52 @@ void MlOptimiser::setMetaDataSubset(long int first_part_id, long int last_part_i
 
 }
 
+bool MlOptimiser::canPrefetchImages()
+{
+    // Only the 2D images that expectationSomeParticles reads from disc can be prefetched
+    return nr_prefetch_pools > 0 && do_parallel_disc_io && !do_preread_images && mymodel.data_dim != 3;
+}
+
+void MlOptimiser::setupImagePrefetcher()
+{
+    if (canPrefetchImages())
+        image_prefetcher.setup(nr_prefetch_pools, (size_t)(prefetch_max_mem_Gb * 1024. * 1024. * 1024.));
+    else
+        image_prefetcher.setup(0, 0);
+}
+
+void MlOptimiser::prefetchImageDataSubset(long int first_part_id, long int last_part_id)
+{
+    if (!image_prefetcher.isActive() || image_prefetcher.isQueued(first_part_id))
+        return;
+
+    // Same image names as in getMetaAndImageDataSubset and expectationSomeParticles
+    std::vector<FileName> fn_imgs;
+    for (long int part_id_sorted = first_part_id; part_id_sorted <= last_part_id; part_id_sorted++)
+    {
+        long int part_id = mydata.sorted_idx[part_id_sorted];
+        FileName fn_img;
+        if (!mydata.getImageNameOnScratch(part_id, fn_img))
+            fn_img = mydata.particles[part_id].name;
+        fn_imgs.push_back(fn_img);
+    }
+
+    image_prefetcher.prefetch(first_part_id, fn_imgs);
+}
+
+int MlOptimiser::metadataLineLength() const
+{
+    int length = METADATA_LINE_LENGTH_BEFORE_BODIES + mymodel.nr_bodies * METADATA_NR_BODY_PARAMS;
+    if (do_prune_cache)
+        length += METADATA_NR_PRUNE_PARAMS;
+    return length;
+}
+
+int MlOptimiser::metadataPruneColumn(int iparam) const
+{
+    return METADATA_LINE_LENGTH_BEFORE_BODIES + mymodel.nr_bodies * METADATA_NR_BODY_PARAMS + iparam;
+}
+
 void MlOptimiser::getMetaAndImageDataSubset(long int first_part_id, long int last_part_id, bool do_also_imagedata)
 {
 
@@ -10300,7 +10623,7 @@ void MlOptimiser::getMetaAndImageDataSubset(long int first_part_id, long int las
         long int part_id = mydata.sorted_idx[part_id_sorted];
         nr_images += mydata.numberOfImagesInParticle(part_id);
     }
-    exp_metadata.initZeros(last_part_id-first_part_id+1, METADATA_LINE_LENGTH_BEFORE_BODIES + (mymodel.nr_bodies) * METADATA_NR_BODY_PARAMS);
+    exp_metadata.initZeros(last_part_id-first_part_id+1, metadataLineLength());
 
     // This assumes all images in first_part_id to last_part_id have the same image_size
     // If not, then do_also_imagedata will not work! Also warn during intialiseGeneral!
@@ -10511,6 +10834,13 @@ void MlOptimiser::getMetaAndImageDataSubset(long int first_part_id, long int las
 
         }
 
+        // The cached neighbourhood of the significant orientations is not stored in the STAR files
+        if (do_prune_cache && YSIZE(prune_cache) > part_id)
+        {
+            for (int i = 0; i < METADATA_NR_PRUNE_PARAMS; i++)
+                DIRECT_A2D_ELEM(exp_metadata, metadata_offset, metadataPruneColumn(i)) = DIRECT_A2D_ELEM(prune_cache, part_id, i);
+        }
+
         // For multi-body refinement
         if (mymodel.nr_bodies > 1)
         {
@@ -42,6 +42,8 @@
 #include "src/healpix_sampling.h"
 #include "src/helix.h"
 #include "src/local_symmetry.h"
+#include "src/image_prefetcher.h"
+#include "src/work_stealing_scheduler.h"
 #include "src/acc/settings.h"
 #include <src/jaz/tomography/optimisation_set.h>
 
@@ -79,6 +81,15 @@
 #define METADATA_LINE_LENGTH_BEFORE_BODIES 25
 #define METADATA_NR_BODY_PARAMS 6
 
+// Neighbourhood of the significant coarse orientations in the previous iteration (--prune_cache)
+// Only with --prune_cache, these follow the parameters of all bodies (see MlOptimiser::metadataPruneColumn)
+#define METADATA_PRUNE_ITER 0
+#define METADATA_PRUNE_SIZE 1
+#define METADATA_PRUNE_DIFF2 2 // best coarse diff2, relative to that with an empty reference
+#define METADATA_PRUNE_DIR_RADIUS 3
+#define METADATA_PRUNE_PSI_RADIUS 4
+#define METADATA_NR_PRUNE_PARAMS 5
+
 #define DO_WRITE_DATA true
 #define DONT_WRITE_DATA false
 #define DO_WRITE_SAMPLING true
@@ -476,12 +487,34 @@ public:
 	// Use alternate cpu implementation
 	bool do_cpu;
 
+	// How threads of the alternate cpu implementation add to the shared back projectors (locked, atomic or sharded)
+	std::string cpu_bp_accumulation;
+
+	// Maximum amount of memory for the private back projectors of all threads in the sharded mode (in Gb)
+	RFLOAT cpu_bp_shard_max_mem_Gb;
+
+	// Release the class references and weighted sums that the alternate cpu implementation keeps its own copies of during
+	// expectation. This lowers the memory per class, but does not make it independent of the number of classes
+	bool do_cpu_release_refs;
+
 	// Which GPU devices to use?
 	std::string gpu_ids;
 
 	// Or preread all images into RAM on the leader node?
 	bool do_preread_images;
 
+	// Leave the pre-reading to another rank on the same host, which shares its images (see MlOptimiserMpi)
+	bool prevent_preread_images;
+
+	// Number of pools of particle images to read ahead in a background thread (0 = no prefetching)
+	int nr_prefetch_pools;
+
+	// Maximum amount of memory for images that have been read ahead (in Gb)
+	RFLOAT prefetch_max_mem_Gb;
+
+	// Reads the images of the next pools while the current pool is being processed
+	ImagePrefetcher image_prefetcher;
+
 	// Place on scratch disk to copy particle stacks temporarily
 	FileName fn_scratch;
 
@@ -686,7 +719,8 @@ public:
 	int verb;
 
 	// Thread Managers for the expectation step: one for all (pooled) particles
-	ThreadTaskDistributor *exp_ipart_ThreadTaskDistributor;
+	ThreadTaskDistributor *exp_ipart_ThreadTaskDistributor; // GPU threads
+	WorkStealingScheduler exp_scheduler; // CPU threads
 
 	// Number of threads to run in parallel
 	int x_pool;
@@ -718,6 +752,23 @@ public:
 	// This can be set by user or automatically
 	int maximum_significants;
 
+	// Restrict the coarse pass of each particle to the neighbourhood of its significant orientations in the previous iteration
+	bool do_prune_cache;
+
+	// Margin around that neighbourhood (in coarse angular sampling steps)
+	RFLOAT prune_cache_margin;
+
+	// Relative increase of the best coarse squared difference (relative to that with an empty reference) above which the
+	// full coarse search is done after all
+	RFLOAT prune_cache_tolerance;
+
+	// The cached neighbourhoods of all particles (METADATA_PRUNE_* columns), kept where the metadata are kept (the leader with MPI)
+	MultidimArray<RFLOAT> prune_cache;
+
+	// Statistics of the pruned coarse searches in this iteration
+	long int prune_nr_part_pruned, prune_nr_part_full, prune_nr_fallback;
+	RFLOAT prune_nr_orient_searched, prune_nr_orient_all;
+
 	// Tabulated sine and cosine values (for 3D helical sub-tomogram averaging with on-the-fly shifts)
 	TabSine tab_sin;
 	TabCosine tab_cos;
@@ -867,6 +918,8 @@ public:
             anticipate_oom(0),
             do_helical_refine(0),
             do_preread_images(0),
+            nr_prefetch_pools(0),
+            prefetch_max_mem_Gb(2.),
             ignore_helical_symmetry(0),
             helical_twist_initial(0),
             helical_rise_initial(0),
@@ -883,6 +936,14 @@ public:
 		//directional_lowpass(0),
 		asymmetric_padding(false),
             maximum_significants(-1),
+            do_prune_cache(false),
+            prune_cache_margin(2.),
+            prune_cache_tolerance(0.005),
+            prune_nr_part_pruned(0),
+            prune_nr_part_full(0),
+            prune_nr_fallback(0),
+            prune_nr_orient_searched(0.),
+            prune_nr_orient_all(0.),
             threadException(NULL),
             do_init_blobs(false),
             do_som(false),
@@ -916,6 +977,7 @@ public:
             grad_suspended_finer_sampling_iter(-1),
             grad_pseudo_halfsets(false),
             skip_realspace_helical_sym(false),
+            prevent_preread_images(false),
 #ifdef ALTCPU
 		mdlClassComplex(NULL),
 #endif
@@ -1020,9 +1082,6 @@ public:
 	 */
 	void expectationSomeParticles(long int my_first_particle, long int my_last_particle);
 
-	/* Perform expectation step for some particles using threads */
-	void doThreadExpectationSomeParticles(int thread_id);
-
 	/* Perform the expectation integration over all k, phi and series elements for a given particle */
 	void expectationOneParticle(long int part_id_sorted, int thread_id);
 
@@ -1126,7 +1185,34 @@ public:
 	bool isSignificantAnyImageAnyTranslation(long int iorient,
 			int exp_itrans_min, int exp_itrans_max, MultidimArray<bool> &exp_Mcoarse_significant);
 
+	// With --prune_cache: set exp_Mcoarse_search (one element per coarse orientation) to the orientations near those that
+	// were significant for this particle in the previous iteration. Returns false, with an empty mask, for a full search
+	bool getOrientationPruningMask(long int part_id, int metadata_offset,
+			std::vector<int> &exp_pointer_dir_nonzeroprior, std::vector<int> &exp_pointer_psi_nonzeroprior,
+			MultidimArray<bool> &exp_Mcoarse_search);
+
+	// The squared difference of the images of a particle with an empty reference, at the size of exp_local_Minvsigma2
+	// (i.e. their power weighted by the current noise model). With --prune_cache, the best coarse squared differences of
+	// subsequent iterations are compared relative to this, so that changes in sigma2 between iterations cancel out
+	RFLOAT getBlankReferenceDiff2(std::vector<MultidimArray<Complex> > &exp_Fimg, std::vector<RFLOAT> &exp_highres_Xi2_img,
+			MultidimArray<RFLOAT> &exp_local_Minvsigma2);
+
+	// After a coarse pass restricted by exp_Mcoarse_search: returns false if its best squared difference, relative to
+	// exp_blank_diff2, got worse than in the previous iteration by more than prune_cache_tolerance, in which case the full
+	// coarse search has to be done
+	bool checkOrientationPruning(int metadata_offset, RFLOAT exp_coarse_min_diff2, RFLOAT exp_blank_diff2,
+			MultidimArray<bool> &exp_Mcoarse_search);
+
+	// After storeWeightedSums: remember how far the significant coarse orientations lie from the new optimal orientation
+	void updateOrientationPruningCache(long int part_id, int metadata_offset, RFLOAT exp_coarse_min_diff2, RFLOAT exp_blank_diff2,
+			MultidimArray<bool> &exp_Mcoarse_significant,
+			std::vector<int> &exp_pointer_dir_nonzeroprior, std::vector<int> &exp_pointer_psi_nonzeroprior);
+
+	// Print (and reset) the statistics of the pruned coarse searches of this iteration
+	void reportOrientationPruning();
+
 	// Get squared differences for all iclass, idir, ipsi and itrans...
+	// In the first pass, a non-empty exp_Mcoarse_search limits the orientations that are searched
 	void getAllSquaredDifferences(long int part_id, int ibody,
 			int exp_ipass, int exp_current_oversampling, int metadata_offset,
 			int exp_idir_min, int exp_idir_max, int exp_ipsi_min, int exp_ipsi_max,
@@ -1138,6 +1224,7 @@ public:
             Matrix1D<RFLOAT> &exp_old_offset,
 			MultidimArray<RFLOAT> &exp_Mweight,
 			MultidimArray<bool> &exp_Mcoarse_significant,
+			MultidimArray<bool> &exp_Mcoarse_search,
 			std::vector<int> &exp_pointer_dir_nonzeroprior, std::vector<int> &exp_pointer_psi_nonzeroprior,
 			std::vector<RFLOAT> &exp_directions_prior, std::vector<RFLOAT> &exp_psi_prior,
 			std::vector<std::vector<MultidimArray<Complex > > > &exp_local_Fimgs_shifted,
@@ -1214,9 +1301,24 @@ public:
 	// Set metadata of a subset of particles to the experimental model
 	void setMetaDataSubset(long int my_first_part_id, long int my_last_part_id);
 
+	// Number of columns of exp_metadata: the common parameters, those of all bodies and, with --prune_cache, the pruning neighbourhood
+	int metadataLineLength() const;
+
+	// Column of one of the METADATA_PRUNE_* parameters in exp_metadata (only with --prune_cache)
+	int metadataPruneColumn(int iparam) const;
+
 	// Get metadata array of a subset of particles from the experimental model
 	void getMetaAndImageDataSubset(long int my_first_part_id, long int my_last_part_id, bool do_also_imagedata = true);
 
+	// Will the images be read in expectationSomeParticles, so that they can be prefetched?
+	bool canPrefetchImages();
+
+	// Set up the image_prefetcher, if the images will be read in expectationSomeParticles
+	void setupImagePrefetcher();
+
+	// Start reading the images of a subset of particles in the background
+	void prefetchImageDataSubset(long int my_first_part_id, long int my_last_part_id);
+
 	// Get the CTF (and Multiplicity weights where available) volumes from the stored files and correct them
 	void get3DCTFAndMulti(MultidimArray<RFLOAT> &Ictf, MultidimArray<RFLOAT> &Fctf, MultidimArray<RFLOAT> &FstMulti,
 			bool ctf_premultiplied);
@@ -1230,7 +1332,7 @@ public:
 
 };
 
-// Global call to threaded core of doThreadExpectationSomeParticles
+// Global call to threaded core of doThreadExpectationSomeParticles (on the GPU)
 void globalThreadExpectationSomeParticles(void *self, int thread_id);
 
 #endif /* MAXLIK_H_ */
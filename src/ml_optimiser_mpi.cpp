@@ -32,6 +32,7 @@
 #elif ALTCPU
 	#include <tbb/tbb.h>
 	#include "src/acc/cpu/cpu_ml_optimiser.h"
+	#include "src/acc/cpu/cpu_dispatch.h"
 #endif
 #include <stdio.h>
 #include <stdlib.h>
@@ -62,12 +63,31 @@ void MlOptimiserMpi::read(int argc, char **argv)
     if (node->isLeader())
     	PRINT_VERSION_INFO();
 
+    // With --continue, MlOptimiser::read already pre-reads the images: leave that to the first follower on each host
+    if (checkParameter(argc, argv, "--node_shared_memory") && !node->isLeader() && node->nodeRank > 0)
+        prevent_preread_images = true;
+
     // First read in non-parallelisation-dependent variables
     MlOptimiser::read(argc, argv, node->rank);
 
     int mpi_section = parser.addSection("MPI options");
     halt_all_followers_except_this = textToInteger(parser.getOption("--halt_all_followers_except", "For debugging: keep all followers except this one waiting", "-1"));
     do_keep_debug_reconstruct_files  = parser.checkOption("--keep_debug_reconstruct_files", "For debugging: keep temporary data and weight files for debug-reconstructions.");
+#ifdef USE_MPI_COLLECTIVE
+    reduce_algorithm = textToReduceAlgorithm(parser.getOption("--mpi_reduce", "How to sum the weighted sums over the followers: serial, ring, tree or collective (MPI_Allreduce)", "collective"));
+#else
+    reduce_algorithm = textToReduceAlgorithm(parser.getOption("--mpi_reduce", "How to sum the weighted sums over the followers: serial, ring or tree", "ring"));
+#endif
+    reduce_chunk_size = textToFloat(parser.getOption("--mpi_reduce_chunk", "Size (in MB) of the messages for ring and tree reductions, so that summation overlaps with communication", "4")) * 1024 * 1024 / sizeof(RFLOAT);
+    std::string pack_format = parser.getOption("--mpi_pack", "How to send the weighted sums: full (all of the Fourier box), shell (only within the current resolution) or float (shell, in single precision)", "shell");
+    if (pack_format != "full" && pack_format != "shell" && pack_format != "float")
+    	REPORT_ERROR("Unknown value for --mpi_pack: " + pack_format + " (use full, shell or float)");
+    do_pack_populated_only = (pack_format != "full");
+    do_transfer_as_float = (pack_format == "float");
+    do_node_shared_memory = parser.checkOption("--node_shared_memory", "Followers on the same host share one copy of the pre-read particles (with --preread_images) and of the references for the CPU kernels (with --cpu)");
+    // Releasing the double-precision references only pays off fully once the XFLOAT copies are not held once per follower
+    if (do_cpu && do_cpu_release_refs)
+    	do_node_shared_memory = true;
 
     // Don't put any output to screen for mpi followers
     ori_verb = verb;
@@ -738,11 +758,24 @@ will still yield good performance and possibly a more stable execution. \n" << s
 
 	// And allow plans before expectation to run using allowed
 	// number of threads
-	fftw_plan_with_nthreads(nr_threads);
+	FftwPlanCache::setPlannerThreads(nr_threads);
 #endif
 
 	MlOptimiser::initialiseGeneral(node->rank);
 
+	if (do_node_shared_memory && !node->isLeader())
+	{
+		MPI_Comm_split(node->nodeC, (do_split_random_halves) ? node->myRandomSubset() : 0, node->nodeRank, &nodeHalfC);
+		if (do_preread_images && do_parallel_disc_io)
+			shareImagesOverNode();
+	}
+
+#ifdef ALTCPU
+	// Nodes may support different instruction sets, so every follower reports its own
+	if (do_cpu && !node->isLeader())
+		std::cout << " Follower " << node->rank << " on " << node->getHostName() << " uses " << CpuKernels::cpuKernelReport() << std::endl;
+#endif
+
 	initialiseWorkLoad();
 
 	// Only the first follower calculates the sigma2_noise spectra (and if fn_ref == None, later sets initial guesses for Iref)
@@ -788,6 +821,104 @@ will still yield good performance and possibly a more stable execution. \n" << s
 #endif
 }
 
+void MlOptimiserMpi::shareImagesOverNode()
+{
+	long int nr_particles = mydata.numberOfParticles();
+	long int nr_particles_first = nr_particles;
+	MPI_Bcast(&nr_particles_first, 1, MPI_LONG, 0, node->nodeC);
+	if (nr_particles_first != nr_particles)
+		REPORT_ERROR("MlOptimiserMpi::shareImagesOverNode ERROR: the followers on " + node->getHostName() + " have different numbers of particles");
+	if (node->nodeSize < 2)
+		return;
+
+	// Size, origin and start in the shared memory (in floats) of each image, as read by the first follower
+	const int nr_values = 7;
+	const long int align = 16; // 64 bytes
+	std::vector<long int> layout(nr_values * nr_particles);
+	long int total = 0;
+	if (node->nodeRank == 0)
+	{
+		for (long int part_id = 0; part_id < nr_particles; part_id++)
+		{
+			const MultidimArray<float> &img = mydata.particles[part_id].img;
+			long int *shape = &layout[nr_values * part_id];
+			shape[0] = XSIZE(img);
+			shape[1] = YSIZE(img);
+			shape[2] = ZSIZE(img);
+			shape[3] = STARTINGX(img);
+			shape[4] = STARTINGY(img);
+			shape[5] = STARTINGZ(img);
+			shape[6] = total;
+			total += (MULTIDIM_SIZE(img) + align - 1) / align * align;
+		}
+	}
+	MPI_Bcast(&total, 1, MPI_LONG, 0, node->nodeC);
+	node->relion_MPI_Bcast(layout.data(), layout.size(), MPI_LONG, 0, node->nodeC);
+
+	float *shared = (float *)node->allocateSharedMemory(total * sizeof(float), node->nodeC, images_win);
+	MPI_Win_fence(0, images_win);
+	if (node->nodeRank == 0)
+	{
+		for (long int part_id = 0; part_id < nr_particles; part_id++)
+		{
+			MultidimArray<float> &img = mydata.particles[part_id].img;
+			memcpy(shared + layout[nr_values * part_id + 6], MULTIDIM_ARRAY(img), MULTIDIM_SIZE(img) * sizeof(float));
+			img.clear();
+		}
+		if (ori_verb > 0)
+			std::cout << " Follower " << node->rank << " shares " << total * sizeof(float) / (1024. * 1024. * 1024.)
+			          << " Gb of pre-read particles with " << node->nodeSize - 1 << " other followers on " << node->getHostName() << std::endl;
+	}
+	MPI_Win_fence(0, images_win);
+
+	// Point all images into the shared memory; they are only read from now on
+	for (long int part_id = 0; part_id < nr_particles; part_id++)
+	{
+		const long int *shape = &layout[nr_values * part_id];
+		MultidimArray<float> &img = mydata.particles[part_id].img;
+		img.clear();
+		img.setDimensions(shape[0], shape[1], shape[2], 1);
+		STARTINGX(img) = shape[3];
+		STARTINGY(img) = shape[4];
+		STARTINGZ(img) = shape[5];
+		img.data = shared + shape[6];
+		img.destroyData = false;
+	}
+}
+
+#ifdef ALTCPU
+void MlOptimiserMpi::shareCpuReferencesOverNode()
+{
+	int rank_in_node, size_of_node;
+	MPI_Comm_rank(nodeHalfC, &rank_in_node);
+	MPI_Comm_size(nodeHalfC, &size_of_node);
+
+	// Start of each class in the shared memory
+	unsigned nr_classes = mymodel.PPref.size();
+	const size_t align = MEM_ALIGN / sizeof(std::complex<XFLOAT>);
+	std::vector<size_t> first(nr_classes + 1, 0);
+	for (int iclass = 0; iclass < nr_classes; iclass++)
+		first[iclass + 1] = first[iclass] + (MULTIDIM_SIZE(mymodel.PPref[iclass].data) + align - 1) / align * align;
+
+	std::complex<XFLOAT> *shared = (std::complex<XFLOAT> *)node->allocateSharedMemory(
+			first[nr_classes] * sizeof(std::complex<XFLOAT>), nodeHalfC, references_win);
+
+	MPI_Win_fence(0, references_win);
+	for (int iclass = 0; iclass < nr_classes; iclass++)
+	{
+		mdlClassComplex[iclass] = shared + first[iclass];
+		if (iclass % size_of_node != rank_in_node)
+			continue;
+
+		std::complex<XFLOAT> *pData = mdlClassComplex[iclass];
+		const Complex *ref = MULTIDIM_ARRAY(mymodel.PPref[iclass].data);
+		for (size_t i = 0; i < MULTIDIM_SIZE(mymodel.PPref[iclass].data); i++)
+			pData[i] = std::complex<XFLOAT>((XFLOAT) ref[i].real, (XFLOAT) ref[i].imag);
+	}
+	MPI_Win_fence(0, references_win);
+}
+#endif
+
 void MlOptimiserMpi::initialiseWorkLoad()
 {
 	if (do_split_random_halves)
@@ -995,6 +1126,12 @@ void MlOptimiserMpi::expectation()
 #endif
 
 	MultidimArray<long int> first_last_nr_images(6);
+	// Jobs that the leader has reserved for a follower, so that it can read their images ahead
+	MultidimArray<long int> next_jobs(2 * XMIPP_MAX(1, nr_prefetch_pools));
+	// Only the followers read images; the leader only needs to know whether to reserve jobs for them
+	const bool do_prefetch_images = canPrefetchImages();
+	if (!node->isLeader())
+		setupImagePrefetcher();
 	int first_follower = 1;
 	// Use maximum of 100 particles for 3D and 10 particles for 2D estimations
 	int n_trials_acc = (mymodel.ref_dim==3 && (mymodel.data_dim != 3|| mydata.is_tomo) ) ? 100 : 10;
@@ -1003,7 +1140,7 @@ void MlOptimiserMpi::expectation()
 
 #ifdef MKLFFT
 	// Allow parallel FFTW execution
-	fftw_plan_with_nthreads(nr_threads);
+	FftwPlanCache::setPlannerThreads(nr_threads);
 #endif
 
 	// Initialise some stuff
@@ -1297,36 +1434,42 @@ void MlOptimiserMpi::expectation()
 			CRITICAL(RAMERR);
 
 		// Set up XFLOAT complex array shared by all threads for each class
-		for (int iclass = 0; iclass < nr_classes; iclass++)
+		// (and with --node_shared_memory, by all followers on this host)
+		if (do_node_shared_memory)
+			shareCpuReferencesOverNode();
+		else
 		{
-			int mdlX = mymodel.PPref[iclass].data.xdim;
-			int mdlY = mymodel.PPref[iclass].data.ydim;
-			int mdlZ = mymodel.PPref[iclass].data.zdim;
-			size_t mdlXYZ;
-			if(mdlZ == 0)
-				mdlXYZ = (size_t)mdlX*(size_t)mdlY;
-			else
-				mdlXYZ = (size_t)mdlX*(size_t)mdlY*(size_t)mdlZ;
-
-			try
+			for (int iclass = 0; iclass < nr_classes; iclass++)
 			{
-				mdlClassComplex[iclass] = new std::complex<XFLOAT>[mdlXYZ];
-			}
-			catch (std::bad_alloc& ba)
-			{
-				CRITICAL(RAMERR);
-			}
+				int mdlX = mymodel.PPref[iclass].data.xdim;
+				int mdlY = mymodel.PPref[iclass].data.ydim;
+				int mdlZ = mymodel.PPref[iclass].data.zdim;
+				size_t mdlXYZ;
+				if(mdlZ == 0)
+					mdlXYZ = (size_t)mdlX*(size_t)mdlY;
+				else
+					mdlXYZ = (size_t)mdlX*(size_t)mdlY*(size_t)mdlZ;
 
-			std::complex<XFLOAT> *pData = mdlClassComplex[iclass];
+				try
+				{
+					mdlClassComplex[iclass] = new std::complex<XFLOAT>[mdlXYZ];
+				}
+				catch (std::bad_alloc& ba)
+				{
+					CRITICAL(RAMERR);
+				}
 
-			// Copy results into complex number array
-			for (size_t i = 0; i < mdlXYZ; i ++)
-			{
-				std::complex<XFLOAT> arrayval(
-					(XFLOAT) mymodel.PPref[iclass].data.data[i].real,
-					(XFLOAT) mymodel.PPref[iclass].data.data[i].imag
-				);
-				pData[i] = arrayval;
+				std::complex<XFLOAT> *pData = mdlClassComplex[iclass];
+
+				// Copy results into complex number array
+				for (size_t i = 0; i < mdlXYZ; i ++)
+				{
+					std::complex<XFLOAT> arrayval(
+						(XFLOAT) mymodel.PPref[iclass].data.data[i].real,
+						(XFLOAT) mymodel.PPref[iclass].data.data[i].imag
+					);
+					pData[i] = arrayval;
+				}
 			}
 		}
 
@@ -1339,7 +1482,7 @@ void MlOptimiserMpi::expectation()
 
 #ifdef MKLFFT
 	// Single-threaded FFTW execution for code inside parallel processing loop
-	fftw_plan_with_nthreads(1);
+	FftwPlanCache::setPlannerThreads(1);
 #endif
 
 #ifdef TIMING
@@ -1399,6 +1542,52 @@ void MlOptimiserMpi::expectation()
 			long int nr_particles_done_halfset1 = 0;
 			long int nr_particles_done_halfset2 = 0;
 			long int my_nr_particles_done = 0;
+			// Particles whose results have come back; nr_particles_done also counts the ones that are only handed out or reserved
+			long int nr_particles_finished = 0;
+			std::vector<std::deque<std::pair<long int, long int> > > reserved_jobs(node->size);
+
+			// Hand out the next pool of particles of the random half-set of this follower, if there are any left
+			auto assignNextJob = [&](int follower, long int &first, long int &last) -> bool
+			{
+				if (do_split_random_halves)
+				{
+					random_halfset = (follower % 2 == 1) ? 1 : 2;
+					if (random_halfset == 1)
+					{
+						my_nr_particles_done = nr_particles_done_halfset1;
+						nr_particles_todo = my_last_particle_halfset1 - my_first_particle_halfset1 + 1;
+						first = nr_particles_done_halfset1;
+						last  = XMIPP_MIN(my_last_particle_halfset1, first + nr_pool - 1);
+					}
+					else
+					{
+						my_nr_particles_done = nr_particles_done_halfset2;
+						nr_particles_todo = my_last_particle_halfset2 - my_first_particle_halfset2 + 1;
+						first = mydata.numberOfParticles(1) + nr_particles_done_halfset2;
+						last  = XMIPP_MIN(my_last_particle_halfset2, first + nr_pool - 1);
+					}
+				}
+				else
+				{
+					random_halfset = 0;
+					my_nr_particles_done = nr_particles_done;
+					nr_particles_todo =  my_last_particle - my_first_particle + 1;
+					first = nr_particles_done;
+					last  = XMIPP_MIN(my_last_particle, first + nr_pool - 1);
+				}
+
+				if (my_nr_particles_done >= nr_particles_todo)
+					return false;
+
+				// Update the total number of particles that has been done already
+				nr_particles_done += last - first + 1;
+				if (random_halfset == 1)
+					nr_particles_done_halfset1 += last - first + 1;
+				else if (random_halfset == 2)
+					nr_particles_done_halfset2 += last - first + 1;
+
+				return true;
+			};
 
 
 			// SHWS10052021: reduce frequency of abort check 10-fold
@@ -1426,7 +1615,7 @@ void MlOptimiserMpi::expectation()
 				// Otherwise, the leader needs to receive and handle the updated metadata from the followers
 				if (JOB_NIMG > 0)
 				{
-					exp_metadata.resize(JOB_NIMG, METADATA_LINE_LENGTH_BEFORE_BODIES + (mymodel.nr_bodies) * METADATA_NR_BODY_PARAMS);
+					exp_metadata.resize(JOB_NIMG, metadataLineLength());
 					node->relion_MPI_Recv(MULTIDIM_ARRAY(exp_metadata), MULTIDIM_SIZE(exp_metadata), MY_MPI_DOUBLE, this_follower, MPITAG_METADATA, MPI_COMM_WORLD, status);
 
 					// The leader monitors the changes in the optimal orientations and classes
@@ -1434,46 +1623,33 @@ void MlOptimiserMpi::expectation()
 
 					// The leader then updates the mydata.MDimg table
 					MlOptimiser::setMetaDataSubset(JOB_FIRST, JOB_LAST);
-					if (verb > 0 && nr_particles_done - prev_barstep> progress_bar_step_size)
+					nr_particles_finished += JOB_NPAR;
+					if (verb > 0 && nr_particles_finished - prev_barstep> progress_bar_step_size)
 					{
-						prev_barstep = nr_particles_done;
+						prev_barstep = nr_particles_finished;
 						if (subset_size > 0 && do_split_random_halves)
-							progress_bar(nr_particles_done/2);
+							progress_bar(nr_particles_finished/2);
 						else
-							progress_bar(nr_particles_done + JOB_NPAR);
+							progress_bar(nr_particles_finished);
 					}
 				}
 
-				// See which random_halfset this follower belongs to, and keep track of the number of particles that have been processed already
-				if (do_split_random_halves)
+				// Jobs that were reserved for this follower come first
+				bool have_job;
+				if (reserved_jobs[this_follower].size() > 0)
 				{
-					random_halfset = (this_follower % 2 == 1) ? 1 : 2;
-					if (random_halfset == 1)
-					{
-						my_nr_particles_done = nr_particles_done_halfset1;
-						nr_particles_todo = my_last_particle_halfset1 - my_first_particle_halfset1 + 1;
-						JOB_FIRST = nr_particles_done_halfset1;
-						JOB_LAST  = XMIPP_MIN(my_last_particle_halfset1, JOB_FIRST + nr_pool - 1);
-					}
-					else
-					{
-						my_nr_particles_done = nr_particles_done_halfset2;
-						nr_particles_todo = my_last_particle_halfset2 - my_first_particle_halfset2 + 1;
-						JOB_FIRST = mydata.numberOfParticles(1) + nr_particles_done_halfset2;
-						JOB_LAST  = XMIPP_MIN(my_last_particle_halfset2, JOB_FIRST + nr_pool - 1);
-					}
+					JOB_FIRST = reserved_jobs[this_follower].front().first;
+					JOB_LAST  = reserved_jobs[this_follower].front().second;
+					reserved_jobs[this_follower].pop_front();
+					have_job = true;
 				}
 				else
 				{
-					random_halfset = 0;
-					my_nr_particles_done = nr_particles_done;
-					nr_particles_todo =  my_last_particle - my_first_particle + 1;
-					JOB_FIRST = nr_particles_done;
-					JOB_LAST  = XMIPP_MIN(my_last_particle, JOB_FIRST + nr_pool - 1);
+					have_job = assignNextJob(this_follower, JOB_FIRST, JOB_LAST);
 				}
 
 				// Now send out a new job
-				if (my_nr_particles_done < nr_particles_todo)
+				if (have_job)
 				{
 					MlOptimiser::getMetaAndImageDataSubset(JOB_FIRST, JOB_LAST, !do_parallel_disc_io);
 					JOB_NIMG = YSIZE(exp_metadata);
@@ -1507,6 +1683,22 @@ void MlOptimiserMpi::expectation()
 #endif
 				node->relion_MPI_Send(MULTIDIM_ARRAY(first_last_nr_images), MULTIDIM_SIZE(first_last_nr_images), MPI_LONG, this_follower, MPITAG_JOB_REPLY, MPI_COMM_WORLD);
 
+				// Reserve the next jobs for this follower and tell it which ones, so that it can read their images while it processes this one
+				if (JOB_NIMG > 0 && do_prefetch_images)
+				{
+					long int next_first, next_last;
+					while (reserved_jobs[this_follower].size() < nr_prefetch_pools && assignNextJob(this_follower, next_first, next_last))
+						reserved_jobs[this_follower].push_back(std::make_pair(next_first, next_last));
+
+					next_jobs.initConstant(-1);
+					for (int i = 0; i < reserved_jobs[this_follower].size(); i++)
+					{
+						DIRECT_A1D_ELEM(next_jobs, 2*i)   = reserved_jobs[this_follower][i].first;
+						DIRECT_A1D_ELEM(next_jobs, 2*i+1) = reserved_jobs[this_follower][i].second;
+					}
+					node->relion_MPI_Send(MULTIDIM_ARRAY(next_jobs), MULTIDIM_SIZE(next_jobs), MPI_LONG, this_follower, MPITAG_JOB_REPLY, MPI_COMM_WORLD);
+				}
+
 				//806 Leader also sends the required metadata and imagedata for this job
 				if (JOB_NIMG > 0)
 				{
@@ -1530,21 +1722,6 @@ void MlOptimiserMpi::expectation()
 						node->relion_MPI_Send(MULTIDIM_ARRAY(exp_imagedata), MULTIDIM_SIZE(exp_imagedata), MY_MPI_DOUBLE, this_follower, MPITAG_IMAGE, MPI_COMM_WORLD);
 					}
 				}
-
-				// Update the total number of particles that has been done already
-				nr_particles_done += JOB_NPAR;
-				if (do_split_random_halves)
-				{
-					// Also update the number of particles that has been done for each subset
-					if (random_halfset == 1)
-					{
-						nr_particles_done_halfset1 += JOB_NPAR;
-					}
-					else
-					{
-						nr_particles_done_halfset2 += JOB_NPAR;
-					}
-				}
 			}
 		}
 		catch (RelionError XE)
@@ -1600,6 +1777,7 @@ void MlOptimiserMpi::expectation()
 #endif
 					exp_imagedata.clear();
 					exp_metadata.clear();
+					image_prefetcher.clear();
 					break;
 				}
 				else
@@ -1607,8 +1785,17 @@ void MlOptimiserMpi::expectation()
 #ifdef TIMING
 					timer.tic(TIMING_MPISLAVEWAIT2);
 #endif
+					// Start reading the images of the jobs that the leader has reserved for me
+					if (do_prefetch_images)
+					{
+						node->relion_MPI_Recv(MULTIDIM_ARRAY(next_jobs), MULTIDIM_SIZE(next_jobs), MPI_LONG, 0, MPITAG_JOB_REPLY, MPI_COMM_WORLD, status);
+						for (int i = 0; i < nr_prefetch_pools; i++)
+							if (DIRECT_A1D_ELEM(next_jobs, 2*i) >= 0)
+								prefetchImageDataSubset(DIRECT_A1D_ELEM(next_jobs, 2*i), DIRECT_A1D_ELEM(next_jobs, 2*i+1));
+					}
+
 					// Also receive the imagedata and the metadata for these images from the leader
-					exp_metadata.resize(JOB_NIMG, METADATA_LINE_LENGTH_BEFORE_BODIES + (mymodel.nr_bodies) * METADATA_NR_BODY_PARAMS);
+					exp_metadata.resize(JOB_NIMG, metadataLineLength());
 					node->relion_MPI_Recv(MULTIDIM_ARRAY(exp_metadata), MULTIDIM_SIZE(exp_metadata), MY_MPI_DOUBLE, 0, MPITAG_METADATA, MPI_COMM_WORLD, status);
 
 					// Receive the image filenames or the exp_imagedata
@@ -1838,6 +2025,10 @@ void MlOptimiserMpi::expectation()
 
 				for (int j = 0; j < b->backprojectors.size(); j++)
 				{
+					// With --cpu_release_refs, MlDataBundle::setup released the weighted sums
+					if (do_cpu_release_refs)
+						wsum_model.BPref[j].initZeros(wsum_model.current_size);
+
 					unsigned long s = wsum_model.BPref[j].data.nzyxdim;
 					XFLOAT *reals = NULL;
 					XFLOAT *imags = NULL;
@@ -1862,10 +2053,15 @@ void MlOptimiserMpi::expectation()
 				accDataBundles.clear();
 
 				// Now clean up
-				unsigned nr_classes = mymodel.nr_classes;
-				for (int iclass = 0; iclass < nr_classes; iclass++)
+				if (do_node_shared_memory)
+					node->freeSharedMemory(references_win);
+				else
 				{
-					delete [] mdlClassComplex[iclass];
+					unsigned nr_classes = mymodel.nr_classes;
+					for (int iclass = 0; iclass < nr_classes; iclass++)
+					{
+						delete [] mdlClassComplex[iclass];
+					}
 				}
 				free(mdlClassComplex);
 
@@ -1886,7 +2082,7 @@ void MlOptimiserMpi::expectation()
 #ifdef  MKLFFT
 	// Allow parallel FFTW execution to continue now that we are outside the parallel
 	// portion of expectation
-	fftw_plan_with_nthreads(nr_threads);
+	FftwPlanCache::setPlannerThreads(nr_threads);
 #endif
 
 	// Just make sure the temporary arrays are empty...
@@ -1908,6 +2104,21 @@ void MlOptimiserMpi::expectation()
 	// Wait until expected angular errors have been calculated
 	MPI_Barrier(MPI_COMM_WORLD);
 
+	// Sum the statistics of the pruned coarse searches over all followers, so that the leader can report them
+	if (do_prune_cache)
+	{
+		RFLOAT my_stats[5] = {(RFLOAT)prune_nr_part_pruned, (RFLOAT)prune_nr_part_full, (RFLOAT)prune_nr_fallback,
+		                      prune_nr_orient_searched, prune_nr_orient_all};
+		RFLOAT all_stats[5];
+		MPI_Allreduce(my_stats, all_stats, 5, MY_MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+		prune_nr_part_pruned = ROUND(all_stats[0]);
+		prune_nr_part_full = ROUND(all_stats[1]);
+		prune_nr_fallback = ROUND(all_stats[2]);
+		prune_nr_orient_searched = all_stats[3];
+		prune_nr_orient_all = all_stats[4];
+		reportOrientationPruning();
+	}
+
 	// All followers reset the size of their projector to zero to save memory
 	if (!node->isLeader())
 	{
@@ -2043,27 +2254,50 @@ void MlOptimiserMpi::combineAllWeightedSums()
 	std::cerr << " starting combineAllWeightedSums..." << std::endl;
 #endif
 	// Only combine weighted sums if there are more than one followers per subset!
-	if ((node->size - 1)/nr_halfsets > 1)
+	if ((node->size - 1)/nr_halfsets > 1 && (reduce_algorithm == REDUCE_RING || reduce_algorithm == REDUCE_TREE))
 	{
+		if (!node->isLeader())
+		{
+			// Sum over all followers of the same random half (or over all followers)
+			std::vector<int> ranks;
+			for (int follower = 1; follower < node->size; follower++)
+				if (!do_split_random_halves || follower % 2 == node->rank % 2)
+					ranks.push_back(follower);
+
+			wsum_model.pack(Mpack, do_pack_populated_only);
+			node->sumOverRanks(MULTIDIM_ARRAY(Mpack), MULTIDIM_SIZE(Mpack), ranks, reduce_algorithm, reduce_chunk_size, do_transfer_as_float);
+			wsum_model.unpack(Mpack, do_pack_populated_only);
+		}
+	}
 #ifdef USE_MPI_COLLECTIVE
+	else if ((node->size - 1)/nr_halfsets > 1 && reduce_algorithm == REDUCE_COLLECTIVE)
+	{
 		if (!node->isLeader())
 		{
 			// First all followers pack up their wsum_model
-			wsum_model.pack(Mpack);
+			wsum_model.pack(Mpack, do_pack_populated_only);
 			Msum.initZeros(Mpack);
 
-			if (do_split_random_halves)
-				node->relion_MPI_Allreduce(MULTIDIM_ARRAY(Mpack), MULTIDIM_ARRAY(Msum), MULTIDIM_SIZE(Mpack), MY_MPI_DOUBLE, MPI_SUM, node->splitC);
+			MPI_Comm comm = (do_split_random_halves) ? node->splitC : node->followerC;
+			if (do_transfer_as_float)
+			{
+				std::vector<float> fpack(MULTIDIM_ARRAY(Mpack), MULTIDIM_ARRAY(Mpack) + MULTIDIM_SIZE(Mpack)), fsum(MULTIDIM_SIZE(Mpack));
+				node->relion_MPI_Allreduce(&fpack[0], &fsum[0], MULTIDIM_SIZE(Mpack), MPI_FLOAT, MPI_SUM, comm);
+				std::copy(fsum.begin(), fsum.end(), MULTIDIM_ARRAY(Msum));
+			}
 			else
-				node->relion_MPI_Allreduce(MULTIDIM_ARRAY(Mpack), MULTIDIM_ARRAY(Msum), MULTIDIM_SIZE(Mpack), MY_MPI_DOUBLE, MPI_SUM, node->followerC);
+				node->relion_MPI_Allreduce(MULTIDIM_ARRAY(Mpack), MULTIDIM_ARRAY(Msum), MULTIDIM_SIZE(Mpack), MY_MPI_DOUBLE, MPI_SUM, comm);
  #ifdef DEBUG
 			if (node->rank == 1) std::cerr << " MPI_Allreduce MULTIDIM_SIZE(Mpack)= "<< MULTIDIM_SIZE(Mpack) << std::endl;
  #endif
 
 			Mpack.clear();
-			wsum_model.unpack(Msum);
+			wsum_model.unpack(Msum, do_pack_populated_only);
 		}
-#else
+	}
+#endif
+	else if ((node->size - 1)/nr_halfsets > 1)
+	{
 		// Loop over possibly multiple instances of Mpack of maximum size
 		int piece = 0;
 		int nr_pieces = 1;
@@ -2181,7 +2415,6 @@ void MlOptimiserMpi::combineAllWeightedSums()
 		} // end for piece
 
 		MPI_Barrier(MPI_COMM_WORLD);
-#endif
 	}
 
 #ifdef TIMING
@@ -2251,6 +2484,28 @@ void MlOptimiserMpi::combineWeightedSumsTwoRandomHalves()
 	MultidimArray<RFLOAT> Mpack, Msum;
 	MPI_Status status;
 
+	if (do_pack_populated_only)
+	{
+		// The leader does not have a wsum_model!
+		if (!node->isLeader())
+		{
+			if (node->rank == 1 && verb > 0) std::cout << " Combining two random halves ..."<< std::endl;
+			wsum_model.pack(Mpack, true);
+
+			// Followers 1 and 2 add up their halves, and follower 1 then sends the sum to everyone else
+			if (node->rank <= 2)
+				node->sumOverRanks(MULTIDIM_ARRAY(Mpack), MULTIDIM_SIZE(Mpack), std::vector<int>{1, 2}, REDUCE_RING, reduce_chunk_size, do_transfer_as_float);
+
+			if (do_transfer_as_float)
+				node->bcastInSinglePrecision(MULTIDIM_ARRAY(Mpack), MULTIDIM_SIZE(Mpack), 0, node->followerC);
+			else
+				node->relion_MPI_Bcast(MULTIDIM_ARRAY(Mpack), MULTIDIM_SIZE(Mpack), MY_MPI_DOUBLE, 0, node->followerC);
+
+			wsum_model.unpack(Mpack, true);
+		}
+		return;
+	}
+
 #ifdef USE_MPI_COLLECTIVE
 	// The leader does not have a wsum_model!
 	if (!node->isLeader())
@@ -2481,7 +2736,9 @@ void MlOptimiserMpi::maximization()
 										mymodel.tau2_fudge_factor,
 										wsum_model.pdf_class[iclass],
 										minres_map,
-										false);
+										false,
+										NULL,
+										nr_threads);
 							}
 						}
 					}
@@ -2619,7 +2876,9 @@ void MlOptimiserMpi::maximization()
 											mymodel.tau2_fudge_factor,
 											wsum_model.pdf_class[iclass],
 											minres_map,
-											false);
+											false,
+											NULL,
+											nr_threads);
 								}
 							}
 
@@ -3644,7 +3903,7 @@ void MlOptimiserMpi::calculateExpectedAngularErrors(long int my_first_part_id, l
 	{
 		// Follower has to receive all metadata from the leader!
 		node->relion_MPI_Recv(&my_nr_images, 1, MPI_INT, 0, MPITAG_JOB_REQUEST, MPI_COMM_WORLD, status);
-		exp_metadata.resize(my_nr_images, METADATA_LINE_LENGTH_BEFORE_BODIES + (mymodel.nr_bodies) * METADATA_NR_BODY_PARAMS);
+		exp_metadata.resize(my_nr_images, metadataLineLength());
 		node->relion_MPI_Recv(MULTIDIM_ARRAY(exp_metadata), MULTIDIM_SIZE(exp_metadata), MY_MPI_DOUBLE, 0, MPITAG_METADATA, MPI_COMM_WORLD, status);
 		node->relion_MPI_Recv(&length_fn_ctf, 1, MPI_INT, 0, MPITAG_JOB_REQUEST, MPI_COMM_WORLD, status);
 		if (length_fn_ctf > 1)
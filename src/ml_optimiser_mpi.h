@@ -45,9 +45,29 @@ public:
     // Original verb
     int ori_verb;
 
+    // How combineAllWeightedSums sums the weighted sums over the followers, and in messages of how many elements
+    ReduceAlgorithm reduce_algorithm;
+    long int reduce_chunk_size;
+
+    // Only send the Fourier components that backprojection can fill, and whether to send them in single precision
+    bool do_pack_populated_only, do_transfer_as_float;
+
+    // Let the followers on each host share one copy of the pre-read images and of the references for the CPU kernels
+    bool do_node_shared_memory;
+
+    // Followers on the same host that refine the same half-set (and thus can share references)
+    MPI_Comm nodeHalfC = MPI_COMM_NULL;
+
+    // MPI-3 shared windows with the pre-read images and the references for the CPU kernels
+    MPI_Win images_win = MPI_WIN_NULL, references_win = MPI_WIN_NULL;
+
 	/** Destructor, calls MPI_Finalize */
     ~MlOptimiserMpi()
     {
+        // The shared images have to be released before MPI_Finalize
+        node->freeSharedMemory(images_win);
+        if (nodeHalfC != MPI_COMM_NULL)
+            MPI_Comm_free(&nodeHalfC);
         delete node;
     }
 
@@ -63,6 +83,18 @@ public:
 
     void initialise();
 
+    /** With --node_shared_memory and pre-read images, the first follower on each host has read them.
+     *  Move its images into memory that is shared with the other followers on the host, and let them all use that.
+     */
+    void shareImagesOverNode();
+
+#ifdef ALTCPU
+    /** With --node_shared_memory, set up mdlClassComplex in memory shared by the followers on this host
+     *  that refine the same half-set. Each of them converts some of the classes from PPref.
+     */
+    void shareCpuReferencesOverNode();
+#endif
+
     /** Initialise the work load: divide images equally over all nodes
      * Also initialise the same random seed for all nodes
      */
@@ -18,6 +18,11 @@
  * author citations must be preserved.
  ***************************************************************************/
 #include <omp.h>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 
 #include "src/motioncorr_runner.h"
 #ifdef _CUDA_ENABLED
@@ -35,10 +40,24 @@
 
 //#define TIMING
 #ifdef TIMING
-	#define RCTIC(label) (MCtimer.tic(label))
-	#define RCTOC(label) (MCtimer.toc(label))
+	#define RCTIC(label) (lockedMCtimerTic(label))
+	#define RCTOC(label) (lockedMCtimerToc(label))
 
 	Timer MCtimer;
+
+	// The reader stage of runOwnPipeline() times its steps while the alignment stage times its own
+	std::mutex MCtimer_mutex;
+	static void lockedMCtimerTic(int label)
+	{
+		std::lock_guard<std::mutex> lock(MCtimer_mutex);
+		MCtimer.tic(label);
+	}
+	static void lockedMCtimerToc(int label)
+	{
+		std::lock_guard<std::mutex> lock(MCtimer_mutex);
+		MCtimer.toc(label);
+	}
+
 	int TIMING_READ_GAIN = MCtimer.setNew("read gain");
 	int TIMING_READ_MOVIE = MCtimer.setNew("read movie");
 	int TIMING_APPLY_GAIN = MCtimer.setNew("apply gain");
@@ -134,6 +153,8 @@ void MotioncorrRunner::read(int argc, char **argv, int rank)
 		std::cerr << "Since RELION 3.1, --early_binning is on by default. Use --no_early_binning to disable it." << std::endl;
 
 	early_binning = !parser.checkOption("--no_early_binning", "Disable --early_binning");
+	streaming_window = textToInteger(parser.getOption("--streaming_window", "Keep at most this many whole frames in memory, by reading the movie once for each step. The low frequencies used for the alignment are still kept for all frames (and patches of all frame groups), so memory use grows much more slowly with the number of frames. 0 = keep all frames", "0"));
+	do_pipeline = parser.checkOption("--pipeline", "Read the next movie (with --max_io_threads threads) and write the previous one in other threads while a movie is aligned with --j threads. The frames of two movies are then in memory.");
 	if (fabs(bin_factor - 1) < 0.01)
 		early_binning = false;
 
@@ -147,6 +168,9 @@ void MotioncorrRunner::read(int argc, char **argv, int rank)
 	dose_motionstats_cutoff = textToFloat(parser.getOption("--dose_motionstats_cutoff", "Electron dose (in electrons/A2) at which to distinguish early/late global accumulated motion in output statistics", "4."));
 	if (ccf_downsample > 1) REPORT_ERROR("--ccf_downsample cannot exceed 1.");
 	if (skip_defect && !do_own) REPORT_ERROR("--skip_decet is valid only for --use_own");
+	if (streaming_window < 0) REPORT_ERROR("--streaming_window cannot be negative.");
+	if (streaming_window > 0 && !do_own) REPORT_ERROR("--streaming_window is valid only for --use_own");
+	if (do_pipeline && !do_own) REPORT_ERROR("--pipeline is valid only for --use_own");
 	// Initialise verb for non-parallel execution
 	verb = 1;
 
@@ -503,35 +527,43 @@ void MotioncorrRunner::run()
 		barstep = XMIPP_MAX(1, fn_micrographs.size() / 60);
 	}
 
-	for (long int imic = 0; imic < fn_micrographs.size(); imic++)
+	if (do_own && do_pipeline)
 	{
-		if (verb > 0 && imic % barstep == 0)
-			progress_bar(imic);
-
-		// Abort through the pipeline_control system
-		if (pipeline_control_check_abort_job())
+		if (!runOwnPipeline(0, (long int)fn_micrographs.size() - 1))
 			exit(RELION_EXIT_ABORTED);
+	}
+	else
+	{
+		for (long int imic = 0; imic < fn_micrographs.size(); imic++)
+		{
+			if (verb > 0 && imic % barstep == 0)
+				progress_bar(imic);
 
-		Micrograph mic(fn_micrographs[imic], fn_gain_reference, bin_factor, eer_upsampling, eer_grouping);
+			// Abort through the pipeline_control system
+			if (pipeline_control_check_abort_job())
+				exit(RELION_EXIT_ABORTED);
 
-        // Set per-micrograph pre_exposure
-        mic.pre_exposure = pre_exposure + pre_exposure_micrographs[imic];
+			Micrograph mic(fn_micrographs[imic], fn_gain_reference, bin_factor, eer_upsampling, eer_grouping);
 
-        // Get angpix and voltage from the optics groups:
-		obsModel.opticsMdt.getValue(EMDL_CTF_VOLTAGE, voltage, optics_group_micrographs[imic]-1);
-		obsModel.opticsMdt.getValue(EMDL_MICROGRAPH_ORIGINAL_PIXEL_SIZE, angpix, optics_group_micrographs[imic]-1);
+	        // Set per-micrograph pre_exposure
+	        mic.pre_exposure = pre_exposure + pre_exposure_micrographs[imic];
 
-		bool result = false;
-		if (do_own)
-			result = executeOwnMotionCorrection(mic);
-		else if (do_motioncor2)
-			result = executeMotioncor2(mic);
-		else
-			REPORT_ERROR("Bug: by now it should be clear whether to use MotionCor2 or own implementation ...");
+	        // Get angpix and voltage from the optics groups:
+			obsModel.opticsMdt.getValue(EMDL_CTF_VOLTAGE, voltage, optics_group_micrographs[imic]-1);
+			obsModel.opticsMdt.getValue(EMDL_MICROGRAPH_ORIGINAL_PIXEL_SIZE, angpix, optics_group_micrographs[imic]-1);
+
+			bool result = false;
+			if (do_own)
+				result = executeOwnMotionCorrection(mic);
+			else if (do_motioncor2)
+				result = executeMotioncor2(mic);
+			else
+				REPORT_ERROR("Bug: by now it should be clear whether to use MotionCor2 or own implementation ...");
 
-		if (result) {
-			saveModel(mic);
-			plotShifts(fn_micrographs[imic], mic);
+			if (result) {
+				saveModel(mic);
+				plotShifts(fn_micrographs[imic], mic);
+			}
 		}
 	}
 
@@ -894,16 +926,20 @@ void MotioncorrRunner::plotShifts(FileName fn_mic, Micrograph &mic)
 }
 
 void MotioncorrRunner::saveModel(Micrograph &mic) {
-	mic.angpix = angpix;
-	mic.voltage = voltage;
-	mic.dose_per_frame = dose_per_frame;
-	mic.fnDefect = fn_defect;
+	setModelParameters(mic);
 
 	FileName fn_avg = getOutputFileNames(mic.getMovieFilename());
 
 	mic.write(fn_avg.withoutExtension() + ".star");
 }
 
+void MotioncorrRunner::setModelParameters(Micrograph &mic) {
+	mic.angpix = angpix;
+	mic.voltage = voltage;
+	mic.dose_per_frame = dose_per_frame;
+	mic.fnDefect = fn_defect;
+}
+
 void MotioncorrRunner::generateLogFilePDFAndWriteStarFiles()
 {
 
@@ -1105,13 +1141,181 @@ void MotioncorrRunner::generateLogFilePDFAndWriteStarFiles()
 }
 
 bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
+	OwnMovie movie;
+	movie.mic = &mic;
+	const bool result = readOwnMovie(movie) && alignOwnMovie(movie);
+	writeOwnMovie(movie);
+	return result;
+}
+
+bool MotioncorrRunner::runOwnPipeline(long int first_mic, long int last_mic) {
+	// Movie N + 1 is read by n_io_threads threads (see readOwnMovie) while movie N is aligned by n_threads threads
+	// and the output of movie N - 1 is written by one thread. The frames of at most two movies are in memory.
+	struct Job
+	{
+		long int imic;
+		std::unique_ptr<Micrograph> mic;
+		OwnMovie movie;
+		bool result;
+	};
+
+	// A movie that has been read, but not aligned, and one that has been aligned, but not written
+	std::unique_ptr<Job> read_job, aligned_job;
+	bool compute_done = false, stopping = false;
+	std::exception_ptr error;
+	std::mutex mutex;
+	std::condition_variable changed;
+
+	auto fail = [&]() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!error)
+			error = std::current_exception();
+		stopping = true;
+		changed.notify_all();
+	};
+
+	auto readMovies = [&]() {
+		for (long int imic = first_mic; imic <= last_mic; imic++)
+		{
+			{
+				// Only start on the next movie when the previous one is being aligned
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [&]{ return !read_job || stopping; });
+				if (stopping)
+					return;
+			}
+
+			std::unique_ptr<Job> job(new Job());
+			try
+			{
+				job->imic = imic;
+				job->mic.reset(new Micrograph(fn_micrographs[imic], fn_gain_reference, bin_factor, eer_upsampling, eer_grouping));
+				job->mic->pre_exposure = pre_exposure + pre_exposure_micrographs[imic];
+				job->movie.mic = job->mic.get();
+				job->movie.buffered = true;
+				job->result = readOwnMovie(job->movie);
+			}
+			catch (...)
+			{
+				fail();
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			read_job = std::move(job);
+			changed.notify_all();
+		}
+	};
+
+	auto writeMovies = [&]() {
+		while (true)
+		{
+			std::unique_ptr<Job> job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				changed.wait(lock, [&]{ return aligned_job || compute_done || stopping; });
+				if (stopping || !aligned_job)
+					return;
+				job = std::move(aligned_job);
+				changed.notify_all();
+			}
+
+			try
+			{
+				writeOwnMovie(job->movie);
+				if (job->result)
+				{
+					job->mic->write(job->movie.fn_avg.withoutExtension() + ".star");
+					plotShifts(fn_micrographs[job->imic], *job->mic);
+				}
+			}
+			catch (...)
+			{
+				fail();
+				return;
+			}
+		}
+	};
+
+	std::thread reader(readMovies), writer(writeMovies);
+
+	const long int n_mics = last_mic - first_mic + 1;
+	const long int barstep = XMIPP_MAX(1, n_mics / 60);
+	bool aborted = false;
+	for (long int imic = first_mic; imic <= last_mic; imic++)
+	{
+		if (verb > 0 && (imic - first_mic) % barstep == 0)
+			progress_bar(imic - first_mic);
+
+		// Abort through the pipeline_control system
+		if (pipeline_control_check_abort_job())
+		{
+			aborted = true;
+			break;
+		}
+
+		std::unique_ptr<Job> job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			changed.wait(lock, [&]{ return read_job || stopping; });
+			if (stopping)
+				break;
+			job = std::move(read_job);
+			changed.notify_all();
+		}
+
+		// Get angpix and voltage from the optics groups. Only this stage uses these members.
+		obsModel.opticsMdt.getValue(EMDL_CTF_VOLTAGE, voltage, optics_group_micrographs[imic]-1);
+		obsModel.opticsMdt.getValue(EMDL_MICROGRAPH_ORIGINAL_PIXEL_SIZE, angpix, optics_group_micrographs[imic]-1);
+
+		try
+		{
+			if (job->result)
+				job->result = alignOwnMovie(job->movie);
+			if (job->result)
+				setModelParameters(*job->mic);
+		}
+		catch (...)
+		{
+			fail();
+			break;
+		}
+		job->movie.Iframes.clear();
+
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [&]{ return !aligned_job || stopping; });
+		if (stopping)
+			break;
+		aligned_job = std::move(job);
+		changed.notify_all();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		compute_done = true;
+		if (aborted)
+			stopping = true;
+		changed.notify_all();
+	}
+	reader.join();
+	writer.join();
+
+	if (error)
+		std::rethrow_exception(error);
+
+	return !aborted;
+}
+
+bool MotioncorrRunner::readOwnMovie(OwnMovie &movie) {
+	Micrograph &mic = *movie.mic;
 	FileName fn_mic = mic.getMovieFilename();
-	FileName fn_avg = getOutputFileNames(fn_mic);
-	FileName fn_avg_noDW = fn_avg.withoutExtension() + "_noDW.mrc";
-	FileName fn_log = fn_avg.withoutExtension() + ".log";
-	FileName fn_ps = fn_avg.withoutExtension() + "_PS.mrc";
-	std::ofstream logfile;
-	logfile.open(fn_log);
+	movie.fn_avg = getOutputFileNames(fn_mic);
+	movie.fn_avg_noDW = movie.fn_avg.withoutExtension() + "_noDW.mrc";
+	movie.fn_log = movie.fn_avg.withoutExtension() + ".log";
+	movie.fn_ps = movie.fn_avg.withoutExtension() + "_PS.mrc";
+	if (!movie.buffered)
+		movie.logfile_direct.open(movie.fn_log);
+	std::ostream &logfile = movie.logfile();
 
 	// EER and compressed MRC related things
 	// TODO: will be refactored
@@ -1128,17 +1332,11 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 		logfile << "Limitted the number of IO threads per movie to " << n_io_threads << " thread(s)." << std::endl;
 	}
 
-	Image<float> Ihead, Igain, Iref, Iref_odd, Iref_even;
-	std::vector<MultidimArray<fComplex> > Fframes;
-	std::vector<Image<float> > Iframes;
-	std::vector<Image<float> > Irefframes;
-	std::vector<int> frames; // 0-indexed
-
-	RFLOAT output_angpix = angpix * bin_factor;
-	RFLOAT prescaling = 1;
+	Image<float> Ihead;
+	Image<float> &Igain = movie.Igain;
+	std::vector<Image<float> > &Iframes = movie.Iframes;
+	std::vector<int> &frames = movie.frames; // 0-indexed
 
-	const int hotpixel_sigma = 6;
-	const int fit_rmsd_threshold = 10; // px
 	int nx, ny, nn;
 
 	// Check image size
@@ -1175,10 +1373,6 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 
 	const int n_frames = frames.size();
 	Iframes.resize(n_frames);
-	Irefframes.resize(n_frames);
-	Fframes.resize(n_frames);
-
-	std::vector<RFLOAT> xshifts(n_frames), yshifts(n_frames);
 
 	// Setup grouping
 	logfile << "Frame grouping: n_frames = " << n_frames << ", requested group size = " << group << std::endl;
@@ -1189,7 +1383,9 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 		return false;
 	}
 	int n_remaining = n_frames % group;
-	std::vector<int> group_start(n_groups, 0), group_size(n_groups, group);
+	std::vector<int> &group_start = movie.group_start, &group_size = movie.group_size;
+	group_start.assign(n_groups, 0);
+	group_size.assign(n_groups, group);
 	while (n_remaining > 0) {
 		for (int i = n_groups - 1; i >= 1 && n_remaining > 0; i--) {
 			// Do not expand the first group, where the motion is largest.
@@ -1230,10 +1426,18 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 		}
 	}
 	RCTOC(TIMING_READ_GAIN);
+	movie.nx = nx;
+	movie.ny = ny;
+
+	// With streaming_window, alignOwnMovie reads the frames itself
+	if (streaming_window > 0)
+		return true;
 
 	// Read images
 	RCTIC(TIMING_READ_MOVIE);
-	#pragma omp parallel for num_threads(isCompressedMRC ? 1 : n_io_threads)
+	if (isEER)
+		renderer.preReadFrames(n_io_threads);
+	#pragma omp parallel for num_threads((isCompressedMRC && !compressedMRCreader.isRandomAccess()) ? 1 : n_io_threads)
 	for (int iframe = 0; iframe < n_frames; iframe++) {
 		if (isEER)
 			renderer.renderFrames(frames[iframe] * eer_grouping + 1, (frames[iframe] + 1) * eer_grouping, Iframes[iframe]());
@@ -1244,6 +1448,33 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	}
 	RCTOC(TIMING_READ_MOVIE);
 
+	return true;
+}
+
+bool MotioncorrRunner::alignOwnMovie(OwnMovie &movie) {
+	Micrograph &mic = *movie.mic;
+	FileName fn_mic = mic.getMovieFilename();
+	FileName fn_avg = movie.fn_avg, fn_avg_noDW = movie.fn_avg_noDW;
+	std::ostream &logfile = movie.logfile();
+	const bool isEER = EERRenderer::isEER(fn_mic);
+
+	if (streaming_window > 0)
+		return executeOwnMotionCorrectionStreaming(movie);
+
+	Image<float> Iref, Iref_odd, Iref_even;
+	Image<float> &Igain = movie.Igain;
+	std::vector<Image<float> > &Iframes = movie.Iframes;
+	std::vector<int> &frames = movie.frames, &group_start = movie.group_start, &group_size = movie.group_size;
+	const int n_frames = frames.size(), n_groups = group_start.size();
+	int nx = movie.nx, ny = movie.ny;
+
+	std::vector<MultidimArray<fComplex> > Fframes(n_frames);
+	std::vector<Image<float> > Irefframes(n_frames);
+	std::vector<RFLOAT> xshifts(n_frames), yshifts(n_frames);
+
+	RFLOAT output_angpix = angpix * bin_factor;
+	RFLOAT prescaling = 1;
+
 	// Apply gain
 	RCTIC(TIMING_APPLY_GAIN);
 	if (fn_gain_reference != "") {
@@ -1272,99 +1503,14 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	if (!skip_defect)
 	{
 		RCTIC(TIMING_DETECT_HOT);
-		RFLOAT mean = 0, std = 0;
-		#pragma omp parallel for reduction(+:mean) num_threads(n_threads)
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum) {
-			mean += DIRECT_MULTIDIM_ELEM(Isum, n);
-		}
-		mean /=  YXSIZE(Isum);
-		#pragma omp parallel for reduction(+:std) num_threads(n_threads)
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum) {
-			RFLOAT d = (DIRECT_MULTIDIM_ELEM(Isum, n) - mean);
-			std += d * d;
-		}
-		std = std::sqrt(std / YXSIZE(Isum));
-		const RFLOAT threshold = mean + hotpixel_sigma * std;
-		logfile << "In unaligned sum, Mean = " << mean << " Std = " << std << " Hotpixel threshold = " << threshold << std::endl;
-
-		MultidimArray<bool> bBad(ny, nx);
-		bBad.initZeros();
-		if (fn_defect != "")
-		{
-			fillDefectMask(bBad, fn_defect, n_threads);
-#ifdef DEBUG_HOTPIXELS
-			Image<RFLOAT> tmp(nx, ny);
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(tmp())
-				DIRECT_MULTIDIM_ELEM(tmp(), n) = DIRECT_MULTIDIM_ELEM(bBad, n);
-			tmp.write("defect.mrc");
-#endif
-		}
-
-		if (fn_gain_reference != "")
-		{
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Igain())
-			{
-				if (DIRECT_MULTIDIM_ELEM(Igain(), n) == 0)
-				{
-					DIRECT_MULTIDIM_ELEM(bBad, n) = true;
-				}
-			}
-		}
-
-		int n_bad = 0;
-		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum) {
-			if (DIRECT_MULTIDIM_ELEM(Isum, n) > threshold && !DIRECT_MULTIDIM_ELEM(bBad, n)) {
-				DIRECT_MULTIDIM_ELEM(bBad, n) = true;
-				n_bad++;
-				mic.hotpixelX.push_back(n % nx);
-				mic.hotpixelY.push_back(n / nx);
-			}
-		}
-		logfile << "Detected " << n_bad << " hot pixels to be corrected." << std::endl;
+		RFLOAT mean, std;
+		MultidimArray<bool> bBad;
+		detectHotPixels(Isum, Igain, mic, bBad, mean, std, logfile);
 		Isum.clear();
 		RCTOC(TIMING_DETECT_HOT);
 
 		RCTIC(TIMING_FIX_DEFECT);
-		const RFLOAT frame_mean = mean / n_frames;
-		const RFLOAT frame_std = std / n_frames;
-
-		const int NUM_MIN_OK = 6;
-		const int D_MAX = isEER ? 4 : 2;
-		const int PBUF_SIZE = 100;
-		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(bBad)
-		{
-			if (!DIRECT_A2D_ELEM(bBad, i, j)) continue;
-//			std::cout << "Hot pixel at (" << i << ", " << j << ")" << std::endl;
-			#pragma omp parallel for num_threads(n_threads)
-			for (int iframe = 0; iframe < n_frames; iframe++)
-			{
-				RFLOAT pbuf[PBUF_SIZE];
-//				std::cout << "Frame: "<< iframe << std::endl;
-				int n_ok = 0;
-				for (int dy= -D_MAX; dy <= D_MAX; dy++)
-				{
-					int y = i + dy;
-					if (y < 0 || y >= ny) continue;
-					for (int dx = -D_MAX; dx <= D_MAX; dx++)
-					{
-						int x = j + dx;
-						if (x < 0 || x >= nx) continue;
-//						std::cout << " " << DIRECT_A2D_ELEM(Iframes[iframe](), y, x);
-						if (DIRECT_A2D_ELEM(bBad, y, x)) continue;
-//						std::cout << "o";
-						pbuf[n_ok] = DIRECT_A2D_ELEM(Iframes[iframe](), y, x);
-						n_ok++;
-					}
-//					std::cout << std::endl;
-				}
-//				std::cout << "n_ok = " << n_ok;
-				if (n_ok > NUM_MIN_OK)
-					DIRECT_A2D_ELEM(Iframes[iframe](), i, j) = pbuf[rand() % n_ok];
-				else
-					DIRECT_A2D_ELEM(Iframes[iframe](), i, j) = rnd_gaus(frame_mean, frame_std);
-//				std::cout << " set = " << DIRECT_A2D_ELEM(Iframes[iframe](), i, j) << std::endl;
-			}
-		}
+		fixDefects(Iframes, bBad, mean / n_frames, std / n_frames, isEER ? 4 : 2);
 		RCTOC(TIMING_FIX_DEFECT);
 		logfile << "Fixed hot pixels." << std::endl;
 	} // !skip_defect
@@ -1409,12 +1555,9 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	// Write power spectrum for CTF estimation
 	if (grouping_for_ps > 0)
 	{
-		const RFLOAT target_pixel_size = 1.4; // value from CTFFIND 4.1
-
 		// NOTE: Image(X, Y) has MultidimArray(Y, X)!! X is the fast axis.
 		RCTIC(TIMING_POWER_SPECTRUM_SUM);
 		Image<float> PS_sum(nx, ny);
-		MultidimArray<fComplex> F_ps, F_ps_small;
 
 		// 0. Group and sum
 		PS_sum().initZeros();
@@ -1446,62 +1589,7 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 #endif
 		RCTOC(TIMING_POWER_SPECTRUM_SUM);
 
-		// 1. Make it square
-		RCTIC(TIMING_POWER_SPECTRUM_SQUARE);
-		int ps_size_square = XMIPP_MIN(nx, ny);
-		if (nx != ny)
-		{
-			F_ps_small.resize(ps_size_square, ps_size_square / 2 + 1);
-			NewFFT::FourierTransform(PS_sum(), F_ps);
-			cropInFourierSpace(F_ps, F_ps_small);
-			NewFFT::inverseFourierTransform(F_ps_small, PS_sum());
-#ifdef DEBUG_PS
-			std::cout << "size of F_ps: NX = " << XSIZE(F_ps) << " NY = " << YSIZE(F_ps) << std::endl;
-			std::cout << "size of F_ps_small: NX = " << XSIZE(F_ps_small) << " NY = " << YSIZE(F_ps_small) << std::endl;
-			std::cout << "size of PS_sum in square: NX = " << XSIZE(PS_sum()) << " NY = " << YSIZE(PS_sum()) << std::endl;
-			PS_sum.write("ps_test_square.mrc");
-#endif
-		}
-		RCTOC(TIMING_POWER_SPECTRUM_SQUARE);
-
-		// 2. Crop the center
-		RCTIC(TIMING_POWER_SPECTRUM_CROP);
-		RFLOAT ps_angpix = (!early_binning) ? angpix : angpix * bin_factor;
-		int nx_needed = XSIZE(PS_sum());
-		if (ps_angpix < target_pixel_size)
-		{
-			nx_needed = CEIL(ps_size_square * ps_angpix / target_pixel_size);
-			nx_needed += nx_needed % 2;
-			ps_angpix = XSIZE(PS_sum()) * ps_angpix / nx_needed;
-		}
-		Image<float> PS_sum_cropped(nx_needed, nx_needed);
-		PS_sum().setXmippOrigin();
-		PS_sum_cropped().setXmippOrigin();
-		FOR_ALL_ELEMENTS_IN_ARRAY2D(PS_sum_cropped())
-			A2D_ELEM(PS_sum_cropped(), i, j) = A2D_ELEM(PS_sum(), i, j);
-
-#ifdef DEBUG_PS
-		std::cout << "size of PS_sum_cropped: NX = " << XSIZE(PS_sum_cropped()) << " NY = " << YSIZE(PS_sum_cropped()) << std::endl;
-		std::cout << "nx_needed = " << nx_needed << std::endl;
-		std::cout << "ps_angpix after cropping = " << ps_angpix << std::endl;
-		PS_sum_cropped.write("ps_test_cropped.mrc");
-#endif
-		RCTOC(TIMING_POWER_SPECTRUM_CROP);
-
-		// 3. Downsample
-		RCTIC(TIMING_POWER_SPECTRUM_RESIZE);
-		F_ps_small.reshape(ps_size, ps_size / 2 + 1);
-		F_ps_small.initZeros();
-		NewFFT::FourierTransform(PS_sum_cropped(), F_ps);
-		cropInFourierSpace(F_ps, F_ps_small);
-		NewFFT::inverseFourierTransform(F_ps_small, PS_sum());
-		RCTOC(TIMING_POWER_SPECTRUM_RESIZE);
-
-		// 4. Write
-		PS_sum.setSamplingRateInHeader(ps_angpix, ps_angpix);
-		PS_sum.write(fn_ps);
-		logfile << "Written the power spectrum for CTF estimation: " << fn_ps << std::endl;
-		logfile << "The pixel size for CTF estimation: " << ps_angpix << std::endl;
+		writePowerSpectrum(PS_sum, nx, ny, movie);
 	}
 	RCTOC(TIMING_POWER_SPECTRUM);
 
@@ -1538,26 +1626,14 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 	}
 
 	if (do_local) {
-		const int patch_nx = nx / patch_x, patch_ny = ny / patch_y, n_patches = patch_x * patch_y;
 		std::vector<RFLOAT> patch_xshifts, patch_yshifts, patch_frames, patch_xs, patch_ys;
 		std::vector<MultidimArray<fComplex> > Fpatches(n_groups);
 
 		int ipatch = 1;
 		for (int iy = 0; iy < patch_y; iy++) {
 			for (int ix = 0; ix < patch_x; ix++) {
-				int x_start = ix * patch_nx, y_start = iy * patch_ny; // Inclusive
-				int x_end = x_start + patch_nx, y_end = y_start + patch_ny; // Exclusive
-				if (x_end > nx) x_end = nx;
-				if (y_end > ny) y_end = ny;
-				// make patch size even
-				if ((x_end - x_start) % 2 == 1) {
-					if (x_end == nx) x_start++;
-					else x_end--;
-				}
-				if ((y_end - y_start) % 2 == 1) {
-					if (y_end == ny) y_start++;
-					else y_end--;
-				}
+				int x_start, x_end, y_start, y_end;
+				getPatchRange(ix, iy, nx, ny, x_start, x_end, y_start, y_end);
 
 				int x_center = (x_start + x_end - 1) / 2, y_center = (y_start + y_end - 1) / 2;
 				logfile << "Patch (" << iy + 1 << ", " << ix + 1 << "): " << ipatch << " / " << patch_x * patch_y;
@@ -1593,148 +1669,17 @@ bool MotioncorrRunner::executeOwnMotionCorrection(Micrograph &mic) {
 				RCTOC(TIMING_PATCH_ALIGN);
 				if (!converged) continue;
 
-				std::vector<RFLOAT> interpolated_xshifts(n_frames), interpolated_yshifts(n_frames);
-				interpolateShifts(group_start, group_size, local_xshifts, local_yshifts, n_frames, interpolated_xshifts, interpolated_yshifts);
-				if (interpolate_shifts) {
-					// Recenter to the first frame
-					for (int iframe = 0; iframe < n_frames; iframe++) {
-						interpolated_xshifts[iframe] -= interpolated_xshifts[0];
-						interpolated_yshifts[iframe] -= interpolated_yshifts[0];
-					}
-					// Store shifts
-					for (int iframe = 0; iframe < n_frames; iframe++) {
-						patch_xshifts.push_back(interpolated_xshifts[iframe]);
-						patch_yshifts.push_back(interpolated_yshifts[iframe]);
-						patch_frames.push_back(iframe);
-						patch_xs.push_back(x_center);
-						patch_ys.push_back(y_center);
-					}
-				} else { // only recenter to the center
-					for (int igroup = 0; igroup < n_groups; igroup++) {
-						patch_xshifts.push_back(local_xshifts[igroup] - interpolated_xshifts[0]);
-						patch_yshifts.push_back(local_yshifts[igroup] - interpolated_yshifts[0]);
-						RFLOAT middle_frame = group_start[igroup] + group_size[igroup] / 2.0;
-						patch_frames.push_back(middle_frame);
-						patch_xs.push_back(x_center);
-						patch_ys.push_back(y_center);
-					}
-				}
+				storePatchTrajectory(group_start, group_size, local_xshifts, local_yshifts, n_frames, x_center, y_center,
+				                     patch_xshifts, patch_yshifts, patch_frames, patch_xs, patch_ys);
 			}
 		}
 		Fpatches.clear();
 
-		// Fit polynomial model
-
-		RCTIC(TIMING_FIT_POLYNOMIAL);
-		const int n_obs = patch_frames.size();
-		const int n_params = 18;
-
-		if (n_obs <= n_params) {
-			std::cerr << fn_mic << ": too few valid local trajectories to fit local motion model." << std::endl;
-			mic.model = NULL;
-			goto skip_fitting; // TODO: Refactor!
-		}
-
-		Matrix2D <RFLOAT> matA(n_obs, n_params);
-		Matrix1D <RFLOAT> vecX(n_obs), vecY(n_obs), coeffX(n_params), coeffY(n_params);
-		for (int i = 0; i < n_obs; i++) {
-			VEC_ELEM(vecX, i) = patch_xshifts[i]; VEC_ELEM(vecY, i) = patch_yshifts[i];
-
-			const RFLOAT x = patch_xs[i] / nx - 0.5;
-			const RFLOAT y = patch_ys[i] / ny - 0.5;
-			const RFLOAT z = patch_frames[i];
-			const RFLOAT x2 = x * x, y2 = y * y, xy = x * y, z2 = z * z;
-			const RFLOAT z3 = z2 * z;
-
-			MAT_ELEM(matA, i, 0)  =      z;
-			MAT_ELEM(matA, i, 1)  =      z2;
-			MAT_ELEM(matA, i, 2)  =      z3;
-
-			MAT_ELEM(matA, i, 3)  = x  * z;
-			MAT_ELEM(matA, i, 4)  = x  * z2;
-			MAT_ELEM(matA, i, 5)  = x  * z3;
-
-			MAT_ELEM(matA, i, 6)  = x2 * z;
-			MAT_ELEM(matA, i, 7)  = x2 * z2;
-			MAT_ELEM(matA, i, 8)  = x2 * z3;
-
-			MAT_ELEM(matA, i, 9)  = y  * z;
-			MAT_ELEM(matA, i, 10) = y  * z2;
-			MAT_ELEM(matA, i, 11) = y  * z3;
-
-			MAT_ELEM(matA, i, 12) = y2 * z;
-			MAT_ELEM(matA, i, 13) = y2 * z2;
-			MAT_ELEM(matA, i, 14) = y2 * z3;
-
-			MAT_ELEM(matA, i, 15) = xy * z;
-			MAT_ELEM(matA, i, 16) = xy * z2;
-			MAT_ELEM(matA, i, 17) = xy * z3;
-		}
-
-		const RFLOAT EPS = 1e-10;
-		solve(matA, vecX, coeffX, EPS);
-		solve(matA, vecY, coeffY, EPS);
-
-#ifdef DEBUG_OWN
-		std::cout << "Polynomial fitting coefficients for X and Y:" << std::endl;
-		for (int i = 0; i < n_params; i++) {
-			std::cout << i << " " << coeffX(i) << " " << coeffY(i) << std::endl;
-		}
-#endif
-
-		ThirdOrderPolynomialModel *model = new ThirdOrderPolynomialModel();
-		model->coeffX = coeffX; model->coeffY = coeffY;
-		mic.model = model;
-
-#ifdef DEBUG_OWN
-		std::cout << "Polynomial Fitting:" << std::endl;
-#endif
-		RFLOAT rms_x = 0, rms_y = 0;
-	        for (int i = 0; i < n_obs; i++) {
-			RFLOAT x_fitted, y_fitted;
-			const RFLOAT x = patch_xs[i] / nx - 0.5;
-			const RFLOAT y = patch_ys[i] / ny - 0.5;
-			const RFLOAT z = patch_frames[i];
-
-			model->getShiftAt(z, x, y, x_fitted, y_fitted);
-			rms_x += (patch_xshifts[i] - x_fitted) * (patch_xshifts[i] - x_fitted);
-			rms_y += (patch_yshifts[i] - y_fitted) * (patch_yshifts[i] - y_fitted);
-
-			// These shifts and RMSDs are for reporting, so should be in the original pixel size
-			mic.patchX.push_back(patch_xs[i] * prescaling);
-			mic.patchY.push_back(patch_ys[i] * prescaling);
-			mic.patchZ.push_back(z + first_frame_sum); // 1-indexed
-			mic.localShiftX.push_back(patch_xshifts[i] * prescaling);
-			mic.localShiftY.push_back(patch_yshifts[i] * prescaling);
-			mic.localFitX.push_back(x_fitted * prescaling);
-			mic.localFitY.push_back(y_fitted * prescaling);
-
-#ifdef DEBUG_OWN
-			std::cout << " x = " << x << " y = " << y << " z = " << z;
-			std::cout << ", Xobs = " << patch_xshifts[i] * prescaling << " Xfit = " << x_fitted * prescaling;
-			std::cout << ", Yobs = " << patch_yshifts[i] * prescaling << " Yfit = " << y_fitted * prescaling << std::endl;
-#endif
-		}
-		rms_x = std::sqrt(rms_x / n_obs) * prescaling; rms_y = std::sqrt(rms_y / n_obs) * prescaling;
-		logfile << std::endl << "Polynomial fit RMSD: X = " << rms_x << " px Y = " << rms_y << " px" << std::endl;
-		if (rms_x >= fit_rmsd_threshold || rms_y >= fit_rmsd_threshold) {
-			logfile << "The polynomial motion model did not explain the observation very well." << std::endl;
-			logfile << "Local correction is disabled for this micrograph." << std::endl;
-			delete mic.model;
-			mic.model = NULL;
-
-			// remove fitted trajectories
-			for (int i = 0, ilim = mic.localFitX.size(); i < ilim; i++) {
-				mic.localFitX[i] = 0;
-				mic.localFitY[i] = 0;
-			}
-		}
-		RCTOC(TIMING_FIT_POLYNOMIAL);
+		fitLocalMotionModel(mic, patch_xshifts, patch_yshifts, patch_frames, patch_xs, patch_ys, nx, ny, prescaling, logfile);
 	} else { // !do_local
 		mic.model = NULL;
 	}
 
-skip_fitting:
 	if (!do_dose_weighting || save_noDW) {
 		Iref().initZeros(Iframes[0]());
 		Iref_odd().initZeros(Iframes[0]());
@@ -1786,7 +1731,7 @@ skip_fitting:
 
 		// Final output
                 Iref.setSamplingRateInHeader(output_angpix, output_angpix);
-		Iref.write(!do_dose_weighting ? fn_avg : fn_avg_noDW, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+		movie.addOutput(Iref, !do_dose_weighting ? fn_avg : fn_avg_noDW, write_float16 ? Float16: Float);
 		logfile << "Written aligned but non-dose weighted sum to " << (!do_dose_weighting ? fn_avg : fn_avg_noDW) << std::endl;
 		// ODD-EVEN Output
 		if (even_odd_split)
@@ -1794,8 +1739,8 @@ skip_fitting:
 		Iref_odd.setSamplingRateInHeader(output_angpix, output_angpix);
 		Iref_even.setSamplingRateInHeader(output_angpix, output_angpix);
 
-		Iref_odd.write(fn_avg.withoutExtension() + "_ODD.mrc", -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
-		Iref_even.write(fn_avg.withoutExtension() + "_EVN.mrc", -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+		movie.addOutput(Iref_odd, fn_avg.withoutExtension() + "_ODD.mrc", write_float16 ? Float16: Float);
+		movie.addOutput(Iref_even, fn_avg.withoutExtension() + "_EVN.mrc", write_float16 ? Float16: Float);
 		logfile << "Written aligned but non-dose weighted sum of odd frames to " << (fn_avg.withoutExtension() + "_ODD.mrc") << std::endl;
 		logfile << "Written aligned but non-dose weighted sum of even frames to " << (fn_avg.withoutExtension() + "_EVN.mrc") << std::endl;
 		}
@@ -1804,22 +1749,11 @@ skip_fitting:
 	// Dose weighting
 	if (do_dose_weighting) {
 		RCTIC(TIMING_DOSE_WEIGHTING);
-		if (std::abs(voltage - 300) > 2 && std::abs(voltage - 200) > 2 && std::abs(voltage - 100) > 2) {
-			REPORT_ERROR("Sorry, dose weighting is supported only for 300, 200 or 100 kV");
-		}
 
         logfile << "Pre-exposure: = " << pre_exposure << std::endl;
 
-		std::vector <RFLOAT> doses(n_frames);
-		for (int iframe = 0; iframe < n_frames; iframe++) {
-			// dose AFTER each frame.
-			doses[iframe] = mic.pre_exposure + dose_per_frame * (frames[iframe] + 1);
-			if (std::abs(voltage - 200) <= 2) {
-				doses[iframe] /= 0.8; // 200 kV electron is more damaging.
-			} else if (std::abs(voltage - 100) <= 2) {
-				doses[iframe] /= 0.64; // 100 kV electron is much more damaging.
-			}
-		}
+		std::vector <RFLOAT> doses;
+		getDoses(mic, frames, doses);
 
 		RCTIC(TIMING_DW_WEIGHT);
 		doseWeighting(Fframes, doses, angpix * prescaling);
@@ -1850,7 +1784,7 @@ skip_fitting:
 
 		// Final output
                 Iref.setSamplingRateInHeader(output_angpix, output_angpix);
-		Iref.write(fn_avg, -1, false, WRITE_OVERWRITE, write_float16 ? Float16: Float);
+		movie.addOutput(Iref, fn_avg, write_float16 ? Float16: Float);
 		logfile << "Written aligned and dose-weighted sum to " << fn_avg << std::endl;
 	}
 
@@ -1860,55 +1794,881 @@ skip_fitting:
 	return true;
 }
 
-void MotioncorrRunner::interpolateShifts(std::vector<int> &group_start, std::vector<int> &group_size,
-                                         std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts,
-                                         int n_frames,
-                                         std::vector<RFLOAT> &interpolated_xshifts, std::vector<RFLOAT> &interpolated_yshifts) {
-	const int n_groups = group_start.size();
-	if (n_groups < 2) REPORT_ERROR("Assert failed for n_groups >= 2");
-	std::vector<RFLOAT> centers(n_groups);
-
-	// Calculate anchor points
-	for (int igroup = 0; igroup < n_groups; igroup++) {
-		centers[igroup] = group_start[igroup] + group_size[igroup] / 2.0;
-#ifdef DEBUG_OWN
-		std::cout << "igroup = " << igroup << " center " << centers[igroup] << " x " << xshifts[igroup] << " y " << yshifts[igroup] << std::endl;
-#endif
+void MotioncorrRunner::writeOwnMovie(OwnMovie &movie) {
+	if (!movie.buffered)
+	{
+		movie.logfile_direct.close();
+		return;
 	}
 
-	// Inter-/Extra-polate
-	int cur_group = 0;
-	for (int iframe = 0; iframe < n_frames; iframe++) {
-		if (cur_group < n_groups - 2 && iframe >= centers[cur_group + 1]) cur_group++; // don't go to the last group
+	for (int i = 0; i < movie.outputs.size(); i++)
+		movie.outputs[i].write(movie.fn_outputs[i], -1, false, WRITE_OVERWRITE, movie.output_types[i]);
+	movie.outputs.clear();
 
-		// This formula can be used for both interpolation and extrapolation
-		interpolated_xshifts[iframe] = (xshifts[cur_group] * (centers[cur_group + 1] - iframe) +
-		                                xshifts[cur_group + 1] * (iframe - centers[cur_group])) /
-		                               (centers[cur_group + 1] - centers[cur_group]);
-		interpolated_yshifts[iframe] = (yshifts[cur_group] * (centers[cur_group + 1] - iframe) +
-		                                yshifts[cur_group + 1] * (iframe - centers[cur_group])) /
-		                               (centers[cur_group + 1] - centers[cur_group]);
-#ifdef DEBUG_OWN
-		std::cout << "iframe = " << iframe << " igroup " << cur_group << " x " << interpolated_xshifts[iframe] << " y " << interpolated_yshifts[iframe] << std::endl;
-#endif
-	}
+	std::ofstream logfile;
+	logfile.open(movie.fn_log);
+	logfile << movie.logfile_buffer.str();
 }
 
-void MotioncorrRunner::realSpaceInterpolation_withoutsum(std::vector<Image<float> > &Ialignedframes, std::vector<Image<float> > &Iframes, MotionModel *model, std::ostream &logfile) {
-	int model_version = MOTION_MODEL_NULL;
-	if (model != NULL) {
-		model_version = model->getModelVersion();
-	}
+bool MotioncorrRunner::executeOwnMotionCorrectionStreaming(OwnMovie &movie) {
+	Micrograph &mic = *movie.mic;
+	FileName fn_mic = mic.getMovieFilename();
+	FileName fn_avg = movie.fn_avg, fn_avg_noDW = movie.fn_avg_noDW;
+	std::ostream &logfile = movie.logfile();
+	std::vector<int> &frames = movie.frames, &group_start = movie.group_start, &group_size = movie.group_size;
+	Image<float> &Igain = movie.Igain;
+	int nx = movie.nx, ny = movie.ny;
+	const bool isEER = EERRenderer::isEER(fn_mic);
+	const bool isCompressedMRC = CompressedMRCReader::isCompressedMRC(fn_mic);
+	const int n_io_threads = (max_io_threads > 0 && n_threads > max_io_threads) ? max_io_threads : n_threads;
+	const int n_frames = frames.size(), n_groups = group_start.size();
+	const int raw_nx = nx, raw_ny = ny;
 
-	const int n_frames = Iframes.size();
-	if (model_version == MOTION_MODEL_NULL) {
-		// Simple sum
-		for (int iframe = 0; iframe < n_frames; iframe++) {
-			logfile << "." << std::flush;
+	Image<float> Iref, Iref_odd, Iref_even;
+	std::vector<Image<float> > Iframes, Ialignedframes;
+	std::vector<MultidimArray<fComplex> > Fframes;
+	std::vector<RFLOAT> xshifts(n_frames), yshifts(n_frames);
+	MultidimArray<bool> bBad;
+	RFLOAT frame_mean = 0, frame_std = 0;
 
-			#pragma omp parallel for num_threads(n_threads)
-//			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum()) {
-//				DIRECT_MULTIDIM_ELEM(Isum(), n) += DIRECT_MULTIDIM_ELEM(Iframes[iframe](), n);
+	RFLOAT output_angpix = angpix * bin_factor;
+	RFLOAT prescaling = 1;
+
+	logfile << "Streaming: at most " << streaming_window << " frames are kept in memory. The movie is read again for each step." << std::endl;
+
+	// Each pass goes through the movie from the first to the last frame, so that a compressed movie
+	// that can only be read in order is decompressed once per pass.
+	std::unique_ptr<CompressedMRCReader> compressedMRCreader;
+	auto startPass = [&]() {
+		if (isCompressedMRC && (!compressedMRCreader || !compressedMRCreader->isRandomAccess())) {
+			compressedMRCreader.reset(new CompressedMRCReader());
+			compressedMRCreader->read(fn_mic, n_io_threads);
+		}
+	};
+
+	// Read frames[ids[i]] into Iframes[i], apply the gain and fix defects. ids must be increasing.
+	// The hot pixels get new random values each time they are read.
+	auto readFrames = [&](const std::vector<int> &ids) {
+		const int n_ids = ids.size();
+		Iframes.resize(n_ids);
+
+		RCTIC(TIMING_READ_MOVIE);
+		EERRenderer renderer;
+		if (isEER) {
+			renderer.read(fn_mic, eer_upsampling);
+			renderer.setFramesOfInterest(frames[ids[0]] * eer_grouping + 1, (frames[ids[n_ids - 1]] + 1) * eer_grouping);
+			renderer.preReadFrames(n_io_threads);
+		}
+		#pragma omp parallel for num_threads((isCompressedMRC && !compressedMRCreader->isRandomAccess()) ? 1 : n_io_threads)
+		for (int i = 0; i < n_ids; i++) {
+			if (isEER)
+				renderer.renderFrames(frames[ids[i]] * eer_grouping + 1, (frames[ids[i]] + 1) * eer_grouping, Iframes[i]());
+			else if (isCompressedMRC)
+				compressedMRCreader->readFrameInto(Iframes[i], frames[ids[i]]);
+			else
+				Iframes[i].read(fn_mic, true, frames[ids[i]], false, true); // mmap false, is_2D true
+		}
+		RCTOC(TIMING_READ_MOVIE);
+
+		RCTIC(TIMING_APPLY_GAIN);
+		if (fn_gain_reference != "") {
+			#pragma omp parallel for num_threads(n_threads)
+			for (int i = 0; i < n_ids; i++) {
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Igain()) {
+					DIRECT_MULTIDIM_ELEM(Iframes[i](), n) *= DIRECT_MULTIDIM_ELEM(Igain(), n);
+				}
+			}
+		}
+		RCTOC(TIMING_APPLY_GAIN);
+
+		if (XSIZE(bBad) > 0) {
+			RCTIC(TIMING_FIX_DEFECT);
+			fixDefects(Iframes, bBad, frame_mean, frame_std, isEER ? 4 : 2);
+			RCTOC(TIMING_FIX_DEFECT);
+		}
+	};
+
+	// As readFrames, and then Fourier transform (and bin) into Fframes and shift by the global shifts found so far
+	auto readAndTransformFrames = [&](const std::vector<int> &ids) {
+		readFrames(ids);
+		const int n_ids = ids.size();
+		Fframes.resize(n_ids);
+
+		RCTIC(TIMING_GLOBAL_FFT);
+		#pragma omp parallel for num_threads(n_threads)
+		for (int i = 0; i < n_ids; i++) {
+			if (!early_binning) {
+				NewFFT::FourierTransform(Iframes[i](), Fframes[i]);
+			} else {
+				MultidimArray<fComplex> Fframe;
+				NewFFT::FourierTransform(Iframes[i](), Fframe);
+				Fframes[i].reshape(ny, nx / 2 + 1);
+				cropInFourierSpace(Fframe, Fframes[i]);
+			}
+			Iframes[i].clear();
+
+			if (xshifts[ids[i]] != 0 || yshifts[ids[i]] != 0)
+				shiftNonSquareImageInFourierTransform(Fframes[i], -xshifts[ids[i]] / nx, -yshifts[ids[i]] / ny);
+		}
+		RCTOC(TIMING_GLOBAL_FFT);
+	};
+
+	auto windowOfFrames = [&](int first) {
+		std::vector<int> ids;
+		for (int iframe = first; iframe < n_frames && iframe < first + streaming_window; iframe++)
+			ids.push_back(iframe);
+		return ids;
+	};
+
+	// Hot pixels from the unaligned sum
+	if (!skip_defect)
+	{
+		MultidimArray<float> Isum(raw_ny, raw_nx);
+		Isum.initZeros();
+		startPass();
+		for (int first = 0; first < n_frames; first += streaming_window) {
+			readFrames(windowOfFrames(first));
+
+			RCTIC(TIMING_INITIAL_SUM);
+			for (int i = 0; i < (int)Iframes.size(); i++) {
+				#pragma omp parallel for num_threads(n_threads)
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum) {
+					DIRECT_MULTIDIM_ELEM(Isum, n) += DIRECT_MULTIDIM_ELEM(Iframes[i](), n);
+				}
+			}
+			RCTOC(TIMING_INITIAL_SUM);
+		}
+
+		RCTIC(TIMING_DETECT_HOT);
+		RFLOAT mean, std;
+		detectHotPixels(Isum, Igain, mic, bBad, mean, std, logfile);
+		frame_mean = mean / n_frames;
+		frame_std = std / n_frames;
+		RCTOC(TIMING_DETECT_HOT);
+		logfile << "Hot pixels are fixed as frames are read." << std::endl;
+	} // !skip_defect
+
+	if (early_binning) {
+		nx /= bin_factor; ny /= bin_factor;
+		if (nx % 2 != 0 || ny % 2 != 0) {
+			// Do not adjust the size because it might lead to non-square pixels
+			REPORT_ERROR("The dimensions of the image after binning must be even");
+		}
+		prescaling = bin_factor;
+		logfile << "Image size after binning: X = " << nx << " Y = " << ny << std::endl;
+	}
+
+	// The power spectrum and, for the global alignment, the low frequencies of each frame
+	int ccf_nx, ccf_ny;
+	getCCFSize(nx, ny, bfactor / (prescaling * prescaling), ccf_nx, ccf_ny);
+	std::vector<MultidimArray<fComplex> > Fglobal(n_frames);
+
+	// NOTE: Image(X, Y) has MultidimArray(Y, X)!! X is the fast axis.
+	Image<float> PS_sum;
+	MultidimArray<fComplex> F_sum;
+	if (grouping_for_ps > 0)
+	{
+		PS_sum().initZeros(ny, nx);
+		PS_sum().setXmippOrigin();
+	}
+
+	startPass();
+	for (int first = 0; first < n_frames; first += streaming_window) {
+		const std::vector<int> ids = windowOfFrames(first);
+		readAndTransformFrames(ids);
+
+		#pragma omp parallel for num_threads(n_threads)
+		for (int i = 0; i < (int)ids.size(); i++)
+			cropForCCF(Fframes[i], ccf_nx, ccf_ny, Fglobal[ids[i]]);
+
+		RCTIC(TIMING_POWER_SPECTRUM);
+		for (int i = 0; grouping_for_ps > 0 && i < (int)ids.size(); i++) {
+			const int iframe = ids[i];
+			if (iframe % grouping_for_ps == 0) {
+				F_sum = Fframes[i];
+			} else {
+				#pragma omp parallel for num_threads(n_threads)
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(F_sum)
+					DIRECT_MULTIDIM_ELEM(F_sum, n) += DIRECT_MULTIDIM_ELEM(Fframes[i], n);
+			}
+			if (iframe % grouping_for_ps != grouping_for_ps - 1 && iframe != n_frames - 1) continue;
+
+			#pragma omp parallel for num_threads(n_threads)
+			FOR_ALL_ELEMENTS_IN_ARRAY2D(PS_sum()) // logical 2D access, i = logical_y, j = logical_x
+			{
+				// F(i, j) = conj(F(-i, -j))
+				if (j > 0)
+					A2D_ELEM(PS_sum(), i, j) += abs(FFTW2D_ELEM(F_sum, i, j)); // accessor is (Y, X)
+				else
+					A2D_ELEM(PS_sum(), i, j) += abs(FFTW2D_ELEM(F_sum, -i, -j));
+			}
+		}
+		RCTOC(TIMING_POWER_SPECTRUM);
+	}
+	Fframes.clear();
+	F_sum.clear();
+
+	// Write power spectrum for CTF estimation
+	if (grouping_for_ps > 0)
+	{
+		RCTIC(TIMING_POWER_SPECTRUM);
+		writePowerSpectrum(PS_sum, nx, ny, movie);
+		PS_sum.clear();
+		RCTOC(TIMING_POWER_SPECTRUM);
+	}
+
+	// Global alignment
+	logfile << std::endl << "Global alignment:" << std::endl;
+	RCTIC(TIMING_GLOBAL_ALIGNMENT);
+	alignPatch(Fglobal, nx, ny, bfactor / (prescaling * prescaling), xshifts, yshifts, logfile);
+	RCTOC(TIMING_GLOBAL_ALIGNMENT);
+	for (int i = 0, ilim = xshifts.size(); i < ilim; i++) {
+		// Should be in the original pixel size
+		mic.setGlobalShift(frames[i] + 1, xshifts[i] * prescaling, yshifts[i] * prescaling); // 1-indexed
+	}
+	Fglobal.clear();
+
+	// Patch based alignment
+	logfile << std::endl << "Local alignments:" << std::endl;
+	logfile << "Patches: X = " << patch_x << " Y = " << patch_y << std::endl;
+	bool do_local = (patch_x > 2) && (patch_y > 2);
+	if (!do_local) {
+		logfile << "Too few patches to do local alignments. Local alignment is skipped." << std::endl;
+	}
+
+	if (do_local) {
+		const int n_patches = patch_x * patch_y;
+		std::vector<int> x_starts(n_patches), x_ends(n_patches), y_starts(n_patches), y_ends(n_patches);
+		std::vector<int> ccf_nxs(n_patches), ccf_nys(n_patches);
+		for (int ipatch = 0; ipatch < n_patches; ipatch++) {
+			getPatchRange(ipatch % patch_x, ipatch / patch_x, nx, ny, x_starts[ipatch], x_ends[ipatch], y_starts[ipatch], y_ends[ipatch]);
+			getCCFSize(x_ends[ipatch] - x_starts[ipatch], y_ends[ipatch] - y_starts[ipatch], bfactor / (prescaling * prescaling), ccf_nxs[ipatch], ccf_nys[ipatch]);
+		}
+
+		// As in executeOwnMotionCorrection, the patch of a group is taken from the last frame of the group
+		std::vector<int> last_frames(n_groups);
+		for (int igroup = 0; igroup < n_groups; igroup++)
+			last_frames[igroup] = group_start[igroup] + group_size[igroup] - 1;
+
+		std::vector<std::vector<MultidimArray<fComplex> > > Fpatches(n_patches, std::vector<MultidimArray<fComplex> >(n_groups));
+		startPass();
+		for (int first = 0; first < n_groups; first += streaming_window) {
+			const int n_ids = XMIPP_MIN(streaming_window, n_groups - first);
+			readAndTransformFrames(std::vector<int>(last_frames.begin() + first, last_frames.begin() + first + n_ids));
+
+			RCTIC(TIMING_GLOBAL_IFFT);
+			#pragma omp parallel for num_threads(n_threads)
+			for (int i = 0; i < n_ids; i++) {
+				Iframes[i]().reshape(ny, nx);
+				NewFFT::inverseFourierTransform(Fframes[i], Iframes[i]());
+				Fframes[i].clear();
+			}
+			RCTOC(TIMING_GLOBAL_IFFT);
+
+			RCTIC(TIMING_PREP_PATCH);
+			#pragma omp parallel for num_threads(n_threads)
+			for (int ijob = 0; ijob < n_ids * n_patches; ijob++) {
+				const int i = ijob / n_patches, ipatch = ijob % n_patches;
+				const int x_start = x_starts[ipatch], x_end = x_ends[ipatch], y_start = y_starts[ipatch], y_end = y_ends[ipatch];
+				MultidimArray<float> Ipatch(y_end - y_start, x_end - x_start); // end is not included
+				for (int ipy = y_start; ipy < y_end; ipy++) {
+					for (int ipx = x_start; ipx < x_end; ipx++) {
+						DIRECT_A2D_ELEM(Ipatch, ipy - y_start, ipx - x_start) = DIRECT_A2D_ELEM(Iframes[i](), ipy, ipx);
+					}
+				}
+
+				MultidimArray<fComplex> Fpatch;
+				NewFFT::FourierTransform(Ipatch, Fpatch);
+				cropForCCF(Fpatch, ccf_nxs[ipatch], ccf_nys[ipatch], Fpatches[ipatch][first + i]);
+			}
+			RCTOC(TIMING_PREP_PATCH);
+		}
+		Iframes.clear();
+
+		std::vector<RFLOAT> patch_xshifts, patch_yshifts, patch_frames, patch_xs, patch_ys;
+		for (int ipatch = 0; ipatch < n_patches; ipatch++) {
+			const int ix = ipatch % patch_x, iy = ipatch / patch_x;
+			const int x_start = x_starts[ipatch], x_end = x_ends[ipatch], y_start = y_starts[ipatch], y_end = y_ends[ipatch];
+			int x_center = (x_start + x_end - 1) / 2, y_center = (y_start + y_end - 1) / 2;
+			logfile << "Patch (" << iy + 1 << ", " << ix + 1 << "): " << ipatch + 1 << " / " << n_patches;
+			logfile << ", X range = [" << x_start << ", " << x_end << "), Y range = [" << y_start << ", " << y_end << ")";
+			logfile << ", Center = (" << x_center << ", " << y_center << ")" << std::endl;
+
+			std::vector<RFLOAT> local_xshifts(n_groups), local_yshifts(n_groups);
+			RCTIC(TIMING_PATCH_ALIGN);
+			bool converged = alignPatch(Fpatches[ipatch], x_end - x_start, y_end - y_start, bfactor / (prescaling * prescaling), local_xshifts, local_yshifts, logfile);
+			RCTOC(TIMING_PATCH_ALIGN);
+			Fpatches[ipatch].clear();
+			if (!converged) continue;
+
+			storePatchTrajectory(group_start, group_size, local_xshifts, local_yshifts, n_frames, x_center, y_center,
+			                     patch_xshifts, patch_yshifts, patch_frames, patch_xs, patch_ys);
+		}
+
+		fitLocalMotionModel(mic, patch_xshifts, patch_yshifts, patch_frames, patch_xs, patch_ys, nx, ny, prescaling, logfile);
+	} else { // !do_local
+		mic.model = NULL;
+	}
+
+	// Sums, with and without dose weighting
+	const bool do_noDW = !do_dose_weighting || save_noDW;
+	std::vector<RFLOAT> doses;
+	MultidimArray<RFLOAT> dw_Ne, dw_norm;
+	if (do_noDW) {
+		Iref().initZeros(ny, nx);
+		Iref_odd().initZeros(ny, nx);
+		Iref_even().initZeros(ny, nx);
+	}
+	Image<float> Iref_DW;
+	if (do_dose_weighting) {
+		Iref_DW().initZeros(ny, nx);
+		logfile << "Pre-exposure: = " << pre_exposure << std::endl;
+		getDoses(mic, frames, doses);
+
+		RCTIC(TIMING_DW_WEIGHT);
+		getDoseWeightingNorm(doses, angpix * prescaling, nx / 2 + 1, ny, dw_Ne, dw_norm);
+		RCTOC(TIMING_DW_WEIGHT);
+	}
+
+	logfile << "Summing frames: ";
+	startPass();
+	for (int first = 0; first < n_frames; first += streaming_window) {
+		const std::vector<int> ids = windowOfFrames(first);
+		const int n_ids = ids.size();
+		readAndTransformFrames(ids);
+
+		if (do_noDW) {
+			Ialignedframes.resize(n_ids);
+			RCTIC(TIMING_GLOBAL_IFFT);
+			#pragma omp parallel for num_threads(n_threads)
+			for (int i = 0; i < n_ids; i++) {
+				Iframes[i]().reshape(ny, nx);
+				NewFFT::inverseFourierTransform(Fframes[i], Iframes[i]());
+				Ialignedframes[i]().initZeros(ny, nx);
+			}
+			RCTOC(TIMING_GLOBAL_IFFT);
+
+			RCTIC(TIMING_REAL_SPACE_INTERPOLATION);
+			realSpaceInterpolation_withoutsum(Ialignedframes, Iframes, mic.model, logfile, first);
+			for (int i = 0; i < n_ids; i++) {
+				Image<float> &Ipart = (ids[i] % 2 == 0) ? Iref_even : Iref_odd;
+				#pragma omp parallel for num_threads(n_threads)
+				FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Iref()) {
+					DIRECT_MULTIDIM_ELEM(Iref(), n) += DIRECT_MULTIDIM_ELEM(Ialignedframes[i](), n);
+					if (even_odd_split)
+						DIRECT_MULTIDIM_ELEM(Ipart(), n) += DIRECT_MULTIDIM_ELEM(Ialignedframes[i](), n);
+				}
+			}
+			RCTOC(TIMING_REAL_SPACE_INTERPOLATION);
+		}
+
+		if (do_dose_weighting) {
+			RCTIC(TIMING_DOSE_WEIGHTING);
+			RCTIC(TIMING_DW_WEIGHT);
+			doseWeighting(Fframes, std::vector<RFLOAT>(doses.begin() + first, doses.begin() + first + n_ids), dw_Ne, dw_norm);
+			RCTOC(TIMING_DW_WEIGHT);
+
+			RCTIC(TIMING_DW_IFFT);
+			#pragma omp parallel for num_threads(n_threads)
+			for (int i = 0; i < n_ids; i++) {
+				Iframes[i]().reshape(ny, nx);
+				NewFFT::inverseFourierTransform(Fframes[i], Iframes[i]());
+			}
+			RCTOC(TIMING_DW_IFFT);
+			RCTOC(TIMING_DOSE_WEIGHTING);
+
+			RCTIC(TIMING_REAL_SPACE_INTERPOLATION);
+			realSpaceInterpolation(Iref_DW, Iframes, mic.model, logfile, first);
+			RCTOC(TIMING_REAL_SPACE_INTERPOLATION);
+		}
+	}
+	logfile << " done" << std::endl;
+	Iframes.clear();
+	Ialignedframes.clear();
+	Fframes.clear();
+
+	if (do_noDW) {
+		// Apply binning
+		RCTIC(TIMING_BINNING);
+		if (!early_binning && bin_factor != 1) {
+			binNonSquareImage(Iref, bin_factor);
+		}
+		RCTOC(TIMING_BINNING);
+
+		// Final output
+		Iref.setSamplingRateInHeader(output_angpix, output_angpix);
+		movie.addOutput(Iref, !do_dose_weighting ? fn_avg : fn_avg_noDW, write_float16 ? Float16: Float);
+		logfile << "Written aligned but non-dose weighted sum to " << (!do_dose_weighting ? fn_avg : fn_avg_noDW) << std::endl;
+		// ODD-EVEN Output
+		if (even_odd_split)
+		{
+			Iref_odd.setSamplingRateInHeader(output_angpix, output_angpix);
+			Iref_even.setSamplingRateInHeader(output_angpix, output_angpix);
+
+			movie.addOutput(Iref_odd, fn_avg.withoutExtension() + "_ODD.mrc", write_float16 ? Float16: Float);
+			movie.addOutput(Iref_even, fn_avg.withoutExtension() + "_EVN.mrc", write_float16 ? Float16: Float);
+			logfile << "Written aligned but non-dose weighted sum of odd frames to " << (fn_avg.withoutExtension() + "_ODD.mrc") << std::endl;
+			logfile << "Written aligned but non-dose weighted sum of even frames to " << (fn_avg.withoutExtension() + "_EVN.mrc") << std::endl;
+		}
+	}
+
+	if (do_dose_weighting) {
+		// Apply binning
+		RCTIC(TIMING_BINNING);
+		if (!early_binning && bin_factor != 1) {
+			binNonSquareImage(Iref_DW, bin_factor);
+		}
+		RCTOC(TIMING_BINNING);
+
+		// Final output
+		Iref_DW.setSamplingRateInHeader(output_angpix, output_angpix);
+		movie.addOutput(Iref_DW, fn_avg, write_float16 ? Float16: Float);
+		logfile << "Written aligned and dose-weighted sum to " << fn_avg << std::endl;
+	}
+
+	// Set the start frame for the local motion model.
+	mic.first_frame = frames[0] + 1; // NOTE that this is 1-indexed.
+
+	return true;
+}
+
+void MotioncorrRunner::detectHotPixels(MultidimArray<float> &Isum, Image<float> &Igain, Micrograph &mic, MultidimArray<bool> &bBad, RFLOAT &mean, RFLOAT &std, std::ostream &logfile) {
+	const int hotpixel_sigma = 6;
+	const int nx = XSIZE(Isum), ny = YSIZE(Isum);
+	mean = 0, std = 0;
+	#pragma omp parallel for reduction(+:mean) num_threads(n_threads)
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum) {
+		mean += DIRECT_MULTIDIM_ELEM(Isum, n);
+	}
+	mean /=  YXSIZE(Isum);
+	#pragma omp parallel for reduction(+:std) num_threads(n_threads)
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum) {
+		RFLOAT d = (DIRECT_MULTIDIM_ELEM(Isum, n) - mean);
+		std += d * d;
+	}
+	std = std::sqrt(std / YXSIZE(Isum));
+	const RFLOAT threshold = mean + hotpixel_sigma * std;
+	logfile << "In unaligned sum, Mean = " << mean << " Std = " << std << " Hotpixel threshold = " << threshold << std::endl;
+
+	bBad.reshape(ny, nx);
+	bBad.initZeros();
+	if (fn_defect != "")
+	{
+		fillDefectMask(bBad, fn_defect, n_threads);
+#ifdef DEBUG_HOTPIXELS
+		Image<RFLOAT> tmp(nx, ny);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(tmp())
+			DIRECT_MULTIDIM_ELEM(tmp(), n) = DIRECT_MULTIDIM_ELEM(bBad, n);
+		tmp.write("defect.mrc");
+#endif
+	}
+
+	if (fn_gain_reference != "")
+	{
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Igain())
+		{
+			if (DIRECT_MULTIDIM_ELEM(Igain(), n) == 0)
+			{
+				DIRECT_MULTIDIM_ELEM(bBad, n) = true;
+			}
+		}
+	}
+
+	int n_bad = 0;
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum) {
+		if (DIRECT_MULTIDIM_ELEM(Isum, n) > threshold && !DIRECT_MULTIDIM_ELEM(bBad, n)) {
+			DIRECT_MULTIDIM_ELEM(bBad, n) = true;
+			n_bad++;
+			mic.hotpixelX.push_back(n % nx);
+			mic.hotpixelY.push_back(n / nx);
+		}
+	}
+	logfile << "Detected " << n_bad << " hot pixels to be corrected." << std::endl;
+}
+
+void MotioncorrRunner::fixDefects(std::vector<Image<float> > &Iframes, MultidimArray<bool> &bBad, RFLOAT frame_mean, RFLOAT frame_std, int D_MAX) {
+	const int n_frames = Iframes.size();
+	const int nx = XSIZE(bBad), ny = YSIZE(bBad);
+	const int NUM_MIN_OK = 6;
+	const int PBUF_SIZE = 100;
+	FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(bBad)
+	{
+		if (!DIRECT_A2D_ELEM(bBad, i, j)) continue;
+//			std::cout << "Hot pixel at (" << i << ", " << j << ")" << std::endl;
+		#pragma omp parallel for num_threads(n_threads)
+		for (int iframe = 0; iframe < n_frames; iframe++)
+		{
+			RFLOAT pbuf[PBUF_SIZE];
+//				std::cout << "Frame: "<< iframe << std::endl;
+			int n_ok = 0;
+			for (int dy= -D_MAX; dy <= D_MAX; dy++)
+			{
+				int y = i + dy;
+				if (y < 0 || y >= ny) continue;
+				for (int dx = -D_MAX; dx <= D_MAX; dx++)
+				{
+					int x = j + dx;
+					if (x < 0 || x >= nx) continue;
+//						std::cout << " " << DIRECT_A2D_ELEM(Iframes[iframe](), y, x);
+					if (DIRECT_A2D_ELEM(bBad, y, x)) continue;
+//						std::cout << "o";
+					pbuf[n_ok] = DIRECT_A2D_ELEM(Iframes[iframe](), y, x);
+					n_ok++;
+				}
+//					std::cout << std::endl;
+			}
+//				std::cout << "n_ok = " << n_ok;
+			if (n_ok > NUM_MIN_OK)
+				DIRECT_A2D_ELEM(Iframes[iframe](), i, j) = pbuf[rand() % n_ok];
+			else
+				DIRECT_A2D_ELEM(Iframes[iframe](), i, j) = rnd_gaus(frame_mean, frame_std);
+//				std::cout << " set = " << DIRECT_A2D_ELEM(Iframes[iframe](), i, j) << std::endl;
+		}
+	}
+}
+
+void MotioncorrRunner::writePowerSpectrum(Image<float> &PS_sum, int nx, int ny, OwnMovie &movie) {
+	const RFLOAT target_pixel_size = 1.4; // value from CTFFIND 4.1
+	MultidimArray<fComplex> F_ps, F_ps_small;
+
+	// 1. Make it square
+	RCTIC(TIMING_POWER_SPECTRUM_SQUARE);
+	int ps_size_square = XMIPP_MIN(nx, ny);
+	if (nx != ny)
+	{
+		F_ps_small.resize(ps_size_square, ps_size_square / 2 + 1);
+		NewFFT::FourierTransform(PS_sum(), F_ps);
+		cropInFourierSpace(F_ps, F_ps_small);
+		NewFFT::inverseFourierTransform(F_ps_small, PS_sum());
+#ifdef DEBUG_PS
+		std::cout << "size of F_ps: NX = " << XSIZE(F_ps) << " NY = " << YSIZE(F_ps) << std::endl;
+		std::cout << "size of F_ps_small: NX = " << XSIZE(F_ps_small) << " NY = " << YSIZE(F_ps_small) << std::endl;
+		std::cout << "size of PS_sum in square: NX = " << XSIZE(PS_sum()) << " NY = " << YSIZE(PS_sum()) << std::endl;
+		PS_sum.write("ps_test_square.mrc");
+#endif
+	}
+	RCTOC(TIMING_POWER_SPECTRUM_SQUARE);
+
+	// 2. Crop the center
+	RCTIC(TIMING_POWER_SPECTRUM_CROP);
+	RFLOAT ps_angpix = (!early_binning) ? angpix : angpix * bin_factor;
+	int nx_needed = XSIZE(PS_sum());
+	if (ps_angpix < target_pixel_size)
+	{
+		nx_needed = CEIL(ps_size_square * ps_angpix / target_pixel_size);
+		nx_needed += nx_needed % 2;
+		ps_angpix = XSIZE(PS_sum()) * ps_angpix / nx_needed;
+	}
+	Image<float> PS_sum_cropped(nx_needed, nx_needed);
+	PS_sum().setXmippOrigin();
+	PS_sum_cropped().setXmippOrigin();
+	FOR_ALL_ELEMENTS_IN_ARRAY2D(PS_sum_cropped())
+		A2D_ELEM(PS_sum_cropped(), i, j) = A2D_ELEM(PS_sum(), i, j);
+
+#ifdef DEBUG_PS
+	std::cout << "size of PS_sum_cropped: NX = " << XSIZE(PS_sum_cropped()) << " NY = " << YSIZE(PS_sum_cropped()) << std::endl;
+	std::cout << "nx_needed = " << nx_needed << std::endl;
+	std::cout << "ps_angpix after cropping = " << ps_angpix << std::endl;
+	PS_sum_cropped.write("ps_test_cropped.mrc");
+#endif
+	RCTOC(TIMING_POWER_SPECTRUM_CROP);
+
+	// 3. Downsample
+	RCTIC(TIMING_POWER_SPECTRUM_RESIZE);
+	F_ps_small.reshape(ps_size, ps_size / 2 + 1);
+	F_ps_small.initZeros();
+	NewFFT::FourierTransform(PS_sum_cropped(), F_ps);
+	cropInFourierSpace(F_ps, F_ps_small);
+	NewFFT::inverseFourierTransform(F_ps_small, PS_sum());
+	RCTOC(TIMING_POWER_SPECTRUM_RESIZE);
+
+	// 4. Write
+	PS_sum.setSamplingRateInHeader(ps_angpix, ps_angpix);
+	movie.addOutput(PS_sum, movie.fn_ps);
+	movie.logfile() << "Written the power spectrum for CTF estimation: " << movie.fn_ps << std::endl;
+	movie.logfile() << "The pixel size for CTF estimation: " << ps_angpix << std::endl;
+}
+
+void MotioncorrRunner::getPatchRange(int ix, int iy, int nx, int ny, int &x_start, int &x_end, int &y_start, int &y_end) {
+	const int patch_nx = nx / patch_x, patch_ny = ny / patch_y;
+	x_start = ix * patch_nx; y_start = iy * patch_ny; // Inclusive
+	x_end = x_start + patch_nx; y_end = y_start + patch_ny; // Exclusive
+	if (x_end > nx) x_end = nx;
+	if (y_end > ny) y_end = ny;
+	// make patch size even
+	if ((x_end - x_start) % 2 == 1) {
+		if (x_end == nx) x_start++;
+		else x_end--;
+	}
+	if ((y_end - y_start) % 2 == 1) {
+		if (y_end == ny) y_start++;
+		else y_end--;
+	}
+}
+
+void MotioncorrRunner::storePatchTrajectory(std::vector<int> &group_start, std::vector<int> &group_size,
+                                            std::vector<RFLOAT> &local_xshifts, std::vector<RFLOAT> &local_yshifts, int n_frames, int x_center, int y_center,
+                                            std::vector<RFLOAT> &patch_xshifts, std::vector<RFLOAT> &patch_yshifts, std::vector<RFLOAT> &patch_frames,
+                                            std::vector<RFLOAT> &patch_xs, std::vector<RFLOAT> &patch_ys) {
+	const int n_groups = group_start.size();
+	std::vector<RFLOAT> interpolated_xshifts(n_frames), interpolated_yshifts(n_frames);
+	interpolateShifts(group_start, group_size, local_xshifts, local_yshifts, n_frames, interpolated_xshifts, interpolated_yshifts);
+	if (interpolate_shifts) {
+		// Recenter to the first frame
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			interpolated_xshifts[iframe] -= interpolated_xshifts[0];
+			interpolated_yshifts[iframe] -= interpolated_yshifts[0];
+		}
+		// Store shifts
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			patch_xshifts.push_back(interpolated_xshifts[iframe]);
+			patch_yshifts.push_back(interpolated_yshifts[iframe]);
+			patch_frames.push_back(iframe);
+			patch_xs.push_back(x_center);
+			patch_ys.push_back(y_center);
+		}
+	} else { // only recenter to the center
+		for (int igroup = 0; igroup < n_groups; igroup++) {
+			patch_xshifts.push_back(local_xshifts[igroup] - interpolated_xshifts[0]);
+			patch_yshifts.push_back(local_yshifts[igroup] - interpolated_yshifts[0]);
+			RFLOAT middle_frame = group_start[igroup] + group_size[igroup] / 2.0;
+			patch_frames.push_back(middle_frame);
+			patch_xs.push_back(x_center);
+			patch_ys.push_back(y_center);
+		}
+	}
+}
+
+void MotioncorrRunner::fitLocalMotionModel(Micrograph &mic, std::vector<RFLOAT> &patch_xshifts, std::vector<RFLOAT> &patch_yshifts, std::vector<RFLOAT> &patch_frames,
+                                           std::vector<RFLOAT> &patch_xs, std::vector<RFLOAT> &patch_ys, int nx, int ny, RFLOAT prescaling, std::ostream &logfile) {
+	const int fit_rmsd_threshold = 10; // px
+	RCTIC(TIMING_FIT_POLYNOMIAL);
+	const int n_obs = patch_frames.size();
+	const int n_params = 18;
+
+	if (n_obs <= n_params) {
+		std::cerr << mic.getMovieFilename() << ": too few valid local trajectories to fit local motion model." << std::endl;
+		mic.model = NULL;
+		RCTOC(TIMING_FIT_POLYNOMIAL);
+		return;
+	}
+
+	Matrix2D <RFLOAT> matA(n_obs, n_params);
+	Matrix1D <RFLOAT> vecX(n_obs), vecY(n_obs), coeffX(n_params), coeffY(n_params);
+	for (int i = 0; i < n_obs; i++) {
+		VEC_ELEM(vecX, i) = patch_xshifts[i]; VEC_ELEM(vecY, i) = patch_yshifts[i];
+
+		const RFLOAT x = patch_xs[i] / nx - 0.5;
+		const RFLOAT y = patch_ys[i] / ny - 0.5;
+		const RFLOAT z = patch_frames[i];
+		const RFLOAT x2 = x * x, y2 = y * y, xy = x * y, z2 = z * z;
+		const RFLOAT z3 = z2 * z;
+
+		MAT_ELEM(matA, i, 0)  =      z;
+		MAT_ELEM(matA, i, 1)  =      z2;
+		MAT_ELEM(matA, i, 2)  =      z3;
+
+		MAT_ELEM(matA, i, 3)  = x  * z;
+		MAT_ELEM(matA, i, 4)  = x  * z2;
+		MAT_ELEM(matA, i, 5)  = x  * z3;
+
+		MAT_ELEM(matA, i, 6)  = x2 * z;
+		MAT_ELEM(matA, i, 7)  = x2 * z2;
+		MAT_ELEM(matA, i, 8)  = x2 * z3;
+
+		MAT_ELEM(matA, i, 9)  = y  * z;
+		MAT_ELEM(matA, i, 10) = y  * z2;
+		MAT_ELEM(matA, i, 11) = y  * z3;
+
+		MAT_ELEM(matA, i, 12) = y2 * z;
+		MAT_ELEM(matA, i, 13) = y2 * z2;
+		MAT_ELEM(matA, i, 14) = y2 * z3;
+
+		MAT_ELEM(matA, i, 15) = xy * z;
+		MAT_ELEM(matA, i, 16) = xy * z2;
+		MAT_ELEM(matA, i, 17) = xy * z3;
+	}
+
+	const RFLOAT EPS = 1e-10;
+	solve(matA, vecX, coeffX, EPS);
+	solve(matA, vecY, coeffY, EPS);
+
+#ifdef DEBUG_OWN
+	std::cout << "Polynomial fitting coefficients for X and Y:" << std::endl;
+	for (int i = 0; i < n_params; i++) {
+		std::cout << i << " " << coeffX(i) << " " << coeffY(i) << std::endl;
+	}
+#endif
+
+	ThirdOrderPolynomialModel *model = new ThirdOrderPolynomialModel();
+	model->coeffX = coeffX; model->coeffY = coeffY;
+	mic.model = model;
+
+#ifdef DEBUG_OWN
+	std::cout << "Polynomial Fitting:" << std::endl;
+#endif
+	RFLOAT rms_x = 0, rms_y = 0;
+        for (int i = 0; i < n_obs; i++) {
+		RFLOAT x_fitted, y_fitted;
+		const RFLOAT x = patch_xs[i] / nx - 0.5;
+		const RFLOAT y = patch_ys[i] / ny - 0.5;
+		const RFLOAT z = patch_frames[i];
+
+		model->getShiftAt(z, x, y, x_fitted, y_fitted);
+		rms_x += (patch_xshifts[i] - x_fitted) * (patch_xshifts[i] - x_fitted);
+		rms_y += (patch_yshifts[i] - y_fitted) * (patch_yshifts[i] - y_fitted);
+
+		// These shifts and RMSDs are for reporting, so should be in the original pixel size
+		mic.patchX.push_back(patch_xs[i] * prescaling);
+		mic.patchY.push_back(patch_ys[i] * prescaling);
+		mic.patchZ.push_back(z + first_frame_sum); // 1-indexed
+		mic.localShiftX.push_back(patch_xshifts[i] * prescaling);
+		mic.localShiftY.push_back(patch_yshifts[i] * prescaling);
+		mic.localFitX.push_back(x_fitted * prescaling);
+		mic.localFitY.push_back(y_fitted * prescaling);
+
+#ifdef DEBUG_OWN
+		std::cout << " x = " << x << " y = " << y << " z = " << z;
+		std::cout << ", Xobs = " << patch_xshifts[i] * prescaling << " Xfit = " << x_fitted * prescaling;
+		std::cout << ", Yobs = " << patch_yshifts[i] * prescaling << " Yfit = " << y_fitted * prescaling << std::endl;
+#endif
+	}
+	rms_x = std::sqrt(rms_x / n_obs) * prescaling; rms_y = std::sqrt(rms_y / n_obs) * prescaling;
+	logfile << std::endl << "Polynomial fit RMSD: X = " << rms_x << " px Y = " << rms_y << " px" << std::endl;
+	if (rms_x >= fit_rmsd_threshold || rms_y >= fit_rmsd_threshold) {
+		logfile << "The polynomial motion model did not explain the observation very well." << std::endl;
+		logfile << "Local correction is disabled for this micrograph." << std::endl;
+		delete mic.model;
+		mic.model = NULL;
+
+		// remove fitted trajectories
+		for (int i = 0, ilim = mic.localFitX.size(); i < ilim; i++) {
+			mic.localFitX[i] = 0;
+			mic.localFitY[i] = 0;
+		}
+	}
+	RCTOC(TIMING_FIT_POLYNOMIAL);
+}
+
+void MotioncorrRunner::interpolateShifts(std::vector<int> &group_start, std::vector<int> &group_size,
+                                         std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts,
+                                         int n_frames,
+                                         std::vector<RFLOAT> &interpolated_xshifts, std::vector<RFLOAT> &interpolated_yshifts) {
+	const int n_groups = group_start.size();
+	if (n_groups < 2) REPORT_ERROR("Assert failed for n_groups >= 2");
+	std::vector<RFLOAT> centers(n_groups);
+
+	// Calculate anchor points
+	for (int igroup = 0; igroup < n_groups; igroup++) {
+		centers[igroup] = group_start[igroup] + group_size[igroup] / 2.0;
+#ifdef DEBUG_OWN
+		std::cout << "igroup = " << igroup << " center " << centers[igroup] << " x " << xshifts[igroup] << " y " << yshifts[igroup] << std::endl;
+#endif
+	}
+
+	// Inter-/Extra-polate
+	int cur_group = 0;
+	for (int iframe = 0; iframe < n_frames; iframe++) {
+		if (cur_group < n_groups - 2 && iframe >= centers[cur_group + 1]) cur_group++; // don't go to the last group
+
+		// This formula can be used for both interpolation and extrapolation
+		interpolated_xshifts[iframe] = (xshifts[cur_group] * (centers[cur_group + 1] - iframe) +
+		                                xshifts[cur_group + 1] * (iframe - centers[cur_group])) /
+		                               (centers[cur_group + 1] - centers[cur_group]);
+		interpolated_yshifts[iframe] = (yshifts[cur_group] * (centers[cur_group + 1] - iframe) +
+		                                yshifts[cur_group + 1] * (iframe - centers[cur_group])) /
+		                               (centers[cur_group + 1] - centers[cur_group]);
+#ifdef DEBUG_OWN
+		std::cout << "iframe = " << iframe << " igroup " << cur_group << " x " << interpolated_xshifts[iframe] << " y " << interpolated_yshifts[iframe] << std::endl;
+#endif
+	}
+}
+
+// The terms of the third order polynomial model for frame z: the shift at (x, y) is C[0] + (C[1] + C[2] * x) * x + (C[3] + C[4] * y + C[5] * x) * y
+static void getThirdOrderPolynomialTerms(const Matrix1D<RFLOAT> &coeff, RFLOAT z, RFLOAT *C) {
+	const RFLOAT z2 = z * z, z3 = z * z2;
+	for (int i = 0; i < 6; i++)
+		C[i] = coeff(3 * i) * z + coeff(3 * i + 1) * z2 + coeff(3 * i + 2) * z3;
+}
+
+// The shifted pixel coordinates of a row
+struct ShiftedRow
+{
+	std::vector<RFLOAT> x, y;
+
+	ShiftedRow(int nx) : x(nx), y(nx) {}
+};
+
+// Add row iy of Iframe, shifted by the polynomial terms x_C and y_C, to out with bilinear interpolation.
+// Pixels that would be interpolated from outside the frame get the nearest pixel on its edge.
+// xs holds the normalised x coordinates (ix / nx - 0.5) and ixs the pixel indices, both as RFLOAT.
+static void addShiftedRow(const MultidimArray<float> &Iframe, int iy, const RFLOAT *x_C, const RFLOAT *y_C,
+                          const RFLOAT *xs, const RFLOAT *ixs, float *out, ShiftedRow &row) {
+	const int nx = XSIZE(Iframe), ny = YSIZE(Iframe);
+	const RFLOAT y = (RFLOAT)iy / ny - 0.5;
+	const RFLOAT x_Cy = x_C[3] + x_C[4] * y, y_Cy = y_C[3] + y_C[4] * y;
+	RFLOAT *x_fitted = row.x.data(), *y_fitted = row.y.data();
+
+	// The model, in one vectorised pass over the row. This loop must not convert between int and RFLOAT
+	// nor choose between values, otherwise the compiler does not vectorise it for SSE2.
+	#pragma omp simd
+	for (int ix = 0; ix < nx; ix++) {
+		const RFLOAT x = xs[ix];
+		x_fitted[ix] = ixs[ix] - (x_C[0] + (x_C[1] + x_C[2] * x) * x + (x_Cy + x_C[5] * x) * y);
+		y_fitted[ix] = iy - (y_C[0] + (y_C[1] + y_C[2] * x) * x + (y_Cy + y_C[5] * x) * y);
+	}
+
+	const float *data = MULTIDIM_ARRAY(Iframe);
+	for (int ix = 0; ix < nx; ix++) {
+		const int x0 = FLOOR(x_fitted[ix]), y0 = FLOOR(y_fitted[ix]);
+		if (x0 < 0 || x0 >= nx - 1 || y0 < 0 || y0 >= ny - 1) {
+			const int x_edge = (x0 < 0) ? 0 : XMIPP_MIN(x0, nx - 1);
+			const int y_edge = (y0 < 0) ? 0 : XMIPP_MIN(y0, ny - 1);
+			out[ix] += data[(size_t)y_edge * nx + x_edge];
+			continue;
+		}
+
+		const RFLOAT fx = x_fitted[ix] - x0, fy = y_fitted[ix] - y0;
+		const float *d = data + (size_t)y0 * nx + x0;
+		const RFLOAT dx0 = LIN_INTERP(fx, (RFLOAT)d[0], (RFLOAT)d[1]);
+		const RFLOAT dx1 = LIN_INTERP(fx, (RFLOAT)d[nx], (RFLOAT)d[nx + 1]);
+		out[ix] += LIN_INTERP(fy, dx0, dx1);
+	}
+}
+
+// Sum of the frames without shifts. Blocks of Isum stay in cache while all frames are added to them.
+static void addFrames(MultidimArray<float> &Isum, std::vector<Image<float> > &Iframes, int n_threads) {
+	const long int size = MULTIDIM_SIZE(Isum), block = 4096;
+	const int n_frames = Iframes.size();
+	float *sum = MULTIDIM_ARRAY(Isum);
+
+	#pragma omp parallel for num_threads(n_threads) schedule(static)
+	for (long int start = 0; start < size; start += block) {
+		const long int end = XMIPP_MIN(start + block, size);
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			const float *frame = MULTIDIM_ARRAY(Iframes[iframe]());
+			#pragma omp simd
+			for (long int n = start; n < end; n++)
+				sum[n] += frame[n];
+		}
+	}
+}
+
+void MotioncorrRunner::realSpaceInterpolation_withoutsum(std::vector<Image<float> > &Ialignedframes, std::vector<Image<float> > &Iframes, MotionModel *model, std::ostream &logfile, int first_frame) {
+	int model_version = MOTION_MODEL_NULL;
+	if (model != NULL) {
+		model_version = model->getModelVersion();
+	}
+
+	const int n_frames = Iframes.size();
+	if (model_version == MOTION_MODEL_NULL) {
+		// Simple sum
+		for (int iframe = 0; iframe < n_frames; iframe++) {
+			logfile << "." << std::flush;
+
+			#pragma omp parallel for num_threads(n_threads)
+//			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum()) {
+//				DIRECT_MULTIDIM_ELEM(Isum(), n) += DIRECT_MULTIDIM_ELEM(Iframes[iframe](), n);
 //			}
 			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Ialignedframes[iframe]()) {
 				DIRECT_MULTIDIM_ELEM(Ialignedframes[iframe](), n) += DIRECT_MULTIDIM_ELEM(Iframes[iframe](), n);
@@ -1916,12 +2676,12 @@ void MotioncorrRunner::realSpaceInterpolation_withoutsum(std::vector<Image<float
 		}
 	} else if (model_version == MOTION_MODEL_THIRD_ORDER_POLYNOMIAL) { // Optimised code
 		ThirdOrderPolynomialModel *polynomial_model = (ThirdOrderPolynomialModel*)model;
-		realSpaceInterpolation_ThirdOrderPolynomial_withoutsum(Ialignedframes, Iframes, *polynomial_model, logfile);
+		realSpaceInterpolation_ThirdOrderPolynomial_withoutsum(Ialignedframes, Iframes, *polynomial_model, logfile, first_frame);
 	} else { // general code
 		const int nx = XSIZE(Iframes[0]()), ny = YSIZE(Iframes[0]());
 		for (int iframe = 0; iframe < n_frames; iframe++) {
 			logfile << "." << std::flush;
-			const RFLOAT z = iframe;
+			const RFLOAT z = first_frame + iframe;
 
 			#pragma omp parallel for num_threads(n_threads)
 			for (int iy = 0; iy < ny; iy++) {
@@ -1981,100 +2741,33 @@ void MotioncorrRunner::realSpaceInterpolation_withoutsum(std::vector<Image<float
 	} // general model
 }
 
-void MotioncorrRunner::realSpaceInterpolation_ThirdOrderPolynomial_withoutsum(std::vector<Image<float> > &Ialignedframes, std::vector<Image<float> > &Iframes, ThirdOrderPolynomialModel &model, std::ostream &logfile) {
+void MotioncorrRunner::realSpaceInterpolation_ThirdOrderPolynomial_withoutsum(std::vector<Image<float> > &Ialignedframes, std::vector<Image<float> > &Iframes, ThirdOrderPolynomialModel &model, std::ostream &logfile, int first_frame) {
 	const int n_frames = Iframes.size();
 	const int nx = XSIZE(Iframes[0]()), ny = YSIZE(Iframes[0]());
-	const Matrix1D<RFLOAT> coeffX = model.coeffX, coeffY = model.coeffY;
 
+	std::vector<RFLOAT> x_C(6 * n_frames), y_C(6 * n_frames), xs(nx), ixs(nx);
 	for (int iframe = 0; iframe < n_frames; iframe++) {
-		logfile << "." << std::flush;
-
-		const RFLOAT z = iframe, z2 = iframe * iframe;
-		const RFLOAT z3 = z * z2;
-		// Common terms
-		const RFLOAT x_C0 = coeffX(0)  * z + coeffX(1)  * z2 + coeffX(2)  * z3;
-		const RFLOAT x_C1 = coeffX(3)  * z + coeffX(4)  * z2 + coeffX(5)  * z3;
-		const RFLOAT x_C2 = coeffX(6)  * z + coeffX(7)  * z2 + coeffX(8)  * z3;
-		const RFLOAT x_C3 = coeffX(9)  * z + coeffX(10) * z2 + coeffX(11) * z3;
-		const RFLOAT x_C4 = coeffX(12) * z + coeffX(13) * z2 + coeffX(14) * z3;
-		const RFLOAT x_C5 = coeffX(15) * z + coeffX(16) * z2 + coeffX(17) * z3;
-		const RFLOAT y_C0 = coeffY(0)  * z + coeffY(1)  * z2 + coeffY(2)  * z3;
-		const RFLOAT y_C1 = coeffY(3)  * z + coeffY(4)  * z2 + coeffY(5)  * z3;
-		const RFLOAT y_C2 = coeffY(6)  * z + coeffY(7)  * z2 + coeffY(8)  * z3;
-		const RFLOAT y_C3 = coeffY(9)  * z + coeffY(10) * z2 + coeffY(11) * z3;
-		const RFLOAT y_C4 = coeffY(12) * z + coeffY(13) * z2 + coeffY(14) * z3;
-		const RFLOAT y_C5 = coeffY(15) * z + coeffY(16) * z2 + coeffY(17) * z3;
-
-		#pragma omp parallel for num_threads(n_threads)
-		for (int iy = 0; iy < ny; iy++) {
-			const RFLOAT y = (RFLOAT)iy / ny - 0.5;
-			for (int ix = 0; ix < nx; ix++) {
-				const RFLOAT x = (RFLOAT)ix / nx - 0.5;
-				bool valid = true;
-
-				RFLOAT x_fitted = x_C0 + (x_C1 + x_C2 * x) * x + (x_C3 + x_C4 * y + x_C5 * x) * y;
-				RFLOAT y_fitted = y_C0 + (y_C1 + y_C2 * x) * x + (y_C3 + y_C4 * y + y_C5 * x) * y;
-
-#ifdef VALIDATE_OPTIMISED_CODE
-				RFLOAT x_fitted2, y_fitted2;
-				model.getShiftAt(z, x, y, x_fitted2, y_fitted2);
-				if (abs(x_fitted - x_fitted2) > 1E-4 || abs(y_fitted - y_fitted2) > 1E-4) {
-					std::cout << "error at " << x << ", " << y << " : " << x_fitted << " " << x_fitted2 << " " << y_fitted << " " << y_fitted2 << std::endl;
-				}
-#endif
-				x_fitted = ix - x_fitted; y_fitted = iy - y_fitted;
-
-				int x0 = FLOOR(x_fitted);
-				int y0 = FLOOR(y_fitted);
-				const int x1 = x0 + 1;
-				const int y1 = y0 + 1;
-
-				// some conditions might seem redundant but necessary when overflow happened
-				if (x0 < 0 || x1 < 0) {x0 = 0; valid = false;}
-				if (y0 < 0 || y1 < 0) {y0 = 0; valid = false;}
-				if (x1 >= nx || x0 >= nx - 1) {x0 = nx - 1; valid = false;}
-				if (y1 >= ny || y0 >= ny - 1) {y0 = ny - 1; valid = false;}
-				if (!valid) {
-/*					DIRECT_A2D_ELEM(Isum(), iy, ix) += DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-#ifdef DEBUG_OWN
-					if (std::isnan(DIRECT_A2D_ELEM(Isum(), iy, ix))) {
-						std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << std::endl;
-					}
-#endif
-*/					DIRECT_A2D_ELEM(Ialignedframes[iframe](), iy, ix) += DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-#ifdef DEBUG_OWN
-					if (std::isnan(DIRECT_A2D_ELEM(Ialignedframes[iframe](), iy, ix))) {
-						std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << std::endl;
-					}
-#endif
-					continue;
-				}
-
-				const RFLOAT fx = x_fitted - x0;
-				const RFLOAT fy = y_fitted - y0;
-
-//				std::cout << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << std::endl;
-				const RFLOAT d00 = DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-				const RFLOAT d01 = DIRECT_A2D_ELEM(Iframes[iframe](), y0, x1);
-				const RFLOAT d10 = DIRECT_A2D_ELEM(Iframes[iframe](), y1, x0);
-				const RFLOAT d11 = DIRECT_A2D_ELEM(Iframes[iframe](), y1, x1);
+		getThirdOrderPolynomialTerms(model.coeffX, first_frame + iframe, &x_C[6 * iframe]);
+		getThirdOrderPolynomialTerms(model.coeffY, first_frame + iframe, &y_C[6 * iframe]);
+	}
+	for (int ix = 0; ix < nx; ix++) {
+		xs[ix] = (RFLOAT)ix / nx - 0.5;
+		ixs[ix] = ix;
+	}
 
-				const RFLOAT dx0 = LIN_INTERP(fx, d00, d01);
-				const RFLOAT dx1 = LIN_INTERP(fx, d10, d11);
-				const RFLOAT val = LIN_INTERP(fy, dx0, dx1);
-#ifdef DEBUG_OWN
-				if (std::isnan(val)) {
-					std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << " d00 " << d00 << " d01 " << d01 << " d10 " << d10 << " d11 " << d11 << " dx0 " << dx0 << " dx1 " << dx1 << std::endl;
-				}
-#endif
-				//DIRECT_A2D_ELEM(Isum(), iy, ix) += val;
-				DIRECT_A2D_ELEM(Ialignedframes[iframe](), iy, ix) += val;
-			}
-		}
+	#pragma omp parallel num_threads(n_threads)
+	{
+		ShiftedRow row(nx);
+		#pragma omp for schedule(static)
+		for (int iy = 0; iy < ny; iy++)
+			for (int iframe = 0; iframe < n_frames; iframe++)
+				addShiftedRow(Iframes[iframe](), iy, &x_C[6 * iframe], &y_C[6 * iframe], xs.data(), ixs.data(),
+				              &DIRECT_A2D_ELEM(Ialignedframes[iframe](), iy, 0), row);
 	}
+	logfile << std::string(n_frames, '.') << std::flush;
 }
 
-void MotioncorrRunner::realSpaceInterpolation(Image <float> &Isum, std::vector<Image<float> > &Iframes, MotionModel *model, std::ostream &logfile) {
+void MotioncorrRunner::realSpaceInterpolation(Image <float> &Isum, std::vector<Image<float> > &Iframes, MotionModel *model, std::ostream &logfile, int first_frame) {
 	int model_version = MOTION_MODEL_NULL;
 	if (model != NULL) {
 		model_version = model->getModelVersion();
@@ -2083,22 +2776,16 @@ void MotioncorrRunner::realSpaceInterpolation(Image <float> &Isum, std::vector<I
 	const int n_frames = Iframes.size();
 	if (model_version == MOTION_MODEL_NULL) {
 		// Simple sum
-		for (int iframe = 0; iframe < n_frames; iframe++) {
-			logfile << "." << std::flush;
-
-			#pragma omp parallel for num_threads(n_threads)
-			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum()) {
-				DIRECT_MULTIDIM_ELEM(Isum(), n) += DIRECT_MULTIDIM_ELEM(Iframes[iframe](), n);
-			}
-		}
+		addFrames(Isum(), Iframes, n_threads);
+		logfile << std::string(n_frames, '.') << std::flush;
 	} else if (model_version == MOTION_MODEL_THIRD_ORDER_POLYNOMIAL) { // Optimised code
 		ThirdOrderPolynomialModel *polynomial_model = (ThirdOrderPolynomialModel*)model;
-		realSpaceInterpolation_ThirdOrderPolynomial(Isum, Iframes, *polynomial_model, logfile);
+		realSpaceInterpolation_ThirdOrderPolynomial(Isum, Iframes, *polynomial_model, logfile, first_frame);
 	} else { // general code
 		const int nx = XSIZE(Iframes[0]()), ny = YSIZE(Iframes[0]());
 		for (int iframe = 0; iframe < n_frames; iframe++) {
 			logfile << "." << std::flush;
-			const RFLOAT z = iframe;
+			const RFLOAT z = first_frame + iframe;
 
 			#pragma omp parallel for num_threads(n_threads)
 			for (int iy = 0; iy < ny; iy++) {
@@ -2152,90 +2839,30 @@ void MotioncorrRunner::realSpaceInterpolation(Image <float> &Isum, std::vector<I
 	} // general model
 }
 
-void MotioncorrRunner::realSpaceInterpolation_ThirdOrderPolynomial(Image <float> &Isum, std::vector<Image<float> > &Iframes, ThirdOrderPolynomialModel &model, std::ostream &logfile) {
+void MotioncorrRunner::realSpaceInterpolation_ThirdOrderPolynomial(Image <float> &Isum, std::vector<Image<float> > &Iframes, ThirdOrderPolynomialModel &model, std::ostream &logfile, int first_frame) {
 	const int n_frames = Iframes.size();
 	const int nx = XSIZE(Iframes[0]()), ny = YSIZE(Iframes[0]());
-	const Matrix1D<RFLOAT> coeffX = model.coeffX, coeffY = model.coeffY;
 
+	std::vector<RFLOAT> x_C(6 * n_frames), y_C(6 * n_frames), xs(nx), ixs(nx);
 	for (int iframe = 0; iframe < n_frames; iframe++) {
-		logfile << "." << std::flush;
-
-		const RFLOAT z = iframe, z2 = iframe * iframe;
-		const RFLOAT z3 = z * z2;
-		// Common terms
-		const RFLOAT x_C0 = coeffX(0)  * z + coeffX(1)  * z2 + coeffX(2)  * z3;
-		const RFLOAT x_C1 = coeffX(3)  * z + coeffX(4)  * z2 + coeffX(5)  * z3;
-		const RFLOAT x_C2 = coeffX(6)  * z + coeffX(7)  * z2 + coeffX(8)  * z3;
-		const RFLOAT x_C3 = coeffX(9)  * z + coeffX(10) * z2 + coeffX(11) * z3;
-		const RFLOAT x_C4 = coeffX(12) * z + coeffX(13) * z2 + coeffX(14) * z3;
-		const RFLOAT x_C5 = coeffX(15) * z + coeffX(16) * z2 + coeffX(17) * z3;
-		const RFLOAT y_C0 = coeffY(0)  * z + coeffY(1)  * z2 + coeffY(2)  * z3;
-		const RFLOAT y_C1 = coeffY(3)  * z + coeffY(4)  * z2 + coeffY(5)  * z3;
-		const RFLOAT y_C2 = coeffY(6)  * z + coeffY(7)  * z2 + coeffY(8)  * z3;
-		const RFLOAT y_C3 = coeffY(9)  * z + coeffY(10) * z2 + coeffY(11) * z3;
-		const RFLOAT y_C4 = coeffY(12) * z + coeffY(13) * z2 + coeffY(14) * z3;
-		const RFLOAT y_C5 = coeffY(15) * z + coeffY(16) * z2 + coeffY(17) * z3;
-
-		#pragma omp parallel for num_threads(n_threads)
-		for (int iy = 0; iy < ny; iy++) {
-			const RFLOAT y = (RFLOAT)iy / ny - 0.5;
-			for (int ix = 0; ix < nx; ix++) {
-				const RFLOAT x = (RFLOAT)ix / nx - 0.5;
-				bool valid = true;
-
-				RFLOAT x_fitted = x_C0 + (x_C1 + x_C2 * x) * x + (x_C3 + x_C4 * y + x_C5 * x) * y;
-				RFLOAT y_fitted = y_C0 + (y_C1 + y_C2 * x) * x + (y_C3 + y_C4 * y + y_C5 * x) * y;
-
-#ifdef VALIDATE_OPTIMISED_CODE
-				RFLOAT x_fitted2, y_fitted2;
-				model.getShiftAt(z, x, y, x_fitted2, y_fitted2);
-				if (abs(x_fitted - x_fitted2) > 1E-4 || abs(y_fitted - y_fitted2) > 1E-4) {
-					std::cout << "error at " << x << ", " << y << " : " << x_fitted << " " << x_fitted2 << " " << y_fitted << " " << y_fitted2 << std::endl;
-				}
-#endif
-				x_fitted = ix - x_fitted; y_fitted = iy - y_fitted;
-
-				int x0 = FLOOR(x_fitted);
-				int y0 = FLOOR(y_fitted);
-				const int x1 = x0 + 1;
-				const int y1 = y0 + 1;
-
-				// some conditions might seem redundant but necessary when overflow happened
-				if (x0 < 0 || x1 < 0) {x0 = 0; valid = false;}
-				if (y0 < 0 || y1 < 0) {y0 = 0; valid = false;}
-				if (x1 >= nx || x0 >= nx - 1) {x0 = nx - 1; valid = false;}
-				if (y1 >= ny || y0 >= ny - 1) {y0 = ny - 1; valid = false;}
-				if (!valid) {
-					DIRECT_A2D_ELEM(Isum(), iy, ix) += DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-#ifdef DEBUG_OWN
-					if (std::isnan(DIRECT_A2D_ELEM(Isum(), iy, ix))) {
-						std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << std::endl;
-					}
-#endif
-					continue;
-				}
-
-				const RFLOAT fx = x_fitted - x0;
-				const RFLOAT fy = y_fitted - y0;
-
-//				std::cout << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << std::endl;
-				const RFLOAT d00 = DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
-				const RFLOAT d01 = DIRECT_A2D_ELEM(Iframes[iframe](), y0, x1);
-				const RFLOAT d10 = DIRECT_A2D_ELEM(Iframes[iframe](), y1, x0);
-				const RFLOAT d11 = DIRECT_A2D_ELEM(Iframes[iframe](), y1, x1);
+		getThirdOrderPolynomialTerms(model.coeffX, first_frame + iframe, &x_C[6 * iframe]);
+		getThirdOrderPolynomialTerms(model.coeffY, first_frame + iframe, &y_C[6 * iframe]);
+	}
+	for (int ix = 0; ix < nx; ix++) {
+		xs[ix] = (RFLOAT)ix / nx - 0.5;
+		ixs[ix] = ix;
+	}
 
-				const RFLOAT dx0 = LIN_INTERP(fx, d00, d01);
-				const RFLOAT dx1 = LIN_INTERP(fx, d10, d11);
-				const RFLOAT val = LIN_INTERP(fy, dx0, dx1);
-#ifdef DEBUG_OWN
-				if (std::isnan(val)) {
-					std::cerr << "ix = " << ix << " xfit = " << x_fitted << " iy = " << iy << " ifit = " << y_fitted << " d00 " << d00 << " d01 " << d01 << " d10 " << d10 << " d11 " << d11 << " dx0 " << dx0 << " dx1 " << dx1 << std::endl;
-				}
-#endif
-				DIRECT_A2D_ELEM(Isum(), iy, ix) += val;
-			}
-		}
+	// Each row of Isum stays in cache while all frames are added to it
+	#pragma omp parallel num_threads(n_threads)
+	{
+		ShiftedRow row(nx);
+		#pragma omp for schedule(static)
+		for (int iy = 0; iy < ny; iy++)
+			for (int iframe = 0; iframe < n_frames; iframe++)
+				addShiftedRow(Iframes[iframe](), iy, &x_C[6 * iframe], &y_C[6 * iframe], xs.data(), ixs.data(), &DIRECT_A2D_ELEM(Isum(), iy, 0), row);
 	}
+	logfile << std::string(n_frames, '.') << std::flush;
 }
 
 bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes, const int pnx, const int pny, const RFLOAT scaled_B, std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile) {
@@ -2261,15 +2888,8 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 	}
 
 	// Calculate the size of down-sampled CCF
-	float ccf_requested_scale = ccf_downsample;
-	if (ccf_downsample <= 0) {
-		ccf_requested_scale = sqrt(-log(1E-8) / (2 * scaled_B)); // exp(-2 B max_dist^2) = 1E-8
-	}
-	int ccf_nx = findGoodSize(int(pnx * ccf_requested_scale)), ccf_ny = findGoodSize(int(pny * ccf_requested_scale));
-	if (ccf_nx > pnx) ccf_nx = pnx;
-	if (ccf_ny > pny) ccf_ny = pny;
-	if (ccf_nx % 2 == 1) ccf_nx++;
-	if (ccf_ny % 2 == 1) ccf_ny++;
+	int ccf_nx, ccf_ny;
+	getCCFSize(pnx, pny, scaled_B, ccf_nx, ccf_ny);
 	const int ccf_nfx = ccf_nx / 2 + 1, ccf_nfy = ccf_ny;
 	const int ccf_nfy_half = ccf_ny / 2;
 	const RFLOAT ccf_scale_x = (RFLOAT)pnx / ccf_nx;
@@ -2278,8 +2898,9 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 	if (search_range * 2 + 1 > ccf_nx) search_range = ccf_nx / 2 - 1;
 	if (search_range * 2 + 1 > ccf_ny) search_range = ccf_ny / 2 - 1;
 
-	const int nfx = XSIZE(Fframes[0]), nfy = YSIZE(Fframes[0]);
-	const int nfy_half = nfy / 2;
+	// Fframes might have been cropped already, but the weight depends on the frequencies in the full patch
+	const int nfy = YSIZE(Fframes[0]);
+	const int full_nfx = pnx / 2 + 1, full_nfy = pny;
 
 	Fref.reshape(ccf_nfy, ccf_nfx);
 	for (int i = 0; i < n_threads; i++) {
@@ -2289,7 +2910,7 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 
 #ifdef DEBUG
 	std::cout << "Patch Size X = " << pnx << " Y  = " << pny << std::endl;
-	std::cout << "Fframes X = " << nfx << " Y = " << nfy << std::endl;
+	std::cout << "Fframes X = " << XSIZE(Fframes[0]) << " Y = " << nfy << std::endl;
 	std::cout << "Fccf X = " << ccf_nfx << " Y = " << ccf_nfy << std::endl;
 	std::cout << "CCF crop request = " << ccf_requested_scale << ", actual X = " << 1 / ccf_scale_x << " Y = " << 1 / ccf_scale_y << std::endl;
 	std::cout << "CCF search range = " << search_range << std::endl;
@@ -2302,10 +2923,10 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 	#pragma omp parallel for num_threads(n_threads)
 	for (int y = 0; y < ccf_nfy; y++) {
 		const int ly = (y > ccf_nfy_half) ? (y - ccf_nfy) : y;
-		RFLOAT ly2 = ly * (RFLOAT)ly / (nfy * (RFLOAT)nfy);
+		RFLOAT ly2 = ly * (RFLOAT)ly / (full_nfy * (RFLOAT)full_nfy);
 
 		for (int x = 0; x < ccf_nfx; x++) {
-			RFLOAT dist2 = ly2 + x * (RFLOAT)x / (nfx * (RFLOAT)nfx);
+			RFLOAT dist2 = ly2 + x * (RFLOAT)x / (full_nfx * (RFLOAT)full_nfx);
 			DIRECT_A2D_ELEM(weight, y, x) = exp(- 2 * dist2 * scaled_B); // 2 for Fref and Fframe
 		}
 	}
@@ -2438,6 +3059,30 @@ bool MotioncorrRunner::alignPatch(std::vector<MultidimArray<fComplex> > &Fframes
 	return converged;
 }
 
+void MotioncorrRunner::getCCFSize(const int pnx, const int pny, const RFLOAT scaled_B, int &ccf_nx, int &ccf_ny) {
+	float ccf_requested_scale = ccf_downsample;
+	if (ccf_downsample <= 0) {
+		ccf_requested_scale = sqrt(-log(1E-8) / (2 * scaled_B)); // exp(-2 B max_dist^2) = 1E-8
+	}
+	ccf_nx = findGoodSize(int(pnx * ccf_requested_scale)), ccf_ny = findGoodSize(int(pny * ccf_requested_scale));
+	if (ccf_nx > pnx) ccf_nx = pnx;
+	if (ccf_ny > pny) ccf_ny = pny;
+	if (ccf_nx % 2 == 1) ccf_nx++;
+	if (ccf_ny % 2 == 1) ccf_ny++;
+}
+
+// The rows are taken as alignPatch() reads them, which differs from cropInFourierSpace() at the Nyquist row of the crop.
+void MotioncorrRunner::cropForCCF(const MultidimArray<fComplex> &Fframe, const int ccf_nx, const int ccf_ny, MultidimArray<fComplex> &Fcrop) {
+	const int nfy = YSIZE(Fframe), ccf_nfx = ccf_nx / 2 + 1, ccf_nfy_half = ccf_ny / 2;
+	Fcrop.reshape(ccf_ny, ccf_nfx);
+	for (int y = 0; y < ccf_ny; y++) {
+		const int ly = (y > ccf_nfy_half) ? (y - ccf_ny + nfy) : y;
+		for (int x = 0; x < ccf_nfx; x++) {
+			DIRECT_A2D_ELEM(Fcrop, y, x) = DIRECT_A2D_ELEM(Fframe, ly, x);
+		}
+	}
+}
+
 int MotioncorrRunner::findGoodSize(int request) {
 	// numbers that do not contain large prime numbers
 	const int good_numbers[] = {192, 216, 256, 288, 324,
@@ -2457,6 +3102,24 @@ int MotioncorrRunner::findGoodSize(int request) {
 	return request; // return as it is
 }
 
+void MotioncorrRunner::getDoses(Micrograph &mic, std::vector<int> &frames, std::vector<RFLOAT> &doses) {
+	if (std::abs(voltage - 300) > 2 && std::abs(voltage - 200) > 2 && std::abs(voltage - 100) > 2) {
+		REPORT_ERROR("Sorry, dose weighting is supported only for 300, 200 or 100 kV");
+	}
+
+	const int n_frames = frames.size();
+	doses.resize(n_frames);
+	for (int iframe = 0; iframe < n_frames; iframe++) {
+		// dose AFTER each frame.
+		doses[iframe] = mic.pre_exposure + dose_per_frame * (frames[iframe] + 1);
+		if (std::abs(voltage - 200) <= 2) {
+			doses[iframe] /= 0.8; // 200 kV electron is more damaging.
+		} else if (std::abs(voltage - 100) <= 2) {
+			doses[iframe] /= 0.64; // 100 kV electron is much more damaging.
+		}
+	}
+}
+
 // dose is equivalent dose at 300 kV at the END of the frame.
 // This implements the model by Timothy Grant & Nikolaus Grigorieff on eLife, 2015
 // doi: 10.7554/eLife.06980
@@ -2501,6 +3164,56 @@ void MotioncorrRunner::doseWeighting(std::vector<MultidimArray<fComplex> > &Ffra
 	}
 }
 
+// As doseWeighting(), in two steps, for frames that are not all in memory at once:
+// Ne is the critical exposure and norm the square root of the sum of the squared weights over all doses
+void MotioncorrRunner::getDoseWeightingNorm(std::vector<RFLOAT> &doses, RFLOAT apix, int nfx, int nfy, MultidimArray<RFLOAT> &Ne, MultidimArray<RFLOAT> &norm) {
+	const int nfy_half = nfy / 2;
+	const RFLOAT nfy2 = (RFLOAT)nfy * nfy;
+	const RFLOAT nfx2 = (RFLOAT)(nfx - 1) * (nfx - 1) * 4; // assuming nx is even
+	const int n_frames= doses.size();
+	const RFLOAT A = 0.245, B = -1.665, C = 2.81;
+
+	Ne.reshape(nfy, nfx);
+	norm.reshape(nfy, nfx);
+	#pragma omp parallel for num_threads(n_threads)
+	for (int y = 0; y < nfy; y++) {
+		int ly = y;
+		if (y > nfy_half) ly = y - nfy;
+
+		const RFLOAT ly2 = (RFLOAT)ly * ly / nfy2;
+		for (int x = 0; x < nfx; x++) {
+			const RFLOAT dinv2 = ly2 + (RFLOAT)x * x / nfx2;
+			const RFLOAT dinv = std::sqrt(dinv2) / apix; // d = N * apix / dist, thus dinv = dist / N / angpix
+			DIRECT_A2D_ELEM(Ne, y, x) = (A * std::pow(dinv, B) + C) * 2; // Eq. 3. 2 comes from Eq. 5
+			RFLOAT sum_weight_sq = 0;
+
+			for (int iframe = 0; iframe < n_frames; iframe++) {
+				const RFLOAT weight = std::exp(- doses[iframe] / DIRECT_A2D_ELEM(Ne, y, x)); // Eq. 5. 0.5 is factored out to Ne.
+				sum_weight_sq += weight * weight;
+			}
+
+			DIRECT_A2D_ELEM(norm, y, x) = std::sqrt(sum_weight_sq);
+			if (std::isnan(DIRECT_A2D_ELEM(norm, y, x))) {
+				std::cerr << " Ne = " << DIRECT_A2D_ELEM(Ne, y, x) << " lx = " << x << " ly = " << ly << " reso = " << 1 / dinv << " sum_weight_sq NaN" << std::endl;
+				REPORT_ERROR("Shouldn't happen.");
+			}
+		}
+	}
+}
+
+void MotioncorrRunner::doseWeighting(std::vector<MultidimArray<fComplex> > &Fframes, std::vector<RFLOAT> doses, MultidimArray<RFLOAT> &Ne, MultidimArray<RFLOAT> &norm) {
+	const int n_frames= Fframes.size();
+
+	#pragma omp parallel for num_threads(n_threads)
+	for (int iframe = 0; iframe < n_frames; iframe++) {
+		FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY2D(Fframes[iframe]) {
+			const RFLOAT weight = std::exp(- doses[iframe] / DIRECT_A2D_ELEM(Ne, i, j)); // Eq. 5
+			DIRECT_A2D_ELEM(Fframes[iframe], i, j) *= weight;
+			DIRECT_A2D_ELEM(Fframes[iframe], i, j) /= DIRECT_A2D_ELEM(norm, i, j); // Eq. 9
+		}
+	}
+}
+
 // shiftx, shifty is relative to the (real space) image size
 void MotioncorrRunner::shiftNonSquareImageInFourierTransform(MultidimArray<fComplex> &frame, RFLOAT shiftx, RFLOAT shifty) {
 	const int nfx = XSIZE(frame), nfy = YSIZE(frame);
@@ -24,6 +24,7 @@
 #include <glob.h>
 #include <vector>
 #include <string>
+#include <sstream>
 #include <stdlib.h>
 #include <stdio.h>
 #include <algorithm>
@@ -157,6 +158,12 @@ public:
 	// EER parameters
 	int eer_upsampling, eer_grouping;
 
+	// Keep at most this number of whole frames in memory in our own implementation (0: all frames)
+	int streaming_window;
+
+	// Read the next movie and write out the previous one in other threads while a movie is aligned in our own implementation
+	bool do_pipeline;
+
 	// Output STAR file
 	MetaDataTable MDavg, MDmov;
 
@@ -191,12 +198,19 @@ public:
 	// Execute our own implementation for a single micrograph
 	bool executeOwnMotionCorrection(Micrograph &mic);
 
+	// Execute our own implementation for micrographs first_mic to last_mic (inclusive) with a reader, a compute and a writer stage.
+	// Returns false if the job was aborted through the pipeline_control system.
+	bool runOwnPipeline(long int first_mic, long int last_mic);
+
 	// Plot the shifts
 	void plotShifts(FileName fn_mic, Micrograph &mic);
 
 	// Save micrograph model
 	void saveModel(Micrograph &mic);
 
+	// Copy the pixel size, voltage, dose and defect file to the micrograph model
+	void setModelParameters(Micrograph &mic);
+
 	// Make a PDF file with all the shifts and write output STAR files
 	void generateLogFilePDFAndWriteStarFiles();
 
@@ -209,25 +223,115 @@ public:
 	// Check if fn_defect is Serial EM's defect file
 	static bool detectSerialEMDefectText(FileName fn_defect);
 
+	// Add the frames, shifted by the motion model with bilinear interpolation, to Isum.
+	// Iframes[i] is frame first_frame + i in the motion model
+	void realSpaceInterpolation(Image <float> &Isum, std::vector<Image<float> > &Iframes, MotionModel *model, std::ostream &logfile, int first_frame = 0);
+
+	// As realSpaceInterpolation(), but add each shifted frame to its own image in Ialignedframes
+	void realSpaceInterpolation_withoutsum(std::vector<Image<float> > &Ialignedframes, std::vector<Image<float> > &Iframes, MotionModel *model, std::ostream &logfile, int first_frame = 0);
+
 private:
+	// A movie in our own implementation, from reading to writing
+	struct OwnMovie
+	{
+		Micrograph *mic;
+		FileName fn_avg, fn_avg_noDW, fn_log, fn_ps;
+		int nx, ny;
+		std::vector<int> frames, group_start, group_size; // frames are 0-indexed
+		Image<float> Igain;
+		std::vector<Image<float> > Iframes; // empty with streaming_window
+
+		// Without the pipeline, the log and the images are written as soon as they are made.
+		// In runOwnPipeline(), they are kept until writeOwnMovie(), so that only the writer stage writes files.
+		bool buffered = false;
+		std::ofstream logfile_direct; // opened by readOwnMovie()
+		std::ostringstream logfile_buffer;
+		std::vector<Image<float> > outputs;
+		std::vector<FileName> fn_outputs;
+		std::vector<DataType> output_types;
+
+		std::ostream& logfile()
+		{
+			if (buffered)
+				return logfile_buffer;
+			return logfile_direct;
+		}
+
+		void addOutput(Image<float> &img, const FileName &fn, DataType type = Unknown_Type)
+		{
+			if (!buffered)
+			{
+				img.write(fn, -1, false, WRITE_OVERWRITE, type);
+				return;
+			}
+			outputs.push_back(img);
+			fn_outputs.push_back(fn);
+			output_types.push_back(type);
+		}
+	};
+
+	// The three steps of executeOwnMotionCorrection(). readOwnMovie() only uses the members that are the same for all movies.
+	bool readOwnMovie(OwnMovie &movie);
+	bool alignOwnMovie(OwnMovie &movie);
+	void writeOwnMovie(OwnMovie &movie);
+
 	// shiftx, shifty is relative to the (real space) image size
 	void shiftNonSquareImageInFourierTransform(MultidimArray<fComplex> &frame, RFLOAT shiftx, RFLOAT shifty);
 
+	// Executes our own implementation with only streaming_window whole frames in memory at a time, reading the movie
+	// once for hot pixels, once for each of the global and local alignments and once for the sums.
+	// The low frequencies that alignPatch() uses are kept for all frames and, per patch, for all frame groups.
+	// This replaces alignOwnMovie(); readOwnMovie() has then chosen the frames and groups and read the gain, but not the frames.
+	bool executeOwnMotionCorrectionStreaming(OwnMovie &movie);
+
+	// Fframes can also be cropped to the low frequencies used for the CCF (see cropForCCF)
 	bool alignPatch(std::vector<MultidimArray<fComplex> > &Fframes, const int pnx, const int pny, const RFLOAT scaled_B, std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts, std::ostream &logfile);
 
+	// Size of the CCF in alignPatch for a patch of pnx * pny pixels
+	void getCCFSize(const int pnx, const int pny, const RFLOAT scaled_B, int &ccf_nx, int &ccf_ny);
+
+	// Copy the part of Fframe that alignPatch uses for a CCF of ccf_nx * ccf_ny pixels
+	void cropForCCF(const MultidimArray<fComplex> &Fframe, const int ccf_nx, const int ccf_ny, MultidimArray<fComplex> &Fcrop);
+
+	// Find hot pixels in the unaligned sum and mark them, defects and pixels without gain in bBad
+	void detectHotPixels(MultidimArray<float> &Isum, Image<float> &Igain, Micrograph &mic, MultidimArray<bool> &bBad, RFLOAT &mean, RFLOAT &std, std::ostream &logfile);
+
+	// Replace pixels marked in bBad by a random good neighbour, or by random noise if there are too few
+	void fixDefects(std::vector<Image<float> > &Iframes, MultidimArray<bool> &bBad, RFLOAT frame_mean, RFLOAT frame_std, int D_MAX);
+
+	// Make the power spectrum summed over frame groups square, crop and downsample it to ps_size and add it to the outputs of the movie
+	void writePowerSpectrum(Image<float> &PS_sum, int nx, int ny, OwnMovie &movie);
+
+	// The pixel range of patch (ix, iy), made even: [x_start, x_end) and [y_start, y_end)
+	void getPatchRange(int ix, int iy, int nx, int ny, int &x_start, int &x_end, int &y_start, int &y_end);
+
+	// Add the trajectory of a patch, from the shifts of the frame groups, to the observations for the local motion model
+	void storePatchTrajectory(std::vector<int> &group_start, std::vector<int> &group_size,
+	                          std::vector<RFLOAT> &local_xshifts, std::vector<RFLOAT> &local_yshifts, int n_frames, int x_center, int y_center,
+	                          std::vector<RFLOAT> &patch_xshifts, std::vector<RFLOAT> &patch_yshifts, std::vector<RFLOAT> &patch_frames,
+	                          std::vector<RFLOAT> &patch_xs, std::vector<RFLOAT> &patch_ys);
+
+	// Fit the third order polynomial model to the patch trajectories and store it in mic.model (NULL if the fit failed)
+	void fitLocalMotionModel(Micrograph &mic, std::vector<RFLOAT> &patch_xshifts, std::vector<RFLOAT> &patch_yshifts, std::vector<RFLOAT> &patch_frames,
+	                         std::vector<RFLOAT> &patch_xs, std::vector<RFLOAT> &patch_ys, int nx, int ny, RFLOAT prescaling, std::ostream &logfile);
+
 	void binNonSquareImage(Image<float> &Iwork, RFLOAT bin_factor);
 
 	int findGoodSize(int request);
 
 	void doseWeighting(std::vector<MultidimArray<fComplex> > &Fframes, std::vector<RFLOAT> doses, RFLOAT apix);
 
-	void realSpaceInterpolation(Image <float> &Isum, std::vector<Image<float> > &Iframes, MotionModel *model, std::ostream &logfile);
+	// Equivalent doses at 300 kV at the end of each frame
+	void getDoses(Micrograph &mic, std::vector<int> &frames, std::vector<RFLOAT> &doses);
 
-	void realSpaceInterpolation_ThirdOrderPolynomial(Image <float> &Isum, std::vector<Image<float> > &Iframes, ThirdOrderPolynomialModel &model, std::ostream &logfile);
-	
-	void realSpaceInterpolation_withoutsum(std::vector<Image<float> > &Ialignedframes, std::vector<Image<float> > &Iframes, MotionModel *model, std::ostream &logfile);
+	// Dose weighting of a subset of frames: getDoseWeightingNorm() from the doses of all frames, then doseWeighting() with the doses of the subset
+	void getDoseWeightingNorm(std::vector<RFLOAT> &doses, RFLOAT apix, int nfx, int nfy, MultidimArray<RFLOAT> &Ne, MultidimArray<RFLOAT> &norm);
 
-	void realSpaceInterpolation_ThirdOrderPolynomial_withoutsum(std::vector<Image<float> > &Ialignedframes, std::vector<Image<float> > &Iframes, ThirdOrderPolynomialModel &model, std::ostream &logfile);
+	void doseWeighting(std::vector<MultidimArray<fComplex> > &Fframes, std::vector<RFLOAT> doses, MultidimArray<RFLOAT> &Ne, MultidimArray<RFLOAT> &norm);
+
+	void realSpaceInterpolation_ThirdOrderPolynomial(Image <float> &Isum, std::vector<Image<float> > &Iframes, ThirdOrderPolynomialModel &model, std::ostream &logfile, int first_frame = 0);
+	
+	void realSpaceInterpolation_ThirdOrderPolynomial_withoutsum(std::vector<Image<float> > &Ialignedframes, std::vector<Image<float> > &Iframes, ThirdOrderPolynomialModel &model, std::ostream &logfile, int first_frame = 0);
 
 	void interpolateShifts(std::vector<int> &group_start, std::vector<int> &group_size,
 	                       std::vector<RFLOAT> &xshifts, std::vector<RFLOAT> &yshifts,
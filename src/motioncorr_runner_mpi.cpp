@@ -58,33 +58,41 @@ void MotioncorrRunnerMpi::run()
 		barstep = XMIPP_MAX(1, my_nr_micrographs / 60);
 	}
 
-	for (long int imic = my_first_micrograph; imic <= my_last_micrograph; imic++)
+	if (do_own && do_pipeline)
 	{
-		if (verb > 0 && imic % barstep == 0)
-			progress_bar(imic);
-
-		// Abort through the pipeline_control system
-		if (pipeline_control_check_abort_job())
+		if (!runOwnPipeline(my_first_micrograph, my_last_micrograph))
 			MPI_Abort(MPI_COMM_WORLD, RELION_EXIT_ABORTED);
-
-		Micrograph mic(fn_micrographs[imic], fn_gain_reference, bin_factor, eer_upsampling, eer_grouping);
-        mic.pre_exposure = pre_exposure + pre_exposure_micrographs[imic];
-
-        // Get angpix and voltage from the optics groups:
-		obsModel.opticsMdt.getValue(EMDL_CTF_VOLTAGE, voltage, optics_group_micrographs[imic]-1);
-		obsModel.opticsMdt.getValue(EMDL_MICROGRAPH_ORIGINAL_PIXEL_SIZE, angpix, optics_group_micrographs[imic]-1);
-
-		bool result;
-		if (do_own)
-			result = executeOwnMotionCorrection(mic);
-		else if (do_motioncor2)
-			result = executeMotioncor2(mic, node->rank);
-		else
-			REPORT_ERROR("Bug: by now it should be clear whether to use MotionCor2 or Unblur...");
-
-		if (result) {
-			saveModel(mic);
-			plotShifts(fn_micrographs[imic], mic);
+	}
+	else
+	{
+		for (long int imic = my_first_micrograph; imic <= my_last_micrograph; imic++)
+		{
+			if (verb > 0 && imic % barstep == 0)
+				progress_bar(imic);
+
+			// Abort through the pipeline_control system
+			if (pipeline_control_check_abort_job())
+				MPI_Abort(MPI_COMM_WORLD, RELION_EXIT_ABORTED);
+
+			Micrograph mic(fn_micrographs[imic], fn_gain_reference, bin_factor, eer_upsampling, eer_grouping);
+	        mic.pre_exposure = pre_exposure + pre_exposure_micrographs[imic];
+
+	        // Get angpix and voltage from the optics groups:
+			obsModel.opticsMdt.getValue(EMDL_CTF_VOLTAGE, voltage, optics_group_micrographs[imic]-1);
+			obsModel.opticsMdt.getValue(EMDL_MICROGRAPH_ORIGINAL_PIXEL_SIZE, angpix, optics_group_micrographs[imic]-1);
+
+			bool result;
+			if (do_own)
+				result = executeOwnMotionCorrection(mic);
+			else if (do_motioncor2)
+				result = executeMotioncor2(mic, node->rank);
+			else
+				REPORT_ERROR("Bug: by now it should be clear whether to use MotionCor2 or Unblur...");
+
+			if (result) {
+				saveModel(mic);
+				plotShifts(fn_micrographs[imic], mic);
+			}
 		}
 	}
 	if (verb > 0)
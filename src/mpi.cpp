@@ -43,9 +43,9 @@
  * e-mail address 'xmipp@cnb.csic.es'
  ***************************************************************************/
 
-#ifdef USE_MPI_COLLECTIVE
- #include <vector>
-#endif
+#include <algorithm>
+#include <type_traits>
+#include <vector>
 #include "src/mpi.h"
 
 // maximum amount of data that can be sent in MPI
@@ -73,6 +73,9 @@ MpiNode::MpiNode(int &argc, char ** argv)
 	if (rank != 0)
 	{
 		MPI_Group_rank(followerG, &followerRank);
+		MPI_Comm_split_type(followerC, MPI_COMM_TYPE_SHARED, followerRank, MPI_INFO_NULL, &nodeC);
+		MPI_Comm_rank(nodeC, &nodeRank);
+		MPI_Comm_size(nodeC, &nodeSize);
 #ifdef USE_MPI_COLLECTIVE
 		// Create seperate communicator and rank for split_random_halves case run
 		const int myColor = followerRank % 2;
@@ -85,6 +88,9 @@ MpiNode::MpiNode(int &argc, char ** argv)
 		// Leader does not belong to follower
 		followerC = MPI_COMM_NULL;
 		followerRank = -1;
+		nodeC = MPI_COMM_NULL;
+		nodeRank = -1;
+		nodeSize = 0;
 #ifdef USE_MPI_COLLECTIVE
 		// Leader does not belong to split_random_halves case run
 		splitC = MPI_COMM_NULL;
@@ -178,6 +184,8 @@ MpiNode::~MpiNode()
 	MPI_Group_free(&root_evenG);
 	MPI_Group_free(&root_oddG);
 #endif
+	if (nodeC != MPI_COMM_NULL)
+		MPI_Comm_free(&nodeC);
 	MPI_Comm_free(&followerC);
 	MPI_Group_free(&followerG);
 	MPI_Group_free(&worldG);
@@ -481,6 +489,339 @@ int MpiNode::relion_MPI_Allreduce(void *sendB, void *recvB, std::ptrdiff_t count
 }
 #endif
 
+ReduceAlgorithm textToReduceAlgorithm(const std::string &text)
+{
+	if (text == "serial")
+		return REDUCE_SERIAL;
+	else if (text == "ring")
+		return REDUCE_RING;
+	else if (text == "tree")
+		return REDUCE_TREE;
+	else if (text == "collective")
+	{
+#ifndef USE_MPI_COLLECTIVE
+		REPORT_ERROR("textToReduceAlgorithm: this program was not compiled with USE_MPI_COLLECTIVE, so collective reduction is not available");
+#endif
+		return REDUCE_COLLECTIVE;
+	}
+
+	REPORT_ERROR("textToReduceAlgorithm: unknown reduction algorithm: " + text + " (use serial, ring, tree or collective)");
+}
+
+namespace
+{
+	template <typename T>
+	MPI_Datatype mpiTypeOf()
+	{
+		return (sizeof(T) == sizeof(float)) ? MPI_FLOAT : MPI_DOUBLE;
+	}
+
+	// Point to data as it goes over the wire: data itself, or a copy in staging of lower precision
+	template <typename W>
+	W* toWire(RFLOAT *data, std::ptrdiff_t n, W *staging)
+	{
+		if (std::is_same<W, RFLOAT>::value)
+			return reinterpret_cast<W*>(data);
+
+		for (std::ptrdiff_t i = 0; i < n; i++)
+			staging[i] = data[i];
+		return staging;
+	}
+
+	// Make data equal to what the other ranks will receive
+	template <typename W>
+	void roundToWire(RFLOAT *data, std::ptrdiff_t n)
+	{
+		if (!std::is_same<W, RFLOAT>::value)
+			for (std::ptrdiff_t i = 0; i < n; i++)
+				data[i] = (W)data[i];
+	}
+}
+
+void MpiNode::sumOverRanks(RFLOAT *data, std::ptrdiff_t count, const std::vector<int> &ranks, ReduceAlgorithm algorithm, std::ptrdiff_t chunk_size, bool transfer_as_float)
+{
+	const int me = std::find(ranks.begin(), ranks.end(), rank) - ranks.begin();
+	if (me == (int)ranks.size())
+		REPORT_ERROR("MpiNode::sumOverRanks BUG: this rank is not in the list of ranks to sum over");
+
+	if (ranks.size() < 2 || count <= 0)
+		return;
+
+	// Each chunk is a single MPI message, whose count is an int
+	chunk_size = std::max((std::ptrdiff_t)1, std::min(chunk_size, (std::ptrdiff_t)(RELION_MPI_MAX_SIZE / sizeof(RFLOAT))));
+
+	if (algorithm == REDUCE_RING && transfer_as_float)
+		sumOverRing<float>(data, count, ranks, me, chunk_size);
+	else if (algorithm == REDUCE_RING)
+		sumOverRing<RFLOAT>(data, count, ranks, me, chunk_size);
+	else if (algorithm == REDUCE_TREE && transfer_as_float)
+		sumOverTree<float>(data, count, ranks, me, chunk_size);
+	else if (algorithm == REDUCE_TREE)
+		sumOverTree<RFLOAT>(data, count, ranks, me, chunk_size);
+	else
+		REPORT_ERROR("MpiNode::sumOverRanks BUG: only the ring and tree algorithms are implemented here");
+}
+
+void MpiNode::bcastInSinglePrecision(RFLOAT *data, std::ptrdiff_t count, int root, MPI_Comm comm)
+{
+	int rank_in_comm;
+	MPI_Comm_rank(comm, &rank_in_comm);
+
+	std::vector<float> buffer(count);
+	if (rank_in_comm == root)
+		std::copy(data, data + count, buffer.begin());
+
+	relion_MPI_Bcast(&buffer[0], count, MPI_FLOAT, root, comm);
+
+	for (std::ptrdiff_t i = 0; i < count; i++)
+		data[i] = buffer[i];
+}
+
+void *MpiNode::allocateSharedMemory(std::ptrdiff_t bytes, MPI_Comm comm, MPI_Win &win)
+{
+	int rank_in_comm;
+	MPI_Comm_rank(comm, &rank_in_comm);
+
+	// Only the first rank allocates, so that the memory is one contiguous block
+	void *base;
+	int result = MPI_Win_allocate_shared((rank_in_comm == 0) ? (MPI_Aint)bytes : 0, 1, MPI_INFO_NULL, comm, &base, &win);
+	if (result != MPI_SUCCESS)
+		report_MPI_ERROR(result);
+
+	MPI_Aint size;
+	int disp_unit;
+	result = MPI_Win_shared_query(win, 0, &size, &disp_unit, &base);
+	if (result != MPI_SUCCESS)
+		report_MPI_ERROR(result);
+	if (size < bytes)
+		REPORT_ERROR("MpiNode::allocateSharedMemory ERROR: could not share " + std::to_string(bytes) + " bytes between the ranks on host " + getHostName());
+
+	return base;
+}
+
+void MpiNode::freeSharedMemory(MPI_Win &win)
+{
+	if (win == MPI_WIN_NULL)
+		return;
+	int result = MPI_Win_free(&win);
+	if (result != MPI_SUCCESS)
+		report_MPI_ERROR(result);
+}
+
+template <typename W>
+void MpiNode::exchangeChunks(const W *send, std::ptrdiff_t n_send, int dest, W *recv, std::ptrdiff_t n_recv, int source,
+                             std::ptrdiff_t chunk_size, const std::function<void(std::ptrdiff_t, std::ptrdiff_t)> &arrived)
+{
+	const std::ptrdiff_t nr_send_chunks = (n_send + chunk_size - 1) / chunk_size;
+	const std::ptrdiff_t nr_recv_chunks = (n_recv + chunk_size - 1) / chunk_size;
+	std::vector<MPI_Request> send_requests(nr_send_chunks), recv_requests(nr_recv_chunks);
+	int result;
+
+	// Post all receives first, so that no message has to wait for its buffer
+	for (std::ptrdiff_t ichunk = 0; ichunk < nr_recv_chunks; ichunk++)
+	{
+		const std::ptrdiff_t first = ichunk * chunk_size;
+		const int n = std::min(chunk_size, n_recv - first);
+		result = MPI_Irecv(recv + first, n, mpiTypeOf<W>(), source, MPITAG_REDUCE, MPI_COMM_WORLD, &recv_requests[ichunk]);
+		if (result != MPI_SUCCESS)
+			report_MPI_ERROR(result);
+	}
+
+	for (std::ptrdiff_t ichunk = 0; ichunk < nr_send_chunks; ichunk++)
+	{
+		const std::ptrdiff_t first = ichunk * chunk_size;
+		const int n = std::min(chunk_size, n_send - first);
+		result = MPI_Isend(const_cast<W*>(send) + first, n, mpiTypeOf<W>(), dest, MPITAG_REDUCE, MPI_COMM_WORLD, &send_requests[ichunk]);
+		if (result != MPI_SUCCESS)
+			report_MPI_ERROR(result);
+	}
+
+	// Process each chunk as soon as it has arrived, while the later ones are still on their way
+	for (std::ptrdiff_t ichunk = 0; ichunk < nr_recv_chunks; ichunk++)
+	{
+		result = MPI_Wait(&recv_requests[ichunk], MPI_STATUS_IGNORE);
+		if (result != MPI_SUCCESS)
+			report_MPI_ERROR(result);
+
+		arrived(ichunk * chunk_size, std::min((ichunk + 1) * chunk_size, n_recv));
+	}
+
+	if (nr_send_chunks > 0)
+	{
+		result = MPI_Waitall(nr_send_chunks, &send_requests[0], MPI_STATUSES_IGNORE);
+		if (result != MPI_SUCCESS)
+			report_MPI_ERROR(result);
+	}
+}
+
+template <typename W>
+void MpiNode::sumOverRing(RFLOAT *data, std::ptrdiff_t count, const std::vector<int> &ranks, int me, std::ptrdiff_t chunk_size)
+{
+	// The array is cut into one segment per rank. In nr_ranks-1 steps of the reduce-scatter, every rank passes a partial sum
+	// of one segment on to its right neighbour and adds its own data to the one it gets from its left neighbour.
+	// Afterwards, every rank holds the total of one segment, and the all-gather passes these around the ring in another nr_ranks-1 steps.
+	// Every rank thus sends and receives 2 * count elements, however many ranks there are.
+	const int nr_ranks = ranks.size();
+	const int right = ranks[(me + 1) % nr_ranks];
+	const int left = ranks[(me + nr_ranks - 1) % nr_ranks];
+
+	auto segment_start = [&](int iseg) { return count * iseg / nr_ranks; };
+	auto segment_size = [&](int iseg) { return segment_start(iseg + 1) - segment_start(iseg); };
+
+	std::vector<W> received(count / nr_ranks + 1), staging((std::is_same<W, RFLOAT>::value) ? 0 : count / nr_ranks + 1);
+
+	for (int step = 0; step < nr_ranks - 1; step++)
+	{
+		const int send_seg = (me - step + nr_ranks) % nr_ranks;
+		const int recv_seg = (me - step - 1 + nr_ranks) % nr_ranks;
+		RFLOAT *sum = data + segment_start(recv_seg);
+		exchangeChunks<W>(toWire(data + segment_start(send_seg), segment_size(send_seg), staging.data()), segment_size(send_seg), right,
+		                  &received[0], segment_size(recv_seg), left, chunk_size, [&](std::ptrdiff_t first, std::ptrdiff_t last)
+		{
+			for (std::ptrdiff_t i = first; i < last; i++)
+				sum[i] += received[i];
+		});
+	}
+
+	// Now segment me+1 is complete here
+	roundToWire<W>(data + segment_start((me + 1) % nr_ranks), segment_size((me + 1) % nr_ranks));
+
+	for (int step = 0; step < nr_ranks - 1; step++)
+	{
+		const int send_seg = (me + 1 - step + nr_ranks) % nr_ranks;
+		const int recv_seg = (me - step + nr_ranks) % nr_ranks;
+		RFLOAT *total = data + segment_start(recv_seg);
+		exchangeChunks<W>(toWire(data + segment_start(send_seg), segment_size(send_seg), staging.data()), segment_size(send_seg), right,
+		                  &received[0], segment_size(recv_seg), left, chunk_size, [&](std::ptrdiff_t first, std::ptrdiff_t last)
+		{
+			for (std::ptrdiff_t i = first; i < last; i++)
+				total[i] = received[i];
+		});
+	}
+}
+
+template <typename W>
+void MpiNode::sumOverTree(RFLOAT *data, std::ptrdiff_t count, const std::vector<int> &ranks, int me, std::ptrdiff_t chunk_size)
+{
+	// The ranks form a binary tree, with ranks[0] at the top. The sums flow up the tree chunk by chunk: a chunk is passed on
+	// to the parent as soon as the children's chunks have been added, while the next chunks from the children are already arriving.
+	// The total then flows back down the same way. This takes only 2 log2(nr_ranks) steps, but the top ranks send and receive more.
+	const int nr_ranks = ranks.size();
+	const int parent = (me == 0) ? -1 : ranks[(me - 1) / 2];
+	std::vector<int> children;
+	for (int ichild = 2 * me + 1; ichild <= 2 * me + 2 && ichild < nr_ranks; ichild++)
+		children.push_back(ranks[ichild]);
+	const int nr_children = children.size();
+
+	const std::ptrdiff_t nr_chunks = (count + chunk_size - 1) / chunk_size;
+	auto chunk_length = [&](std::ptrdiff_t ichunk) { return (int)std::min(chunk_size, count - ichunk * chunk_size); };
+
+	// Two buffers per child: one being added, one being received into
+	std::vector<W> buffers(2 * nr_children * chunk_size);
+	std::vector<MPI_Request> recv_requests(2 * nr_children, MPI_REQUEST_NULL), send_requests;
+	int result;
+
+	// What goes over the wire, if that is not data itself
+	std::vector<W> staging((std::is_same<W, RFLOAT>::value) ? 0 : count);
+	W *wire = toWire(data, 0, staging.data());
+
+	auto post_receives = [&](std::ptrdiff_t ichunk)
+	{
+		for (int ichild = 0; ichild < nr_children; ichild++)
+		{
+			const int ibuf = 2 * ichild + ichunk % 2;
+			result = MPI_Irecv(&buffers[ibuf * chunk_size], chunk_length(ichunk), mpiTypeOf<W>(), children[ichild], MPITAG_REDUCE, MPI_COMM_WORLD, &recv_requests[ibuf]);
+			if (result != MPI_SUCCESS)
+				report_MPI_ERROR(result);
+		}
+	};
+
+	// A. Reduce
+	if (nr_children > 0)
+		post_receives(0);
+	for (std::ptrdiff_t ichunk = 0; ichunk < nr_chunks; ichunk++)
+	{
+		RFLOAT *chunk = data + ichunk * chunk_size;
+		const int n = chunk_length(ichunk);
+
+		if (nr_children > 0)
+		{
+			if (ichunk + 1 < nr_chunks)
+				post_receives(ichunk + 1);
+
+			for (int ichild = 0; ichild < nr_children; ichild++)
+			{
+				const int ibuf = 2 * ichild + ichunk % 2;
+				result = MPI_Wait(&recv_requests[ibuf], MPI_STATUS_IGNORE);
+				if (result != MPI_SUCCESS)
+					report_MPI_ERROR(result);
+
+				const W *received = &buffers[ibuf * chunk_size];
+				for (int i = 0; i < n; i++)
+					chunk[i] += received[i];
+			}
+		}
+
+		if (parent >= 0)
+		{
+			send_requests.push_back(MPI_REQUEST_NULL);
+			result = MPI_Isend(toWire(chunk, n, wire + ichunk * chunk_size), n, mpiTypeOf<W>(), parent, MPITAG_REDUCE, MPI_COMM_WORLD, &send_requests.back());
+			if (result != MPI_SUCCESS)
+				report_MPI_ERROR(result);
+		}
+	}
+
+	// B. Broadcast: the chunks from the parent overwrite the partial sums (which have been sent already), so they can be received in place
+	if (parent < 0)
+	{
+		roundToWire<W>(data, count);
+		toWire(data, count, wire);
+	}
+
+	recv_requests.assign((parent >= 0) ? nr_chunks : 0, MPI_REQUEST_NULL);
+	for (std::ptrdiff_t ichunk = 0; ichunk < (std::ptrdiff_t)recv_requests.size(); ichunk++)
+	{
+		// Receiving into a buffer that is still being sent from is not allowed: wait for the partial sum to have gone first
+		result = MPI_Wait(&send_requests[ichunk], MPI_STATUS_IGNORE);
+		if (result != MPI_SUCCESS)
+			report_MPI_ERROR(result);
+
+		result = MPI_Irecv(wire + ichunk * chunk_size, chunk_length(ichunk), mpiTypeOf<W>(), parent, MPITAG_REDUCE, MPI_COMM_WORLD, &recv_requests[ichunk]);
+		if (result != MPI_SUCCESS)
+			report_MPI_ERROR(result);
+	}
+	send_requests.clear();
+
+	for (std::ptrdiff_t ichunk = 0; ichunk < nr_chunks; ichunk++)
+	{
+		if (parent >= 0)
+		{
+			result = MPI_Wait(&recv_requests[ichunk], MPI_STATUS_IGNORE);
+			if (result != MPI_SUCCESS)
+				report_MPI_ERROR(result);
+		}
+
+		for (int ichild = 0; ichild < nr_children; ichild++)
+		{
+			send_requests.push_back(MPI_REQUEST_NULL);
+			result = MPI_Isend(wire + ichunk * chunk_size, chunk_length(ichunk), mpiTypeOf<W>(), children[ichild], MPITAG_REDUCE, MPI_COMM_WORLD, &send_requests.back());
+			if (result != MPI_SUCCESS)
+				report_MPI_ERROR(result);
+		}
+	}
+
+	if (!send_requests.empty())
+	{
+		result = MPI_Waitall(send_requests.size(), &send_requests[0], MPI_STATUSES_IGNORE);
+		if (result != MPI_SUCCESS)
+			report_MPI_ERROR(result);
+	}
+
+	if (parent >= 0 && !std::is_same<W, RFLOAT>::value)
+		for (std::ptrdiff_t i = 0; i < count; i++)
+			data[i] = wire[i];
+}
+
 void MpiNode::report_MPI_ERROR(int error_code)
 {
 	char error_string[200];
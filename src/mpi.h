@@ -49,6 +49,9 @@
 #include <cstdlib>
 #include <cstdio>
 #include <unistd.h>
+#include <functional>
+#include <string>
+#include <vector>
 #include "src/error.h"
 #include "src/macros.h"
 
@@ -65,6 +68,19 @@
 #define MPITAG_BCAST 9
 #define MPITAG_WAIT 10
 #define MPITAG_STOP 11
+#define MPITAG_REDUCE 12
+
+// Algorithms for summing arrays over a set of ranks (see MpiNode::sumOverRanks)
+enum ReduceAlgorithm
+{
+	REDUCE_SERIAL,     // pass the sum from one rank to the next, one at a time
+	REDUCE_RING,       // reduce-scatter + all-gather around a ring: bandwidth-optimal for large arrays
+	REDUCE_TREE,       // reduce up a binary tree and broadcast back down: fewer steps for small arrays
+	REDUCE_COLLECTIVE  // MPI_Allreduce of the MPI library (only with USE_MPI_COLLECTIVE)
+};
+
+// Convert serial/ring/tree/collective into a ReduceAlgorithm
+ReduceAlgorithm textToReduceAlgorithm(const std::string &text);
 
 /** Class to wrapp some MPI common calls in an work node.
 *
@@ -78,6 +94,8 @@ public:
 	MPI_Group worldG, followerG; // groups of ranks (in practice only used to create communicators)
 	MPI_Comm worldC, followerC; // communicators
 	int followerRank; // index of follower within the follower-group (and communicator)
+	MPI_Comm nodeC; // followers on the same host, which can share memory (MPI_COMM_NULL on the leader)
+	int nodeRank, nodeSize; // index of this follower among those on its host, and their number
 #ifdef USE_MPI_COLLECTIVE
 	MPI_Comm splitC;	// communicator when doing split random halves
 	int splitRank;		// index of ranks within the split random halves group
@@ -113,16 +131,55 @@ public:
 
 	int relion_MPI_Bcast(void *buffer, std::ptrdiff_t count, MPI_Datatype datatype, int root, MPI_Comm comm);
 
+	/** Sum data over the given (world) ranks; afterwards all of them hold the sum.
+	 *  All ranks in the list must call this with the same count, list, algorithm and chunk_size.
+	 *  Messages are sent in chunks of chunk_size elements, so that the summation of one chunk overlaps with
+	 *  the transfer of the next ones. REDUCE_SERIAL and REDUCE_COLLECTIVE are not handled here.
+	 *  With transfer_as_float, partial sums are sent in single precision (half the traffic in double-precision builds),
+	 *  but they are still added up in RFLOAT on every rank. All ranks end up with the same (single-precision) values.
+	 *  Every partial sum is rounded again before it is passed on, so this is not compensated summation: the error
+	 *  grows with the number of ranks, up to (nr_ranks + 1) float roundings of the sum of the absolute values
+	 *  (relion_mpi_tester --reduce --float reports it).
+	 */
+	void sumOverRanks(RFLOAT *data, std::ptrdiff_t count, const std::vector<int> &ranks, ReduceAlgorithm algorithm, std::ptrdiff_t chunk_size,
+	                  bool transfer_as_float = false);
+
+	/** Like relion_MPI_Bcast of RFLOATs, but sent in single precision. The root's data are rounded as well. */
+	void bcastInSinglePrecision(RFLOAT *data, std::ptrdiff_t count, int root, MPI_Comm comm);
+
+	/** Allocate memory that all ranks of comm share, through an MPI-3 shared window.
+	 *  comm must only contain ranks on the same host (e.g. nodeC, or a sub-communicator of it).
+	 *  The memory belongs to rank 0 of comm; every rank gets a pointer to its start.
+	 *  Collective over comm. Use MPI_Win_fence(0, win) around writes, so that the others see them.
+	 */
+	void *allocateSharedMemory(std::ptrdiff_t bytes, MPI_Comm comm, MPI_Win &win);
+	/** Release memory from allocateSharedMemory. Collective over the same comm. */
+	void freeSharedMemory(MPI_Win &win);
+
 	/* Better error handling of MPI error messages */
 	void report_MPI_ERROR(int error_code);
 
 #ifdef USE_MPI_COLLECTIVE
 	int relion_MPI_Allreduce(void *sendB, void *recvB, std::ptrdiff_t count, MPI_Datatype datatype, MPI_Op op, MPI_Comm comm);
+#endif
 
 private:
+#ifdef USE_MPI_COLLECTIVE
 	std::ptrdiff_t p2p_blocksize, coll_blocksize;	// Block size for point-to-point and collective MPI communiucation
 #endif
 
+	// Send n_send elements to dest while receiving n_recv elements from source, both in chunks.
+	// arrived(first, last) is called for each received chunk, while the later ones may still be on their way.
+	template <typename W>
+	void exchangeChunks(const W *send, std::ptrdiff_t n_send, int dest, W *recv, std::ptrdiff_t n_recv, int source,
+	                    std::ptrdiff_t chunk_size, const std::function<void(std::ptrdiff_t, std::ptrdiff_t)> &arrived);
+
+	// W is the type used on the wire: RFLOAT, or float
+	template <typename W>
+	void sumOverRing(RFLOAT *data, std::ptrdiff_t count, const std::vector<int> &ranks, int me, std::ptrdiff_t chunk_size);
+	template <typename W>
+	void sumOverTree(RFLOAT *data, std::ptrdiff_t count, const std::vector<int> &ranks, int me, std::ptrdiff_t chunk_size);
+
 };
 
 // General function to print machinenames on all MPI nodes
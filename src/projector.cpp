@@ -309,7 +309,7 @@ void Projector::computeFourierTransformMap(
 			}
 			else
 #endif
-			griddingCorrect(vol_in);
+			griddingCorrect(vol_in, nr_threads);
 		else
 			vol_in.setXmippOrigin();
 	}
@@ -592,11 +592,24 @@ void Projector::computeFourierTransformMap(
 
 }
 
-void Projector::griddingCorrect(MultidimArray<RFLOAT> &vol_in)
+void Projector::griddingCorrect(MultidimArray<RFLOAT> &vol_in, int threads)
 {
+	// NN interpolation is convolution with a rectangular pulse, which FT is a sinc function
+	// trilinear interpolation is convolution with a triangular pulse, which FT is a sinc^2 function
+	bool is_sinc2;
+	if (interpolator==NEAREST_NEIGHBOUR && r_min_nn == 0)
+		is_sinc2 = false;
+	else if (interpolator==TRILINEAR || (interpolator==NEAREST_NEIGHBOUR && r_min_nn > 0) )
+		is_sinc2 = true;
+	else
+		REPORT_ERROR("BUG Projector::griddingCorrect: unrecognised interpolator scheme.");
+
 	// Correct real-space map by dividing it by the Fourier transform of the interpolator(s)
 	vol_in.setXmippOrigin();
-	FOR_ALL_ELEMENTS_IN_ARRAY3D(vol_in)
+	#pragma omp parallel for num_threads(threads)
+	for (long int k = STARTINGZ(vol_in); k <= FINISHINGZ(vol_in); k++)
+	for (long int i = STARTINGY(vol_in); i <= FINISHINGY(vol_in); i++)
+	for (long int j = STARTINGX(vol_in); j <= FINISHINGX(vol_in); j++)
 	{
 		RFLOAT r = sqrt((RFLOAT)(k*k+i*i+j*j));
 		// if r==0: do nothing (i.e. divide by 1)
@@ -606,18 +619,10 @@ void Projector::griddingCorrect(MultidimArray<RFLOAT> &vol_in)
 			RFLOAT sinc = sin(PI * rval) / ( PI * rval);
 			//RFLOAT ftblob = blob_Fourier_val(rval, blob) / blob_Fourier_val(0., blob);
 			// Interpolation (goes with "interpolator") to go from arbitrary to fine grid
-			if (interpolator==NEAREST_NEIGHBOUR && r_min_nn == 0)
-			{
-				// NN interpolation is convolution with a rectangular pulse, which FT is a sinc function
-				A3D_ELEM(vol_in, k, i, j) /= sinc;
-			}
-			else if (interpolator==TRILINEAR || (interpolator==NEAREST_NEIGHBOUR && r_min_nn > 0) )
-			{
-				// trilinear interpolation is convolution with a triangular pulse, which FT is a sinc^2 function
+			if (is_sinc2)
 				A3D_ELEM(vol_in, k, i, j) /= sinc * sinc;
-			}
 			else
-				REPORT_ERROR("BUG Projector::griddingCorrect: unrecognised interpolator scheme.");
+				A3D_ELEM(vol_in, k, i, j) /= sinc;
 //#define DEBUG_GRIDDING_CORRECT
 #ifdef DEBUG_GRIDDING_CORRECT
 			if (k==0 && i==0 && j > 0)
@@ -240,7 +240,7 @@ public:
 	 * the real-space maps by dividing them by the Fourier Transform of the interpolator
 	 * Note these corrections are made on the not-oversampled, i.e. originally sized real-space map
 	 */
-	void griddingCorrect(MultidimArray<RFLOAT> &vol_in);
+	void griddingCorrect(MultidimArray<RFLOAT> &vol_in, int threads = 1);
 
 	/*
 	* Go from the Projector-centered fourier transform back to FFTW-uncentered one
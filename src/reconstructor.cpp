@@ -82,6 +82,8 @@ void Reconstructor::read(int argc, char **argv)
 	ctf_dim  = textToInteger(parser.getOption("--reconstruct_ctf", "Perform a 3D reconstruction from 2D CTF-images, with the given size in pixels", "-1"));
 	do_reconstruct_ctf2 = parser.checkOption("--ctf2", "Reconstruct CTF^2 and then take the sqrt of that");
 	skip_gridding = !parser.checkOption("--dont_skip_gridding", "Perform gridding in the reconstruction (obsolete?)");
+	float_gridding_weights = parser.checkOption("--float_gridding_weights", "Keep the weights of the gridding iterations in single precision, to halve their memory (with --dont_skip_gridding)");
+	nr_threads = textToInteger(parser.getOption("--j", "Number of threads for the reconstruction of the padded map", "1"));
 	fn_debug = parser.getOption("--debug", "Rootname for debug reconstruction files", "");
 	debug_ori_size =  textToInteger(parser.getOption("--debug_ori_size", "Rootname for debug reconstruction files", "1"));
 	debug_size =  textToInteger(parser.getOption("--debug_size", "Rootname for debug reconstruction files", "1"));
@@ -837,7 +839,7 @@ void Reconstructor::reconstruct()
 		}
 		else
 		{
-			backprojector.reconstruct(vol(), iter, do_map, tau2);
+			backprojector.reconstruct(vol(), iter, do_map, tau2, 1., 1., -1, false, NULL, nr_threads, float_gridding_weights);
 		}
 	}
 
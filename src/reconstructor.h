@@ -45,7 +45,7 @@ public:
 	int r_max, r_min_nn, blob_order, ref_dim, interpolator, iter,
 	    debug_ori_size, debug_size,
 	    ctf_dim, nr_helical_asu, newbox, width_mask_edge, nr_sectors, subset, chosen_class,
-	    data_dim, output_boxsize, verb;
+	    data_dim, output_boxsize, verb, nr_threads;
 
 	RFLOAT blob_radius, blob_alpha, angular_error, shift_error, angpix, maxres,
 	       helical_rise, helical_twist;
@@ -55,7 +55,8 @@ public:
 	     do_ignore_optics, skip_subtomo_correction, normalised_subtomo, ctf3d_squared, is_tomo;
 
 
-	bool skip_gridding, do_reconstruct_ctf2, do_reconstruct_meas, is_reverse, read_weights, do_external_reconstruct;
+	bool skip_gridding, do_reconstruct_ctf2, do_reconstruct_meas, is_reverse, read_weights, do_external_reconstruct,
+	     float_gridding_weights;
 
 	float padding_factor, mask_diameter;
 
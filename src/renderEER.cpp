@@ -1,9 +1,12 @@
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <vector>
 #include <algorithm>
 #include <omp.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <src/time.h>
 #include <src/metadata_table.h>
@@ -66,6 +69,83 @@ void EERRenderer::silenceTIFFWarnings()
 	}
 }
 
+/* Unpack a frame of 7-bit run lengths, each followed by a symbol of symbol_bits bits unless the run length is 127.
+ * Sets the positions and (flipped) symbols of the electrons and returns the number of pixels covered.
+ *
+ * The stream is read 64 bits at a time, of which at least 57 are usable whatever the bit offset.
+ * At low doses, most codes are runs of 127 empty pixels, i.e. seven 1 bits in a row.
+ * These are skipped several at a time by counting the trailing 1 bits of the word.
+ * The frame must be followed by at least 8 readable bytes.
+ * Decoding stops at the end of the n_bytes of the frame and after max_electrons electrons,
+ * so that a corrupted frame returns fewer pixels than total_pixels.
+ */
+template <int symbol_bits>
+static long long unpackRLE7(const unsigned char *data, long long n_bytes, long long total_pixels, unsigned char symbol_flip,
+                            unsigned int *positions, unsigned char *symbols, unsigned int &n_electron, long long max_electrons)
+{
+	const int code_bits = 7 + symbol_bits;
+	const uint64_t symbol_mask = (1 << symbol_bits) - 1;
+	const unsigned long long n_bits = (unsigned long long)n_bytes * 8;
+	long long n_pix = 0;
+	unsigned long long bit_pos = 0;
+
+	while (bit_pos + 7 <= n_bits)
+	{
+		uint64_t chunk;
+		memcpy(&chunk, data + (bit_pos >> 3), sizeof(uint64_t)); // little-endian, as the stream
+		chunk >>= (bit_pos & 7);
+		int avail = (int)std::min(57ULL, n_bits - bit_pos);
+
+		while (avail >= 7)
+		{
+			if ((chunk & 127) == 127)
+			{
+				// Count the runs of 127, but not beyond the end of the frame
+				const uint64_t zeros = ~chunk;
+				const int ones = (zeros == 0) ? 64 : __builtin_ctzll(zeros);
+				const long long max_runs = (total_pixels - n_pix + 126) / 127;
+				const int runs = (int)std::min((long long)(std::min(ones, avail) / 7), max_runs);
+
+				n_pix += 127 * runs;
+				if (n_pix >= total_pixels)
+					return n_pix;
+				chunk >>= 7 * runs;
+				avail -= 7 * runs;
+				bit_pos += 7 * runs;
+				continue;
+			}
+
+			// The last run length of a frame has no symbol
+			const long long run = chunk & 127;
+			if (n_pix + run >= total_pixels)
+				return n_pix + run;
+
+			if (avail < code_bits)
+			{
+				// The symbol is cut off by the end of the frame, or continues in the next word
+				if (bit_pos + code_bits > n_bits)
+					return n_pix;
+				break;
+			}
+
+			n_pix += run;
+			if (n_electron >= max_electrons)
+				return n_pix;
+
+			positions[n_electron] = n_pix;
+			symbols[n_electron] = (unsigned char)((chunk >> 7) & symbol_mask) ^ symbol_flip;
+			n_electron++;
+			n_pix++;
+
+			chunk >>= code_bits;
+			avail -= code_bits;
+			bit_pos += code_bits;
+		}
+	}
+
+	return n_pix;
+}
+
 template <typename T>
 void EERRenderer::render4K_to_16K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons)
 {
@@ -291,7 +371,7 @@ void EERRenderer::readLegacy(FILE *fh)
 	read_data = true;
 }
 
-void EERRenderer::lazyReadFrames()
+void EERRenderer::lazyReadFrames(int n_threads)
 {
 	#pragma omp critical(EERRenderer_lazyReadFrames)
 	{
@@ -301,44 +381,95 @@ void EERRenderer::lazyReadFrames()
 
 			frame_starts.resize(nframes, 0);
 			frame_sizes.resize(nframes, 0);
-			buf = (unsigned char*)malloc(file_size); // This is big enough
-			if (buf == NULL)
-				REPORT_ERROR("Failed to allocate the buffer for " + fn_movie);
+			std::vector<std::vector<long long> > strip_offsets(nframes), strip_sizes(nframes); // in the file
 			long long pos = 0;
 
-			// Read everything
+			// Find the strips. Directories are visited in order, since TIFFSetDirectory()
+			// starts again from the first one, which is quadratic in the number of frames.
 			for (int frame = 0; frame < nframes; frame++)
 			{
+				if (frame > 0 && !TIFFReadDirectory(ftiff))
+					REPORT_ERROR("EER: failed to read the TIFF directory of frame " + integerToString(frame + 1) + " in " + fn_movie);
+
 				if ((preread_start > 0 && frame < preread_start) ||
 				    (preread_end > 0 && frame > preread_end))
 					continue;
 
-				TIFFSetDirectory(ftiff, frame);
 				const int nstrips = TIFFNumberOfStrips(ftiff);
+				toff_t *offsets = NULL;
+				if (!TIFFGetField(ftiff, TIFFTAG_STRIPOFFSETS, &offsets) || offsets == NULL)
+					REPORT_ERROR("EER: no strips in frame " + integerToString(frame + 1) + " in " + fn_movie);
 				frame_starts[frame] = pos;
 
 				for (int strip = 0; strip < nstrips; strip++)
 				{
-					const int strip_size = TIFFRawStripSize(ftiff, strip);
-					if (pos + strip_size >= file_size)
+					const long long strip_size = TIFFRawStripSize(ftiff, strip);
+					if (strip_size < 0 || offsets[strip] + strip_size > file_size)
 						REPORT_ERROR("EER: buffer overflow when reading raw strips.");
 
-					TIFFReadRawStrip(ftiff, strip, buf + pos, strip_size);
+					strip_offsets[frame].push_back(offsets[strip]);
+					strip_sizes[frame].push_back(strip_size);
 					pos += strip_size;
 					frame_sizes[frame] += strip_size;
 				}
 	#ifdef DEBUG_EER
-				printf("EER in TIFF: Read frame %d from %s, nstrips = %d, current pos in buffer = %lld / %lld\n", frame, fn_movie.c_str(), nstrips, pos, file_size);
+				printf("EER in TIFF: Found frame %d in %s, nstrips = %d, current pos in buffer = %lld / %lld\n", frame, fn_movie.c_str(), nstrips, pos, file_size);
 	#endif
 			}
 
 			TIFFClose(ftiff);
 
+			// The decoders read up to 8 bytes beyond the end of a frame
+			const long long read_ahead = 8;
+			buf = (unsigned char*)malloc(pos + read_ahead);
+			if (buf == NULL)
+				REPORT_ERROR("Failed to allocate the buffer for " + fn_movie);
+			memset(buf + pos, 0, read_ahead);
+
+			// Read the strips, several frames at a time
+			const int fd = open(fn_movie.c_str(), O_RDONLY);
+			if (fd < 0)
+				REPORT_ERROR("Failed to open " + fn_movie);
+
+			bool is_ok = true;
+			#pragma omp parallel for num_threads(n_threads) schedule(dynamic) reduction(&&:is_ok)
+			for (int frame = 0; frame < nframes; frame++)
+			{
+				unsigned char *dest = buf + frame_starts[frame];
+				for (int strip = 0; strip < strip_offsets[frame].size(); strip++)
+				{
+					long long done = 0;
+					while (done < strip_sizes[frame][strip])
+					{
+						const ssize_t n = pread(fd, dest + done, strip_sizes[frame][strip] - done, strip_offsets[frame][strip] + done);
+						if (n <= 0)
+						{
+							is_ok = false;
+							break;
+						}
+						done += n;
+					}
+					dest += strip_sizes[frame][strip];
+				}
+			}
+			close(fd);
+
+			if (!is_ok)
+				REPORT_ERROR("EER: failed to read raw strips from " + fn_movie);
+
 			read_data = true;
 		}
 	}
 }
 
+void EERRenderer::preReadFrames(int n_threads)
+{
+	if (!ready)
+		REPORT_ERROR("EERRenderer::preReadFrames called before ready.");
+
+	lazyReadFrames(n_threads);
+}
+
 EERRenderer::~EERRenderer()
 {
 	if (buf != NULL)
@@ -376,12 +507,12 @@ int EERRenderer::getHeight()
 }
 
 template <typename T>
-long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArray<T> &image)
+long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArray<T> &image, int n_threads)
 {
 	if (!ready)
 		REPORT_ERROR("EERRenderer::renderNFrames called before ready.");
 
-	lazyReadFrames();
+	lazyReadFrames(n_threads);
 
 	if (frame_start <= 0 || frame_start > getNFrames() ||
 	    frame_end < frame_start || frame_end > getNFrames())
@@ -390,233 +521,199 @@ long long EERRenderer::renderFrames(int frame_start, int frame_end, MultidimArra
 		REPORT_ERROR("Invalid frame range was requested.");
 	}
 
+	if ((preread_start > 0 && frame_start - 1 < preread_start) ||
+	    (preread_end > 0 && frame_end - 1 > preread_end))
+	{
+		std::cerr << "EERRenderer::renderFrames(frame_start = " << frame_start << ", frame_end = " << frame_end << "),  NFrames = " << getNFrames() << " preread_start = " << preread_start + 1 << " prered_end = " << preread_end + 1<< std::endl;
+		REPORT_ERROR("Tried to render frames outside pre-read region");
+	}
+
+	if (width == EER_4K)
+	{
+		if (eer_upsampling != 3 && eer_upsampling != 2 && eer_upsampling != 1 && eer_upsampling != -1)
+			REPORT_ERROR("Invalid EER upsamle for 4K images. This must be 3, 2, 1 or -1.");
+	}
+	else if (width == EER_2K)
+	{
+		if (eer_upsampling != 2 && eer_upsampling != 1)
+			REPORT_ERROR("Invalid EER upsamle for 2K images. This must be 2 or 1.");
+	}
+	else
+		REPORT_ERROR("Logic error: an invalid EER size at EERRenderer::renderFrames().");
+
 	// Make this 0-indexed
 	frame_start--;
 	frame_end--;
 
 	long long total_n_electron = 0;
-
-	std::vector<unsigned int> positions;
-	std::vector<unsigned char> symbols;
 	image.initZeros(getHeight(), getWidth());
 
-	for (int iframe = frame_start; iframe <= frame_end; iframe++)
+	const int n_fractions = frame_end - frame_start + 1;
+	if (n_threads > n_fractions)
+		n_threads = n_fractions;
+
+	if (n_threads <= 1)
 	{
-		RCTIC(TIMING_UNPACK_RLE);
-		if ((preread_start > 0 && iframe < preread_start) ||
-	  	    (preread_end > 0 && iframe > preread_end))
-		{
-			std::cerr << "EERRenderer::renderFrames(frame_start = " << frame_start + 1 << ", frame_end = " << frame_end + 1<< "),  NFrames = " << getNFrames() << " preread_start = " << preread_start + 1 << " prered_end = " << preread_end + 1<< std::endl;
-			REPORT_ERROR("Tried to render frames outside pre-read region");
-		}		
-
-		long long pos = frame_starts[iframe];
-		unsigned int n_pix = 0, n_electron = 0;
-		const int max_electrons = frame_sizes[iframe] * 2; // at 4 bits per electron (very permissive bound!)
-		if (positions.size() < max_electrons)
+		std::vector<unsigned int> positions;
+		std::vector<unsigned char> symbols;
+		for (int iframe = frame_start; iframe <= frame_end; iframe++)
+			total_n_electron += renderFrame(iframe, image, positions, symbols);
+	}
+	else
+	{
+		// Each thread renders a block of consecutive frames into its own image
+		std::vector<MultidimArray<T> > thread_images(n_threads - 1);
+
+		#pragma omp parallel for num_threads(n_threads) reduction(+:total_n_electron)
+		for (int ithread = 0; ithread < n_threads; ithread++)
 		{
-			positions.resize(max_electrons);
-			symbols.resize(max_electrons);
+			MultidimArray<T> &thread_image = (ithread == 0) ? image : thread_images[ithread - 1];
+			if (ithread > 0)
+				thread_image.initZeros(getHeight(), getWidth());
+
+			std::vector<unsigned int> positions;
+			std::vector<unsigned char> symbols;
+			const int first = frame_start + (long long)n_fractions * ithread / n_threads;
+			const int last = frame_start + (long long)n_fractions * (ithread + 1) / n_threads - 1;
+			for (int iframe = first; iframe <= last; iframe++)
+				total_n_electron += renderFrame(iframe, thread_image, positions, symbols);
 		}
 
-		if (rle_bits == 7 && subpixel_bits == 4)
+		#pragma omp parallel for num_threads(n_threads)
+		for (long int n = 0; n < MULTIDIM_SIZE(image); n++)
 		{
-			unsigned int bit_pos = 0; // 4 K * 4 K * 11 bit << 2 ** 32
-			unsigned char p, s;
+			for (int ithread = 0; ithread < n_threads - 1; ithread++)
+				DIRECT_MULTIDIM_ELEM(image, n) += DIRECT_MULTIDIM_ELEM(thread_images[ithread], n);
+		}
+	}
 
-			while (true)
-			{
-				// Fetch 32 bits and unpack up to 2 chunks of 7 + 4 bits.
-				// This is faster than unpack 7 and 4 bits sequentially.
-				// Since the size of buf is larger than the actual size by the TIFF header size,
-				// it is always safe to read ahead.
-
-				long long first_byte = pos + (bit_pos >> 3);
-				const unsigned int bit_offset_in_first_byte = bit_pos & 7; // 7 = 00000111 (same as % 8)
-				const unsigned int chunk = (*(unsigned int*)(buf + first_byte)) >> bit_offset_in_first_byte;
-
-				p = (unsigned char)(chunk & 127); // 127 = 01111111; 7 bits for RLE
-				bit_pos += 7; // TODO: we can remove this for further speed.
-				n_pix += p;
-				if (n_pix >= total_pixels) break;
-				if (p == 127) continue; // this should be rare.
-
-				// 15 = 00001111; 4 bits for symbol. See the 8+4 bit section for 0x0A
-				s = (unsigned char)((chunk >> 7) & 15) ^ 0x0A;
-				bit_pos += 4;
-				positions[n_electron] = n_pix;
-				symbols[n_electron] = s;
-				n_electron++;
-				n_pix++;
+#ifdef DEBUG_EER
+	printf("Decoded %lld electrons in total.\n", total_n_electron);
+#endif
 
-				p = (unsigned char)((chunk >> 11) & 127);
-				bit_pos += 7;
-				n_pix += p;
-				if (n_pix >= total_pixels) break;
-				if (p == 127) continue;
+#ifdef TIMING
+	EERtimer.printTimes(false);
+#endif
 
-				s = (unsigned char)((chunk >> 18) & 15) ^ 0x0A;
-				bit_pos += 4;
-				positions[n_electron] = n_pix;
-				symbols[n_electron] = s;
-				n_electron++;
-				n_pix++;
-			}
-		}
-		else if (rle_bits == 7 && subpixel_bits == 2)
-		{
-			unsigned int bit_pos = 0; // 4 K * 4 K * 11 bit << 2 ** 32
-			unsigned char p, s;
+	return total_n_electron;
+}
+
+template <typename T>
+long long EERRenderer::renderFrame(int iframe, MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols)
+{
+	RCTIC(TIMING_UNPACK_RLE);
+	long long pos = frame_starts[iframe];
+	long long n_pix = 0;
+	unsigned int n_electron = 0;
+	const long long max_electrons = frame_sizes[iframe] * 2; // at 4 bits per electron (very permissive bound!)
+	if (positions.size() < max_electrons)
+	{
+		positions.resize(max_electrons);
+		symbols.resize(max_electrons);
+	}
 
-			while (true)
+	if (rle_bits == 7 && subpixel_bits == 4)
+	{
+		// 15 = 00001111; 4 bits for symbol. See the 8+4 bit section for 0x0A
+		n_pix = unpackRLE7<4>(buf + pos, frame_sizes[iframe], total_pixels, 0x0A, positions.data(), symbols.data(), n_electron, max_electrons);
+	}
+	else if (rle_bits == 7 && subpixel_bits == 2)
+	{
+		// 3 = 00000011; 2 bits for symbol
+		// Note that we have to flip bits (see below).
+		n_pix = unpackRLE7<2>(buf + pos, frame_sizes[iframe], total_pixels, 3, positions.data(), symbols.data(), n_electron, max_electrons);
+	}
+	else if (rle_bits == 8 && subpixel_bits == 4)
+	{
+		// unpack every two symbols = 12 bit * 2 = 24 bit = 3 byte
+		// high <- |bbbbBBBB|BBBBaaaa|AAAAAAAA| -> low
+		// With SIMD intrinsics at the SSSE3 level, we can unpack 10 symbols (120 bits) simultaneously.
+		unsigned char p1, p2, s1, s2;
+
+		const long long pos_limit = frame_starts[iframe] + frame_sizes[iframe];
+		// Because there is a footer, it is safe to go beyond the limit by two bytes.
+		while (pos < pos_limit)
+		{
+			// Symbol is bit tricky: 0000YyXx, where Y and X must be flipped.
+			// In other words, the bits for shifts 0, 1, 2, 3 are 10, 11, 00, 01.
+			// This can be considered as 'signed 2 bit' representation of -2, -1, 0, 1.
+			// For 2 bit symbols (2K EER): 000000YX and Y and X must be flipped.
+			// That is, shifts 0 and 1 correspond to bits 1 and 0.
+			// This is "signed 1 bit" representation of -1 and 0..
+			// ref: Lingbo Yu, TFS (Email to Takanori on 10-11 May 2023)
+			p1 = buf[pos];
+			s1 = (buf[pos + 1] & 0x0F) ^ 0x0A; // 0x0F = 00001111, 0x0A = 00001010
+
+			p2 = (buf[pos + 1] >> 4) | (buf[pos + 2] << 4);
+			s2 = (buf[pos + 2] >> 4) ^ 0x0A;
+
+			// Note the order. Add p before checking the size and placing a new electron.
+			n_pix += p1;
+			if (n_pix >= total_pixels) break;
+			if (p1 < 255)
 			{
-				// Fetch 32 bits and unpack up to 2 chunks of 7 + 2 bits.
-				// (Note: one cannot unpack 3 chunks because bit_offset_in_first_byte can be 7;
-				//  7 + 9 + 9 + 9 = 34 > 32 so the last subpixel symbol would be lost.)
-				// This is faster than unpack 7 and 2 bits sequentially.
-				// Since the size of buf is larger than the actual size by the TIFF header size,
-				// it is always safe to read ahead.
-
-				long long first_byte = pos + (bit_pos >> 3);
-				const unsigned int bit_offset_in_first_byte = bit_pos & 7; // 7 = 00000111 (same as % 8)
-				const unsigned int chunk = (*(unsigned int*)(buf + first_byte)) >> bit_offset_in_first_byte;
-
-				p = (unsigned char)(chunk & 127); // 127 = 01111111; 7 bits for RLE
-				bit_pos += 7; // TODO: we can remove this for further speed.
-				n_pix += p;
-				if (n_pix >= total_pixels) break;
-				if (p == 127) continue; // this should be rare.
-
-				// 3 = 00000011; 2 bits for symbol
-				// Note that we have to flip bits (see below).
-				s = (unsigned char)((chunk >> 7) & 3) ^ 3;
-				bit_pos += 2;
 				positions[n_electron] = n_pix;
-				symbols[n_electron] = s;
+				symbols[n_electron] = s1;
 				n_electron++;
 				n_pix++;
+			}
 
-				p = (unsigned char)((chunk >> 9) & 127);
-				bit_pos += 7;
-				n_pix += p;
-				if (n_pix >= total_pixels) break;
-				if (p == 127) continue;
-
-				s = (unsigned char)((chunk >> 16) & 3) ^ 3;
-				bit_pos += 2;
+			n_pix += p2;
+			if (n_pix >= total_pixels) break;
+			if (p2 < 255)
+			{
 				positions[n_electron] = n_pix;
-				symbols[n_electron] = s;
+				symbols[n_electron] = s2;
 				n_electron++;
 				n_pix++;
 			}
-		}
-		else if (rle_bits == 8 && subpixel_bits == 4)
-		{
-			// unpack every two symbols = 12 bit * 2 = 24 bit = 3 byte
-			// high <- |bbbbBBBB|BBBBaaaa|AAAAAAAA| -> low
-			// With SIMD intrinsics at the SSSE3 level, we can unpack 10 symbols (120 bits) simultaneously.
-			unsigned char p1, p2, s1, s2;
-
-			const long long pos_limit = frame_starts[iframe] + frame_sizes[iframe];
-			// Because there is a footer, it is safe to go beyond the limit by two bytes.
-			while (pos < pos_limit)
-			{
-				// Symbol is bit tricky: 0000YyXx, where Y and X must be flipped.
-				// In other words, the bits for shifts 0, 1, 2, 3 are 10, 11, 00, 01.
-				// This can be considered as 'signed 2 bit' representation of -2, -1, 0, 1.
-				// For 2 bit symbols (2K EER): 000000YX and Y and X must be flipped.
-				// That is, shifts 0 and 1 correspond to bits 1 and 0.
-				// This is "signed 1 bit" representation of -1 and 0..
-				// ref: Lingbo Yu, TFS (Email to Takanori on 10-11 May 2023)
-				p1 = buf[pos];
-				s1 = (buf[pos + 1] & 0x0F) ^ 0x0A; // 0x0F = 00001111, 0x0A = 00001010
-
-				p2 = (buf[pos + 1] >> 4) | (buf[pos + 2] << 4);
-				s2 = (buf[pos + 2] >> 4) ^ 0x0A;
-
-				// Note the order. Add p before checking the size and placing a new electron.
-				n_pix += p1;
-				if (n_pix >= total_pixels) break;
-				if (p1 < 255)
-				{
-					positions[n_electron] = n_pix;
-					symbols[n_electron] = s1;
-					n_electron++;
-					n_pix++;
-				}
-
-				n_pix += p2;
-				if (n_pix >= total_pixels) break;
-				if (p2 < 255)
-				{
-					positions[n_electron] = n_pix;
-					symbols[n_electron] = s2;
-					n_electron++;
-					n_pix++;
-				}
 #ifdef DEBUG_EER_DETAIL
-				printf("%d: %u %u, %u %u %d\n", pos, p1, s1, p2, s2, n_pix);
+			printf("%d: %u %u, %u %u %d\n", pos, p1, s1, p2, s2, n_pix);
 #endif
-				pos += 3;
-			}
+			pos += 3;
 		}
+	}
 
-		if (n_pix != total_pixels)
-		{
-			std::cerr << "WARNING: The number of pixels is not right in " + fn_movie + " frame " + integerToString(iframe + 1) + ". Probably this frame is corrupted. This frame is skipped." << std::endl;
-			continue;
-		}
-
-		RCTOC(TIMING_UNPACK_RLE);
-
-		RCTIC(TIMING_RENDER_ELECTRONS);
-		if (width == EER_4K)
-		{
-			if (eer_upsampling == 3)
-				render4K_to_16K(image, positions, symbols, n_electron);
-			else if (eer_upsampling == 2)
-				render4K_to_8K(image, positions, symbols, n_electron);
-			else if (eer_upsampling == 1)
-				render4K_to_4K(image, positions, symbols, n_electron);
-			else if (eer_upsampling == -1)
-				render4K_to_2K(image, positions, symbols, n_electron);
-			else
-				REPORT_ERROR("Invalid EER upsamle for 4K images. This must be 3, 2, 1 or -1.");
-		}
-		else if (width == EER_2K)
-		{
-			if (eer_upsampling == 2)
-				render2K_to_4K(image, positions, symbols, n_electron);
-			else if (eer_upsampling == 1)
-				render2K_to_2K(image, positions, symbols, n_electron);
-			else
-				REPORT_ERROR("Invalid EER upsamle for 2K images. This must be 2 or 1.");
-		}
-		else
-			REPORT_ERROR("Logic error: an invalid EER size at EERRenderer::renderFrames().");
+	if (n_pix != total_pixels)
+	{
+		std::cerr << "WARNING: The number of pixels is not right in " + fn_movie + " frame " + integerToString(iframe + 1) + ". Probably this frame is corrupted. This frame is skipped." << std::endl;
+		return 0;
+	}
 
-		RCTOC(TIMING_RENDER_ELECTRONS);
+	RCTOC(TIMING_UNPACK_RLE);
 
-		total_n_electron += n_electron;
-#ifdef DEBUG_EER
-		printf("Decoded %lld electrons / %d pixels from frame %5d.\n", n_electron, n_pix, iframe);
-#endif
+	RCTIC(TIMING_RENDER_ELECTRONS);
+	if (width == EER_4K)
+	{
+		if (eer_upsampling == 3)
+			render4K_to_16K(image, positions, symbols, n_electron);
+		else if (eer_upsampling == 2)
+			render4K_to_8K(image, positions, symbols, n_electron);
+		else if (eer_upsampling == 1)
+			render4K_to_4K(image, positions, symbols, n_electron);
+		else if (eer_upsampling == -1)
+			render4K_to_2K(image, positions, symbols, n_electron);
 	}
-#ifdef DEBUG_EER
-	printf("Decoded %lld electrons in total.\n", total_n_electron);
-#endif
+	else if (width == EER_2K)
+	{
+		if (eer_upsampling == 2)
+			render2K_to_4K(image, positions, symbols, n_electron);
+		else if (eer_upsampling == 1)
+			render2K_to_2K(image, positions, symbols, n_electron);
+	}
+	RCTOC(TIMING_RENDER_ELECTRONS);
 
-#ifdef TIMING
-	EERtimer.printTimes(false);
+#ifdef DEBUG_EER
+	printf("Decoded %lld electrons / %lld pixels from frame %5d.\n", (long long)n_electron, n_pix, iframe);
 #endif
 
-	return total_n_electron;
+	return n_electron;
 }
 
 // Instantiate for Polishing
-template long long EERRenderer::renderFrames<float>(int frame_start, int frame_end, MultidimArray<float> &image);
-template long long EERRenderer::renderFrames<short>(int frame_start, int frame_end, MultidimArray<short> &image);
-template long long EERRenderer::renderFrames<unsigned short>(int frame_start, int frame_end, MultidimArray<unsigned short> &image);
-template long long EERRenderer::renderFrames<char>(int frame_start, int frame_end, MultidimArray<char> &image);
-template long long EERRenderer::renderFrames<signed char>(int frame_start, int frame_end, MultidimArray<signed char> &image);
-template long long EERRenderer::renderFrames<unsigned char>(int frame_start, int frame_end, MultidimArray<unsigned char> &image);
+template long long EERRenderer::renderFrames<float>(int frame_start, int frame_end, MultidimArray<float> &image, int n_threads);
+template long long EERRenderer::renderFrames<short>(int frame_start, int frame_end, MultidimArray<short> &image, int n_threads);
+template long long EERRenderer::renderFrames<unsigned short>(int frame_start, int frame_end, MultidimArray<unsigned short> &image, int n_threads);
+template long long EERRenderer::renderFrames<char>(int frame_start, int frame_end, MultidimArray<char> &image, int n_threads);
+template long long EERRenderer::renderFrames<signed char>(int frame_start, int frame_end, MultidimArray<signed char> &image, int n_threads);
+template long long EERRenderer::renderFrames<unsigned char>(int frame_start, int frame_end, MultidimArray<unsigned char> &image, int n_threads);
@@ -35,7 +35,11 @@ class EERRenderer {
 	uint16_t rle_bits, subpixel_bits;
 	long long file_size, total_pixels;
 	void readLegacy(FILE *fh);
-	void lazyReadFrames();
+	void lazyReadFrames(int n_threads);
+
+	// Decode one (0-indexed) frame and add its electrons to image. Returns the number of electrons.
+	template <typename T>
+	long long renderFrame(int iframe, MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols);
 
 	template <typename T>
 	void render4K_to_16K(MultidimArray<T> &image, std::vector<unsigned int> &positions, std::vector<unsigned char> &symbols, int n_electrons);
@@ -91,6 +95,10 @@ class EERRenderer {
 
 	void read(FileName _fn_movie, int eer_upsampling=1);
 
+	// Read the raw frames of interest now, with n_threads threads, instead of in the first call to renderFrames().
+	// Call this outside parallel regions; otherwise the frames are read by one thread.
+	void preReadFrames(int n_threads);
+
 	// Due to a limitation in libtiff (not TIFF specification!),
 	// the maximum number of frames is 65535.
 	// See https://www.asmail.be/msg0055011809.html.
@@ -102,8 +110,10 @@ class EERRenderer {
 	// image is cleared.
 	// This function is thread-safe (except for timing).
 	// It is caller's responsibility to make sure type T does not overflow.
+	// With n_threads > 1, the frames are split into blocks, one per thread, which are rendered
+	// into separate images and summed. This needs an extra image for every thread but the first.
 	template <typename T>
-	long long renderFrames(int frame_start, int frame_end, MultidimArray<T> &image);
+	long long renderFrames(int frame_start, int frame_end, MultidimArray<T> &image, int n_threads = 1);
 
 	// The gain reference for EER is not multiplicative! So the inverse is taken here.
 	// 0 means defect.
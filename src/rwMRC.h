@@ -280,6 +280,20 @@ int readMRC(long int img_select, bool isStack=false, const FileName &name="")
 	return readData(fimg, img_select, datatype, 0);
 }
 
+/** MRC Reader for a stack in the MappedStackCache
+  * @ingroup MRC
+*/
+int readMRCMapped(const MappedStack &stack, long int img_select, const FileName &name="")
+{
+	// parseMRCHeader swaps the header in place, so work on a copy
+	MRChead header;
+	memcpy(&header, stack.data, MRCSIZE);
+
+	DataType datatype = parseMRCHeader(&header, img_select, true, name);
+
+	return readMappedData(stack, img_select, datatype);
+}
+
 /** MRC Writer
   * @ingroup MRC
 */
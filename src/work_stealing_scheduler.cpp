@@ -0,0 +1,201 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#include "src/work_stealing_scheduler.h"
+
+#include <algorithm>
+#include <omp.h>
+
+namespace
+{
+	// The scheduler whose team the calling thread is in, if any; used to recognise nested loops
+	thread_local WorkStealingScheduler *current_scheduler = NULL;
+	thread_local int current_thread_id = -1;
+}
+
+WorkStealingScheduler::WorkStealingScheduler(int _nr_threads)
+:	nr_threads(0),
+	work_version(0),
+	nr_idle(0)
+{
+	setThreads(_nr_threads);
+}
+
+void WorkStealingScheduler::setThreads(int _nr_threads)
+{
+	nr_threads = std::max(1, _nr_threads);
+	while ((int)workers.size() < nr_threads)
+		workers.push_back(std::unique_ptr<Worker>(new Worker));
+}
+
+int WorkStealingScheduler::getThreads() const
+{
+	return nr_threads;
+}
+
+void WorkStealingScheduler::parallelFor(long int first, long int last, const std::function<void(long int, int)> &fn, long int grain)
+{
+	if (last <= first)
+		return;
+
+	Group group;
+	group.fn = &fn;
+	group.grain = std::max(1L, grain);
+	group.remaining = last - first;
+	group.has_failed = false;
+
+	if (current_scheduler == this)
+	{
+		// Called from one of our own tasks: the iterations become tasks for the same team
+		const int thread_id = current_thread_id;
+		push(thread_id, Range{first, last, 1, &group});
+		work(thread_id, group);
+	}
+	else
+	{
+		const int nr_team = (int)std::min((long int)nr_threads, last - first);
+
+		// Deal the iterations out round-robin, so that a loop sorted by cost is shared evenly; stealing only has to even out the differences
+		for (int ithread = 0; ithread < nr_team; ithread++)
+			push(ithread, Range{first + ithread, last, nr_team, &group});
+
+		#pragma omp parallel num_threads(nr_team)
+		{
+			// (With nested OpenMP switched off, a team inside another parallel region has only one thread, which then does everything)
+			const int thread_id = omp_get_thread_num();
+			current_scheduler = this;
+			current_thread_id = thread_id;
+
+			work(thread_id, group);
+
+			current_scheduler = NULL;
+			current_thread_id = -1;
+		}
+	}
+
+	if (group.error)
+		std::rethrow_exception(group.error);
+}
+
+void WorkStealingScheduler::push(int thread_id, const Range &range)
+{
+	{
+		Worker &worker = *workers[thread_id];
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.ranges.push_back(range);
+	}
+	notifyIdle();
+}
+
+void WorkStealingScheduler::notifyIdle()
+{
+	work_version++;
+
+	// A thread that is about to wait has raised nr_idle before it checks work_version, so it cannot miss this
+	if (nr_idle > 0)
+	{
+		std::lock_guard<std::mutex> lock(idle_mutex);
+		idle_cv.notify_all();
+	}
+}
+
+bool WorkStealingScheduler::pop(int thread_id, Range &range)
+{
+	// Own work is taken from the back: the smallest and most recently split ranges, which are still in cache
+	Worker &worker = *workers[thread_id];
+	std::lock_guard<std::mutex> lock(worker.mutex);
+	if (worker.ranges.empty())
+		return false;
+
+	range = worker.ranges.back();
+	worker.ranges.pop_back();
+	return true;
+}
+
+bool WorkStealingScheduler::steal(int thread_id, Range &range)
+{
+	// Other threads' work is taken from the front: the largest ranges, so that stealing is rare
+	for (int i = 1; i < (int)workers.size(); i++)
+	{
+		Worker &victim = *workers[(thread_id + i) % workers.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.ranges.empty())
+		{
+			range = victim.ranges.front();
+			victim.ranges.pop_front();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void WorkStealingScheduler::execute(int thread_id, Range range)
+{
+	Group &group = *range.group;
+
+	// Leave the upper halves for this thread later on, or for thieves
+	while (range.size() > group.grain)
+	{
+		const long int middle = range.first + range.size() / 2 * range.stride;
+		push(thread_id, Range{middle, range.last, range.stride, range.group});
+		range.last = middle;
+	}
+
+	for (long int i = range.first; i < range.last; i += range.stride)
+	{
+		if (group.has_failed)
+			break;
+
+		try
+		{
+			(*group.fn)(i, thread_id);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(group.error_mutex);
+			if (!group.error)
+				group.error = std::current_exception();
+			group.has_failed = true;
+		}
+	}
+
+	// Done (or given up after an error) is done: the group should not wait for these forever
+	const long int nr_done = range.size();
+	if (group.remaining.fetch_sub(nr_done) == nr_done)
+		notifyIdle();
+}
+
+void WorkStealingScheduler::work(int thread_id, Group &group)
+{
+	Range range;
+	while (group.remaining > 0)
+	{
+		const long int seen_version = work_version;
+		if (pop(thread_id, range) || steal(thread_id, range))
+		{
+			execute(thread_id, range);
+			continue;
+		}
+
+		// Nothing to do: sleep until some work is queued, or until the last iterations of group (run by others) are done
+		std::unique_lock<std::mutex> lock(idle_mutex);
+		nr_idle++;
+		idle_cv.wait(lock, [&]() { return work_version != seen_version || group.remaining <= 0; });
+		nr_idle--;
+	}
+}
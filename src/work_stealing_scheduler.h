@@ -0,0 +1,123 @@
+/***************************************************************************
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * This complete copyright notice must be included in any revised version of the
+ * source code. Additional authorship citations may be added, but existing
+ * author citations must be preserved.
+ ***************************************************************************/
+
+#ifndef WORK_STEALING_SCHEDULER_H
+#define WORK_STEALING_SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/*	class WorkStealingScheduler:
+ *
+ *	Runs the iterations of a loop as tasks on a team of OpenMP threads.
+ *
+ *	Each thread has its own queue of index ranges. The loop is dealt out round-robin over the queues
+ *	(thread t gets iterations t, t + nr_threads, ...), so that loops sorted by cost give every thread
+ *	its share of the expensive iterations. A thread splits the range it takes in halves until it is
+ *	down to the grain size, queueing the other halves. A thread that runs out of work steals the
+ *	largest range from the queue of another thread, so that the threads stay busy until the very last
+ *	iteration, even when some iterations take much longer than others. A thread that finds no work
+ *	at all sleeps until more work is queued or its loop is done.
+ *
+ *	The function is called with the index and the number of the thread (0 .. nr_threads-1), which
+ *	can be used to index per-thread buffers. A task may call parallelFor of the same scheduler again:
+ *	its iterations then become tasks for the same team (e.g. blocks of orientations of one particle),
+ *	and the thread waits for them by running tasks itself.
+ *	The first exception thrown by a task is re-thrown by parallelFor, once all other tasks are done.
+ *
+ *	Only one thread (outside the team) should call parallelFor at a time.
+ *
+ *	@code
+ *	WorkStealingScheduler scheduler(nr_threads);
+ *	scheduler.parallelFor(0, nr_particles, [&](long int ipart, int thread_id)
+ *	{
+ *		processParticle(ipart, buffers[thread_id]);
+ *	});
+ *	@endcode
+ */
+class WorkStealingScheduler
+{
+public:
+
+	WorkStealingScheduler(int nr_threads = 1);
+
+	WorkStealingScheduler(const WorkStealingScheduler&) = delete;
+	WorkStealingScheduler& operator=(const WorkStealingScheduler&) = delete;
+
+	void setThreads(int nr_threads);
+
+	int getThreads() const;
+
+	// Call fn(i, thread_id) for all i in [first, last), in tasks of at least grain iterations
+	void parallelFor(long int first, long int last, const std::function<void(long int, int)> &fn, long int grain = 1);
+
+private:
+
+	struct Group
+	{
+		const std::function<void(long int, int)> *fn;
+		long int grain;
+		std::atomic<long int> remaining;
+		std::atomic<bool> has_failed;
+		std::exception_ptr error;
+		std::mutex error_mutex;
+	};
+
+	// Iterations first, first + stride, ... below last
+	struct Range
+	{
+		long int first, last, stride;
+		Group *group;
+
+		long int size() const { return (last - first + stride - 1) / stride; }
+	};
+
+	struct Worker
+	{
+		std::mutex mutex;
+		std::deque<Range> ranges;
+	};
+
+	int nr_threads;
+	std::vector<std::unique_ptr<Worker> > workers;
+
+	// Idle threads wait on idle_cv until work_version changes: it is raised by every push and every finished loop
+	std::mutex idle_mutex;
+	std::condition_variable idle_cv;
+	std::atomic<long int> work_version;
+	std::atomic<int> nr_idle;
+
+	// Raise work_version and wake the idle threads, if there are any
+	void notifyIdle();
+
+	void push(int thread_id, const Range &range);
+	bool pop(int thread_id, Range &range);
+	bool steal(int thread_id, Range &range);
+
+	void execute(int thread_id, Range range);
+
+	// Run tasks until all iterations of group are done
+	void work(int thread_id, Group &group);
+};
+
+#endif
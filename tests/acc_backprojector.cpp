@@ -0,0 +1,114 @@
+#ifdef ALTCPU
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <vector>
+#include <tbb/parallel_for.h>
+#include <tbb/task_arena.h>
+#include "src/acc/cpu/device_stubs.h"
+#include "src/acc/acc_ptr.h"
+#include "src/acc/acc_projector.h"
+#include "src/acc/acc_backprojector.h"
+#include "src/acc/cpu/cpu_kernels/helper.h"
+#include "src/acc/cpu/cpu_kernels/BP.h"
+
+// Back-projects nr_images central sections of a smooth image in different orientations, one image per TBB task
+static void backprojectSynthetic(AccBackprojector &BP, int nr_images, AccBackprojector::Accumulation accumulation,
+                                 std::vector<XFLOAT> &real, std::vector<XFLOAT> &imag, std::vector<XFLOAT> &weight)
+{
+	const int img_x = BP.maxR + 1, img_y = 2 * BP.maxR;
+	std::vector<XFLOAT> img_real(img_x * img_y), img_imag(img_x * img_y), ctfs(img_x * img_y, 1.), Minvsigma2s(img_x * img_y, 1.);
+	for (int n = 0; n < img_x * img_y; n++)
+	{
+		img_real[n] = sin(0.1 * n);
+		img_imag[n] = cos(0.07 * n);
+	}
+	XFLOAT trans_x = 0., trans_y = 0., weights = 1.;
+
+	std::vector<XFLOAT> eulers(9 * nr_images);
+	for (int i = 0; i < nr_images; i++)
+	{
+		const XFLOAT ca = cos(0.37 * i), sa = sin(0.37 * i), cb = cos(0.11 * i), sb = sin(0.11 * i);
+		const XFLOAT A[9] = {ca * cb, -sa, ca * sb, sa * cb, ca, sa * sb, -sb, 0., cb};
+		for (int k = 0; k < 9; k++)
+			eulers[9 * i + k] = A[k];
+	}
+
+	BP.initMdl();
+	BP.setAccumulation(accumulation, tbb::this_task_arena::max_concurrency());
+
+	tbb::parallel_for(0, nr_images, [&](int i)
+	{
+		XFLOAT *mdl_real, *mdl_imag, *mdl_weight;
+		AccBackprojector::Accumulation mode = BP.getAccumulationTarget(mdl_real, mdl_imag, mdl_weight);
+		CpuKernels::backprojectRef3D<false>(1,
+			&img_real[0], &img_imag[0], &trans_x, &trans_y, &weights, &Minvsigma2s[0], &ctfs[0],
+			1, 0.5, 1., &eulers[9 * i],
+			mdl_real, mdl_imag, mdl_weight,
+			BP.maxR, BP.maxR2, BP.padding_factor,
+			img_x, img_y, 1, img_x * img_y,
+			BP.mdlX, BP.mdlY, BP.mdlInitY, BP.mdlInitZ, BP.mutexes, mode);
+	});
+
+	real.resize(BP.mdlXYZ);
+	imag.resize(BP.mdlXYZ);
+	weight.resize(BP.mdlXYZ);
+	BP.getMdlData(&real[0], &imag[0], &weight[0]);
+}
+
+static void setupSyntheticAccBackprojector(AccBackprojector &BP, int max_r)
+{
+	const int padding_factor = 2;
+	const int xdim = padding_factor * max_r + 3, ydim = 2 * xdim - 1;
+	BP.setMdlDim(xdim, ydim, ydim, -(ydim - 1) / 2, -(ydim - 1) / 2, max_r, padding_factor);
+}
+
+TEST_CASE( "AccBackprojector accumulates the same model with locks, atomics and shards", "[backprojector]" ) {
+	AccBackprojector BP;
+	setupSyntheticAccBackprojector(BP, 12);
+
+	std::vector<XFLOAT> locked_real, locked_imag, locked_weight;
+	backprojectSynthetic(BP, 50, AccBackprojector::LOCKED, locked_real, locked_imag, locked_weight);
+
+	XFLOAT scale = 0.;
+	for (size_t n = 0; n < locked_weight.size(); n++)
+		scale = std::max(scale, std::abs(locked_weight[n]));
+	REQUIRE(scale > 0.);
+
+	for (int mode = AccBackprojector::ATOMIC; mode <= AccBackprojector::SHARDED; mode++)
+	{
+		std::vector<XFLOAT> real, imag, weight;
+		backprojectSynthetic(BP, 50, (AccBackprojector::Accumulation)mode, real, imag, weight);
+
+		// Only the order of the additions differs
+		for (size_t n = 0; n < locked_weight.size(); n++)
+		{
+			REQUIRE(real[n] == Approx(locked_real[n]).margin(1e-4 * scale));
+			REQUIRE(imag[n] == Approx(locked_imag[n]).margin(1e-4 * scale));
+			REQUIRE(weight[n] == Approx(locked_weight[n]).margin(1e-4 * scale));
+		}
+	}
+}
+
+// Hidden by default; run with: tests "[benchmark]"
+TEST_CASE( "Benchmark AccBackprojector accumulation", "[.][benchmark][backprojector]" ) {
+	const char *names[] = {"locked", "atomic", "sharded"};
+	const int nr_images = 2000;
+
+	AccBackprojector BP;
+	setupSyntheticAccBackprojector(BP, 60);
+
+	for (int mode = AccBackprojector::LOCKED; mode <= AccBackprojector::SHARDED; mode++)
+	{
+		std::vector<XFLOAT> real, imag, weight;
+		auto t0 = std::chrono::steady_clock::now();
+		backprojectSynthetic(BP, nr_images, (AccBackprojector::Accumulation)mode, real, imag, weight);
+		const double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+		std::cout << " " << nr_images << " images into a " << BP.mdlX << "x" << BP.mdlY << "x" << BP.mdlZ
+		          << " model on " << tbb::this_task_arena::max_concurrency() << " threads, " << names[mode]
+		          << ": " << t << " s" << std::endl;
+	}
+}
+#endif
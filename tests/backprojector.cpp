@@ -0,0 +1,101 @@
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <iostream>
+#include <omp.h>
+#include "src/backprojector.h"
+
+// A BackProjector with smooth, deterministic data and weights inside r_max, as if many images had been backprojected
+static void setupSyntheticBackProjector(BackProjector &BP, int ori_size, bool skip_gridding)
+{
+	BP = BackProjector(ori_size, 3, "c1", TRILINEAR, 2., 10, 0, 1.9, 15, 2, skip_gridding);
+	BP.initZeros(ori_size);
+
+	const int max_r2 = ROUND(BP.r_max * BP.padding_factor) * ROUND(BP.r_max * BP.padding_factor);
+	FOR_ALL_ELEMENTS_IN_ARRAY3D(BP.data)
+	{
+		if (k * k + i * i + j * j < max_r2)
+		{
+			const RFLOAT r = sqrt((RFLOAT)(k * k + i * i + j * j));
+			A3D_ELEM(BP.data, k, i, j) = Complex(cos(0.3 * k + 0.2 * i) / (1. + r), sin(0.1 * j - 0.2 * k) / (1. + r));
+			A3D_ELEM(BP.weight, k, i, j) = 1. + (RFLOAT)((k * 7 + i * 3 + j) % 5) + 100. / (1. + r);
+		}
+	}
+}
+
+static void reconstructSynthetic(int ori_size, bool skip_gridding, int threads, bool float_gridding_weights,
+                                 MultidimArray<RFLOAT> &vol_out)
+{
+	BackProjector BP;
+	setupSyntheticBackProjector(BP, ori_size, skip_gridding);
+
+	MultidimArray<RFLOAT> tau2(ori_size / 2 + 1);
+	FOR_ALL_DIRECT_ELEMENTS_IN_ARRAY1D(tau2)
+		DIRECT_A1D_ELEM(tau2, i) = (i < ori_size / 4) ? 10. / (1. + i) : 0.;
+
+	BP.reconstruct(vol_out, 5, true, tau2, 1., 1., -1, false, NULL, threads, float_gridding_weights);
+}
+
+TEST_CASE( "BackProjector::reconstruct gives the same map on any number of threads", "[backprojector]" ) {
+	const int ori_size = 12;
+
+	for (int skip_gridding = 0; skip_gridding <= 1; skip_gridding++)
+	{
+		MultidimArray<RFLOAT> serial, threaded;
+		reconstructSynthetic(ori_size, skip_gridding, 1, false, serial);
+		reconstructSynthetic(ori_size, skip_gridding, 3, false, threaded);
+
+		REQUIRE(XSIZE(serial) == ori_size);
+		REQUIRE(ZSIZE(threaded) == ori_size);
+
+		const RFLOAT scale = serial.computeMax() - serial.computeMin();
+		REQUIRE(scale > 0.);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(serial)
+			REQUIRE(DIRECT_MULTIDIM_ELEM(threaded, n) == Approx(DIRECT_MULTIDIM_ELEM(serial, n)).margin(1e-9 * scale));
+	}
+
+	// Gridding weights in single precision
+	MultidimArray<RFLOAT> reference, single;
+	reconstructSynthetic(ori_size, false, 1, false, reference);
+	reconstructSynthetic(ori_size, false, 3, true, single);
+
+	const RFLOAT scale = reference.computeMax() - reference.computeMin();
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(reference)
+		REQUIRE(DIRECT_MULTIDIM_ELEM(single, n) == Approx(DIRECT_MULTIDIM_ELEM(reference, n)).margin(1e-4 * scale));
+}
+
+// Hidden by default; run with: tests "[benchmark]"
+TEST_CASE( "Benchmark BackProjector::reconstruct", "[.][benchmark][backprojector]" ) {
+	const int box_sizes[] = {64, 128, 256};
+	const int max_threads = omp_get_max_threads();
+
+	for (int ori_size : box_sizes)
+	{
+		BackProjector BP;
+		setupSyntheticBackProjector(BP, ori_size, false);
+
+		MultidimArray<RFLOAT> tau2(ori_size / 2 + 1);
+		tau2.initConstant(1.);
+
+		double serial_time = 0.;
+		for (int threads = 1; threads <= max_threads; threads = (threads == max_threads) ? threads + 1 : std::min(2 * threads, max_threads))
+		{
+			for (int float_gridding_weights = 0; float_gridding_weights <= ((threads == max_threads) ? 1 : 0); float_gridding_weights++)
+			{
+				BackProjector BPcopy(BP);
+				MultidimArray<RFLOAT> vol_out;
+
+				auto t0 = std::chrono::steady_clock::now();
+				BPcopy.reconstruct(vol_out, 10, true, tau2, 1., 1., -1, false, NULL, threads, float_gridding_weights);
+				const double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+				if (threads == 1)
+					serial_time = t;
+				std::cout << " box " << ori_size << " (padded " << BP.pad_size << "), " << threads << " threads"
+				          << (float_gridding_weights ? ", float gridding weights" : "") << ": " << t << " s ("
+				          << serial_time / t << "x)" << std::endl;
+
+				REQUIRE(XSIZE(vol_out) == ori_size);
+			}
+		}
+	}
+}
@@ -0,0 +1,192 @@
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include "src/image.h"
+#include "src/compressed_movie.h"
+#ifdef HAVE_BZIP2
+#include <bzlib.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+static std::vector<char> readBytes(const FileName &fn)
+{
+	std::ifstream in(fn.c_str(), std::ios::binary);
+	return std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+static void writeBytes(const FileName &fn, const std::vector<char> &bytes)
+{
+	std::ofstream out(fn.c_str(), std::ios::binary | std::ios::trunc);
+	out.write(bytes.data(), bytes.size());
+}
+
+// Compress the file in independent parts of chunk bytes, and return the names of the compressed files
+static std::vector<FileName> compressMovie(const FileName &fn_movie, size_t chunk)
+{
+	const std::vector<char> raw = readBytes(fn_movie);
+	std::vector<FileName> fn_compressed;
+
+#ifdef HAVE_BZIP2
+	{
+		// As pbzip2: one stream after another
+		std::vector<char> out;
+		for (size_t start = 0; start < raw.size(); start += chunk)
+		{
+			const unsigned int n = std::min(chunk, raw.size() - start);
+			std::vector<char> part(n + n / 100 + 600);
+			unsigned int part_size = part.size();
+			REQUIRE(BZ2_bzBuffToBuffCompress(&part[0], &part_size, (char *)&raw[start], n, 9, 0, 0) == BZ_OK);
+			out.insert(out.end(), part.begin(), part.begin() + part_size);
+		}
+		writeBytes(fn_movie + ".bz2", out);
+		fn_compressed.push_back(fn_movie + ".bz2");
+	}
+#endif
+#ifdef HAVE_LZMA
+	{
+		// As "xz -T2 --block-size=<chunk>"
+		lzma_stream strm = LZMA_STREAM_INIT;
+		lzma_mt mt;
+		memset(&mt, 0, sizeof(mt));
+		mt.threads = 2;
+		mt.block_size = chunk;
+		mt.preset = 1;
+		mt.check = LZMA_CHECK_CRC64;
+		REQUIRE(lzma_stream_encoder_mt(&strm, &mt) == LZMA_OK);
+		std::vector<char> out(raw.size() + raw.size() / 2 + 65536);
+		strm.next_in = (const uint8_t *)raw.data();
+		strm.avail_in = raw.size();
+		strm.next_out = (uint8_t *)&out[0];
+		strm.avail_out = out.size();
+		REQUIRE(lzma_code(&strm, LZMA_FINISH) == LZMA_STREAM_END);
+		out.resize(out.size() - strm.avail_out);
+		lzma_end(&strm);
+		writeBytes(fn_movie + ".xz", out);
+		fn_compressed.push_back(fn_movie + ".xz");
+	}
+#endif
+#ifdef HAVE_ZSTD
+	{
+		// Frames with their content sizes, concatenated
+		std::vector<char> out;
+		for (size_t start = 0; start < raw.size(); start += chunk)
+		{
+			const size_t n = std::min(chunk, raw.size() - start);
+			std::vector<char> part(ZSTD_compressBound(n));
+			const size_t part_size = ZSTD_compress(&part[0], part.size(), &raw[start], n, 3);
+			REQUIRE(!ZSTD_isError(part_size));
+			out.insert(out.end(), part.begin(), part.begin() + part_size);
+		}
+		writeBytes(fn_movie + ".zst", out);
+		fn_compressed.push_back(fn_movie + ".zst");
+	}
+#endif
+
+	return fn_compressed;
+}
+
+static void writeMovie(const FileName &fn_movie, Image<float> &Imovie, int nx, int ny, int n_frames)
+{
+	Imovie().resize(n_frames, 1, ny, nx);
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Imovie())
+		DIRECT_MULTIDIM_ELEM(Imovie(), n) = (float)((n * 7919) % 1009) - 500.f;
+	Imovie.write(fn_movie, -1, true, WRITE_OVERWRITE, Float);
+}
+
+TEST_CASE( "Compressed MRC movies decoded in any frame order", "[image]" ) {
+	const FileName fn_movie = "test_output/compressed_movie.mrcs";
+	const int nx = 64, ny = 60, n_frames = 6;
+	Image<float> Imovie;
+	writeMovie(fn_movie, Imovie, nx, ny, n_frames);
+
+	// Parts that do not line up with the frames
+	const std::vector<FileName> fn_compressed = compressMovie(fn_movie, 5000);
+	if (fn_compressed.empty())
+		WARN("RELION was built without libbz2, liblzma and libzstd");
+
+	for (const FileName &fn : fn_compressed)
+	{
+		INFO("file: " << fn);
+		CompressedMRCReader reader;
+		reader.read(fn, 3);
+		REQUIRE(reader.isRandomAccess());
+		REQUIRE(XSIZE(reader.Ihead()) == nx);
+		REQUIRE(YSIZE(reader.Ihead()) == ny);
+		REQUIRE(NSIZE(reader.Ihead()) == n_frames);
+
+		const int order[n_frames] = {4, 1, 5, 0, 3, 2};
+		std::vector<Image<float> > frames(n_frames);
+		#pragma omp parallel for num_threads(3)
+		for (int i = 0; i < n_frames; i++)
+			reader.readFrameInto(frames[order[i]], order[i]);
+
+		for (int iframe = 0; iframe < n_frames; iframe++)
+		{
+			REQUIRE(XSIZE(frames[iframe]()) == nx);
+			REQUIRE(YSIZE(frames[iframe]()) == ny);
+			REQUIRE(memcmp(MULTIDIM_ARRAY(frames[iframe]()), &DIRECT_NZYX_ELEM(Imovie(), iframe, 0, 0, 0),
+			               nx * ny * sizeof(float)) == 0);
+		}
+
+		// Decoders that keep only the parts used last have to decode the first frame read again
+		Image<float> frame;
+		reader.readFrameInto(frame, order[0]);
+		REQUIRE(memcmp(MULTIDIM_ARRAY(frame()), &DIRECT_NZYX_ELEM(Imovie(), order[0], 0, 0, 0), nx * ny * sizeof(float)) == 0);
+	}
+
+	// Files of a single block can be read in order only
+	for (const FileName &fn : compressMovie(fn_movie, 1 << 30))
+	{
+		INFO("file: " << fn);
+		CompressedMRCReader reader;
+		reader.read(fn, 3);
+		REQUIRE(!reader.isRandomAccess());
+
+		Image<float> frame;
+		for (int iframe = 1; iframe < n_frames; iframe += 2)
+		{
+			reader.readFrameInto(frame, iframe);
+			REQUIRE(memcmp(MULTIDIM_ARRAY(frame()), &DIRECT_NZYX_ELEM(Imovie(), iframe, 0, 0, 0), nx * ny * sizeof(float)) == 0);
+		}
+		REQUIRE_THROWS(reader.readFrameInto(frame, 0));
+	}
+}
+
+// Hidden by default; run with: tests "[benchmark]"
+TEST_CASE( "Benchmark reading compressed MRC movies", "[.][benchmark][image]" ) {
+	const FileName fn_movie = "test_output/compressed_movie_benchmark.mrcs";
+	const int nx = 1024, ny = 1024, n_frames = 24, n_threads = 8;
+	Image<float> Imovie;
+	writeMovie(fn_movie, Imovie, nx, ny, n_frames);
+
+	for (const FileName &fn : compressMovie(fn_movie, (size_t)nx * ny * sizeof(float)))
+	{
+		CompressedMRCReader reader;
+		reader.read(fn, n_threads);
+		std::vector<Image<float> > frames(n_frames);
+
+		auto t0 = std::chrono::steady_clock::now();
+		for (int iframe = 0; iframe < n_frames; iframe++)
+			reader.readFrameInto(frames[iframe], iframe);
+		const double serial = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+		CompressedMRCReader reader2;
+		reader2.read(fn, n_threads);
+		t0 = std::chrono::steady_clock::now();
+		#pragma omp parallel for num_threads(n_threads)
+		for (int iframe = 0; iframe < n_frames; iframe++)
+			reader2.readFrameInto(frames[iframe], iframe);
+		const double parallel = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+		std::cout << " " << fn << ": one thread " << serial << " s, " << n_threads << " threads " << parallel
+		          << " s (" << serial / parallel << "x)" << std::endl;
+		REQUIRE(XSIZE(frames[0]()) == nx);
+	}
+}
@@ -0,0 +1,208 @@
+#ifdef ALTCPU
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <iostream>
+#include <vector>
+#include "src/acc/cpu/device_stubs.h"
+#include "src/acc/acc_ptr.h"
+#include "src/acc/acc_projector.h"
+#include "src/acc/cpu/cpu_kernels/helper.h"
+#include "src/acc/cpu/cpu_kernels/diff2.h"
+#include "src/acc/cpu/cpu_kernels/diff2_simd.h"
+
+// The kernel sets this build contains and this CPU can run
+static std::vector<const CpuKernels::Diff2SimdKernels *> runnableDiff2SimdKernels()
+{
+	std::vector<const CpuKernels::Diff2SimdKernels *> sets(1, CpuKernels::diff2SimdKernelsPortable());
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	if (CpuKernels::diff2SimdKernelsAVX2() != NULL && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		sets.push_back(CpuKernels::diff2SimdKernelsAVX2());
+	if (CpuKernels::diff2SimdKernelsAVX512() != NULL && __builtin_cpu_supports("avx512f"))
+		sets.push_back(CpuKernels::diff2SimdKernelsAVX512());
+#endif
+	return sets;
+}
+
+/* A smooth, deterministic reference, image and set of orientations and translations,
+ * laid out as the expectation step hands them to the diff2 kernels: a half-complex
+ * image of (r_max + 1) x 2 r_max (x 2 r_max) pixels, and nine Euler matrix elements
+ * per orientation. The reference is one pixel larger than needed on every side, so
+ * that interpolation near r_max stays inside it.
+ */
+struct Diff2Data
+{
+	int r_max, img_x, img_y, img_z, mdl_x, mdl_y, mdl_z;
+	bool ref3d;
+	unsigned long image_size, orientation_num, translation_num;
+	std::vector<std::complex<XFLOAT> > model;
+	std::vector<XFLOAT> img_real, img_imag, corr, eulers, trans_x, trans_y, trans_z;
+
+	Diff2Data(int r_max, bool ref3d, bool data3d, unsigned long orientation_num, unsigned long translation_num):
+		r_max(r_max), img_x(r_max + 1), img_y(2 * r_max), img_z(data3d ? 2 * r_max : 1),
+		mdl_x(r_max + 2), mdl_y(2 * r_max + 3), mdl_z(ref3d ? 2 * r_max + 3 : 1), ref3d(ref3d),
+		image_size((unsigned long)img_x * img_y * img_z), orientation_num(orientation_num), translation_num(translation_num),
+		model((size_t)mdl_x * mdl_y * mdl_z),
+		img_real(image_size), img_imag(image_size), corr(image_size), eulers(9 * orientation_num),
+		trans_x(translation_num), trans_y(translation_num), trans_z(translation_num)
+	{
+		for (size_t n = 0; n < model.size(); n++)
+			model[n] = std::complex<XFLOAT>(sin(0.013 * n), cos(0.029 * n));
+		for (unsigned long p = 0; p < image_size; p++)
+		{
+			img_real[p] = sin(0.1 * p);
+			img_imag[p] = cos(0.07 * p);
+			corr[p] = 0.5 + 0.25 * cos(0.003 * p);
+		}
+		for (unsigned long i = 0; i < orientation_num; i++)
+		{
+			const XFLOAT ca = cos(0.37 * i), sa = sin(0.37 * i), cb = cos(0.11 * i), sb = sin(0.11 * i);
+			const XFLOAT A[9] = {ca * cb, -sa, ca * sb, sa * cb, ca, sa * sb, -sb, 0., cb};
+			for (int k = 0; k < 9; k++)
+				eulers[9 * i + k] = A[k];
+		}
+		for (unsigned long t = 0; t < translation_num; t++)
+		{
+			trans_x[t] = -2. + 0.7 * t;
+			trans_y[t] = 1.5 - 0.4 * t;
+			trans_z[t] = data3d ? 0.3 * t - 1. : 0.;
+		}
+	}
+
+	AccProjectorKernel projector()
+	{
+		return AccProjectorKernel(mdl_x, mdl_y, mdl_z, img_x, img_y, img_z,
+				-(r_max + 1), ref3d ? -(r_max + 1) : 0, 1., r_max, &model[0]);
+	}
+};
+
+// diff2_coarse for all orientations, in blocks of eulers_per_block, as in the expectation step
+template <bool REF3D, bool DATA3D, int block_sz, int eulers_per_block>
+static std::vector<XFLOAT> coarseDiff2s(Diff2Data &d)
+{
+	REQUIRE(d.orientation_num % eulers_per_block == 0);
+	std::vector<XFLOAT> diff2s(d.orientation_num * d.translation_num, 1.);
+	AccProjectorKernel projector = d.projector();
+	CpuKernels::diff2_coarse<REF3D, DATA3D, block_sz, eulers_per_block, PREFETCH_FRACTION_3D>(
+			d.orientation_num / eulers_per_block, &d.eulers[0], &d.trans_x[0], &d.trans_y[0], &d.trans_z[0],
+			&d.img_real[0], &d.img_imag[0], projector, &d.corr[0], &diff2s[0], d.translation_num, d.image_size);
+	return diff2s;
+}
+
+// diff2_fine_2D/3D with one job per orientation that holds all translations
+template <bool REF3D, bool DATA3D>
+static std::vector<XFLOAT> fineDiff2s(Diff2Data &d)
+{
+	const XFLOAT sum_init = 0.5;
+	const unsigned long nr_diff2s = d.orientation_num * d.translation_num;
+	std::vector<unsigned long> rot_idx(nr_diff2s), trans_idx(nr_diff2s), job_idx(d.orientation_num), job_num(d.orientation_num);
+	for (unsigned long i = 0; i < d.orientation_num; i++)
+	{
+		job_idx[i] = i * d.translation_num;
+		job_num[i] = d.translation_num;
+		for (unsigned long t = 0; t < d.translation_num; t++)
+		{
+			rot_idx[i * d.translation_num + t] = i;
+			trans_idx[i * d.translation_num + t] = t;
+		}
+	}
+
+	std::vector<XFLOAT> diff2s(nr_diff2s, 2.);
+	AccProjectorKernel projector = d.projector();
+	if (DATA3D)
+		CpuKernels::diff2_fine_3D(d.orientation_num, &d.eulers[0], &d.img_real[0], &d.img_imag[0],
+				&d.trans_x[0], &d.trans_y[0], &d.trans_z[0], projector, &d.corr[0], &diff2s[0], d.image_size, sum_init,
+				d.orientation_num, d.translation_num, d.orientation_num, &rot_idx[0], &trans_idx[0], &job_idx[0], &job_num[0]);
+	else
+		CpuKernels::diff2_fine_2D<REF3D>(d.orientation_num, &d.eulers[0], &d.img_real[0], &d.img_imag[0],
+				&d.trans_x[0], &d.trans_y[0], &d.trans_z[0], projector, &d.corr[0], &diff2s[0], d.image_size, sum_init,
+				d.orientation_num, d.translation_num, d.orientation_num, &rot_idx[0], &trans_idx[0], &job_idx[0], &job_num[0]);
+	return diff2s;
+}
+
+// Runs a kernel with the auto-vectorised loops and with every runnable set of hand-vectorised ones
+template <typename Kernel>
+static void compareDiff2SimdKernels(Diff2Data &d, Kernel kernel)
+{
+	const XFLOAT tolerance = (sizeof(XFLOAT) == sizeof(float)) ? 1e-4 : 1e-10;
+	const CpuKernels::Diff2SimdKernels *selected = CpuKernels::diff2SimdKernels();
+
+	CpuKernels::setDiff2SimdKernels(NULL);
+	const std::vector<XFLOAT> expected = kernel(d);
+
+	for (const CpuKernels::Diff2SimdKernels *k : runnableDiff2SimdKernels())
+	{
+		INFO("kernels: " << k->isa);
+		CpuKernels::setDiff2SimdKernels(k);
+		const std::vector<XFLOAT> got = kernel(d);
+		REQUIRE(got.size() == expected.size());
+		for (size_t i = 0; i < got.size(); i++)
+			REQUIRE(got[i] == Approx(expected[i]).epsilon(tolerance));
+	}
+
+	CpuKernels::setDiff2SimdKernels(selected);
+}
+
+TEST_CASE( "diff2 kernels give the same with and without hand-vectorised loops", "[diff2]" ) {
+	// Radius 12 gives images of 13 x 24 (x 24) pixels: passes of the coarse kernel end in a remainder,
+	// and fine rows start and end at different x
+	SECTION( "2D references" ) {
+		Diff2Data d(12, false, false, 2 * D2C_EULERS_PER_BLOCK_2D, 5);
+		compareDiff2SimdKernels(d, coarseDiff2s<false, false, D2C_BLOCK_SIZE_2D, D2C_EULERS_PER_BLOCK_2D>);
+		compareDiff2SimdKernels(d, fineDiff2s<false, false>);
+	}
+	SECTION( "3D references" ) {
+		Diff2Data d(12, true, false, 2 * D2C_EULERS_PER_BLOCK_REF3D, 5);
+		compareDiff2SimdKernels(d, coarseDiff2s<true, false, D2C_BLOCK_SIZE_REF3D, D2C_EULERS_PER_BLOCK_REF3D>);
+		compareDiff2SimdKernels(d, fineDiff2s<true, false>);
+	}
+	SECTION( "3D data" ) {
+		Diff2Data d(6, true, true, D2C_EULERS_PER_BLOCK_DATA3D, 3);
+		compareDiff2SimdKernels(d, coarseDiff2s<true, true, D2C_BLOCK_SIZE_DATA3D, D2C_EULERS_PER_BLOCK_DATA3D>);
+		compareDiff2SimdKernels(d, coarseDiff2s<true, true, D2C_BLOCK_SIZE_DATA3D, 1>);
+		compareDiff2SimdKernels(d, fineDiff2s<true, true>);
+	}
+}
+
+// Hidden by default; run with: tests "[benchmark]"
+TEST_CASE( "Benchmark hand-vectorised diff2 loops", "[.][benchmark][diff2]" ) {
+	const int repeats = 20;
+	Diff2Data d(32, true, false, 4 * D2C_EULERS_PER_BLOCK_REF3D, 9);
+	const CpuKernels::Diff2SimdKernels *selected = CpuKernels::diff2SimdKernels();
+
+	std::vector<const CpuKernels::Diff2SimdKernels *> sets(1, (const CpuKernels::Diff2SimdKernels *)NULL);
+	for (const CpuKernels::Diff2SimdKernels *k : runnableDiff2SimdKernels())
+		sets.push_back(k);
+
+	double coarse_legacy = 0., fine_legacy = 0.;
+	XFLOAT checksum = 0.;
+	for (const CpuKernels::Diff2SimdKernels *k : sets)
+	{
+		CpuKernels::setDiff2SimdKernels(k);
+
+		auto t0 = std::chrono::steady_clock::now();
+		for (int r = 0; r < repeats; r++)
+			checksum += coarseDiff2s<true, false, D2C_BLOCK_SIZE_REF3D, D2C_EULERS_PER_BLOCK_REF3D>(d)[0];
+		const double coarse = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+		t0 = std::chrono::steady_clock::now();
+		for (int r = 0; r < repeats; r++)
+			checksum += fineDiff2s<true, false>(d)[0];
+		const double fine = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+		if (k == NULL)
+		{
+			coarse_legacy = coarse;
+			fine_legacy = fine;
+			std::cout << " auto-vectorised: coarse " << coarse << " s, fine " << fine << " s" << std::endl;
+		}
+		else
+			std::cout << " " << k->isa << ": coarse " << coarse << " s (" << coarse_legacy / coarse
+			          << "x), fine " << fine << " s (" << fine_legacy / fine << "x)" << std::endl;
+	}
+
+	CpuKernels::setDiff2SimdKernels(selected);
+	REQUIRE(std::isfinite(checksum));
+}
+#endif
@@ -0,0 +1,260 @@
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <random>
+#include "src/renderEER.h"
+
+// One electron on the 4K sensor: the pixel (y * 4096 + x) and its decoded 4-bit sub-pixel symbol
+struct SyntheticElectron
+{
+	unsigned int position;
+	unsigned char symbol;
+};
+
+// Writes bits from the lowest up, as EER streams are read
+class BitWriter
+{
+public:
+	std::vector<unsigned char> bytes;
+	size_t n_bits = 0;
+
+	void put(unsigned int value, int bits)
+	{
+		for (int i = 0; i < bits; i++, n_bits++)
+		{
+			if (n_bits % 8 == 0)
+				bytes.push_back(0);
+			if ((value >> i) & 1)
+				bytes.back() |= 1 << (n_bits % 8);
+		}
+	}
+};
+
+// A frame in 7-bit run lengths and 4-bit symbols (TIFF compression 65001)
+static std::vector<unsigned char> encodeFrame7bit(const std::vector<SyntheticElectron> &electrons, long long total_pixels)
+{
+	BitWriter writer;
+	long long n_pix = 0;
+	for (const SyntheticElectron &e : electrons)
+	{
+		long long gap = e.position - n_pix;
+		for (; gap >= 127; gap -= 127)
+			writer.put(127, 7);
+		writer.put(gap, 7);
+		writer.put(e.symbol ^ 0x0A, 4);
+		n_pix = e.position + 1;
+	}
+
+	// The frame ends when the run lengths reach the number of pixels, even with a 127
+	long long rest = total_pixels - n_pix;
+	for (; rest > 127; rest -= 127)
+		writer.put(127, 7);
+	writer.put(rest, 7);
+
+	return writer.bytes;
+}
+
+static void put16(std::vector<unsigned char> &out, size_t at, uint16_t v)
+{
+	out[at] = v & 255; out[at + 1] = v >> 8;
+}
+
+static void put32(std::vector<unsigned char> &out, size_t at, uint32_t v)
+{
+	for (int i = 0; i < 4; i++)
+		out[at + i] = (v >> (8 * i)) & 255;
+}
+
+// Write a 4K EER movie as EPU does: one TIFF directory per fraction, with the compressed stream split over strips
+// The stream of truncated_frame, if any, is cut in half, as in an incompletely written file
+static void writeSyntheticEER(const FileName &fn, const std::vector<std::vector<SyntheticElectron> > &frames, int truncated_frame = -1)
+{
+	const int size = 4096, n_strips = 4;
+	std::vector<unsigned char> out(8, 0);
+	out[0] = out[1] = 'I';
+	put16(out, 2, 42);
+
+	size_t previous_link = 4; // where the offset of the next directory goes
+	for (size_t iframe = 0; iframe < frames.size(); iframe++)
+	{
+		std::vector<unsigned char> stream = encodeFrame7bit(frames[iframe], (long long)size * size);
+		if (iframe == truncated_frame)
+			stream.resize(stream.size() / 2);
+
+		std::vector<uint32_t> strip_offsets, strip_sizes;
+		for (int strip = 0; strip < n_strips; strip++)
+		{
+			const size_t begin = stream.size() * strip / n_strips, end = stream.size() * (strip + 1) / n_strips;
+			strip_offsets.push_back(out.size());
+			strip_sizes.push_back(end - begin);
+			out.insert(out.end(), stream.begin() + begin, stream.begin() + end);
+		}
+		if (out.size() % 2 != 0)
+			out.push_back(0);
+
+		// The strip tables, then the directory
+		const size_t offsets_at = out.size(), sizes_at = offsets_at + 4 * n_strips;
+		out.resize(sizes_at + 4 * n_strips);
+		for (int strip = 0; strip < n_strips; strip++)
+		{
+			put32(out, offsets_at + 4 * strip, strip_offsets[strip]);
+			put32(out, sizes_at + 4 * strip, strip_sizes[strip]);
+		}
+
+		const int n_entries = 7;
+		const size_t ifd = out.size();
+		put32(out, previous_link, ifd);
+		out.resize(ifd + 2 + 12 * n_entries + 4, 0);
+		put16(out, ifd, n_entries);
+		const uint32_t entries[n_entries][4] = { // tag, type (3: SHORT, 4: LONG), count, value
+			{256, 4, 1, (uint32_t)size}, {257, 4, 1, (uint32_t)size}, {259, 3, 1, 65001}, {262, 3, 1, 1},
+			{273, 4, n_strips, (uint32_t)offsets_at}, {278, 4, 1, size / n_strips}, {279, 4, n_strips, (uint32_t)sizes_at}};
+		for (int i = 0; i < n_entries; i++)
+		{
+			const size_t at = ifd + 2 + 12 * i;
+			put16(out, at, entries[i][0]);
+			put16(out, at + 2, entries[i][1]);
+			put32(out, at + 4, entries[i][2]);
+			if (entries[i][1] == 3)
+				put16(out, at + 8, entries[i][3]);
+			else
+				put32(out, at + 8, entries[i][3]);
+		}
+		previous_link = ifd + 2 + 12 * n_entries;
+	}
+
+	FILE *fh = fopen(fn.c_str(), "wb");
+	REQUIRE(fh != NULL);
+	fwrite(out.data(), 1, out.size(), fh);
+	fclose(fh);
+}
+
+// Random electrons at the given dose per pixel, with clusters of neighbours and ones at both ends of the frame
+static std::vector<std::vector<SyntheticElectron> > makeSyntheticFrames(int n_frames, double dose, unsigned int seed)
+{
+	const long long total_pixels = 4096LL * 4096;
+	std::mt19937 rng(seed);
+	std::vector<std::vector<SyntheticElectron> > frames(n_frames);
+
+	for (int iframe = 0; iframe < n_frames; iframe++)
+	{
+		std::vector<unsigned int> positions;
+		std::geometric_distribution<int> gap(dose);
+		for (long long p = (iframe % 2 == 0) ? 0 : gap(rng); p < total_pixels; p += 1 + gap(rng))
+		{
+			positions.push_back(p);
+			if (rng() % 50 == 0) // a cluster
+				for (int i = 0; i < 5 && p + 1 < total_pixels; i++)
+					positions.push_back(++p);
+		}
+		if (iframe % 3 == 0 && positions.back() != total_pixels - 1)
+			positions.push_back(total_pixels - 1);
+
+		for (unsigned int p : positions)
+			frames[iframe].push_back({p, (unsigned char)(rng() & 15)});
+	}
+
+	return frames;
+}
+
+TEST_CASE( "EER frames rendered on several threads", "[eer]" ) {
+	const FileName fn_eer = "test_output/synthetic.eer";
+	const int n_frames = 7;
+	const std::vector<std::vector<SyntheticElectron> > frames = makeSyntheticFrames(n_frames, 0.002, 42);
+	writeSyntheticEER(fn_eer, frames);
+
+	for (int upsampling : {1, 2})
+	{
+		INFO("upsampling: " << upsampling);
+		const int size = 4096 * upsampling;
+
+		// What the frames from 2 to 6 should add up to
+		MultidimArray<float> expected(size, size);
+		long long expected_electrons = 0;
+		for (int iframe = 1; iframe <= 5; iframe++)
+		{
+			for (const SyntheticElectron &e : frames[iframe])
+			{
+				int x = e.position & 4095, y = e.position >> 12;
+				if (upsampling == 2)
+				{
+					x = (x << 1) | ((e.symbol & 2) >> 1);
+					y = (y << 1) | ((e.symbol & 8) >> 3);
+				}
+				DIRECT_A2D_ELEM(expected, y, x)++;
+			}
+			expected_electrons += frames[iframe].size();
+		}
+
+		for (int n_threads : {1, 3, 8})
+		{
+			INFO("threads: " << n_threads);
+			EERRenderer renderer;
+			renderer.read(fn_eer, upsampling);
+			REQUIRE(renderer.getNFrames() == n_frames);
+			REQUIRE(renderer.getWidth() == size);
+
+			MultidimArray<float> image;
+			REQUIRE(renderer.renderFrames(2, 6, image, n_threads) == expected_electrons);
+			REQUIRE(XSIZE(image) == size);
+			REQUIRE(memcmp(MULTIDIM_ARRAY(image), MULTIDIM_ARRAY(expected), MULTIDIM_SIZE(image) * sizeof(float)) == 0);
+
+			// Only the frames of interest are read
+			EERRenderer partial;
+			partial.read(fn_eer, upsampling);
+			partial.setFramesOfInterest(2, 6);
+			partial.preReadFrames(n_threads);
+			REQUIRE(partial.renderFrames(2, 6, image, n_threads) == expected_electrons);
+			REQUIRE(memcmp(MULTIDIM_ARRAY(image), MULTIDIM_ARRAY(expected), MULTIDIM_SIZE(image) * sizeof(float)) == 0);
+		}
+	}
+}
+
+TEST_CASE( "EER frames that end too early are skipped", "[eer]" ) {
+	const FileName fn_eer = "test_output/synthetic_truncated.eer";
+	const int n_frames = 4;
+	const std::vector<std::vector<SyntheticElectron> > frames = makeSyntheticFrames(n_frames, 0.002, 11);
+
+	// The decoder must not read beyond the last frame, or into the next one
+	for (int truncated_frame : {1, n_frames - 1})
+	{
+		INFO("truncated frame: " << truncated_frame);
+		writeSyntheticEER(fn_eer, frames, truncated_frame);
+
+		long long expected_electrons = 0;
+		for (int iframe = 0; iframe < n_frames; iframe++)
+			if (iframe != truncated_frame)
+				expected_electrons += frames[iframe].size();
+
+		EERRenderer renderer;
+		renderer.read(fn_eer, 1);
+		MultidimArray<float> image;
+		REQUIRE(renderer.renderFrames(1, n_frames, image, 1) == expected_electrons);
+	}
+}
+
+// Hidden by default; run with: tests "[benchmark]"
+TEST_CASE( "Benchmark rendering EER movies", "[.][benchmark][eer]" ) {
+	const FileName fn_eer = "test_output/synthetic_benchmark.eer";
+	const int n_frames = 200, n_threads = 8;
+	writeSyntheticEER(fn_eer, makeSyntheticFrames(n_frames, 0.002, 7));
+
+	double times[2];
+	long long n_electrons[2];
+	for (int i = 0; i < 2; i++)
+	{
+		EERRenderer renderer;
+		renderer.read(fn_eer, 1);
+		MultidimArray<float> image;
+
+		const auto t0 = std::chrono::steady_clock::now();
+		renderer.preReadFrames(i == 0 ? 1 : n_threads);
+		n_electrons[i] = renderer.renderFrames(1, n_frames, image, i == 0 ? 1 : n_threads);
+		times[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+	}
+
+	std::cout << " " << n_frames << " fractions, " << n_electrons[0] << " electrons: one thread " << times[0] << " s, "
+	          << n_threads << " threads " << times[1] << " s (" << times[0] / times[1] << "x)" << std::endl;
+	REQUIRE(n_electrons[0] == n_electrons[1]);
+}
@@ -0,0 +1,197 @@
+#include <catch2/catch.hpp>
+#include "src/fftw.h"
+
+#ifdef RELION_SINGLE_PRECISION
+#define FFTW_ALIGNMENT_OF(p) fftwf_alignment_of(p)
+#else
+#define FFTW_ALIGNMENT_OF(p) fftw_alignment_of(p)
+#endif
+
+static void fillTestImage(MultidimArray<RFLOAT> &img, int seed)
+{
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(img)
+		DIRECT_MULTIDIM_ELEM(img, n) = (RFLOAT)((n * 7 + seed) % 13) - 6.;
+}
+
+TEST_CASE( "FourierTransformers share plans through the FftwPlanCache", "[fftw]" ) {
+	FftwPlanCache::clear();
+	const size_t nr_plans_before = FftwPlanCache::size();
+
+	MultidimArray<RFLOAT> img1(12, 10), img2(12, 10), img3(6, 8, 10);
+	fillTestImage(img1, 1);
+	fillTestImage(img2, 2);
+	fillTestImage(img3, 3);
+
+	{
+		FourierTransformer transformer1, transformer2, transformer3;
+		MultidimArray<Complex> F1, F2, F3;
+
+		transformer1.FourierTransform(img1, F1);
+		const size_t nr_plans = FftwPlanCache::size();
+		REQUIRE(nr_plans == nr_plans_before + 2);
+
+		// A second transformer of the same size (and alignment) does not make new plans
+		transformer2.FourierTransform(img2, F2);
+		if (FFTW_ALIGNMENT_OF(MULTIDIM_ARRAY(img1)) == FFTW_ALIGNMENT_OF(MULTIDIM_ARRAY(img2)) &&
+		    FFTW_ALIGNMENT_OF((RFLOAT *)MULTIDIM_ARRAY(transformer1.fFourier)) == FFTW_ALIGNMENT_OF((RFLOAT *)MULTIDIM_ARRAY(transformer2.fFourier)))
+		{
+			REQUIRE(transformer2.fPlanForward == transformer1.fPlanForward);
+			REQUIRE(transformer2.fPlanBackward == transformer1.fPlanBackward);
+			REQUIRE(FftwPlanCache::size() == nr_plans);
+		}
+
+		// Each transformer executes the shared plan on its own arrays
+		MultidimArray<RFLOAT> back1(img1), back2(img2);
+		transformer1.inverseFourierTransform(F1, back1);
+		transformer2.inverseFourierTransform(F2, back2);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(img1)
+		{
+			REQUIRE(DIRECT_MULTIDIM_ELEM(back1, n) == Approx(DIRECT_MULTIDIM_ELEM(img1, n)).margin(1e-4));
+			REQUIRE(DIRECT_MULTIDIM_ELEM(back2, n) == Approx(DIRECT_MULTIDIM_ELEM(img2, n)).margin(1e-4));
+		}
+
+		// A copy keeps its plans after the original is gone
+		FourierTransformer *original = new FourierTransformer;
+		original->FourierTransform(img3, F3);
+		FourierTransformer copy(*original);
+		delete original;
+
+		MultidimArray<RFLOAT> back3(img3);
+		copy.inverseFourierTransform(F3, back3);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(img3)
+			REQUIRE(DIRECT_MULTIDIM_ELEM(back3, n) == Approx(DIRECT_MULTIDIM_ELEM(img3, n)).margin(1e-4));
+	}
+
+	// Unused plans stay in the cache until it is cleared
+	REQUIRE(FftwPlanCache::size() > nr_plans_before);
+	FftwPlanCache::clear();
+	REQUIRE(FftwPlanCache::size() == nr_plans_before);
+}
+
+TEST_CASE( "Plans for another number of planner threads are not shared", "[fftw]" ) {
+	FftwPlanCache::clear();
+	const size_t nr_plans_before = FftwPlanCache::size();
+
+	MultidimArray<RFLOAT> img(12, 10);
+	fillTestImage(img, 4);
+	MultidimArray<Complex> F1, F2;
+	FourierTransformer transformer1, transformer2;
+
+	transformer1.FourierTransform(img, F1);
+	REQUIRE(FftwPlanCache::size() == nr_plans_before + 2);
+
+	FftwPlanCache::setPlannerThreads(2);
+	transformer2.FourierTransform(img, F2);
+	FftwPlanCache::setPlannerThreads(1);
+	REQUIRE(FftwPlanCache::size() == nr_plans_before + 4);
+	REQUIRE(transformer2.fPlanForward != transformer1.fPlanForward);
+
+	transformer1.clear();
+	transformer2.clear();
+	FftwPlanCache::clear();
+	REQUIRE(FftwPlanCache::size() == nr_plans_before);
+}
+
+TEST_CASE( "BatchFourierTransformer gives the same transforms as FourierTransformer", "[fftw]" ) {
+	const int nr_images = 7, ysize = 10, xsize = 9;
+
+	MultidimArray<RFLOAT> stack(nr_images, 1, ysize, xsize);
+	fillTestImage(stack, 5);
+
+	// One at a time
+	std::vector<MultidimArray<Complex> > Fsingle(nr_images);
+	for (int i = 0; i < nr_images; i++)
+	{
+		MultidimArray<RFLOAT> img;
+		stack.getImage(i, img);
+		FourierTransformer transformer;
+		transformer.FourierTransform(img, Fsingle[i]);
+	}
+
+	for (int nr_threads = 1; nr_threads <= 3; nr_threads += 2)
+	{
+		BatchFourierTransformer transformer(nr_threads);
+
+		MultidimArray<Complex> Fstack;
+		transformer.FourierTransform(stack, Fstack);
+		REQUIRE(NSIZE(Fstack) == nr_images);
+		REQUIRE(YSIZE(Fstack) == ysize);
+		REQUIRE(XSIZE(Fstack) == xsize / 2 + 1);
+
+		for (int i = 0; i < nr_images; i++)
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fsingle[i])
+			{
+				REQUIRE(DIRECT_NZYX_ELEM(Fstack, i, 0, 0, n).real == Approx(DIRECT_MULTIDIM_ELEM(Fsingle[i], n).real).margin(1e-6));
+				REQUIRE(DIRECT_NZYX_ELEM(Fstack, i, 0, 0, n).imag == Approx(DIRECT_MULTIDIM_ELEM(Fsingle[i], n).imag).margin(1e-6));
+			}
+
+		// And back
+		MultidimArray<Complex> Fcopy(Fstack);
+		MultidimArray<RFLOAT> back(nr_images, 1, ysize, xsize);
+		transformer.inverseFourierTransform(Fcopy, back);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(stack)
+			REQUIRE(DIRECT_MULTIDIM_ELEM(back, n) == Approx(DIRECT_MULTIDIM_ELEM(stack, n)).margin(1e-4));
+
+		// In place
+		MultidimArray<Complex> data;
+		BatchFourierTransformer::toInPlaceLayout(stack, data);
+		transformer.FourierTransformInPlace(data, xsize);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fstack)
+		{
+			REQUIRE(DIRECT_MULTIDIM_ELEM(data, n).real == Approx(DIRECT_MULTIDIM_ELEM(Fstack, n).real).margin(1e-6));
+			REQUIRE(DIRECT_MULTIDIM_ELEM(data, n).imag == Approx(DIRECT_MULTIDIM_ELEM(Fstack, n).imag).margin(1e-6));
+		}
+
+		transformer.inverseFourierTransformInPlace(data, xsize);
+		BatchFourierTransformer::fromInPlaceLayout(data, xsize, back);
+		REQUIRE(NSIZE(back) == nr_images);
+		REQUIRE(XSIZE(back) == xsize);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(stack)
+			REQUIRE(DIRECT_MULTIDIM_ELEM(back, n) == Approx(DIRECT_MULTIDIM_ELEM(stack, n)).margin(1e-4));
+	}
+}
+
+TEST_CASE( "BatchFourierTransformer cuts a single volume into slabs", "[fftw]" ) {
+	const int zsize = 7, ysize = 6, xsize = 5;
+
+	MultidimArray<RFLOAT> vol(zsize, ysize, xsize);
+	fillTestImage(vol, 3);
+
+	MultidimArray<Complex> Fref;
+	FourierTransformer reference;
+	reference.FourierTransform(vol, Fref);
+
+	for (int nr_threads = 2; nr_threads <= 9; nr_threads += 7)
+	{
+		BatchFourierTransformer transformer(nr_threads);
+
+		MultidimArray<Complex> Fvol;
+		transformer.FourierTransform(vol, Fvol);
+		REQUIRE(ZSIZE(Fvol) == zsize);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fref)
+		{
+			REQUIRE(DIRECT_MULTIDIM_ELEM(Fvol, n).real == Approx(DIRECT_MULTIDIM_ELEM(Fref, n).real).margin(1e-6));
+			REQUIRE(DIRECT_MULTIDIM_ELEM(Fvol, n).imag == Approx(DIRECT_MULTIDIM_ELEM(Fref, n).imag).margin(1e-6));
+		}
+
+		MultidimArray<RFLOAT> back(zsize, ysize, xsize);
+		transformer.inverseFourierTransform(Fvol, back);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(vol)
+			REQUIRE(DIRECT_MULTIDIM_ELEM(back, n) == Approx(DIRECT_MULTIDIM_ELEM(vol, n)).margin(1e-4));
+
+		// In place
+		MultidimArray<Complex> data;
+		BatchFourierTransformer::toInPlaceLayout(vol, data);
+		transformer.FourierTransformInPlace(data, xsize);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Fref)
+		{
+			REQUIRE(DIRECT_MULTIDIM_ELEM(data, n).real == Approx(DIRECT_MULTIDIM_ELEM(Fref, n).real).margin(1e-6));
+			REQUIRE(DIRECT_MULTIDIM_ELEM(data, n).imag == Approx(DIRECT_MULTIDIM_ELEM(Fref, n).imag).margin(1e-6));
+		}
+
+		transformer.inverseFourierTransformInPlace(data, xsize);
+		BatchFourierTransformer::fromInPlaceLayout(data, xsize, back);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(vol)
+			REQUIRE(DIRECT_MULTIDIM_ELEM(back, n) == Approx(DIRECT_MULTIDIM_ELEM(vol, n)).margin(1e-4));
+	}
+}
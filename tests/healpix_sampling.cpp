@@ -0,0 +1,88 @@
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <iostream>
+#include "src/healpix_sampling.h"
+
+static void setupSampling(HealpixSampling &sampling, FileName fn_sym, int order)
+{
+	sampling.clear();
+	sampling.fn_sym = fn_sym;
+	sampling.fn_sym_relax = "";
+	sampling.healpix_order = order;
+	sampling.psi_step = -1.;
+	sampling.offset_range = 5.;
+	sampling.offset_step = 1.;
+	sampling.limit_tilt = -91.;
+	sampling.initialise(3);
+}
+
+// The same sampling, without the precalculated tables
+static void removeTables(HealpixSampling &sampling)
+{
+	sampling.precalculateOrientationTables(0);
+	sampling.directions_z.clear();
+}
+
+TEST_CASE( "Precalculated orientation tables do not change the orientational searches", "[healpix_sampling]" ) {
+	for (FileName fn_sym : {"C1", "D2", "C4"})
+	{
+		INFO("symmetry: " << fn_sym);
+		HealpixSampling with_tables, without_tables;
+		setupSampling(with_tables, fn_sym, 3);
+		with_tables.precalculateOrientationTables(2);
+		without_tables = with_tables;
+		removeTables(without_tables);
+		REQUIRE(with_tables.oversampled_rot_angles.size() == 2);
+
+		for (int i = 0; i < 50; i++)
+		{
+			RFLOAT rot = -175. + 7.3 * i, tilt = 3.6 * i, psi = 11. * i, sigma = 1. + 0.3 * i;
+			RFLOAT sigma_tilt_from_ninety = (i % 3 == 0) ? 20. : -1.;
+			std::vector<int> dir_a, dir_b, psi_a, psi_b;
+			std::vector<RFLOAT> dir_prior_a, dir_prior_b, psi_prior_a, psi_prior_b;
+			with_tables.selectOrientationsWithNonZeroPriorProbability(rot, tilt, psi, sigma, sigma, sigma,
+					dir_a, dir_prior_a, psi_a, psi_prior_a, false, 3., sigma_tilt_from_ninety);
+			without_tables.selectOrientationsWithNonZeroPriorProbability(rot, tilt, psi, sigma, sigma, sigma,
+					dir_b, dir_prior_b, psi_b, psi_prior_b, false, 3., sigma_tilt_from_ninety);
+			REQUIRE(dir_a == dir_b);
+			REQUIRE(dir_prior_a == dir_prior_b);
+
+			for (int oversampling_order = 0; oversampling_order <= 2; oversampling_order++)
+			{
+				std::vector<RFLOAT> rot_a, tilt_a, psi_angles_a, rot_b, tilt_b, psi_angles_b;
+				long int idir = i % dir_a.size();
+				with_tables.getOrientations(idir, 0, oversampling_order, rot_a, tilt_a, psi_angles_a,
+						dir_a, dir_prior_a, psi_a, psi_prior_a);
+				without_tables.getOrientations(idir, 0, oversampling_order, rot_b, tilt_b, psi_angles_b,
+						dir_a, dir_prior_a, psi_a, psi_prior_a);
+				REQUIRE(rot_a == rot_b);
+				REQUIRE(tilt_a == tilt_b);
+				REQUIRE(psi_angles_a == psi_angles_b);
+			}
+		}
+	}
+}
+
+// Hidden by default; run with: tests "[benchmark]"
+TEST_CASE( "Benchmark selecting directions for local searches", "[.][benchmark][healpix_sampling]" ) {
+	HealpixSampling with_tables, without_tables;
+	setupSampling(with_tables, "C1", 6);
+	without_tables = with_tables;
+	removeTables(without_tables);
+
+	std::vector<int> dirs, psis;
+	std::vector<RFLOAT> dir_prior, psi_prior;
+	auto t0 = std::chrono::steady_clock::now();
+	for (int i = 0; i < 50; i++)
+		without_tables.selectOrientationsWithNonZeroPriorProbability(10. + i, 50., 20., 2., 2., 2., dirs, dir_prior, psis, psi_prior);
+	const double full = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+	t0 = std::chrono::steady_clock::now();
+	for (int i = 0; i < 50; i++)
+		with_tables.selectOrientationsWithNonZeroPriorProbability(10. + i, 50., 20., 2., 2., 2., dirs, dir_prior, psis, psi_prior);
+	const double indexed = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+	std::cout << " " << with_tables.rot_angles.size() << " directions: all " << full << " s, near the prior "
+	          << indexed << " s (" << full / indexed << "x)" << std::endl;
+	REQUIRE(dirs.size() > 0);
+}
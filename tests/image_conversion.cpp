@@ -0,0 +1,191 @@
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <vector>
+#include "src/image_conversion.h"
+
+static float floatFromBits(unsigned int bits)
+{
+	float f;
+	memcpy(&f, &bits, sizeof(float));
+	return f;
+}
+
+static unsigned int bitsOfFloat(float f)
+{
+	unsigned int bits;
+	memcpy(&bits, &f, sizeof(float));
+	return bits;
+}
+
+static bool sameBits(float a, float b)
+{
+	return memcmp(&a, &b, sizeof(float)) == 0;
+}
+
+TEST_CASE( "Vectorised page conversions match the scalar casts", "[image]" ) {
+
+	SECTION( "float16 to float, all 65536 values" ) {
+		std::vector<float16> halves(65536);
+		for (int i = 0; i < 65536; i++)
+			halves[i] = (float16)i;
+
+		std::vector<float> floats(65536);
+		std::vector<double> doubles(65536);
+		castHalfPage(&halves[0], &floats[0], halves.size());
+		castHalfPage(&halves[0], &doubles[0], halves.size());
+
+		for (int i = 0; i < 65536; i++)
+		{
+			const float expected = half2float(halves[i]);
+			REQUIRE(sameBits(floats[i], expected));
+			REQUIRE((sameBits((float)doubles[i], expected) || (doubles[i] != doubles[i] && expected != expected)));
+		}
+	}
+
+	SECTION( "float to float16" ) {
+		// Every 251st bit pattern, and the edge cases: signed zeros, subnormals, Inf/NaN,
+		// overflow, underflow and rounding that carries into the exponent
+		std::vector<float> floats;
+		for (unsigned long long bits = 0; bits < (1ull << 32); bits += 251)
+			floats.push_back(floatFromBits((unsigned int)bits));
+
+		const unsigned int edges[] = {
+			0x00000000u, 0x80000000u, 0x00000001u, 0x807fffffu, 0x7f800000u, 0xff800000u, 0x7fc00000u, 0x7f800001u,
+			0x477fe000u, 0x477fefffu, 0x477ff000u, 0x47800000u, 0xc77ff000u, 0x7f7fffffu,
+			0x38800000u, 0x387fffffu, 0x387ff000u, 0x38000000u, 0xb87ff000u,
+			0x3f7ff000u, 0x3f7fefffu, 0x3fffffffu};
+		for (int i = 0; i < sizeof(edges) / sizeof(edges[0]); i++)
+			floats.push_back(floatFromBits(edges[i]));
+
+		std::vector<float16> halves(floats.size()), halves_from_double(floats.size());
+		castPage2Half(&floats[0], &halves[0], floats.size());
+
+		std::vector<double> doubles(floats.begin(), floats.end());
+		castPage2Half(&doubles[0], &halves_from_double[0], doubles.size());
+
+		// Comparing in bulk is much faster than millions of REQUIREs
+		size_t nr_different = 0, first_different = 0;
+		for (size_t i = 0; i < floats.size(); i++)
+		{
+			if (halves[i] != float2half(floats[i]) || halves_from_double[i] != float2half((float)doubles[i]))
+			{
+				if (nr_different == 0) first_different = i;
+				nr_different++;
+			}
+		}
+		INFO("first different input: bits " << std::hex << bitsOfFloat(floats[first_different]));
+		REQUIRE(nr_different == 0);
+	}
+
+	SECTION( "integers and floating point" ) {
+		const size_t n = 1037; // not a multiple of any vector length
+		std::vector<unsigned char> uc(n);
+		std::vector<signed char> sc(n);
+		std::vector<unsigned short> us(n);
+		std::vector<short> ss(n);
+		std::vector<unsigned int> ui(n);
+		std::vector<int> si(n);
+		std::vector<float> f(n);
+		std::vector<double> d(n);
+		for (size_t i = 0; i < n; i++)
+		{
+			uc[i] = (unsigned char)(i * 37);
+			sc[i] = (signed char)(i * 37);
+			us[i] = (unsigned short)(i * 7919);
+			ss[i] = (short)(i * 7919);
+			ui[i] = (unsigned int)(i * 2654435761u);
+			si[i] = (int)(i * 2654435761u);
+			f[i] = (float)(0.37 * i - 200.);
+			d[i] = 1.0000001 * i - 0.3;
+		}
+
+		std::vector<float> to_f(n);
+		std::vector<double> to_d(n);
+
+#define CHECK_CAST_PAGE(src, dst, D) \
+		castPage(&src[0], &dst[0], n); \
+		for (size_t i = 0; i < n; i++) \
+			REQUIRE(dst[i] == (D)src[i]);
+
+		CHECK_CAST_PAGE(uc, to_f, float)
+		CHECK_CAST_PAGE(sc, to_f, float)
+		CHECK_CAST_PAGE(us, to_f, float)
+		CHECK_CAST_PAGE(ss, to_f, float)
+		CHECK_CAST_PAGE(ui, to_f, float)
+		CHECK_CAST_PAGE(si, to_f, float)
+		CHECK_CAST_PAGE(d, to_f, float)
+
+		CHECK_CAST_PAGE(uc, to_d, double)
+		CHECK_CAST_PAGE(sc, to_d, double)
+		CHECK_CAST_PAGE(us, to_d, double)
+		CHECK_CAST_PAGE(ss, to_d, double)
+		CHECK_CAST_PAGE(ui, to_d, double)
+		CHECK_CAST_PAGE(si, to_d, double)
+		CHECK_CAST_PAGE(f, to_d, double)
+
+		// Keep the values in range of the integer types
+		for (size_t i = 0; i < n; i++)
+		{
+			f[i] = (float)(0.23 * i + 0.5);
+			d[i] = 0.23 * i + 0.5;
+		}
+
+		CHECK_CAST_PAGE(f, ss, short)
+		CHECK_CAST_PAGE(f, us, unsigned short)
+		CHECK_CAST_PAGE(f, uc, unsigned char)
+		CHECK_CAST_PAGE(d, ss, short)
+		CHECK_CAST_PAGE(d, us, unsigned short)
+		CHECK_CAST_PAGE(d, uc, unsigned char)
+
+#undef CHECK_CAST_PAGE
+	}
+}
+
+// Hidden by default; run with: tests "[benchmark]"
+TEST_CASE( "Benchmark page conversions", "[.][benchmark][image]" ) {
+	const size_t n = 64 * 1024 * 1024;
+	const int nr_repeats = 5;
+
+	std::vector<float16> halves(n);
+	std::vector<short> shorts(n);
+	std::vector<float> floats(n);
+	for (size_t i = 0; i < n; i++)
+	{
+		halves[i] = float2half((float)(i % 1000) * 0.01f - 5.f);
+		shorts[i] = (short)(i % 2001) - 1000;
+	}
+
+	std::vector<float16> halves_out(n);
+
+	auto measure = [&](const char *name, std::function<void()> scalar, std::function<void()> kernel)
+	{
+		double t[2];
+		for (int k = 0; k < 2; k++)
+		{
+			std::function<void()> &f = (k == 0) ? scalar : kernel;
+			f(); // warm up
+			auto t0 = std::chrono::steady_clock::now();
+			for (int r = 0; r < nr_repeats; r++)
+				f();
+			t[k] = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count() / nr_repeats;
+		}
+		std::cout << " " << name << ": scalar " << n / t[0] / 1e6 << " Mvalues/s, vectorised "
+		          << n / t[1] / 1e6 << " Mvalues/s (" << t[0] / t[1] << "x)" << std::endl;
+	};
+
+	measure("float16 -> float",
+		[&]{ for (size_t i = 0; i < n; i++) floats[i] = half2float(halves[i]); },
+		[&]{ castHalfPage(&halves[0], &floats[0], n); });
+
+	measure("float -> float16",
+		[&]{ for (size_t i = 0; i < n; i++) halves_out[i] = float2half(floats[i]); },
+		[&]{ castPage2Half(&floats[0], &halves_out[0], n); });
+
+	REQUIRE(halves_out[n - 1] == float2half(floats[n - 1]));
+
+	measure("short -> float",
+		[&]{ for (size_t i = 0; i < n; i++) floats[i] = (float)shorts[i]; },
+		[&]{ castPage(&shorts[0], &floats[0], n); });
+}
@@ -0,0 +1,53 @@
+#include <catch2/catch.hpp>
+#include "src/image.h"
+#include "src/image_prefetcher.h"
+
+TEST_CASE( "Prefetched particle images equal the images read from disc", "[image]" ) {
+	const FileName fn_stack = "test_output/prefetch_particles.mrcs";
+	const int nr_images = 20;
+
+	Image<RFLOAT> Istack(32, 32, 1, nr_images);
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Istack())
+		DIRECT_MULTIDIM_ELEM(Istack(), n) = (RFLOAT)(n % 997);
+	Istack.write(fn_stack);
+
+	std::vector<FileName> fn_first, fn_second;
+	for (int i = 1; i <= nr_images; i++)
+		((i <= nr_images / 2) ? fn_first : fn_second).push_back(integerToString(i, 6) + "@" + fn_stack);
+	fn_second.back() = "000001@test_output/prefetch_does_not_exist.mrcs";
+
+	ImagePrefetcher prefetcher;
+	prefetcher.setup(2, 1024 * 1024);
+	REQUIRE(prefetcher.prefetch(0, fn_first));
+	REQUIRE(prefetcher.prefetch(10, fn_second));
+	REQUIRE(!prefetcher.prefetch(20, fn_first)); // the queue is full
+	REQUIRE(prefetcher.isQueued(10));
+
+	std::vector<MultidimArray<RFLOAT> > imgs;
+	REQUIRE(!prefetcher.fetch(20, imgs));
+	REQUIRE(prefetcher.fetch(0, imgs));
+	REQUIRE(imgs.size() == fn_first.size());
+	for (int i = 0; i < imgs.size(); i++)
+	{
+		Image<RFLOAT> img;
+		img.read(fn_first[i]);
+		img().setXmippOrigin();
+		REQUIRE(img().sameShape(imgs[i]));
+		REQUIRE(memcmp(MULTIDIM_ARRAY(img()), MULTIDIM_ARRAY(imgs[i]), MULTIDIM_SIZE(img()) * sizeof(RFLOAT)) == 0);
+	}
+
+	// Images that cannot be read are left to the caller
+	REQUIRE(prefetcher.fetch(10, imgs));
+	REQUIRE(MULTIDIM_SIZE(imgs[0]) == 32 * 32);
+	REQUIRE(MULTIDIM_SIZE(imgs.back()) == 0);
+	REQUIRE(!prefetcher.isQueued(10));
+
+	// With a memory cap of a few images, the rest of the batch is not read
+	prefetcher.setup(1, 3 * 32 * 32 * sizeof(RFLOAT));
+	REQUIRE(prefetcher.prefetch(0, fn_first));
+	REQUIRE(prefetcher.fetch(0, imgs));
+	int nr_read = 0;
+	for (int i = 0; i < imgs.size(); i++)
+		if (MULTIDIM_SIZE(imgs[i]) > 0) nr_read++;
+	REQUIRE(nr_read == 3);
+}
@@ -0,0 +1,110 @@
+#include <catch2/catch.hpp>
+#include "src/image.h"
+#include "src/mapped_stack_cache.h"
+
+TEST_CASE( "Particles read from memory-mapped MRC stacks", "[image]" ) {
+	const FileName fn_stack = "test_output/mapped_particles.mrcs";
+	const int nr_images = 7;
+	const bool was_enabled = MappedStackCache::isEnabled();
+	MappedStackCache::setEnabled(true);
+
+	Image<RFLOAT> Istack(24, 20, 1, nr_images);
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Istack())
+		DIRECT_MULTIDIM_ELEM(Istack(), n) = (RFLOAT)(n % 101) - 50.;
+
+	// These values can be stored exactly in all datatypes
+	const DataType datatypes[] = {Float, Float16, SShort, SChar};
+	for (int itype = 0; itype < 4; itype++)
+	{
+		if (datatypes[itype] == SChar)
+		{
+			// Image cannot write 8-bit data, so change an MRC header to mode 0 and write the bytes
+			Istack.write(fn_stack, -1, true, WRITE_OVERWRITE, Float);
+			std::vector<char> buffer(1024 + MULTIDIM_SIZE(Istack()));
+			std::ifstream in(fn_stack.c_str(), std::ios::binary);
+			in.read(&buffer[0], 1024);
+			in.close();
+			const int mode = 0;
+			memcpy(&buffer[12], &mode, sizeof(int));
+			for (long int n = 0; n < MULTIDIM_SIZE(Istack()); n++)
+				buffer[1024 + n] = (signed char)DIRECT_MULTIDIM_ELEM(Istack(), n);
+			std::ofstream out(fn_stack.c_str(), std::ios::binary | std::ios::trunc);
+			out.write(&buffer[0], buffer.size());
+		}
+		else
+			Istack.write(fn_stack, -1, true, WRITE_OVERWRITE, datatypes[itype]);
+
+		for (int i = 0; i < nr_images; i++)
+		{
+			Image<RFLOAT> img;
+			img.read(integerToString(i + 1, 6) + "@" + fn_stack);
+			REQUIRE(XSIZE(img()) == 24);
+			REQUIRE(YSIZE(img()) == 20);
+			REQUIRE(NSIZE(img()) == 1);
+
+			int img_datatype;
+			img.MDMainHeader.getValue(EMDL_IMAGE_DATATYPE, img_datatype);
+			REQUIRE(img_datatype == datatypes[itype]);
+
+			for (long int n = 0; n < NZYXSIZE(img()); n++)
+				REQUIRE(DIRECT_MULTIDIM_ELEM(img(), n) == DIRECT_NZYX_ELEM(Istack(), i, 0, 0, n));
+		}
+
+		Image<RFLOAT> all;
+		all.read(fn_stack);
+		REQUIRE(NSIZE(all()) == nr_images);
+		REQUIRE(memcmp(MULTIDIM_ARRAY(all()), MULTIDIM_ARRAY(Istack()), MULTIDIM_SIZE(all()) * sizeof(RFLOAT)) == 0);
+	}
+
+	// Reading through an open file handler gives the same
+	fImageHandler hFile;
+	hFile.openFile(fn_stack);
+	Image<float> img3;
+	img3.readFromOpenFile("000003@" + fn_stack, hFile, -1);
+	REQUIRE(img3(0, 0) == (float)DIRECT_NZYX_ELEM(Istack(), 2, 0, 0, 0));
+
+	// Writing the stack drops the old map
+	Istack() *= 2.;
+	Istack.write(fn_stack);
+	Image<RFLOAT> img;
+	img.read("000002@" + fn_stack);
+	REQUIRE(DIRECT_A2D_ELEM(img(), 1, 1) == DIRECT_NZYX_ELEM(Istack(), 1, 0, 1, 1));
+
+	// Images beyond the end of the stack are still an error
+	REQUIRE_THROWS(img.read("000008@" + fn_stack));
+
+	// A stack that is rewritten by someone else (here: truncated to 3 images) is mapped again
+	std::shared_ptr<const MappedStack> old_stack = MappedStackCache::get(fn_stack);
+	REQUIRE(old_stack);
+	{
+		std::vector<char> buffer(1024 + 3 * 24 * 20 * sizeof(float));
+		std::ifstream in(fn_stack.c_str(), std::ios::binary);
+		in.read(&buffer[0], 1024);
+		in.close();
+		const int nz = 3;
+		memcpy(&buffer[8], &nz, sizeof(int));
+		for (long int n = 0; n < 3 * 24 * 20; n++)
+		{
+			const float value = -DIRECT_MULTIDIM_ELEM(Istack(), n);
+			memcpy(&buffer[1024 + n * sizeof(float)], &value, sizeof(float));
+		}
+		std::ofstream out(fn_stack.c_str(), std::ios::binary | std::ios::trunc);
+		out.write(&buffer[0], buffer.size());
+	}
+	std::shared_ptr<const MappedStack> new_stack = MappedStackCache::get(fn_stack);
+	REQUIRE(new_stack);
+	REQUIRE(new_stack != old_stack);
+	REQUIRE(new_stack->size == 1024 + 3 * 24 * 20 * sizeof(float));
+	old_stack.reset();
+	img.read("000002@" + fn_stack);
+	REQUIRE(DIRECT_A2D_ELEM(img(), 1, 1) == -DIRECT_NZYX_ELEM(Istack(), 1, 0, 1, 1));
+	REQUIRE_THROWS(img.read("000004@" + fn_stack));
+
+	// Switched off, nothing is mapped and stacks are read as before
+	MappedStackCache::setEnabled(false);
+	REQUIRE(!MappedStackCache::isEnabled());
+	img.read("000003@" + fn_stack);
+	REQUIRE(DIRECT_A2D_ELEM(img(), 1, 1) == -DIRECT_NZYX_ELEM(Istack(), 2, 0, 1, 1));
+
+	MappedStackCache::setEnabled(was_enabled);
+}
@@ -0,0 +1,277 @@
+#include <catch2/catch.hpp>
+#include <cstdlib>
+#include <sys/time.h>
+#include "src/metadata_table.h"
+#include "src/metadata_star_reader.h"
+#include "src/metadata_table_cache.h"
+#include "src/metadata_index.h"
+
+static double wallTime()
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + 1e-6 * tv.tv_usec;
+}
+
+// A particle table with the usual mix of column types, an unknown label and quoted strings
+static void writeSyntheticParticles(const FileName &fn, long int nr_particles)
+{
+	MetaDataTable MDopt, MDpart;
+
+	MDopt.setName("optics");
+	MDopt.addObject();
+	MDopt.setValue(EMDL_IMAGE_OPTICS_GROUP, 1);
+	MDopt.setValue(EMDL_IMAGE_OPTICS_GROUP_NAME, std::string("opticsGroup1"));
+	MDopt.setValue(EMDL_IMAGE_PIXEL_SIZE, 1.06);
+
+	MDpart.setName("particles");
+	MDpart.reserve(nr_particles);
+	for (long int i = 0; i < nr_particles; i++)
+	{
+		MDpart.addObject();
+		MDpart.setValue(EMDL_IMAGE_COORD_X, 4096. * (i % 997) / 997.);
+		MDpart.setValue(EMDL_IMAGE_COORD_Y, 4096. * (i % 991) / 991.);
+		MDpart.setValue(EMDL_IMAGE_NAME, integerToString(i % 100 + 1, 6) + "@Extract/job012/Movies/mic" + integerToString(i / 100, 5) + ".mrcs");
+		MDpart.setValue(EMDL_MICROGRAPH_NAME, (i % 1000 == 7) ? std::string("Movies/with space.mrc") : "Movies/mic" + integerToString(i / 100, 5) + ".mrc");
+		MDpart.setValue(EMDL_ORIENT_ROT, -180. + 0.37 * (i % 971));
+		MDpart.setValue(EMDL_ORIENT_TILT, 0.17 * (i % 983));
+		MDpart.setValue(EMDL_ORIENT_PSI, -180. + 0.41 * (i % 877));
+		MDpart.setValue(EMDL_CTF_DEFOCUSU, 10000. + i % 20011);
+		MDpart.setValue(EMDL_CTF_DEFOCUSV, 10500. + i % 19997);
+		MDpart.setValue(EMDL_PARTICLE_CLASS, (int) (i % 5 + 1));
+		MDpart.setValue(EMDL_IMAGE_OPTICS_GROUP, 1);
+		MDpart.setValue(EMDL_PARTICLE_RANDOM_SUBSET, (int) (i % 2 + 1));
+	}
+	MDpart.addLabel(EMDL_UNKNOWN_LABEL, "rlnSomethingNew");
+
+	std::ofstream fh(fn.c_str());
+	MDopt.write(fh);
+	MDpart.write(fh);
+}
+
+static std::string tableToString(const MetaDataTable &MD)
+{
+	std::ostringstream sts;
+	MD.write(sts);
+	return sts.str();
+}
+
+TEST_CASE( "Memory-mapped STAR reader gives the same table as the stream reader", "[metadata]" ) {
+	const FileName fn = "test_output/mmap_reader.star";
+	writeSyntheticParticles(fn, 2500);
+
+	setenv("RELION_STAR_MMAP", "0", 1);
+	MetaDataTable MDstream_opt, MDstream_part;
+	MDstream_opt.read(fn, "optics");
+	MDstream_part.read(fn, "particles");
+
+	unsetenv("RELION_STAR_MMAP");
+	MetaDataTable MDmmap_opt, MDmmap_part;
+	MDmmap_opt.read(fn, "optics");
+	MDmmap_part.read(fn, "particles");
+
+	REQUIRE(MDmmap_part.numberOfObjects() == 2500);
+	REQUIRE(tableToString(MDmmap_opt) == tableToString(MDstream_opt));
+	REQUIRE(tableToString(MDmmap_part) == tableToString(MDstream_part));
+}
+
+TEST_CASE( "Memory-mapped STAR reader parses odd numbers as operator>> does", "[metadata]" ) {
+	const FileName fn = "test_output/mmap_reader_numbers.star";
+	const char *values[] = {"0x1A", "-0X10", "1e", "1e+", "1.5.3", "1.5abc", "1E3x", ".", "-.", "+3.25", ".5e-2", "007", "nan", "inf", "None"};
+	const int nr_values = sizeof(values) / sizeof(values[0]);
+	{
+		std::ofstream fh(fn.c_str());
+		fh << "\ndata_\n\nloop_\n_rlnDefocusU #1\n_rlnClassNumber #2\n";
+		for (int i = 0; i < nr_values; i++)
+			fh << values[i] << " " << values[i] << "\n";
+	}
+
+	setenv("RELION_STAR_MMAP", "0", 1);
+	MetaDataTable MDstream;
+	MDstream.read(fn);
+	unsetenv("RELION_STAR_MMAP");
+	MetaDataTable MDmmap;
+	MDmmap.read(fn);
+
+	REQUIRE(MDmmap.numberOfObjects() == nr_values);
+	for (int i = 0; i < nr_values; i++)
+	{
+		INFO("value: " << values[i]);
+		REQUIRE(MDmmap.getDouble(EMDL_CTF_DEFOCUSU, i) == MDstream.getDouble(EMDL_CTF_DEFOCUSU, i));
+		REQUIRE(MDmmap.getInt(EMDL_PARTICLE_CLASS, i) == MDstream.getInt(EMDL_PARTICLE_CLASS, i));
+	}
+	REQUIRE(MDmmap.getDouble(EMDL_CTF_DEFOCUSU, 0) == 0.);
+}
+
+TEST_CASE( "Binary STAR sidecar round trip and invalidation", "[metadata]" ) {
+	const FileName fn = "test_output/binary_cache.star";
+	writeSyntheticParticles(fn, 2500);
+	StarBinaryCache::invalidate(fn);
+
+	setenv("RELION_STAR_CACHE", "1", 1);
+	setenv("RELION_STAR_CACHE_MIN_ROWS", "100", 1);
+
+	// The first read parses the text and writes the sidecar; only the large block is stored
+	MetaDataTable MDtext, MDopt;
+	MDtext.read(fn, "particles");
+	MDopt.read(fn, "optics");
+	REQUIRE(exists(StarBinaryCache::getCacheName(fn)));
+
+	MetaDataTable MDbin;
+	REQUIRE(StarBinaryCache::read(fn, "particles", MDbin));
+	REQUIRE(!StarBinaryCache::read(fn, "optics", MDbin));
+	REQUIRE(StarBinaryCache::read(fn, "", MDbin) == false); // the first block is data_optics
+
+	MDbin.read(fn, "particles");
+	REQUIRE(tableToString(MDbin) == tableToString(MDtext));
+
+	// Rewriting the STAR file makes the sidecar stale
+	MDtext.setValue(EMDL_CTF_DEFOCUSU, 123., 0);
+	MDtext.write(fn);
+	REQUIRE(!StarBinaryCache::read(fn, "particles", MDbin));
+
+	unsetenv("RELION_STAR_CACHE");
+	unsetenv("RELION_STAR_CACHE_MIN_ROWS");
+}
+
+TEST_CASE( "Parallel STAR writer formats values as getValueToString", "[metadata]" ) {
+	const double values[] = {0., -0., 1e-300, -2.5e-7, 0.0000005, 0.0015, -0.0015, 1.0000005, 12345.0000005,
+	                         99999.9999999, -99999.999999, 100000., 100000.0000001, -1e200, 3.14159265358979};
+
+	MetaDataTable MD;
+	for (int i = 0; i < 30000; i++)
+	{
+		MD.addObject();
+		MD.setValue(EMDL_ORIENT_ROT, values[i % 15] * ((i / 15) % 2 ? 1. : -1.));
+		MD.setValue(EMDL_PARTICLE_CLASS, (long) ((i % 7) ? i : -123456789012345L));
+		MD.setValue(EMDL_IMAGE_NAME, std::string((i % 3) ? "with space" : ""));
+	}
+
+	std::istringstream written(tableToString(MD));
+	std::string line;
+	while (std::getline(written, line) && line.find("_rlnImageName") == std::string::npos);
+
+	for (long int i = 0; i < MD.numberOfObjects(); i++)
+	{
+		std::string expected, val;
+		std::vector<EMDLabel> labels = MD.getActiveLabels();
+		for (int j = 0; j < labels.size(); j++)
+		{
+			MD.getValueToString(labels[j], val, i, true);
+			std::ostringstream sts;
+			sts << std::setw(10) << val << " ";
+			expected += sts.str();
+		}
+
+		std::getline(written, line);
+		REQUIRE(line == expected);
+	}
+}
+
+TEST_CASE( "Hash index, join and semi-join on MetaDataTables", "[metadata]" ) {
+	MetaDataTable MDpart, MDmic;
+
+	for (int i = 0; i < 10; i++)
+	{
+		MDpart.addObject();
+		MDpart.setValue(EMDL_MICROGRAPH_NAME, "mic" + integerToString(i % 3) + ".mrc");
+		MDpart.setValue(EMDL_PARTICLE_CLASS, i % 4);
+		MDpart.setValue(EMDL_CTF_DEFOCUSU, 1000. * i);
+	}
+
+	for (int i = 1; i < 4; i++)
+	{
+		MDmic.addObject();
+		MDmic.setValue(EMDL_MICROGRAPH_NAME, "mic" + integerToString(i) + ".mrc");
+		MDmic.setValue(EMDL_CTF_DEFOCUSU, -1.);
+		MDmic.setValue(EMDL_CTF_ASTIGMATISM, 10. * i);
+	}
+
+	// Groups are numbered by first appearance and hold their rows in table order
+	MetaDataIndex byMic(MDpart, EMDL_MICROGRAPH_NAME);
+	REQUIRE(byMic.numberOfGroups() == 3);
+	REQUIRE(byMic.getGroupKey(1) == "mic1.mrc");
+	REQUIRE(byMic.getGroupRows(byMic.findGroup(std::string("mic1.mrc"))) == std::vector<long int>({1, 4, 7}));
+	REQUIRE(byMic.find(std::string("mic2.mrc")) == 2);
+	REQUIRE(byMic.find(std::string("mic9.mrc")) == -1);
+	REQUIRE(byMic.groupOfRow(9) == 0);
+
+	MetaDataIndex byClass(MDpart, EMDL_PARTICLE_CLASS);
+	REQUIRE(byClass.groupSize(byClass.findGroup(3L)) == 2);
+	REQUIRE(byClass.getGroupIntKey(2) == 2);
+	REQUIRE_THROWS(MetaDataIndex(MDpart, EMDL_CTF_DEFOCUSU));
+
+	// Only mic1 and mic2 occur in both; the particle defocus wins over the micrograph one
+	MetaDataTable MDjoin = joinMetaDataTables(MDpart, MDmic, EMDL_MICROGRAPH_NAME);
+	REQUIRE(MDjoin.numberOfObjects() == 6);
+	REQUIRE(MDjoin.getString(EMDL_MICROGRAPH_NAME, 0) == "mic1.mrc");
+	REQUIRE(MDjoin.getDouble(EMDL_CTF_DEFOCUSU, 1) == 2000.);
+	REQUIRE(MDjoin.getDouble(EMDL_CTF_ASTIGMATISM, 1) == 20.);
+
+	MetaDataTable MDsemi = semiJoinMetaDataTables(MDpart, MDmic, EMDL_MICROGRAPH_NAME);
+	MetaDataTable MDanti = semiJoinMetaDataTables(MDpart, MDmic, EMDL_MICROGRAPH_NAME, true);
+	REQUIRE(MDsemi.numberOfObjects() == 6);
+	REQUIRE(MDanti.numberOfObjects() == 4);
+	REQUIRE(!MDsemi.containsLabel(EMDL_CTF_ASTIGMATISM));
+
+	// compareMetaDataTable uses the index for exact matches
+	MetaDataTable MDboth, MDonly1, MDonly2;
+	compareMetaDataTable(MDmic, MDpart, MDboth, MDonly1, MDonly2, EMDL_MICROGRAPH_NAME);
+	REQUIRE(MDboth.numberOfObjects() == 2);
+	REQUIRE(MDonly1.numberOfObjects() == 1);
+	REQUIRE(MDonly2.numberOfObjects() == 8);
+}
+
+// Hidden by default; run with: tests "[benchmark]"
+TEST_CASE( "Benchmark writing a large particle STAR file", "[.][benchmark][metadata]" ) {
+	const FileName fn = "test_output/star_writer_benchmark.star";
+	writeSyntheticParticles(fn, 1000000);
+
+	MetaDataTable MD;
+	MD.read(fn, "particles");
+
+	double t0 = wallTime();
+	MD.write(fn);
+	double t1 = wallTime();
+
+	std::cout << " Writing " << MD.numberOfObjects() << " particles with " << StarLoopReader::getNumberOfThreads() << " threads: "
+	          << t1 - t0 << " s (" << fn.getFileSize() / (t1 - t0) / (1024. * 1024.) << " MB/s)" << std::endl;
+
+	REQUIRE(fn.getFileSize() > 0);
+}
+
+// Hidden by default; run with: tests "[benchmark]"
+TEST_CASE( "Benchmark reading a large particle STAR file", "[.][benchmark][metadata]" ) {
+	const FileName fn = "test_output/mmap_reader_benchmark.star";
+	const long int nr_particles = 1000000;
+	writeSyntheticParticles(fn, nr_particles);
+
+	setenv("RELION_STAR_MMAP", "0", 1);
+	double t0 = wallTime();
+	MetaDataTable MDstream;
+	MDstream.read(fn, "particles");
+	double t1 = wallTime();
+
+	unsetenv("RELION_STAR_MMAP");
+	MetaDataTable MDmmap;
+	MDmmap.read(fn, "particles");
+	double t2 = wallTime();
+
+	setenv("RELION_STAR_CACHE", "1", 1);
+	StarBinaryCache::invalidate(fn);
+	MetaDataTable MDcache;
+	MDcache.read(fn, "particles");
+	double t3 = wallTime();
+	MDcache.read(fn, "particles");
+	double t4 = wallTime();
+	unsetenv("RELION_STAR_CACHE");
+
+	std::cout << " Reading " << nr_particles << " particles with " << StarLoopReader::getNumberOfThreads() << " threads:" << std::endl;
+	std::cout << "  stream parser:          " << t1 - t0 << " s" << std::endl;
+	std::cout << "  memory-mapped parser:   " << t2 - t1 << " s" << std::endl;
+	std::cout << "  parse and write sidecar: " << t3 - t2 << " s" << std::endl;
+	std::cout << "  binary sidecar:         " << t4 - t3 << " s" << std::endl;
+
+	REQUIRE(MDmmap.numberOfObjects() == MDstream.numberOfObjects());
+	REQUIRE(MDcache.numberOfObjects() == MDstream.numberOfObjects());
+}
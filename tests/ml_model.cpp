@@ -0,0 +1,85 @@
+#include <catch2/catch.hpp>
+#include "src/ml_model.h"
+#include "src/euler.h"
+
+static void setupWsumModel(MlWsumModel &wsum, int ori_size, int current_size, int nr_classes)
+{
+	wsum.ori_size = ori_size;
+	wsum.current_size = current_size;
+	wsum.ref_dim = 3;
+	wsum.nr_classes = nr_classes;
+	wsum.nr_bodies = 1;
+	wsum.nr_optics_groups = 1;
+	wsum.nr_groups = 1;
+	wsum.nr_directions = 10;
+
+	MultidimArray<RFLOAT> spectrum(ori_size / 2 + 1);
+	for (int iclass = 0; iclass < nr_classes; iclass++)
+	{
+		wsum.BPref.push_back(BackProjector(ori_size, 3, "c1"));
+		wsum.pdf_direction.push_back(MultidimArray<RFLOAT>(wsum.nr_directions));
+	}
+	wsum.pdf_class.resize(nr_classes);
+	wsum.class_age.resize(nr_classes);
+	wsum.prior_offset_class.resize(nr_classes, vectorR2(0., 0.));
+	wsum.sigma2_noise.resize(1, spectrum);
+	wsum.sumw_ctf2.resize(1, spectrum);
+	wsum.sumw_stMulti.resize(1, spectrum);
+	wsum.sumw_group.resize(1);
+	wsum.wsum_signal_product.resize(1);
+	wsum.wsum_reference_power.resize(1);
+	wsum.initZeros();
+}
+
+TEST_CASE( "MlWsumModel packs only the populated shell without losing anything", "[ml_model]" ) {
+	const int ori_size = 48, current_size = 32, nr_classes = 2;
+	MlWsumModel wsum;
+	setupWsumModel(wsum, ori_size, current_size, nr_classes);
+
+	// Backproject some slices in random orientations
+	MultidimArray<Complex> slice(current_size, current_size / 2 + 1);
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(slice)
+		DIRECT_MULTIDIM_ELEM(slice, n) = Complex((n % 7) - 3., (n % 5) - 2.);
+	init_random_generator(1234);
+	Matrix2D<RFLOAT> A;
+	for (int iclass = 0; iclass < nr_classes; iclass++)
+	{
+		for (int iproj = 0; iproj < 20; iproj++)
+		{
+			Euler_angles2matrix(rnd_unif(0., 360.), rnd_unif(0., 180.), rnd_unif(0., 360.), A);
+			wsum.BPref[iclass].set2DFourierTransform(slice, A);
+		}
+		wsum.pdf_class[iclass] = iclass + 0.5;
+	}
+	wsum.LL = 42.;
+
+	std::vector<MultidimArray<Complex> > data;
+	std::vector<MultidimArray<RFLOAT> > weight;
+	for (int iclass = 0; iclass < nr_classes; iclass++)
+	{
+		data.push_back(wsum.BPref[iclass].data);
+		weight.push_back(wsum.BPref[iclass].weight);
+	}
+
+	MultidimArray<RFLOAT> full, shell;
+	wsum.pack(full);
+	const long int full_size = MULTIDIM_SIZE(full);
+	wsum.unpack(full);
+	wsum.pack(shell, true);
+	REQUIRE(MULTIDIM_SIZE(shell) == wsum.getPackSize(true));
+	REQUIRE(MULTIDIM_SIZE(shell) < 0.6 * full_size);
+	wsum.unpack(shell, true);
+
+	REQUIRE(wsum.LL == 42.);
+	for (int iclass = 0; iclass < nr_classes; iclass++)
+	{
+		REQUIRE(wsum.pdf_class[iclass] == iclass + 0.5);
+		REQUIRE(MULTIDIM_SIZE(wsum.BPref[iclass].data) == MULTIDIM_SIZE(data[iclass]));
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(data[iclass])
+		{
+			REQUIRE(DIRECT_MULTIDIM_ELEM(wsum.BPref[iclass].data, n).real == DIRECT_MULTIDIM_ELEM(data[iclass], n).real);
+			REQUIRE(DIRECT_MULTIDIM_ELEM(wsum.BPref[iclass].data, n).imag == DIRECT_MULTIDIM_ELEM(data[iclass], n).imag);
+			REQUIRE(DIRECT_MULTIDIM_ELEM(wsum.BPref[iclass].weight, n) == DIRECT_MULTIDIM_ELEM(weight[iclass], n));
+		}
+	}
+}
@@ -0,0 +1,139 @@
+#include <catch2/catch.hpp>
+#include "src/ml_optimiser.h"
+#include "src/euler.h"
+
+// One particle, 3D sampling of order 2 (15 degrees) and a coarse image size of 32 pixels, as after iterateSetup()
+static void setupPruning(MlOptimiser &opt)
+{
+	opt.nr_threads = 1;
+	opt.keep_scratch = true;
+	opt.do_prune_cache = true;
+	opt.mymodel.nr_bodies = 1;
+
+	opt.sampling.clear();
+	opt.sampling.fn_sym = "C1";
+	opt.sampling.fn_sym_relax = "";
+	opt.sampling.healpix_order = 2;
+	opt.sampling.psi_step = -1.;
+	opt.sampling.offset_range = 2.;
+	opt.sampling.offset_step = 1.;
+	opt.sampling.limit_tilt = -91.;
+	opt.sampling.initialise(3);
+
+	opt.mydata.particles.resize(1);
+	opt.mydata.particles[0].optics_group = 0;
+	opt.image_coarse_size.assign(1, 32);
+	opt.exp_metadata.initZeros(1, opt.metadataLineLength());
+}
+
+TEST_CASE( "Pruned coarse searches cover the neighbourhood of last iteration's significant orientations", "[ml_optimiser]" ) {
+	MlOptimiser opt;
+	setupPruning(opt);
+
+	// The pruning neighbourhood is appended after the bodies, and only with --prune_cache
+	REQUIRE(opt.metadataLineLength() == METADATA_LINE_LENGTH_BEFORE_BODIES + METADATA_NR_BODY_PARAMS + METADATA_NR_PRUNE_PARAMS);
+	REQUIRE(opt.metadataPruneColumn(METADATA_PRUNE_ITER) == METADATA_LINE_LENGTH_BEFORE_BODIES + METADATA_NR_BODY_PARAMS);
+	opt.do_prune_cache = false;
+	REQUIRE(opt.metadataLineLength() == METADATA_LINE_LENGTH_BEFORE_BODIES + METADATA_NR_BODY_PARAMS);
+	opt.do_prune_cache = true;
+	opt.iterateSetup();
+
+	std::vector<int> pointer_dir, pointer_psi;
+	const long int nr_dir = opt.sampling.NrDirections(0, &pointer_dir);
+	const long int nr_psi = opt.sampling.NrPsiSamplings(0, &pointer_psi);
+	const long int nr_trans = opt.sampling.NrTranslationalSamplings();
+	MultidimArray<bool> search;
+
+	// Without a cache, all orientations are searched
+	opt.iter = 2;
+	REQUIRE(!opt.getOrientationPruningMask(0, 0, pointer_dir, pointer_psi, search));
+	REQUIRE(search.nzyxdim == 0);
+	REQUIRE(opt.prune_nr_part_full == 1);
+
+	// Last iteration's optimum, at the only significant coarse orientation
+	const long int idir0 = nr_dir / 3, ipsi0 = nr_psi / 4;
+	DIRECT_A2D_ELEM(opt.exp_metadata, 0, METADATA_ROT) = opt.sampling.rot_angles[idir0];
+	DIRECT_A2D_ELEM(opt.exp_metadata, 0, METADATA_TILT) = opt.sampling.tilt_angles[idir0];
+	DIRECT_A2D_ELEM(opt.exp_metadata, 0, METADATA_PSI) = opt.sampling.psi_angles[ipsi0];
+	MultidimArray<bool> significant(nr_dir * nr_psi * nr_trans);
+	significant.initZeros();
+	DIRECT_A1D_ELEM(significant, (idir0 * nr_psi + ipsi0) * nr_trans + nr_trans / 2) = true;
+	opt.updateOrientationPruningCache(0, 0, 90., 100., significant, pointer_dir, pointer_psi);
+	REQUIRE(DIRECT_A2D_ELEM(opt.exp_metadata, 0, opt.metadataPruneColumn(METADATA_PRUNE_ITER)) == 2);
+	REQUIRE(DIRECT_A2D_ELEM(opt.exp_metadata, 0, opt.metadataPruneColumn(METADATA_PRUNE_SIZE)) == 32);
+	REQUIRE(DIRECT_A2D_ELEM(opt.exp_metadata, 0, opt.metadataPruneColumn(METADATA_PRUNE_DIFF2)) == Approx(0.9));
+	REQUIRE(DIRECT_A2D_ELEM(opt.exp_metadata, 0, opt.metadataPruneColumn(METADATA_PRUNE_DIR_RADIUS)) == Approx(0.).margin(1e-6));
+	REQUIRE(DIRECT_A2D_ELEM(opt.exp_metadata, 0, opt.metadataPruneColumn(METADATA_PRUNE_PSI_RADIUS)) == Approx(0.).margin(1e-6));
+
+	// In the next iteration, the mask holds the orientations within the margin around it
+	opt.iter = 3;
+	REQUIRE(opt.getOrientationPruningMask(0, 0, pointer_dir, pointer_psi, search));
+	REQUIRE(XSIZE(search) == nr_dir * nr_psi);
+
+	const RFLOAT dir_radius = opt.prune_cache_margin * opt.sampling.getAngularSampling();
+	const RFLOAT psi_radius = opt.prune_cache_margin * opt.sampling.psi_step;
+	Matrix1D<RFLOAT> v0, v;
+	Euler_angles2direction(opt.sampling.rot_angles[idir0], opt.sampling.tilt_angles[idir0], v0);
+	long int nr_searched = 0;
+	for (long int idir = 0; idir < nr_dir; idir++)
+		for (long int ipsi = 0; ipsi < nr_psi; ipsi++)
+		{
+			Euler_angles2direction(opt.sampling.rot_angles[idir], opt.sampling.tilt_angles[idir], v);
+			const RFLOAT angle = RAD2DEG(acos(XMIPP_MIN(1., dotProduct(v0, v))));
+			const RFLOAT dpsi = ABS(realWRAP(opt.sampling.psi_angles[ipsi] - opt.sampling.psi_angles[ipsi0], -180., 180.));
+			const bool is_searched = DIRECT_A1D_ELEM(search, idir * nr_psi + ipsi);
+
+			// Leave out orientations right at the edge, where rounding decides
+			if (ABS(angle - dir_radius) > 1e-3 && ABS(dpsi - psi_radius) > 1e-3)
+				REQUIRE(is_searched == (angle < dir_radius && dpsi < psi_radius));
+			if (is_searched)
+				nr_searched++;
+		}
+	REQUIRE(DIRECT_A1D_ELEM(search, idir0 * nr_psi + ipsi0));
+	REQUIRE(nr_searched > 1);
+	REQUIRE(nr_searched < nr_dir * nr_psi / 4);
+
+	// The best squared difference is compared relative to that with an empty reference, so that it may double with sigma2
+	REQUIRE(opt.checkOrientationPruning(0, 90., 100., search));
+	REQUIRE(opt.checkOrientationPruning(0, 180., 200., search));
+	REQUIRE(opt.checkOrientationPruning(0, 60., 100., search));
+	REQUIRE(opt.prune_nr_fallback == 0);
+
+	// A worse fit than last iteration triggers the full search
+	REQUIRE(!opt.checkOrientationPruning(0, 95., 100., search));
+	REQUIRE(!opt.checkOrientationPruning(0, 90., 99., search));
+	REQUIRE(opt.prune_nr_fallback == 2);
+	REQUIRE(opt.prune_nr_part_pruned == 5);
+
+	// A cache from an older iteration, or for another coarse image size, is not used
+	opt.iter = 4;
+	REQUIRE(!opt.getOrientationPruningMask(0, 0, pointer_dir, pointer_psi, search));
+	opt.iter = 3;
+	opt.image_coarse_size[0] = 48;
+	REQUIRE(!opt.getOrientationPruningMask(0, 0, pointer_dir, pointer_psi, search));
+	REQUIRE(search.nzyxdim == 0);
+
+	opt.iterateWrapUp();
+}
+
+TEST_CASE( "Squared difference with an empty reference", "[ml_optimiser]" ) {
+	MlOptimiser opt;
+	std::vector<MultidimArray<Complex> > Fimg(2, MultidimArray<Complex>(8, 5));
+	std::vector<RFLOAT> highres_Xi2(2);
+	MultidimArray<RFLOAT> Minvsigma2(8, 5);
+	highres_Xi2[0] = 3.;
+	highres_Xi2[1] = 5.;
+
+	RFLOAT expected = (3. + 5.) / 2.;
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Minvsigma2)
+	{
+		DIRECT_MULTIDIM_ELEM(Minvsigma2, n) = 1. / (n + 1.);
+		for (int img_id = 0; img_id < 2; img_id++)
+		{
+			DIRECT_MULTIDIM_ELEM(Fimg[img_id], n) = Complex(sin(0.3 * n + img_id), cos(0.2 * n));
+			expected += norm(DIRECT_MULTIDIM_ELEM(Fimg[img_id], n)) * 0.5 / (n + 1.);
+		}
+	}
+
+	REQUIRE(opt.getBlankReferenceDiff2(Fimg, highres_Xi2, Minvsigma2) == Approx(expected));
+}
@@ -0,0 +1,392 @@
+#include <catch2/catch.hpp>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include "src/motioncorr_runner.h"
+
+// The per-pixel loop that MotioncorrRunner used before, one frame after another
+static void referenceShiftedSum(Image<float> &Isum, std::vector<Image<float> > &Iframes, ThirdOrderPolynomialModel &model, int first_frame)
+{
+	const int nx = XSIZE(Iframes[0]()), ny = YSIZE(Iframes[0]()), n_frames = Iframes.size();
+	for (int iframe = 0; iframe < n_frames; iframe++)
+	{
+		const RFLOAT z = first_frame + iframe;
+		for (int iy = 0; iy < ny; iy++)
+		{
+			const RFLOAT y = (RFLOAT)iy / ny - 0.5;
+			for (int ix = 0; ix < nx; ix++)
+			{
+				const RFLOAT x = (RFLOAT)ix / nx - 0.5;
+				RFLOAT x_fitted, y_fitted;
+				model.getShiftAt(z, x, y, x_fitted, y_fitted);
+				x_fitted = ix - x_fitted; y_fitted = iy - y_fitted;
+
+				int x0 = FLOOR(x_fitted), y0 = FLOOR(y_fitted);
+				bool valid = true;
+				if (x0 < 0) {x0 = 0; valid = false;}
+				if (y0 < 0) {y0 = 0; valid = false;}
+				if (x0 >= nx - 1) {x0 = nx - 1; valid = false;}
+				if (y0 >= ny - 1) {y0 = ny - 1; valid = false;}
+				if (!valid)
+				{
+					DIRECT_A2D_ELEM(Isum(), iy, ix) += DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0);
+					continue;
+				}
+
+				const RFLOAT fx = x_fitted - x0, fy = y_fitted - y0;
+				const RFLOAT dx0 = LIN_INTERP(fx, DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0), DIRECT_A2D_ELEM(Iframes[iframe](), y0, x0 + 1));
+				const RFLOAT dx1 = LIN_INTERP(fx, DIRECT_A2D_ELEM(Iframes[iframe](), y0 + 1, x0), DIRECT_A2D_ELEM(Iframes[iframe](), y0 + 1, x0 + 1));
+				DIRECT_A2D_ELEM(Isum(), iy, ix) += LIN_INTERP(fy, dx0, dx1);
+			}
+		}
+	}
+}
+
+static std::vector<Image<float> > makeRandomFrames(int nx, int ny, int n_frames, unsigned int seed)
+{
+	std::mt19937 rng(seed);
+	std::normal_distribution<float> noise(0., 1.);
+	std::vector<Image<float> > frames(n_frames);
+	for (Image<float> &frame : frames)
+	{
+		frame().resize(ny, nx);
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(frame())
+			DIRECT_MULTIDIM_ELEM(frame(), n) = noise(rng);
+	}
+	return frames;
+}
+
+// Drifts of up to some tens of pixels over the movie, so that pixels near the edges come from outside the frames
+static void makeRandomModel(ThirdOrderPolynomialModel &model, unsigned int seed)
+{
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<RFLOAT> coeff(-1., 1.);
+	const RFLOAT scale[3] = {3., 0.1, 0.003}; // for z, z^2 and z^3
+	model.coeffX.resize(ThirdOrderPolynomialModel::NUM_COEFFS_PER_DIM);
+	model.coeffY.resize(ThirdOrderPolynomialModel::NUM_COEFFS_PER_DIM);
+	for (int i = 0; i < ThirdOrderPolynomialModel::NUM_COEFFS_PER_DIM; i++)
+	{
+		model.coeffX(i) = coeff(rng) * scale[i % 3];
+		model.coeffY(i) = coeff(rng) * scale[i % 3];
+	}
+}
+
+static double maxDifference(const MultidimArray<float> &a, const MultidimArray<float> &b)
+{
+	REQUIRE(MULTIDIM_SIZE(a) == MULTIDIM_SIZE(b));
+	double max_diff = 0.;
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(a)
+		max_diff = XMIPP_MAX(max_diff, fabs(DIRECT_MULTIDIM_ELEM(a, n) - DIRECT_MULTIDIM_ELEM(b, n)));
+	return max_diff;
+}
+
+TEST_CASE( "Frames summed along the local motion model", "[motioncorr]" ) {
+	const int nx = 130, ny = 96, n_frames = 9, first_frame = 2;
+	std::vector<Image<float> > frames = makeRandomFrames(nx, ny, n_frames, 11);
+	ThirdOrderPolynomialModel model;
+	makeRandomModel(model, 12);
+
+	Image<float> Iexpected(nx, ny), Iunshifted(nx, ny);
+	Iexpected().initZeros();
+	referenceShiftedSum(Iexpected, frames, model, first_frame);
+	Iunshifted().initZeros();
+	for (int iframe = 0; iframe < n_frames; iframe++)
+		FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Iunshifted())
+			DIRECT_MULTIDIM_ELEM(Iunshifted(), n) += DIRECT_MULTIDIM_ELEM(frames[iframe](), n);
+
+	MotioncorrRunner runner;
+	std::ostringstream log;
+
+	for (int n_threads : {1, 3})
+	{
+		INFO("threads: " << n_threads);
+		runner.n_threads = n_threads;
+
+		Image<float> Isum(nx, ny);
+		Isum().initZeros();
+		runner.realSpaceInterpolation(Isum, frames, &model, log, first_frame);
+		REQUIRE(maxDifference(Isum(), Iexpected()) < 1e-4);
+
+		// Each frame on its own adds up to the same sum
+		std::vector<Image<float> > aligned(n_frames);
+		for (Image<float> &frame : aligned)
+		{
+			frame().resize(ny, nx);
+			frame().initZeros();
+		}
+		runner.realSpaceInterpolation_withoutsum(aligned, frames, &model, log, first_frame);
+		Isum().initZeros();
+		for (int iframe = 0; iframe < n_frames; iframe++)
+			FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(Isum())
+				DIRECT_MULTIDIM_ELEM(Isum(), n) += DIRECT_MULTIDIM_ELEM(aligned[iframe](), n);
+		REQUIRE(maxDifference(Isum(), Iexpected()) < 1e-4);
+
+		// Without a model, the frames are summed as they are
+		Isum().initZeros();
+		runner.realSpaceInterpolation(Isum, frames, NULL, log);
+		REQUIRE(memcmp(MULTIDIM_ARRAY(Isum()), MULTIDIM_ARRAY(Iunshifted()), MULTIDIM_SIZE(Isum()) * sizeof(float)) == 0);
+	}
+}
+
+// A random specimen, blurred a little, that moves by (drift_x, drift_y) pixels per frame, with independent noise in every frame.
+// Frame 0 shows specimen(iy + margin, ix + margin).
+static void writeDriftingMovie(const FileName &fn_movie, MultidimArray<float> &specimen, int nx, int ny, int n_frames,
+                               int drift_x, int drift_y, int margin, unsigned int seed)
+{
+	std::mt19937 rng(seed);
+	std::normal_distribution<float> noise(0., 1.);
+	MultidimArray<float> white(ny + 2 * margin, nx + 2 * margin);
+	FOR_ALL_DIRECT_ELEMENTS_IN_MULTIDIMARRAY(white)
+		DIRECT_MULTIDIM_ELEM(white, n) = noise(rng);
+	specimen.initZeros(white);
+	for (int iy = 1; iy < YSIZE(white) - 1; iy++)
+		for (int ix = 1; ix < XSIZE(white) - 1; ix++)
+			for (int dy = -1; dy <= 1; dy++)
+				for (int dx = -1; dx <= 1; dx++)
+					DIRECT_A2D_ELEM(specimen, iy, ix) += DIRECT_A2D_ELEM(white, iy + dy, ix + dx) / 3.f;
+
+	Image<float> Imovie;
+	Imovie().resize(n_frames, 1, ny, nx);
+	for (int iframe = 0; iframe < n_frames; iframe++)
+		for (int iy = 0; iy < ny; iy++)
+			for (int ix = 0; ix < nx; ix++)
+				DIRECT_NZYX_ELEM(Imovie(), iframe, 0, iy, ix) = DIRECT_A2D_ELEM(specimen, iy + margin - iframe * drift_y, ix + margin - iframe * drift_x)
+				                                                + 0.5f * noise(rng);
+	Imovie.write(fn_movie, -1, true, WRITE_OVERWRITE, Float);
+}
+
+// Set up runner as relion_run_motioncorr with these arguments would; args must outlive runner
+static void readMotioncorrArguments(MotioncorrRunner &runner, std::vector<std::string> &args)
+{
+	std::vector<char *> argv;
+	for (std::string &arg : args)
+		argv.push_back(&arg[0]);
+	argv.push_back(NULL);
+	runner.read(args.size(), &argv[0]);
+}
+
+static std::vector<std::string> ownMotioncorrArguments(const FileName &fn_out)
+{
+	return {"relion_run_motioncorr", "--i", "unused.star", "--o", fn_out, "--use_own", "--j", "2",
+	        "--patch_x", "3", "--patch_y", "3", "--dose_weighting", "--save_noDW", "--angpix", "1", "--voltage", "300",
+	        "--dose_per_frame", "2", "--grouping_for_ps", "3", "--ps_size", "64"};
+}
+
+// Correlation coefficient of a and b, leaving out margin pixels on every side
+static double interiorCorrelation(const MultidimArray<float> &a, const MultidimArray<float> &b, int margin)
+{
+	double sum_a = 0., sum_b = 0., sum_aa = 0., sum_bb = 0., sum_ab = 0.;
+	long int n = 0;
+	for (int iy = margin; iy < YSIZE(a) - margin; iy++)
+		for (int ix = margin; ix < XSIZE(a) - margin; ix++, n++)
+		{
+			const double va = DIRECT_A2D_ELEM(a, iy, ix), vb = DIRECT_A2D_ELEM(b, iy, ix);
+			sum_a += va; sum_b += vb; sum_aa += va * va; sum_bb += vb * vb; sum_ab += va * vb;
+		}
+	return (sum_ab - sum_a * sum_b / n) / sqrt((sum_aa - sum_a * sum_a / n) * (sum_bb - sum_b * sum_b / n));
+}
+
+TEST_CASE( "Own motion correction with a streaming window gives the same as with all frames in memory", "[motioncorr]" ) {
+	const FileName fn_movie = "test_output/motioncorr_drift.mrcs";
+	const int nx = 256, ny = 192, n_frames = 9, drift_x = 2, drift_y = -1, margin = 20;
+	MultidimArray<float> specimen;
+	writeDriftingMovie(fn_movie, specimen, nx, ny, n_frames, drift_x, drift_y, margin, 31);
+
+	std::vector<std::string> args = ownMotioncorrArguments("test_output/motioncorr_all/");
+	MotioncorrRunner runner;
+	readMotioncorrArguments(runner, args);
+	const FileName fn_avg = runner.getOutputFileNames(fn_movie);
+	mktree(fn_avg.beforeLastOf("/"));
+	Micrograph mic(fn_movie, "", 1.);
+	mic.pre_exposure = 0.;
+	REQUIRE(runner.executeOwnMotionCorrection(mic));
+	REQUIRE(mic.model != NULL);
+
+	// The drift is found, relative to the first frame. The sign convention is checked by the aligned sum below.
+	RFLOAT x0, y0, x, y, last_x, last_y;
+	mic.getShiftAt(1, 0., 0., x0, y0, false);
+	mic.getShiftAt(n_frames, 0., 0., last_x, last_y, false);
+	const RFLOAT sign = (last_x - x0 > 0) == (drift_x > 0) ? 1. : -1.;
+	for (int iframe = 0; iframe < n_frames; iframe++)
+	{
+		INFO("frame: " << iframe + 1);
+		mic.getShiftAt(iframe + 1, 0., 0., x, y, false);
+		REQUIRE(x - x0 == Approx(sign * iframe * drift_x).margin(0.5));
+		REQUIRE(y - y0 == Approx(sign * iframe * drift_y).margin(0.5));
+
+		// The drift is the same everywhere, so the local model adds little
+		for (RFLOAT px : {-0.3, 0., 0.3})
+			for (RFLOAT py : {-0.3, 0.3})
+			{
+				RFLOAT local_x, local_y, global_x, global_y;
+				mic.getShiftAt(iframe + 1, px, py, local_x, local_y, true);
+				mic.getShiftAt(iframe + 1, px, py, global_x, global_y, false);
+				REQUIRE(fabs(local_x - global_x) < 1.);
+				REQUIRE(fabs(local_y - global_y) < 1.);
+			}
+	}
+
+	// The aligned sum shows the specimen as in the first frame, the unaligned one does not
+	Image<float> Isum, Isum_DW;
+	Isum.read(fn_avg.withoutExtension() + "_noDW.mrc");
+	Isum_DW.read(fn_avg);
+	MultidimArray<float> Ifirst(ny, nx), Iunaligned(ny, nx);
+	Iunaligned.initZeros();
+	for (int iy = 0; iy < ny; iy++)
+		for (int ix = 0; ix < nx; ix++)
+		{
+			DIRECT_A2D_ELEM(Ifirst, iy, ix) = DIRECT_A2D_ELEM(specimen, iy + margin, ix + margin);
+			for (int iframe = 0; iframe < n_frames; iframe++)
+				DIRECT_A2D_ELEM(Iunaligned, iy, ix) += DIRECT_A2D_ELEM(specimen, iy + margin - iframe * drift_y, ix + margin - iframe * drift_x);
+		}
+	REQUIRE(interiorCorrelation(Isum(), Ifirst, margin) > 0.9);
+	REQUIRE(interiorCorrelation(Isum_DW(), Ifirst, margin) > 0.7);
+	REQUIRE(interiorCorrelation(Isum(), Iunaligned, margin) < 0.5);
+
+	Image<float> Ips;
+	Ips.read(fn_avg.withoutExtension() + "_PS.mrc");
+
+	for (int window : {2, 3})
+	{
+		INFO("streaming window: " << window);
+		std::vector<std::string> args_streaming = ownMotioncorrArguments("test_output/motioncorr_window" + integerToString(window) + "/");
+		args_streaming.push_back("--streaming_window");
+		args_streaming.push_back(integerToString(window));
+		MotioncorrRunner streaming;
+		readMotioncorrArguments(streaming, args_streaming);
+		const FileName fn_avg_streaming = streaming.getOutputFileNames(fn_movie);
+		mktree(fn_avg_streaming.beforeLastOf("/"));
+		Micrograph mic_streaming(fn_movie, "", 1.);
+		mic_streaming.pre_exposure = 0.;
+		REQUIRE(streaming.executeOwnMotionCorrection(mic_streaming));
+		REQUIRE(mic_streaming.model != NULL);
+
+		for (int iframe = 0; iframe < n_frames; iframe++)
+			for (RFLOAT px : {-0.4, 0., 0.4})
+				for (RFLOAT py : {-0.4, 0.4})
+				{
+					RFLOAT expected_x, expected_y;
+					mic.getShiftAt(iframe + 1, px, py, expected_x, expected_y, false);
+					mic_streaming.getShiftAt(iframe + 1, px, py, x, y, false);
+					REQUIRE(x == Approx(expected_x).margin(1e-3));
+					REQUIRE(y == Approx(expected_y).margin(1e-3));
+
+					mic.getShiftAt(iframe + 1, px, py, expected_x, expected_y, true);
+					mic_streaming.getShiftAt(iframe + 1, px, py, x, y, true);
+					REQUIRE(x == Approx(expected_x).margin(1e-3));
+					REQUIRE(y == Approx(expected_y).margin(1e-3));
+				}
+
+		Image<float> Isum_streaming, Isum_DW_streaming, Ips_streaming;
+		Isum_streaming.read(fn_avg_streaming.withoutExtension() + "_noDW.mrc");
+		Isum_DW_streaming.read(fn_avg_streaming);
+		Ips_streaming.read(fn_avg_streaming.withoutExtension() + "_PS.mrc");
+		REQUIRE(maxDifference(Isum_streaming(), Isum()) < 1e-3 * n_frames);
+		REQUIRE(maxDifference(Isum_DW_streaming(), Isum_DW()) < 1e-3 * n_frames);
+		REQUIRE(maxDifference(Ips_streaming(), Ips()) < 1e-4 * Ips().computeMax());
+	}
+}
+
+TEST_CASE( "Pipelined own motion correction gives the same as one movie after another", "[motioncorr]" ) {
+	const int nx = 192, ny = 128, n_frames = 9, n_movies = 3;
+	std::vector<FileName> fn_movies;
+	for (int imovie = 0; imovie < n_movies; imovie++)
+	{
+		MultidimArray<float> specimen;
+		fn_movies.push_back("test_output/motioncorr_pipeline" + integerToString(imovie + 1) + ".mrcs");
+		writeDriftingMovie(fn_movies.back(), specimen, nx, ny, n_frames, imovie - 1, 1, 20, 41 + imovie);
+	}
+
+	std::vector<std::string> args = ownMotioncorrArguments("test_output/motioncorr_sequential/");
+	MotioncorrRunner sequential;
+	readMotioncorrArguments(sequential, args);
+	std::vector<std::string> args_pipeline = ownMotioncorrArguments("test_output/motioncorr_pipeline/");
+	args_pipeline.push_back("--pipeline");
+	MotioncorrRunner pipeline;
+	readMotioncorrArguments(pipeline, args_pipeline);
+	pipeline.verb = 0;
+
+	// As initialise() sets them up from a STAR file with one optics group
+	pipeline.fn_micrographs = fn_movies;
+	pipeline.optics_group_micrographs.assign(n_movies, 1);
+	pipeline.pre_exposure_micrographs.assign(n_movies, 0.);
+	pipeline.obsModel.opticsMdt.clear();
+	pipeline.obsModel.opticsMdt.addObject();
+	pipeline.obsModel.opticsMdt.setValue(EMDL_CTF_VOLTAGE, 300.);
+	pipeline.obsModel.opticsMdt.setValue(EMDL_MICROGRAPH_ORIGINAL_PIXEL_SIZE, 1.);
+
+	std::vector<std::unique_ptr<Micrograph> > mics;
+	for (const FileName &fn_movie : fn_movies)
+	{
+		mktree(sequential.getOutputFileNames(fn_movie).beforeLastOf("/"));
+		mktree(pipeline.getOutputFileNames(fn_movie).beforeLastOf("/"));
+		mics.emplace_back(new Micrograph(fn_movie, "", 1.));
+		mics.back()->pre_exposure = 0.;
+		REQUIRE(sequential.executeOwnMotionCorrection(*mics.back()));
+	}
+
+	REQUIRE(pipeline.runOwnPipeline(0, n_movies - 1));
+
+	for (int imovie = 0; imovie < n_movies; imovie++)
+	{
+		INFO("movie: " << fn_movies[imovie]);
+		const FileName fn_avg = sequential.getOutputFileNames(fn_movies[imovie]);
+		const FileName fn_avg_pipeline = pipeline.getOutputFileNames(fn_movies[imovie]);
+		for (const std::string suffix : {".mrc", "_noDW.mrc", "_PS.mrc"})
+		{
+			INFO("output: " << suffix);
+			Image<float> Iexpected, Igot;
+			Iexpected.read(fn_avg.withoutExtension() + suffix);
+			Igot.read(fn_avg_pipeline.withoutExtension() + suffix);
+			REQUIRE(maxDifference(Igot(), Iexpected()) <= 1e-4 * (Iexpected().computeMax() - Iexpected().computeMin()));
+		}
+		REQUIRE(exists(fn_avg_pipeline.withoutExtension() + ".log"));
+
+		Micrograph mic_pipeline(fn_avg_pipeline.withoutExtension() + ".star");
+		for (int iframe = 1; iframe <= n_frames; iframe++)
+		{
+			RFLOAT expected_x, expected_y, x, y;
+			mics[imovie]->getShiftAt(iframe, 0., 0., expected_x, expected_y, false);
+			mic_pipeline.getShiftAt(iframe, 0., 0., x, y, false);
+			REQUIRE(x == Approx(expected_x).margin(1e-3));
+			REQUIRE(y == Approx(expected_y).margin(1e-3));
+		}
+	}
+
+	// An error in the reader stage reaches the caller
+	pipeline.fn_micrographs[1] = "test_output/motioncorr_pipeline_missing.mrcs";
+	REQUIRE_THROWS_AS(pipeline.runOwnPipeline(0, n_movies - 1), RelionError);
+}
+
+// Hidden by default; run with: tests "[benchmark]"
+TEST_CASE( "Benchmark summing frames along the local motion model", "[.][benchmark][motioncorr]" ) {
+	const int nx = 2048, ny = 2048, n_frames = 24, n_threads = 8;
+	std::vector<Image<float> > frames = makeRandomFrames(nx, ny, n_frames, 21);
+	ThirdOrderPolynomialModel model;
+	makeRandomModel(model, 22);
+
+	Image<float> Iexpected(nx, ny);
+	Iexpected().initZeros();
+	auto t0 = std::chrono::steady_clock::now();
+	referenceShiftedSum(Iexpected, frames, model, 0);
+	const double reference = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+	MotioncorrRunner runner;
+	std::ostringstream log;
+	double times[2];
+	for (int i = 0; i < 2; i++)
+	{
+		runner.n_threads = (i == 0) ? 1 : n_threads;
+		Image<float> Isum(nx, ny);
+		Isum().initZeros();
+		t0 = std::chrono::steady_clock::now();
+		runner.realSpaceInterpolation(Isum, frames, &model, log);
+		times[i] = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+		REQUIRE(maxDifference(Isum(), Iexpected()) < 1e-4);
+	}
+
+	std::cout << " " << n_frames << " frames of " << nx << " x " << ny << ": per-pixel loop " << reference << " s, tiled one thread "
+	          << times[0] << " s (" << reference / times[0] << "x), " << n_threads << " threads " << times[1] << " s" << std::endl;
+}
@@ -2,3 +2,18 @@
 
 #include <catch2/catch.hpp>
 #include "ctf.cpp"
+#include "fftw.cpp"
+#include "metadata_table.cpp"
+#include "image_prefetcher.cpp"
+#include "mapped_stack_cache.cpp"
+#include "image_conversion.cpp"
+#include "work_stealing_scheduler.cpp"
+#include "ml_model.cpp"
+#include "ml_optimiser.cpp"
+#include "backprojector.cpp"
+#include "acc_backprojector.cpp"
+#include "diff2_simd.cpp"
+#include "healpix_sampling.cpp"
+#include "compressed_movie.cpp"
+#include "eer_renderer.cpp"
+#include "motioncorr_runner.cpp"
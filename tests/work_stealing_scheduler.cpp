@@ -0,0 +1,99 @@
+#include <catch2/catch.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "src/work_stealing_scheduler.h"
+#include "src/error.h"
+
+TEST_CASE( "WorkStealingScheduler runs every iteration once", "[parallel]" ) {
+	const int nr_threads = 4;
+	const long int n = 10007;
+	WorkStealingScheduler scheduler(nr_threads);
+
+	for (long int grain = 1; grain <= 64; grain *= 8)
+	{
+		std::vector<std::atomic<int> > counts(n);
+		for (long int i = 0; i < n; i++)
+			counts[i] = 0;
+		std::atomic<bool> bad_thread_id(false);
+
+		scheduler.parallelFor(0, n, [&](long int i, int thread_id)
+		{
+			counts[i]++;
+			if (thread_id < 0 || thread_id >= nr_threads)
+				bad_thread_id = true;
+		}, grain);
+
+		for (long int i = 0; i < n; i++)
+			REQUIRE(counts[i] == 1);
+		REQUIRE(!bad_thread_id);
+	}
+
+	// Empty and tiny loops
+	long int nr_calls = 0;
+	scheduler.parallelFor(5, 5, [&](long int i, int thread_id) { nr_calls++; });
+	REQUIRE(nr_calls == 0);
+	scheduler.parallelFor(5, 6, [&](long int i, int thread_id) { nr_calls++; });
+	REQUIRE(nr_calls == 1);
+}
+
+TEST_CASE( "WorkStealingScheduler balances uneven work and nested loops", "[parallel]" ) {
+	const int nr_threads = 4;
+	WorkStealingScheduler scheduler(nr_threads);
+
+	// A few slow iterations at the start: while they run, the other threads should take all the rest
+	std::vector<int> finished_as(64, -1);
+	std::atomic<int> nr_finished(0);
+	scheduler.parallelFor(0, 64, [&](long int i, int thread_id)
+	{
+		if (i < 2)
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		finished_as[i] = nr_finished++;
+	});
+	for (int i = 2; i < 64; i++)
+		REQUIRE(finished_as[i] < std::min(finished_as[0], finished_as[1]));
+
+	// Per-thread buffers stay private, also for the iterations of nested loops
+	const long int nr_outer = 13, nr_inner = 101;
+	std::vector<std::atomic<int> > in_use(nr_threads);
+	for (int i = 0; i < nr_threads; i++)
+		in_use[i] = 0;
+	std::atomic<long int> sum(0);
+	std::atomic<bool> is_shared(false);
+
+	scheduler.parallelFor(0, nr_outer, [&](long int i, int outer_thread_id)
+	{
+		scheduler.parallelFor(0, nr_inner, [&](long int j, int thread_id)
+		{
+			if (in_use[thread_id]++ != 0)
+				is_shared = true;
+			sum += i * nr_inner + j;
+			in_use[thread_id]--;
+		}, 4);
+	});
+
+	const long int total = nr_outer * nr_inner;
+	REQUIRE(sum == total * (total - 1) / 2);
+	REQUIRE(!is_shared);
+}
+
+TEST_CASE( "WorkStealingScheduler passes on errors", "[parallel]" ) {
+	WorkStealingScheduler scheduler(3);
+	std::atomic<int> nr_calls(0);
+
+	REQUIRE_THROWS_AS(scheduler.parallelFor(0, 1000, [&](long int i, int thread_id)
+	{
+		nr_calls++;
+		if (i == 500)
+			REPORT_ERROR("task failed");
+	}), RelionError);
+
+	REQUIRE(nr_calls <= 1000);
+
+	// The scheduler can be used again afterwards
+	std::atomic<int> count(0);
+	scheduler.parallelFor(0, 100, [&](long int i, int thread_id) { count++; });
+	REQUIRE(count == 100);
+}